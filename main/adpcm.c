@@ -0,0 +1,315 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#include "adpcm.h"
+
+#define ADPCM_INDEX_MAX		88
+
+static const int16_t s_step_table[ADPCM_INDEX_MAX + 1] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+/* indexed by the whole code, the sign bit does not matter */
+static const int8_t s_index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static inline int32_t adpcm_clamp_sample(int32_t v)
+{
+	if (v > INT16_MAX) {
+		return INT16_MAX;
+	} else if (v < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return v;
+}
+
+static inline int adpcm_clamp_index(int index)
+{
+	if (index < 0) {
+		return 0;
+	} else if (index > ADPCM_INDEX_MAX) {
+		return ADPCM_INDEX_MAX;
+	}
+	return index;
+}
+
+/*
+ * Quantizes and reconstructs in one pass: the difference the decoder will
+ * see is summed up while the code bits are chosen, so no second lookup
+ * of the step is needed. Inlined into the block loops, predictor and
+ * index stay in registers for the whole block.
+ */
+static inline int adpcm_encode_sample(int32_t *predictor, int *index, int32_t sample)
+{
+	int32_t step = s_step_table[*index];
+	int32_t diff = sample - *predictor;
+	int32_t vpdiff = step >> 3;
+	int code = 0;
+	
+	if (diff < 0) {
+		code = 8;
+		diff = -diff;
+	}
+	if (diff >= step) {
+		code |= 4;
+		diff -= step;
+		vpdiff += step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		code |= 2;
+		diff -= step;
+		vpdiff += step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		code |= 1;
+		vpdiff += step;
+	}
+	
+	*predictor = adpcm_clamp_sample(code & 8 ? *predictor - vpdiff : *predictor + vpdiff);
+	*index = adpcm_clamp_index(*index + s_index_table[code]);
+	
+	return code;
+}
+
+static inline int32_t adpcm_decode_sample(int32_t *predictor, int *index, int code)
+{
+	int32_t step = s_step_table[*index];
+	int32_t vpdiff = step >> 3;
+	
+	if (code & 4) {
+		vpdiff += step;
+	}
+	if (code & 2) {
+		vpdiff += step >> 1;
+	}
+	if (code & 1) {
+		vpdiff += step >> 2;
+	}
+	
+	*predictor = adpcm_clamp_sample(code & 8 ? *predictor - vpdiff : *predictor + vpdiff);
+	*index = adpcm_clamp_index(*index + s_index_table[code]);
+	
+	return *predictor;
+}
+
+/**
+ * @brief Encode mono 16 bit PCM into one IMA-ADPCM block
+ * @param [in]  state 	The encoder state, zeroed before the first block
+ * @param [in]  pcm 	The samples
+ * @param [in]  samples The number of samples, at least 1
+ * @param [out] out 	The block, ADPCM_HEADER_SIZE + samples / 2 bytes
+ * @return The block size in bytes
+ */
+IRAM_ATTR int adpcm_encode_block(adpcm_state_t *state, const int16_t *pcm, int samples, uint8_t *out)
+{
+	/* the first sample goes out verbatim and seeds the predictor */
+	int32_t predictor = pcm[0];
+	int index = state->index;
+	uint8_t *p = out + ADPCM_HEADER_SIZE;
+	int i, lo, hi;
+	
+	out[0] = (uint8_t)predictor;
+	out[1] = (uint8_t)(predictor >> 8);
+	out[2] = (uint8_t)index;
+	out[3] = 0;
+	
+	for (i = 1; i + 1 < samples; i += 2) {
+		lo = adpcm_encode_sample(&predictor, &index, pcm[i]);
+		hi = adpcm_encode_sample(&predictor, &index, pcm[i + 1]);
+		*p++ = (uint8_t)(lo | hi << 4);
+	}
+	
+	/* an even count leaves half a byte, the decoder gets one extra sample */
+	if (i < samples) {
+		*p++ = (uint8_t)adpcm_encode_sample(&predictor, &index, pcm[i]);
+	}
+	
+	state->predictor = predictor;
+	state->index = index;
+	
+	return p - out;
+}
+
+/**
+ * @brief Decode one IMA-ADPCM block into mono 16 bit PCM
+ * @param [in]  in 		The block
+ * @param [in]  len 	The block size in bytes
+ * @param [out] pcm 	The samples, room for ADPCM_BLOCK_SAMPLES(len)
+ * @return The number of samples, -1 if the block is malformed
+ */
+IRAM_ATTR int adpcm_decode_block(const uint8_t *in, int len, int16_t *pcm)
+{
+	int32_t predictor;
+	int index;
+	int16_t *out = pcm;
+	
+	if (len < ADPCM_HEADER_SIZE || in[2] > ADPCM_INDEX_MAX) {
+		return -1;
+	}
+	
+	predictor = (int16_t)(in[0] | in[1] << 8);
+	index = in[2];
+	*out++ = predictor;
+	
+	for (const uint8_t *p = in + ADPCM_HEADER_SIZE; p < in + len; p++) {
+		*out++ = adpcm_decode_sample(&predictor, &index, *p & 0x0f);
+		*out++ = adpcm_decode_sample(&predictor, &index, *p >> 4);
+	}
+	
+	return out - pcm;
+}
+
+#ifdef ADPCM_REFERENCE
+
+/* the tables as printed in the IMA recommendation */
+static const int s_ref_index_table[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static int adpcm_ref_decode_sample(adpcm_state_t *state, int code)
+{
+	int step = s_step_table[state->index];
+	int diffq = step >> 3;
+	
+	if (code & 4) {
+		diffq += step;
+	}
+	if (code & 2) {
+		diffq += step >> 1;
+	}
+	if (code & 1) {
+		diffq += step >> 2;
+	}
+	
+	if (code & 8) {
+		state->predictor -= diffq;
+	} else {
+		state->predictor += diffq;
+	}
+	state->predictor = adpcm_clamp_sample(state->predictor);
+	
+	state->index = adpcm_clamp_index(state->index + s_ref_index_table[code & 7]);
+	
+	return state->predictor;
+}
+
+static int adpcm_ref_encode_sample(adpcm_state_t *state, int sample)
+{
+	int step = s_step_table[state->index];
+	int diff = sample - state->predictor;
+	int code = 0;
+	
+	if (diff < 0) {
+		code = 8;
+		diff = -diff;
+	}
+	
+	for (int bit = 4; bit; bit >>= 1) {
+		if (diff >= step) {
+			code |= bit;
+			diff -= step;
+		}
+		step >>= 1;
+	}
+	
+	/* the encoder tracks what the decoder will reconstruct */
+	adpcm_ref_decode_sample(state, code);
+	
+	return code;
+}
+
+/**
+ * @brief Plain, sample at a time IMA-ADPCM encoder for checking the kernel
+ */
+int adpcm_ref_encode_block(adpcm_state_t *state, const int16_t *pcm, int samples, uint8_t *out)
+{
+	int len = ADPCM_HEADER_SIZE;
+	
+	state->predictor = pcm[0];
+	out[0] = pcm[0] & 0xff;
+	out[1] = (pcm[0] >> 8) & 0xff;
+	out[2] = state->index;
+	out[3] = 0;
+	
+	for (int i = 1; i < samples; i++) {
+		int code = adpcm_ref_encode_sample(state, pcm[i]);
+		
+		if (i & 1) {
+			out[len] = code;
+		} else {
+			out[len++] |= code << 4;
+		}
+	}
+	
+	/* a half filled last byte */
+	if (!(samples & 1)) {
+		len++;
+	}
+	
+	return len;
+}
+
+/**
+ * @brief Plain, sample at a time IMA-ADPCM decoder for checking the kernel
+ */
+int adpcm_ref_decode_block(const uint8_t *in, int len, int16_t *pcm)
+{
+	adpcm_state_t state;
+	int n = 0;
+	
+	if (len < ADPCM_HEADER_SIZE || in[2] > ADPCM_INDEX_MAX) {
+		return -1;
+	}
+	
+	state.predictor = (int16_t)(in[0] | in[1] << 8);
+	state.index = in[2];
+	pcm[n++] = state.predictor;
+	
+	for (int i = ADPCM_HEADER_SIZE; i < len; i++) {
+		pcm[n++] = adpcm_ref_decode_sample(&state, in[i] & 0x0f);
+		pcm[n++] = adpcm_ref_decode_sample(&state, in[i] >> 4);
+	}
+	
+	return n;
+}
+
+#endif /* ADPCM_REFERENCE */
@@ -0,0 +1,95 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _ADPCM_H_
+#define _ADPCM_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Size of the block header: first sample (16 bit LE), step index, zero
+ */
+#define ADPCM_HEADER_SIZE			(4)
+
+/**
+ * Number of samples held by a block of the given size in bytes
+ */
+#define ADPCM_BLOCK_SAMPLES(size)	(((size) - ADPCM_HEADER_SIZE) * 2 + 1)
+
+/**
+ * @brief IMA-ADPCM encoder state carried from block to block
+ */
+typedef struct {
+	int32_t predictor;
+	int index;
+} adpcm_state_t;
+
+/**
+ * @brief Encode mono 16 bit PCM into one IMA-ADPCM block
+ *
+ * The block layout is the one of mono IMA-ADPCM WAV files: a header with
+ * the first sample verbatim and the step index, followed by two 4 bit
+ * codes per byte, low nibble first. Every block can be decoded on its own.
+ *
+ * @param [in]  state 	The encoder state, zeroed before the first block
+ * @param [in]  pcm 	The samples
+ * @param [in]  samples The number of samples, at least 1
+ * @param [out] out 	The block, ADPCM_HEADER_SIZE + samples / 2 bytes
+ * @return The block size in bytes
+ */
+int adpcm_encode_block(adpcm_state_t *state, const int16_t *pcm, int samples, uint8_t *out);
+
+/**
+ * @brief Decode one IMA-ADPCM block into mono 16 bit PCM
+ * @param [in]  in 		The block
+ * @param [in]  len 	The block size in bytes
+ * @param [out] pcm 	The samples, room for ADPCM_BLOCK_SAMPLES(len)
+ * @return The number of samples, -1 if the block is malformed
+ */
+int adpcm_decode_block(const uint8_t *in, int len, int16_t *pcm);
+
+#ifdef ADPCM_REFERENCE
+/**
+ * @brief Plain, sample at a time IMA-ADPCM encoder for checking the kernel
+ *
+ * Only built on the host with ADPCM_REFERENCE, its output must match
+ * adpcm_encode_block byte for byte.
+ */
+int adpcm_ref_encode_block(adpcm_state_t *state, const int16_t *pcm, int samples, uint8_t *out);
+
+/**
+ * @brief Plain, sample at a time IMA-ADPCM decoder for checking the kernel
+ */
+int adpcm_ref_decode_block(const uint8_t *in, int len, int16_t *pcm);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ADPCM_H_ */
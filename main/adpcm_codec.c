@@ -0,0 +1,291 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "audio_element.h"
+
+#include "adpcm_codec.h"
+
+#if defined(CONFIG_RECORDER_CODEC_ADPCM) || defined(CONFIG_PLAYER_CODEC_ADPCM)
+
+static const char *TAG = "ADPCM";
+
+struct adpcm_codec {
+	adpcm_codec_cfg_t				cfg;
+	adpcm_state_t					state;
+	/* samples per block */
+	int								samples;
+	/* PCM side: encoder input or decoder output */
+	int16_t							*pcm;
+	int								pcm_size;
+	/* ADPCM side: encoder output or decoder input */
+	uint8_t							*block;
+	/* bytes gathered so far of the current input unit */
+	int								in_len;
+	bool							input_done;
+	adpcm_codec_stats_t				stats;
+};
+
+static esp_err_t adpcm_codec_reset(struct adpcm_codec *ac)
+{
+	memset(&ac->state, 0, sizeof(ac->state));
+	memset(&ac->stats, 0, sizeof(ac->stats));
+	ac->in_len = 0;
+	ac->input_done = false;
+	
+	return ESP_OK;
+}
+
+static esp_err_t adpcm_encoder_open(audio_element_handle_t self)
+{
+	return adpcm_codec_reset((struct adpcm_codec *)audio_element_getdata(self));
+}
+
+static esp_err_t adpcm_decoder_open(audio_element_handle_t self)
+{
+	struct adpcm_codec *ac = (struct adpcm_codec *)audio_element_getdata(self);
+	audio_element_info_t info = {0};
+	
+	audio_element_getinfo(self, &info);
+	info.sample_rates = ac->cfg.sample_rate;
+	info.channels = 1;
+	info.bits = 16;
+	audio_element_setinfo(self, &info);
+	audio_element_report_info(self);
+	
+	return adpcm_codec_reset(ac);
+}
+
+static esp_err_t adpcm_codec_close(audio_element_handle_t self)
+{
+	return ESP_OK;
+}
+
+static esp_err_t adpcm_codec_destroy(audio_element_handle_t self)
+{
+	struct adpcm_codec *ac = (struct adpcm_codec *)audio_element_getdata(self);
+	
+	free(ac->pcm);
+	free(ac->block);
+	free(ac);
+	
+	return ESP_OK;
+}
+
+/*
+ * Gathers size bytes of input in buf, resuming at ac->in_len. Returns the
+ * bytes available, which is short only for the tail of the input, or an
+ * error of audio_element_input.
+ */
+static int adpcm_codec_gather(audio_element_handle_t self, struct adpcm_codec *ac, char *buf, int size)
+{
+	int ret;
+	
+	if (ac->input_done) {
+		return AEL_IO_DONE;
+	}
+	
+	while (ac->in_len < size) {
+		ret = audio_element_input(self, buf + ac->in_len, size - ac->in_len);
+		if (ret > 0) {
+			ac->in_len += ret;
+			continue;
+		}
+		
+		if ((ret == AEL_IO_DONE || ret == AEL_IO_OK) && ac->in_len > 0) {
+			ac->input_done = true;
+			break;
+		}
+		
+		return ret == AEL_IO_OK ? AEL_IO_DONE : ret;
+	}
+	
+	ret = ac->in_len;
+	ac->in_len = 0;
+	
+	return ret;
+}
+
+static int adpcm_encoder_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+	struct adpcm_codec *ac = (struct adpcm_codec *)audio_element_getdata(self);
+	int16_t *pcm = ac->pcm;
+	int64_t started;
+	int ret, samples, len;
+	
+	ret = adpcm_codec_gather(self, ac, (char *)ac->pcm, ac->pcm_size);
+	if (ret <= 0) {
+		return ret;
+	}
+	
+	samples = ret / (ac->cfg.channels * sizeof(int16_t));
+	if (samples == 0) {
+		return AEL_IO_DONE;
+	}
+	
+	started = esp_timer_get_time();
+	if (ac->cfg.channels == 2) {
+		/* in place, sample i never overtakes pair 2i */
+		for (int i = 0; i < samples; i++) {
+			pcm[i] = ((int32_t)pcm[2 * i] + pcm[2 * i + 1]) / 2;
+		}
+	}
+	len = adpcm_encode_block(&ac->state, pcm, samples, ac->block);
+	ac->stats.codec_us += esp_timer_get_time() - started;
+	
+	ac->stats.blocks++;
+	ac->stats.bytes += len;
+	ac->stats.samples += samples;
+	
+	return audio_element_output(self, (char *)ac->block, len);
+}
+
+static int adpcm_decoder_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+	struct adpcm_codec *ac = (struct adpcm_codec *)audio_element_getdata(self);
+	int64_t started;
+	int ret, samples;
+	
+	ret = adpcm_codec_gather(self, ac, (char *)ac->block, ac->cfg.block_size);
+	if (ret <= 0) {
+		return ret;
+	}
+	
+	started = esp_timer_get_time();
+	samples = adpcm_decode_block(ac->block, ret, ac->pcm);
+	ac->stats.codec_us += esp_timer_get_time() - started;
+	
+	if (samples < 0) {
+		ESP_LOGE(TAG, "Malformed block of %d bytes", ret);
+		return AEL_PROCESS_FAIL;
+	}
+	
+	ac->stats.blocks++;
+	ac->stats.bytes += ret;
+	ac->stats.samples += samples;
+	
+	return audio_element_output(self, (char *)ac->pcm, samples * sizeof(int16_t));
+}
+
+static audio_element_handle_t adpcm_codec_init(adpcm_codec_cfg_t *config, bool encoder)
+{
+	audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+	audio_element_handle_t el;
+	struct adpcm_codec *ac;
+	
+	if (config->block_size <= ADPCM_HEADER_SIZE) {
+		ESP_LOGE(TAG, "Block size %d too small", config->block_size);
+		return NULL;
+	}
+	
+	if (config->channels != 1 && config->channels != 2) {
+		ESP_LOGE(TAG, "Unsupported channel count %d", config->channels);
+		return NULL;
+	}
+	
+	ac = calloc(1, sizeof(struct adpcm_codec));
+	if (!ac) {
+		return NULL;
+	}
+	
+	ac->cfg = *config;
+	ac->samples = ADPCM_BLOCK_SAMPLES(config->block_size);
+	/* the decoder always produces mono */
+	ac->pcm_size = ac->samples * (encoder ? config->channels : 1) * sizeof(int16_t);
+	ac->pcm = malloc(ac->pcm_size);
+	ac->block = malloc(config->block_size);
+	if (!ac->pcm || !ac->block) {
+		goto errout;
+	}
+	
+	cfg.open = encoder ? adpcm_encoder_open : adpcm_decoder_open;
+	cfg.close = adpcm_codec_close;
+	cfg.process = encoder ? adpcm_encoder_process : adpcm_decoder_process;
+	cfg.destroy = adpcm_codec_destroy;
+	cfg.task_stack = config->task_stack;
+	cfg.task_prio = config->task_prio;
+	cfg.task_core = config->task_core;
+	cfg.out_rb_size = config->out_rb_size;
+	cfg.tag = "adpcm";
+	
+	el = audio_element_init(&cfg);
+	if (!el) {
+		goto errout;
+	}
+	
+	audio_element_setdata(el, ac);
+	
+	return el;
+	
+errout:
+	free(ac->pcm);
+	free(ac->block);
+	free(ac);
+	return NULL;
+}
+
+/**
+ * @brief Create an element encoding 16 bit PCM into IMA-ADPCM blocks
+ * @param [in] config The codec configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t adpcm_encoder_init(adpcm_codec_cfg_t *config)
+{
+	return adpcm_codec_init(config, true);
+}
+
+/**
+ * @brief Create an element decoding IMA-ADPCM blocks into mono 16 bit PCM
+ * @param [in] config The codec configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t adpcm_decoder_init(adpcm_codec_cfg_t *config)
+{
+	return adpcm_codec_init(config, false);
+}
+
+/**
+ * @brief Get the statistics of an IMA-ADPCM element since it was last opened
+ * @param [in]  self 	The audio element handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t adpcm_codec_get_stats(audio_element_handle_t self, adpcm_codec_stats_t *stats)
+{
+	struct adpcm_codec *ac = (struct adpcm_codec *)audio_element_getdata(self);
+	
+	if (!ac) {
+		return ESP_FAIL;
+	}
+	
+	*stats = ac->stats;
+	
+	return ESP_OK;
+}
+
+#endif /* CONFIG_RECORDER_CODEC_ADPCM || CONFIG_PLAYER_CODEC_ADPCM */
@@ -0,0 +1,107 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _ADPCM_CODEC_H_
+#define _ADPCM_CODEC_H_
+
+#include "audio_element.h"
+#include "adpcm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ADPCM_CODEC_TASK_STACK		(3 * 1024)
+#define ADPCM_CODEC_TASK_PRIORITY	(5)
+#define ADPCM_CODEC_TASK_CORE		(0)
+#define ADPCM_CODEC_RINGBUFFER_SIZE	(2 * 1024)
+
+/**
+ * @brief IMA-ADPCM encoder and decoder configuration
+ */
+typedef struct {
+	int sample_rate;	/*!< Sample rate, reported by the decoder to the next element */
+	int channels;		/*!< Interleaved 16 bit encoder input channels, stereo is mixed down to mono */
+	int block_size;		/*!< Block size in bytes, including the header */
+	int out_rb_size;	/*!< Size of the output ring buffer */
+	int task_stack;		/*!< Task stack size */
+	int task_prio;		/*!< Task priority */
+	int task_core;		/*!< Core the task runs on */
+} adpcm_codec_cfg_t;
+
+#define DEFAULT_ADPCM_CODEC_CONFIG() {				\
+	.sample_rate	= 8000,							\
+	.channels		= 2,							\
+	.block_size		= 256,							\
+	.out_rb_size	= ADPCM_CODEC_RINGBUFFER_SIZE,	\
+	.task_stack		= ADPCM_CODEC_TASK_STACK,		\
+	.task_prio		= ADPCM_CODEC_TASK_PRIORITY,	\
+	.task_core		= ADPCM_CODEC_TASK_CORE,		\
+}
+
+/**
+ * @brief Statistics of an IMA-ADPCM element since it was last opened
+ */
+typedef struct {
+	uint32_t blocks;			/*!< Blocks encoded or decoded */
+	uint32_t bytes;				/*!< Encoded bytes produced or consumed */
+	uint32_t samples;			/*!< Mono samples consumed or produced */
+	uint64_t codec_us;			/*!< Time spent in the kernel */
+} adpcm_codec_stats_t;
+
+/**
+ * @brief Create an element encoding 16 bit PCM into IMA-ADPCM blocks
+ *
+ * Every buffer the element writes out is exactly one block, see
+ * adpcm_encode_block. Only the last block of a recording may be short.
+ *
+ * @param [in] config The codec configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t adpcm_encoder_init(adpcm_codec_cfg_t *config);
+
+/**
+ * @brief Create an element decoding IMA-ADPCM blocks into mono 16 bit PCM
+ *
+ * The input is read as consecutive blocks of config->block_size bytes.
+ * The sample rate is reported as music info when the element opens.
+ *
+ * @param [in] config The codec configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t adpcm_decoder_init(adpcm_codec_cfg_t *config);
+
+/**
+ * @brief Get the statistics of an IMA-ADPCM element since it was last opened
+ * @param [in]  self 	The audio element handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t adpcm_codec_get_stats(audio_element_handle_t self, adpcm_codec_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ADPCM_CODEC_H_ */
@@ -0,0 +1,375 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_BACKEND_MDNS
+#include "mdns.h"
+#endif
+
+#include "backend.h"
+#include "resolver.h"
+#include "link_quality.h"
+#include "tcp_stream.h"
+
+#define BACKEND_TASK_SIZE			3072
+#define BACKEND_TASK_PRIORITY		2
+
+/* a probe which takes longer than this counts as failed */
+#define BACKEND_PROBE_TIMEOUT_MS	1000
+/* an endpoint is unhealthy after this many failures in a row */
+#define BACKEND_MAX_FAILS			2
+/* RTT reported for endpoints which were never probed */
+#define BACKEND_RTT_UNKNOWN			UINT32_MAX
+
+#define BACKEND_PROBE_BIT			BIT0
+#define BACKEND_WAKEUP_BIT			BIT1
+
+struct backend_entry {
+	backend_endpoint_t	ep;
+	uint32_t			srtt_ms;
+	unsigned int		fails;
+};
+
+static const char *TAG = "BACKEND";
+
+static struct backend_entry s_entries[BACKEND_MAX_ENDPOINTS];
+static int s_count = 0;
+/* the endpoint of the last successful connection */
+static int s_current = -1;
+static SemaphoreHandle_t s_lock = NULL;
+static EventGroupHandle_t s_event_group = NULL;
+static TaskHandle_t s_task = NULL;
+
+static inline bool backend_healthy(const struct backend_entry *entry)
+{
+	return entry->fails < BACKEND_MAX_FAILS;
+}
+
+/* must be called with the lock held */
+static int backend_add(const char *host, int port, bool discovered)
+{
+	for (int i = 0; i < s_count; i++) {
+		if (s_entries[i].ep.port == port && !strcmp(s_entries[i].ep.host, host)) {
+			return i;
+		}
+	}
+	
+	if (s_count >= BACKEND_MAX_ENDPOINTS || strlen(host) >= BACKEND_MAX_HOSTNAME) {
+		ESP_LOGW(TAG, "Ignoring endpoint %s:%d", host, port);
+		return -1;
+	}
+	
+	struct backend_entry *entry = &s_entries[s_count];
+	strcpy(entry->ep.host, host);
+	entry->ep.port = port;
+	entry->srtt_ms = BACKEND_RTT_UNKNOWN;
+	entry->fails = 0;
+	
+	ESP_LOGI(TAG, "Endpoint %d: %s:%d%s", s_count, host, port, discovered ? " (mDNS)" : "");
+	
+	return s_count++;
+}
+
+/* must be called with the lock held */
+static void backend_update(struct backend_entry *entry, bool ok, uint32_t rtt_ms)
+{
+	if (!ok) {
+		entry->fails++;
+		return;
+	}
+	
+	entry->fails = 0;
+	if (entry->srtt_ms == BACKEND_RTT_UNKNOWN) {
+		entry->srtt_ms = rtt_ms;
+	} else {
+		entry->srtt_ms = (7 * entry->srtt_ms + rtt_ms) / 8;
+	}
+}
+
+/**
+ * @brief Measure the TCP connect time to the probe port of an endpoint
+ *
+ * Never the audio port, the server would see an empty session every time.
+ *
+ * @return The RTT in milliseconds, -1 if the endpoint could not be reached
+ */
+static int backend_probe(const backend_endpoint_t *ep)
+{
+	int64_t started = esp_timer_get_time();
+	int sock;
+	
+	sock = tcp_stream_connect_socket(ep->host, CONFIG_BACKEND_PROBE_PORT, BACKEND_PROBE_TIMEOUT_MS);
+	if (sock < 0) {
+		return -1;
+	}
+	close(sock);
+	
+	return (int)((esp_timer_get_time() - started) / 1000);
+}
+
+#ifdef CONFIG_BACKEND_MDNS
+static void backend_discover(void)
+{
+	mdns_result_t *results = NULL, *r;
+	char host[16];
+	
+	if (mdns_query_ptr(CONFIG_BACKEND_MDNS_SERVICE, "_tcp", 1000, BACKEND_MAX_ENDPOINTS, &results) != ESP_OK) {
+		return;
+	}
+	
+	for (r = results; r; r = r->next) {
+		for (mdns_ip_addr_t *a = r->addr; a; a = a->next) {
+			if (a->addr.type != IPADDR_TYPE_V4) {
+				continue;
+			}
+			
+			/* keep the literal address, the resolver then skips the lookup */
+			ip4addr_ntoa_r(&a->addr.u_addr.ip4, host, sizeof(host));
+			xSemaphoreTake(s_lock, portMAX_DELAY);
+			backend_add(host, r->port, true);
+			xSemaphoreGive(s_lock);
+			break;
+		}
+	}
+	
+	mdns_query_results_free(results);
+}
+#endif
+
+static void backend_task(void *pvParameters)
+{
+	backend_endpoint_t ep;
+	int count, rtt;
+	
+	for (;;) {
+		/* only probe while idle */
+		xEventGroupWaitBits(s_event_group, BACKEND_PROBE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+		
+#ifdef CONFIG_BACKEND_MDNS
+		backend_discover();
+#endif
+		
+		/* without a probe port, connects for turns are all that is measured */
+		xSemaphoreTake(s_lock, portMAX_DELAY);
+		count = CONFIG_BACKEND_PROBE_PORT > 0 ? s_count : 0;
+		xSemaphoreGive(s_lock);
+		
+		for (int i = 0; i < count; i++) {
+			if (!(xEventGroupGetBits(s_event_group) & BACKEND_PROBE_BIT)) {
+				break;
+			}
+			
+			xSemaphoreTake(s_lock, portMAX_DELAY);
+			ep = s_entries[i].ep;
+			xSemaphoreGive(s_lock);
+			
+			rtt = backend_probe(&ep);
+			
+			xSemaphoreTake(s_lock, portMAX_DELAY);
+			backend_update(&s_entries[i], rtt >= 0, rtt);
+			ESP_LOGD(TAG, "Probe %s:%d: %d ms, srtt %u ms", ep.host, ep.port, rtt, s_entries[i].srtt_ms);
+			xSemaphoreGive(s_lock);
+			
+			/* the path turns actually take */
+			if (i == s_current && rtt >= 0) {
+				link_quality_add_rtt(rtt);
+			}
+		}
+		
+		xEventGroupWaitBits(s_event_group, BACKEND_WAKEUP_BIT, pdTRUE, pdFALSE,
+							pdMS_TO_TICKS(CONFIG_BACKEND_PROBE_INTERVAL));
+	}
+}
+
+/**
+ * @brief Register the configured backend endpoints
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t backend_init(void)
+{
+	char list[] = CONFIG_SERVER_ENDPOINTS;
+	char *save = NULL, *item, *colon;
+	
+	if (s_lock) {
+		return ESP_OK;
+	}
+	
+	s_lock = xSemaphoreCreateMutex();
+	s_event_group = xEventGroupCreate();
+	if (!s_lock || !s_event_group) {
+		return ESP_FAIL;
+	}
+	
+	backend_add(CONFIG_SERVER_HOST, CONFIG_SERVER_PORT, false);
+	
+	/* "host[:port],host[:port],..." */
+	for (item = strtok_r(list, ", ", &save); item; item = strtok_r(NULL, ", ", &save)) {
+		colon = strchr(item, ':');
+		if (colon) {
+			*colon = '\0';
+		}
+		backend_add(item, colon ? atoi(colon + 1) : CONFIG_SERVER_PORT, false);
+	}
+	
+	/* have the addresses ready before the first turn */
+	for (int i = 0; i < s_count; i++) {
+		resolver_add(s_entries[i].ep.host);
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Start probing the endpoints in the background
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t backend_start(void)
+{
+	if (s_task) {
+		xEventGroupSetBits(s_event_group, BACKEND_WAKEUP_BIT);
+		return ESP_OK;
+	}
+	
+#ifdef CONFIG_BACKEND_MDNS
+	if (mdns_init() != ESP_OK) {
+		ESP_LOGW(TAG, "Failed to start mDNS, only configured endpoints are used");
+	}
+#endif
+	
+	if (xTaskCreate(backend_task, "backend", BACKEND_TASK_SIZE, NULL, BACKEND_TASK_PRIORITY, &s_task) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create backend task");
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Allow or suspend the background probes
+ * @param [in] enable true to allow probing
+ */
+void backend_set_probing(bool enable)
+{
+	if (!s_event_group) {
+		return;
+	}
+	
+	if (enable) {
+		xEventGroupSetBits(s_event_group, BACKEND_PROBE_BIT);
+	} else {
+		xEventGroupClearBits(s_event_group, BACKEND_PROBE_BIT);
+	}
+}
+
+/**
+ * @brief Pick the endpoint to connect to
+ * @param [out] ep The endpoint
+ * @return The endpoint id to pass to backend_report, -1 if there is none
+ */
+int backend_select(backend_endpoint_t *ep)
+{
+	int best = -1;
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	
+	for (int i = 0; i < s_count; i++) {
+		const struct backend_entry *entry = &s_entries[i];
+		
+		if (best < 0) {
+			best = i;
+		} else if (backend_healthy(entry) != backend_healthy(&s_entries[best])) {
+			if (backend_healthy(entry)) {
+				best = i;
+			}
+		} else if (backend_healthy(entry) ? entry->srtt_ms < s_entries[best].srtt_ms
+										  : entry->fails < s_entries[best].fails) {
+			best = i;
+		}
+	}
+	
+	if (best >= 0) {
+		*ep = s_entries[best].ep;
+	}
+	
+	xSemaphoreGive(s_lock);
+	
+	return best;
+}
+
+/**
+ * @brief Report the outcome of a connection attempt
+ * @param [in] id 		The endpoint id returned by backend_select
+ * @param [in] ok 		true if the connection succeeded
+ * @param [in] rtt_ms 	How long the TCP connect took, -1 if unknown
+ */
+void backend_report(int id, bool ok, int rtt_ms)
+{
+	if (id < 0 || id >= s_count) {
+		return;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	if (ok) {
+		if (rtt_ms >= 0) {
+			backend_update(&s_entries[id], true, rtt_ms);
+		} else {
+			s_entries[id].fails = 0;
+		}
+		s_current = id;
+	} else {
+		/* a failed turn is reason enough, do not wait for a second strike */
+		s_entries[id].fails = BACKEND_MAX_FAILS;
+		ESP_LOGW(TAG, "Endpoint %s:%d marked unhealthy", s_entries[id].ep.host, s_entries[id].ep.port);
+	}
+	xSemaphoreGive(s_lock);
+}
+
+/**
+ * @brief Count the endpoints currently considered healthy
+ * @return The number of healthy endpoints
+ */
+int backend_healthy_count(void)
+{
+	int count = 0;
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	for (int i = 0; i < s_count; i++) {
+		if (backend_healthy(&s_entries[i])) {
+			count++;
+		}
+	}
+	xSemaphoreGive(s_lock);
+	
+	return count;
+}
@@ -0,0 +1,106 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BACKEND_MAX_ENDPOINTS		6
+#define BACKEND_MAX_HOSTNAME		64
+
+/**
+ * @brief A backend server address
+ */
+typedef struct {
+	char 	host[BACKEND_MAX_HOSTNAME];
+	int		port;
+} backend_endpoint_t;
+
+/**
+ * @brief Register the configured backend endpoints
+ *
+ * CONFIG_SERVER_HOST:CONFIG_SERVER_PORT comes first, followed by the
+ * entries of CONFIG_SERVER_ENDPOINTS.
+ *
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t backend_init(void);
+
+/**
+ * @brief Start probing the endpoints in the background
+ *
+ * Call once the station has an IP address, calling it again probes right
+ * away. Endpoints are only probed with CONFIG_BACKEND_PROBE_PORT set,
+ * otherwise their RTT comes from backend_report. With CONFIG_BACKEND_MDNS,
+ * LAN servers are discovered as well.
+ *
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t backend_start(void);
+
+/**
+ * @brief Allow or suspend the background probes
+ *
+ * Probes should only run while the device is idle so that they never
+ * compete with a turn for bandwidth.
+ *
+ * @param [in] enable true to allow probing
+ */
+void backend_set_probing(bool enable);
+
+/**
+ * @brief Pick the endpoint to connect to
+ *
+ * Prefers the healthy endpoint with the lowest smoothed RTT. If none is
+ * healthy, the one which failed least often in a row is returned.
+ *
+ * @param [out] ep The endpoint
+ * @return The endpoint id to pass to backend_report, -1 if there is none
+ */
+int backend_select(backend_endpoint_t *ep);
+
+/**
+ * @brief Report the outcome of a connection attempt
+ * @param [in] id 		The endpoint id returned by backend_select
+ * @param [in] ok 		true if the connection succeeded
+ * @param [in] rtt_ms 	How long the TCP connect took, -1 if unknown
+ */
+void backend_report(int id, bool ok, int rtt_ms);
+
+/**
+ * @brief Count the endpoints currently considered healthy
+ * @return The number of healthy endpoints
+ */
+int backend_healthy_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BACKEND_H_ */
@@ -0,0 +1,263 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "capture_ring.h"
+
+static const char *TAG = "CAPTURE_RING";
+
+typedef struct {
+	uint32_t ts_ms;
+	uint16_t len;
+	uint16_t flags;
+} capture_ring_hdr_t;
+
+/*
+ * Single producer, single consumer. head is only advanced by the writer
+ * and tail only by the reader, both count bytes without wrapping back,
+ * so head - tail is the fill level and a power of two size keeps the
+ * offsets right across the 2^32 wrap.
+ */
+struct capture_ring {
+	uint8_t							*buf;
+	uint32_t						size;
+	uint32_t						head;
+	uint32_t						tail;
+	/* given on every write to wake the reader */
+	SemaphoreHandle_t				avail;
+	capture_ring_stats_t			stats;
+};
+
+static inline uint32_t capture_ring_load(const uint32_t *idx)
+{
+	return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
+}
+
+static inline void capture_ring_store(uint32_t *idx, uint32_t v)
+{
+	__atomic_store_n(idx, v, __ATOMIC_RELEASE);
+}
+
+static void capture_ring_copy_in(capture_ring_handle_t r, uint32_t pos, const void *data, uint32_t len)
+{
+	uint32_t off = pos & (r->size - 1);
+	uint32_t first = r->size - off < len ? r->size - off : len;
+	
+	memcpy(r->buf + off, data, first);
+	memcpy(r->buf, (const uint8_t *)data + first, len - first);
+}
+
+static void capture_ring_copy_out(capture_ring_handle_t r, uint32_t pos, void *data, uint32_t len)
+{
+	uint32_t off = pos & (r->size - 1);
+	uint32_t first = r->size - off < len ? r->size - off : len;
+	
+	memcpy(data, r->buf + off, first);
+	memcpy((uint8_t *)data + first, r->buf, len - first);
+}
+
+/**
+ * @brief Create a ring of timestamped audio records
+ * @param [in] size The storage size in bytes, rounded down to a power of two
+ * @return capture ring handle on success, NULL otherwise
+ */
+capture_ring_handle_t capture_ring_create(size_t size)
+{
+	capture_ring_handle_t r;
+	uint32_t pow2 = 1;
+	
+	while (pow2 <= size / 2) {
+		pow2 <<= 1;
+	}
+	
+	r = calloc(1, sizeof(struct capture_ring));
+	if (!r) {
+		return NULL;
+	}
+	
+	/* internal RAM is scarce, seconds of audio belong in PSRAM */
+	r->buf = heap_caps_malloc(pow2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if (!r->buf) {
+		r->buf = malloc(pow2);
+	}
+	r->avail = xSemaphoreCreateBinary();
+	if (!r->buf || !r->avail) {
+		ESP_LOGE(TAG, "Failed to allocate %u bytes", pow2);
+		capture_ring_destroy(r);
+		return NULL;
+	}
+	
+	r->size = pow2;
+	r->stats.size = pow2;
+	
+	return r;
+}
+
+/**
+ * @brief Destroy a capture ring
+ * @param [in] r The capture ring handle
+ */
+void capture_ring_destroy(capture_ring_handle_t r)
+{
+	if (r) {
+		if (r->avail) {
+			vSemaphoreDelete(r->avail);
+		}
+		free(r->buf);
+		free(r);
+	}
+}
+
+/**
+ * @brief Append a record unless the ring is full, never blocks
+ * @param [in] r 		The capture ring handle
+ * @param [in] buf 		The record data
+ * @param [in] len 		The record length
+ * @param [in] ts_ms 	The capture time of the record
+ * @param [in] flags 	Bits of the caller's choosing kept with the record
+ * @return len on success, 0 if the record was dropped for lack of room,
+ *         -1 if it can never fit
+ */
+int capture_ring_write(capture_ring_handle_t r, const void *buf, int len, uint32_t ts_ms, uint16_t flags)
+{
+	capture_ring_hdr_t hdr = {
+		.ts_ms = ts_ms,
+		.len = len,
+		.flags = flags
+	};
+	uint32_t head = r->head;
+	uint32_t used = head - capture_ring_load(&r->tail);
+	
+	if (len < 0 || len > UINT16_MAX || sizeof(hdr) + len > r->size) {
+		return -1;
+	}
+	
+	if (r->size - used < sizeof(hdr) + len) {
+		r->stats.overruns++;
+		r->stats.overrun_bytes += len;
+		return 0;
+	}
+	
+	capture_ring_copy_in(r, head, &hdr, sizeof(hdr));
+	capture_ring_copy_in(r, head + sizeof(hdr), buf, len);
+	capture_ring_store(&r->head, head + sizeof(hdr) + len);
+	
+	used += sizeof(hdr) + len;
+	if (used > r->stats.high_water) {
+		r->stats.high_water = used;
+	}
+	r->stats.records_in++;
+	
+	xSemaphoreGive(r->avail);
+	
+	return len;
+}
+
+/**
+ * @brief Take the oldest record out of a capture ring
+ * @param [in]  r 			The capture ring handle
+ * @param [out] buf 		The record data
+ * @param [in]  bufsz 		The buffer size
+ * @param [out] ts_ms 		The capture time of the record, may be NULL
+ * @param [out] flags 		The flags written with the record, may be NULL
+ * @param [in]  timeout_ms 	The maximum time to wait for a record
+ * @return The record length, 0 on timeout, -1 if the record did not fit
+ *         into buf and was dropped
+ */
+int capture_ring_read(capture_ring_handle_t r, void *buf, int bufsz, uint32_t *ts_ms, uint16_t *flags,
+					  unsigned int timeout_ms)
+{
+	capture_ring_hdr_t hdr;
+	uint32_t tail = r->tail;
+	int ret;
+	
+	if (capture_ring_load(&r->head) == tail) {
+		/* a leftover wakeup can end the wait early, callers treat it as a timeout */
+		if (xSemaphoreTake(r->avail, pdMS_TO_TICKS(timeout_ms)) != pdTRUE ||
+			capture_ring_load(&r->head) == tail) {
+			return 0;
+		}
+	}
+	
+	capture_ring_copy_out(r, tail, &hdr, sizeof(hdr));
+	if (hdr.len > bufsz) {
+		r->stats.oversized++;
+		ret = -1;
+	} else {
+		capture_ring_copy_out(r, tail + sizeof(hdr), buf, hdr.len);
+		r->stats.records_out++;
+		ret = hdr.len;
+	}
+	capture_ring_store(&r->tail, tail + sizeof(hdr) + hdr.len);
+	
+	if (ts_ms) {
+		*ts_ms = hdr.ts_ms;
+	}
+	if (flags) {
+		*flags = hdr.flags;
+	}
+	
+	return ret;
+}
+
+/**
+ * @brief Drop the records captured before a given time
+ * @param [in] r 		The capture ring handle
+ * @param [in] ts_ms 	The capture time of the oldest record to keep
+ */
+void capture_ring_trim(capture_ring_handle_t r, uint32_t ts_ms)
+{
+	capture_ring_hdr_t hdr;
+	uint32_t head = capture_ring_load(&r->head);
+	uint32_t tail = r->tail;
+	
+	while (tail != head) {
+		capture_ring_copy_out(r, tail, &hdr, sizeof(hdr));
+		/* wrap-safe comparison */
+		if ((int32_t)(hdr.ts_ms - ts_ms) >= 0) {
+			break;
+		}
+		tail += sizeof(hdr) + hdr.len;
+	}
+	
+	capture_ring_store(&r->tail, tail);
+}
+
+/**
+ * @brief Get the counters of a capture ring
+ * @param [in]  r 		The capture ring handle
+ * @param [out] stats 	The counters
+ */
+void capture_ring_get_stats(capture_ring_handle_t r, capture_ring_stats_t *stats)
+{
+	*stats = r->stats;
+	stats->used = capture_ring_load(&r->head) - capture_ring_load(&r->tail);
+}
@@ -0,0 +1,122 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _CAPTURE_RING_H_
+#define _CAPTURE_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct capture_ring *capture_ring_handle_t;
+typedef struct capture_ring_stats capture_ring_stats_t;
+
+/**
+ * @brief Counters of a capture ring since it was created
+ */
+struct capture_ring_stats {
+	uint32_t records_in;		/*!< Records written */
+	uint32_t records_out;		/*!< Records read */
+	uint32_t overruns;			/*!< Records dropped by the writer because the ring was full */
+	uint32_t overrun_bytes;		/*!< Payload bytes of the overruns */
+	uint32_t oversized;			/*!< Records dropped by the reader because they did not fit its buffer */
+	uint32_t high_water;		/*!< Highest fill level seen, in bytes */
+	uint32_t used;				/*!< Current fill level, in bytes */
+	uint32_t size;				/*!< Storage size, in bytes */
+};
+
+/**
+ * @brief Create a ring of timestamped audio records
+ *
+ * The storage is taken from PSRAM when the board has it. Records keep
+ * their boundaries, so one encoded packet written is one packet read.
+ *
+ * The ring is lock-free for one writer task and one reader task:
+ * capture_ring_write may only be called by the writer, capture_ring_read
+ * and capture_ring_trim only by the reader.
+ *
+ * @param [in] size The storage size in bytes, including 8 bytes per record,
+ *                  rounded down to a power of two
+ * @return capture ring handle on success, NULL otherwise
+ */
+capture_ring_handle_t capture_ring_create(size_t size);
+
+/**
+ * @brief Destroy a capture ring
+ * @param [in] r The capture ring handle
+ */
+void capture_ring_destroy(capture_ring_handle_t r);
+
+/**
+ * @brief Append a record unless the ring is full, never blocks
+ *
+ * A record which does not fit is dropped and counted as an overrun, the
+ * audio already queued is left alone.
+ *
+ * @param [in] r 		The capture ring handle
+ * @param [in] buf 		The record data
+ * @param [in] len 		The record length
+ * @param [in] ts_ms 	The capture time of the record
+ * @param [in] flags 	Bits of the caller's choosing kept with the record
+ * @return len on success, 0 if the record was dropped for lack of room,
+ *         -1 if it can never fit, records are at most 65535 bytes
+ */
+int capture_ring_write(capture_ring_handle_t r, const void *buf, int len, uint32_t ts_ms, uint16_t flags);
+
+/**
+ * @brief Take the oldest record out of a capture ring
+ * @param [in]  r 			The capture ring handle
+ * @param [out] buf 		The record data
+ * @param [in]  bufsz 		The buffer size
+ * @param [out] ts_ms 		The capture time of the record, may be NULL
+ * @param [out] flags 		The flags written with the record, may be NULL
+ * @param [in]  timeout_ms 	The maximum time to wait for a record
+ * @return The record length, 0 on timeout, -1 if the record did not fit
+ *         into buf and was dropped
+ */
+int capture_ring_read(capture_ring_handle_t r, void *buf, int bufsz, uint32_t *ts_ms, uint16_t *flags,
+					  unsigned int timeout_ms);
+
+/**
+ * @brief Drop the records captured before a given time
+ * @param [in] r 		The capture ring handle
+ * @param [in] ts_ms 	The capture time of the oldest record to keep
+ */
+void capture_ring_trim(capture_ring_handle_t r, uint32_t ts_ms);
+
+/**
+ * @brief Get the counters of a capture ring, from any task
+ * @param [in]  r 		The capture ring handle
+ * @param [out] stats 	The counters
+ */
+void capture_ring_get_stats(capture_ring_handle_t r, capture_ring_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CAPTURE_RING_H_ */
@@ -5,4 +5,13 @@ COMPONENT_EMBED_FILES := assets/style.css assets/jquery.gz assets/code.js assets
 
 ifdef CONFIG_ENABLE_SECURITY_PROTO
 COMPONENT_EMBED_TXTFILES += certs/cacert.pem certs/cert.pem certs/privkey.pem
+COMPONENT_EMBED_FILES += certs/cacert.der certs/cert.der certs/privkey.der
+
+# Decode the PEM credentials at build time, so the firmware does not have
+# to at boot. Certificate chains become concatenated DER certificates.
+$(COMPONENT_PATH)/certs/%key.der: $(COMPONENT_PATH)/certs/%key.pem
+	openssl pkey -in $< -outform DER -out $@
+
+$(COMPONENT_PATH)/certs/%.der: $(COMPONENT_PATH)/certs/%.pem
+	awk '/-BEGIN CERTIFICATE-/ { c = "" } { c = c $$0 "\n" } /-END CERTIFICATE-/ { printf "%s", c | "openssl x509 -outform DER"; close("openssl x509 -outform DER") }' $< > $@
 endif
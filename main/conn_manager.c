@@ -0,0 +1,346 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "conn_manager.h"
+#include "link_quality.h"
+
+/* connects, so it holds the mbedtls handshake and the authentication */
+#define CONN_MANAGER_TASK_SIZE		8192
+#define CONN_MANAGER_TASK_PRIORITY	3
+
+/* how often an idle connection is checked for a dead link */
+#define CONN_CHECK_INTERVAL_MS		1000
+#define CONN_BACKOFF_MIN_MS			500
+
+/* set while an authenticated connection is available */
+#define CONN_CONNECTED_BIT			BIT0
+/* wakes the manager task up ahead of its next check */
+#define CONN_WAKEUP_BIT				BIT1
+
+static const char *TAG = "CONNMGR";
+
+struct conn_manager {
+	TaskHandle_t					task;
+	tcp_stream_handle_t				stream;
+	backend_endpoint_t				endpoint;
+	conn_manager_auth_cb_t			auth_cb;
+	void							*auth_arg;
+	EventGroupHandle_t				event_group;
+	SemaphoreHandle_t				lock;
+	unsigned int					backoff_ms;
+	int64_t							idle_deadline;
+	bool							wanted;
+	bool							connected;
+	bool							in_use;
+};
+
+static inline int64_t conn_manager_now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+/* a connection is wanted again, keep it for another idle period */
+static inline void conn_manager_touch(conn_manager_handle_t cm)
+{
+	cm->wanted = true;
+	cm->idle_deadline = conn_manager_now_ms() + CONFIG_CONN_IDLE_TIMEOUT;
+}
+
+static void conn_manager_disconnect(conn_manager_handle_t cm)
+{
+	xEventGroupClearBits(cm->event_group, CONN_CONNECTED_BIT);
+	cm->stream->close(cm->stream);
+	cm->connected = false;
+}
+
+/* must be called with the lock held */
+static bool conn_manager_connect_once(conn_manager_handle_t cm, int64_t deadline)
+{
+	int id = backend_select(&cm->endpoint);
+	tcp_stream_stats_t before, after;
+	int64_t left;
+	int rtt_ms = -1;
+	
+	if (id < 0) {
+		return false;
+	}
+	
+	tcp_stream_get_stats(cm->stream, &before);
+	if (!cm->stream->open(cm->stream, cm->endpoint.host, cm->endpoint.port)) {
+		backend_report(id, false, -1);
+		return false;
+	}
+	
+	/* the TCP connect of the open is the endpoint's RTT, no probe needed */
+	tcp_stream_get_stats(cm->stream, &after);
+	if (after.connect_time.count > before.connect_time.count) {
+		rtt_ms = (int)((after.connect_time.total_us - before.connect_time.total_us) / 1000);
+	}
+	
+	tcp_stream_set_keepalive(cm->stream, CONFIG_CONN_KEEPALIVE_IDLE,
+							 CONFIG_CONN_KEEPALIVE_INTERVAL, CONFIG_CONN_KEEPALIVE_COUNT);
+	
+	if (cm->auth_cb) {
+		/* the authentication must not push the connect past its deadline */
+		left = deadline - conn_manager_now_ms();
+		if (left > link_quality_get_timeout()) {
+			left = link_quality_get_timeout();
+		}
+		tcp_stream_set_timeout(cm->stream, left > 0 ? left : 0);
+		
+		if (!cm->auth_cb(cm->stream, cm->auth_arg)) {
+			ESP_LOGE(TAG, "Authentication failed");
+			cm->stream->close(cm->stream);
+			backend_report(id, false, -1);
+			return false;
+		}
+	}
+	
+	tcp_stream_set_timeout(cm->stream, link_quality_get_timeout());
+	
+	backend_report(id, true, rtt_ms);
+	return true;
+}
+
+/* must be called with the lock held */
+static bool conn_manager_connect(conn_manager_handle_t cm)
+{
+	int64_t deadline = conn_manager_now_ms() + CONN_MANAGER_CONNECT_TIMEOUT;
+	int attempts = 1;
+	
+	/* fail over to the next best endpoint while there is one left and time for it */
+	while (!conn_manager_connect_once(cm, deadline)) {
+		if (backend_healthy_count() == 0 || attempts++ >= BACKEND_MAX_ENDPOINTS) {
+			return false;
+		}
+		if (conn_manager_now_ms() + CONFIG_TCP_CONNECT_TIMEOUT > deadline) {
+			ESP_LOGW(TAG, "No time left to fail over within %d ms", CONN_MANAGER_CONNECT_TIMEOUT);
+			return false;
+		}
+		ESP_LOGW(TAG, "Failing over to another endpoint");
+	}
+	
+	cm->connected = true;
+	cm->backoff_ms = CONN_BACKOFF_MIN_MS;
+	xEventGroupSetBits(cm->event_group, CONN_CONNECTED_BIT);
+	
+	ESP_LOGI(TAG, "Connection ready");
+	
+	return true;
+}
+
+static void conn_manager_task(void *pvParameters)
+{
+	conn_manager_handle_t cm = (conn_manager_handle_t)pvParameters;
+	unsigned int wait_ms;
+	
+	for (;;) {
+		wait_ms = CONN_CHECK_INTERVAL_MS;
+		
+		/* the lock is held for the whole turn, leave the stream alone then */
+		if (xSemaphoreTake(cm->lock, 0) == pdTRUE) {
+			if (cm->connected && !tcp_stream_is_alive(cm->stream)) {
+				ESP_LOGW(TAG, "Connection lost, reconnecting");
+				conn_manager_disconnect(cm);
+			}
+			
+			if (CONFIG_CONN_IDLE_TIMEOUT > 0 && cm->wanted && conn_manager_now_ms() >= cm->idle_deadline) {
+				cm->wanted = false;
+				if (cm->connected) {
+					ESP_LOGI(TAG, "Connection unused for %d ms, dropping it", CONFIG_CONN_IDLE_TIMEOUT);
+					conn_manager_disconnect(cm);
+				}
+			}
+			
+			if (!cm->connected && cm->wanted && !conn_manager_connect(cm)) {
+				wait_ms = cm->backoff_ms;
+				ESP_LOGW(TAG, "Connect failed, retrying in %u ms", wait_ms);
+				cm->backoff_ms *= 2;
+				if (cm->backoff_ms > CONFIG_CONN_BACKOFF_MAX) {
+					cm->backoff_ms = CONFIG_CONN_BACKOFF_MAX;
+				}
+			}
+			
+			xSemaphoreGive(cm->lock);
+		}
+		
+		xEventGroupWaitBits(cm->event_group, CONN_WAKEUP_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(wait_ms));
+	}
+}
+
+/**
+ * @brief Create a connection manager keeping a TCP stream open between turns
+ * @param [in] stream	The TCP stream handle to manage
+ * @param [in] auth_cb	The authentication callback, may be NULL
+ * @param [in] arg		The user argument passed to auth_cb
+ * @return connection manager handle on success, NULL otherwise
+ */
+conn_manager_handle_t conn_manager_create(tcp_stream_handle_t stream, conn_manager_auth_cb_t auth_cb, void *arg)
+{
+	conn_manager_handle_t cm;
+	
+	cm = calloc(1, sizeof(struct conn_manager));
+	if (!cm) {
+		return NULL;
+	}
+	
+	cm->event_group = xEventGroupCreate();
+	cm->lock = xSemaphoreCreateMutex();
+	if (!cm->event_group || !cm->lock) {
+		ESP_LOGE(TAG, "Failed to create the connection manager");
+		return NULL;
+	}
+	
+	cm->stream = stream;
+	cm->auth_cb = auth_cb;
+	cm->auth_arg = arg;
+	cm->backoff_ms = CONN_BACKOFF_MIN_MS;
+	/* without an idle timeout the connection is always kept up */
+	cm->wanted = (CONFIG_CONN_IDLE_TIMEOUT == 0);
+	
+	return cm;
+}
+
+/**
+ * @brief Start connecting in the background
+ * @param [in] cm The connection manager handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t conn_manager_start(conn_manager_handle_t cm)
+{
+	if (cm->task) {
+		cm->backoff_ms = CONN_BACKOFF_MIN_MS;
+		xEventGroupSetBits(cm->event_group, CONN_WAKEUP_BIT);
+		return ESP_OK;
+	}
+	
+	if (xTaskCreate(conn_manager_task, "conn_manager", CONN_MANAGER_TASK_SIZE, (void *)cm, CONN_MANAGER_TASK_PRIORITY, &cm->task) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create connection manager task");
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Get a connection ready ahead of a turn which is likely to follow
+ * @param [in] cm The connection manager handle
+ */
+void conn_manager_preconnect(conn_manager_handle_t cm)
+{
+	conn_manager_touch(cm);
+	cm->backoff_ms = CONN_BACKOFF_MIN_MS;
+	xEventGroupSetBits(cm->event_group, CONN_WAKEUP_BIT);
+}
+
+/**
+ * @brief Take the authenticated stream for a conversation turn
+ * @param [in] cm 			The connection manager handle
+ * @param [in] timeout_ms	The maximum time to wait for a connection
+ * @return The TCP stream handle, NULL if no connection could be made
+ */
+tcp_stream_handle_t conn_manager_acquire(conn_manager_handle_t cm, unsigned int timeout_ms)
+{
+	int64_t deadline = conn_manager_now_ms() + timeout_ms;
+	int64_t left;
+	
+	/*
+	 * Connecting is left to the manager task, whose stack is sized for the
+	 * TLS handshake. One deadline covers the wait for the connection and
+	 * for the lock, whatever the order they come in.
+	 */
+	for (;;) {
+		/* skip whatever backoff is pending, somebody is waiting now */
+		conn_manager_preconnect(cm);
+		
+		left = deadline - conn_manager_now_ms();
+		xEventGroupWaitBits(cm->event_group, CONN_CONNECTED_BIT, pdFALSE, pdTRUE,
+							pdMS_TO_TICKS(left > 0 ? left : 0));
+		
+		left = deadline - conn_manager_now_ms();
+		if (xSemaphoreTake(cm->lock, pdMS_TO_TICKS(left > 0 ? left : 0)) != pdTRUE) {
+			return NULL;
+		}
+		
+		if (cm->connected && !tcp_stream_is_alive(cm->stream)) {
+			ESP_LOGW(TAG, "Connection lost while idle");
+			conn_manager_disconnect(cm);
+		}
+		
+		if (cm->connected) {
+			cm->in_use = true;
+			return cm->stream;
+		}
+		
+		xSemaphoreGive(cm->lock);
+		
+		if (conn_manager_now_ms() >= deadline) {
+			ESP_LOGW(TAG, "No connection within %u ms", timeout_ms);
+			return NULL;
+		}
+	}
+}
+
+/**
+ * @brief Give the stream back after a turn
+ * @param [in] cm 		The connection manager handle
+ * @param [in] reusable	false to drop the connection, e.g. after an error
+ */
+void conn_manager_release(conn_manager_handle_t cm, bool reusable)
+{
+	if (!cm->in_use) {
+		return;
+	}
+	
+	if (!reusable) {
+		conn_manager_disconnect(cm);
+	}
+	
+	cm->in_use = false;
+	conn_manager_touch(cm);
+	xSemaphoreGive(cm->lock);
+	
+	/* have the manager check the link (and reconnect) right away */
+	xEventGroupSetBits(cm->event_group, CONN_WAKEUP_BIT);
+}
+
+/**
+ * @brief Get the server endpoint of the current connection
+ * @param [in] cm The connection manager handle
+ * @return The endpoint last connected to
+ */
+const backend_endpoint_t *conn_manager_get_endpoint(conn_manager_handle_t cm)
+{
+	return &cm->endpoint;
+}
@@ -0,0 +1,127 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _CONN_MANAGER_H_
+#define _CONN_MANAGER_H_
+
+#include "tcp_stream.h"
+#include "backend.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Longest a connect by the manager task takes, failing over included. No
+ * endpoint is tried once a full attempt would no longer fit, and the
+ * authentication gets whatever is left. Acquiring with this timeout
+ * therefore never gives up on a cold connect which is still under way.
+ */
+#define CONN_MANAGER_CONNECT_TIMEOUT	(2 * CONFIG_TCP_CONNECT_TIMEOUT)
+
+typedef struct conn_manager *conn_manager_handle_t;
+
+/**
+ * @brief Called on every new connection before it is handed out
+ * @param [in] stream 	The freshly opened TCP stream
+ * @param [in] arg 		The user argument given to conn_manager_create
+ * @return true if the connection is authenticated, false otherwise
+ */
+typedef bool (*conn_manager_auth_cb_t)(tcp_stream_handle_t stream, void *arg);
+
+/**
+ * @brief Create a connection manager keeping a TCP stream open between turns
+ *
+ * Every connection goes to the endpoint picked by backend_select, failing
+ * over to the next one if it cannot be reached. backend_init must have
+ * been called before.
+ *
+ * @param [in] stream	The TCP stream handle to manage
+ * @param [in] auth_cb	The authentication callback, may be NULL
+ * @param [in] arg		The user argument passed to auth_cb
+ * @return connection manager handle on success, NULL otherwise
+ */
+conn_manager_handle_t conn_manager_create(tcp_stream_handle_t stream, conn_manager_auth_cb_t auth_cb, void *arg);
+
+/**
+ * @brief Start connecting in the background
+ *
+ * Safe to call again, e.g. every time the station gets an IP address.
+ *
+ * @param [in] cm The connection manager handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t conn_manager_start(conn_manager_handle_t cm);
+
+/**
+ * @brief Get a connection ready ahead of a turn which is likely to follow
+ *
+ * Connects and authenticates in the background without waiting. With
+ * CONFIG_CONN_IDLE_TIMEOUT set, a connection which is not acquired within
+ * that time is dropped again.
+ *
+ * @param [in] cm The connection manager handle
+ */
+void conn_manager_preconnect(conn_manager_handle_t cm);
+
+/**
+ * @brief Take the authenticated stream for a conversation turn
+ *
+ * Never connects in the caller's context, a connection which is not up
+ * yet is waited for from the manager task. The whole call, including the
+ * wait for a turn still holding the stream, takes at most timeout_ms.
+ *
+ * @param [in] cm 			The connection manager handle
+ * @param [in] timeout_ms	The maximum time to wait for a connection,
+ * 							CONN_MANAGER_CONNECT_TIMEOUT to wait out a cold connect
+ * @return The TCP stream handle, NULL if no connection could be made
+ */
+tcp_stream_handle_t conn_manager_acquire(conn_manager_handle_t cm, unsigned int timeout_ms);
+
+/**
+ * @brief Give the stream back after a turn
+ *
+ * Must be called from the task which acquired the stream.
+ *
+ * @param [in] cm 		The connection manager handle
+ * @param [in] reusable	false to drop the connection, e.g. after an error
+ */
+void conn_manager_release(conn_manager_handle_t cm, bool reusable);
+
+/**
+ * @brief Get the server endpoint of the current connection
+ *
+ * Meant for the authentication callback, which may need to open further
+ * streams to the same server.
+ *
+ * @param [in] cm The connection manager handle
+ * @return The endpoint last connected to
+ */
+const backend_endpoint_t *conn_manager_get_endpoint(conn_manager_handle_t cm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CONN_MANAGER_H_ */
@@ -0,0 +1,156 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "credentials.h"
+
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+
+#include "mbedtls/asn1.h"
+
+extern const unsigned char cacert_der_start[] asm("_binary_cacert_der_start");
+extern const unsigned char cacert_der_end[] asm("_binary_cacert_der_end");
+extern const unsigned char cert_der_start[] asm("_binary_cert_der_start");
+extern const unsigned char cert_der_end[] asm("_binary_cert_der_end");
+extern const unsigned char privkey_der_start[] asm("_binary_privkey_der_start");
+extern const unsigned char privkey_der_end[] asm("_binary_privkey_der_end");
+
+extern const unsigned char cacert_pem_start[] asm("_binary_cacert_pem_start");
+extern const unsigned char cert_pem_start[] asm("_binary_cert_pem_start");
+extern const unsigned char privkey_pem_start[] asm("_binary_privkey_pem_start");
+
+static const char *TAG = "CREDENTIALS";
+
+static credentials_t s_credentials;
+static bool s_loaded = false;
+
+/**
+ * @brief Parse a sequence of concatenated DER certificates
+ */
+static int credentials_parse_der_chain(mbedtls_x509_crt *chain, const unsigned char *buf, const unsigned char *end)
+{
+	int ret;
+	
+	while (buf < end) {
+		unsigned char *p = (unsigned char *)buf;
+		size_t len;
+		
+		ret = mbedtls_asn1_get_tag(&p, end, &len, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE);
+		if (ret != 0) {
+			return ret;
+		}
+		
+		len += p - buf;
+		if ((ret = mbedtls_x509_crt_parse_der(chain, buf, len)) != 0) {
+			return ret;
+		}
+		buf += len;
+	}
+	
+	return 0;
+}
+
+/**
+ * @brief Load the embedded DER credentials into the shared store
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t credentials_init(void)
+{
+	int64_t started = esp_timer_get_time();
+	int ret;
+	
+	if (s_loaded) {
+		return ESP_OK;
+	}
+	
+	mbedtls_x509_crt_init(&s_credentials.cacert);
+	mbedtls_x509_crt_init(&s_credentials.clntcert);
+	mbedtls_pk_init(&s_credentials.clntkey);
+	
+	ret = credentials_parse_der_chain(&s_credentials.cacert, cacert_der_start, cacert_der_end);
+	if (ret != 0) {
+		ESP_LOGE(TAG, "Failed to parse CA root certificate, ret=-0x%x", -ret);
+		goto errout;
+	}
+	
+	ret = credentials_parse_der_chain(&s_credentials.clntcert, cert_der_start, cert_der_end);
+	if (ret != 0) {
+		ESP_LOGE(TAG, "Failed to parse client certificate, ret=-0x%x", -ret);
+		goto errout;
+	}
+	
+	ret = mbedtls_pk_parse_key(&s_credentials.clntkey, privkey_der_start, privkey_der_end - privkey_der_start, NULL, 0);
+	if (ret != 0) {
+		ESP_LOGE(TAG, "Failed to parse private key, ret=-0x%x", -ret);
+		goto errout;
+	}
+	
+	s_loaded = true;
+	
+	ESP_LOGI(TAG, "Credentials loaded in %d ms", (int)((esp_timer_get_time() - started) / 1000));
+	
+	return ESP_OK;
+	
+errout:
+	mbedtls_x509_crt_free(&s_credentials.cacert);
+	mbedtls_x509_crt_free(&s_credentials.clntcert);
+	mbedtls_pk_free(&s_credentials.clntkey);
+	return ESP_FAIL;
+}
+
+/**
+ * @brief Get the shared credential store
+ * @return The credentials, NULL if credentials_init has not succeeded
+ */
+credentials_handle_t credentials_get(void)
+{
+	return s_loaded ? &s_credentials : NULL;
+}
+
+/**
+ * @brief Get the PEM form of a credential, for clients which parse their own
+ *
+ * esp-mqtt takes PEM only and parses its own copy on every connect, so
+ * the credentials are embedded in both forms.
+ *
+ * @param [in] id The credential
+ * @return NUL terminated PEM text
+ */
+const char *credentials_get_pem(credential_id_t id)
+{
+	switch (id) {
+	case CREDENTIAL_CA_CERT:
+		return (const char *)cacert_pem_start;
+	case CREDENTIAL_CLIENT_CERT:
+		return (const char *)cert_pem_start;
+	case CREDENTIAL_CLIENT_KEY:
+		return (const char *)privkey_pem_start;
+	default:
+		return NULL;
+	}
+}
+
+#endif /* CONFIG_ENABLE_SECURITY_PROTO */
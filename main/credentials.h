@@ -0,0 +1,92 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _CREDENTIALS_H_
+#define _CREDENTIALS_H_
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+
+/**
+ * @brief Identifies one of the embedded credentials
+ */
+typedef enum {
+	CREDENTIAL_CA_CERT = 0,		/*!< Certificate Authority (CA) certificate */
+	CREDENTIAL_CLIENT_CERT,		/*!< CA signed client certificate */
+	CREDENTIAL_CLIENT_KEY,		/*!< Client private key */
+} credential_id_t;
+
+/**
+ * @brief Parsed credentials shared by every secure connection
+ */
+typedef struct credentials {
+	mbedtls_x509_crt 	cacert;
+	mbedtls_x509_crt 	clntcert;
+	mbedtls_pk_context 	clntkey;
+} credentials_t, *credentials_handle_t;
+
+/**
+ * @brief Load the embedded DER credentials into the shared store
+ *
+ * Must be called once before any secure connection is created.
+ *
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t credentials_init(void);
+
+/**
+ * @brief Get the shared credential store
+ * @return The credentials, NULL if credentials_init has not succeeded
+ */
+credentials_handle_t credentials_get(void);
+
+/**
+ * @brief Get the PEM form of a credential, for clients which parse their own
+ *
+ * esp-mqtt takes PEM only and parses its own copy on every connect, so
+ * the credentials are embedded in both forms.
+ *
+ * @param [in] id The credential
+ * @return NUL terminated PEM text
+ */
+const char *credentials_get_pem(credential_id_t id);
+
+#endif /* CONFIG_ENABLE_SECURITY_PROTO */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CREDENTIALS_H_ */
@@ -0,0 +1,159 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "sdkconfig.h"
+
+#include "dtx.h"
+
+#ifdef CONFIG_RECORDER_DTX
+
+/**
+ * @brief Start leaving silence out of a new upload
+ * @param [out] dtx 		The state
+ * @param [in] sample_rate 	The sample rate of the audio
+ * @param [in] max_ms 		The longest silence a single descriptor stands for
+ * @param [in] lead_ms 		The silence held back as lead-in, 0 for none
+ */
+void dtx_init(dtx_t *dtx, int sample_rate, uint32_t max_ms, uint32_t lead_ms)
+{
+	memset(dtx, 0, sizeof(*dtx));
+	dtx->sample_rate = sample_rate;
+	dtx->max_ms = max_ms;
+	dtx->lead_max = (uint32_t)((uint64_t)lead_ms * sample_rate / 1000);
+}
+
+/* the oldest record of the lead-in is left out after all */
+static void dtx_lead_drop(dtx_t *dtx)
+{
+	dtx->samples += dtx->lead_samples[0];
+	dtx->bytes += dtx->lead_len[0];
+	dtx_lead_pop(dtx);
+}
+
+/**
+ * @brief Leave a silent record out
+ * @param [in] dtx 		The state
+ * @param [in] buf 		The record
+ * @param [in] samples 	The duration of the record in samples
+ * @param [in] len 		The size of the record in bytes
+ * @return The milliseconds of silence to describe now, 0 for none
+ */
+uint32_t dtx_skip(dtx_t *dtx, const void *buf, uint32_t samples, int len)
+{
+	while (dtx->leads > 0 && (dtx->leads == DTX_LEAD_RECORDS || dtx->lead_bytes + len > DTX_LEAD_SIZE ||
+							  dtx->lead_total + samples > dtx->lead_max)) {
+		dtx_lead_drop(dtx);
+	}
+	
+	if (len > DTX_LEAD_SIZE || samples > dtx->lead_max) {
+		dtx->samples += samples;
+		dtx->bytes += len;
+	} else {
+		memcpy(dtx->lead + dtx->lead_bytes, buf, len);
+		dtx->lead_len[dtx->leads] = len;
+		dtx->lead_samples[dtx->leads] = samples;
+		dtx->leads++;
+		dtx->lead_bytes += len;
+		dtx->lead_total += samples;
+	}
+	
+	if ((uint64_t)dtx->samples * 1000 >= (uint64_t)dtx->max_ms * dtx->sample_rate) {
+		return dtx_take(dtx);
+	}
+	
+	return 0;
+}
+
+/**
+ * @brief Take the silence left out and not described yet
+ * @param [in] dtx The state
+ * @return The milliseconds of silence to describe now, 0 for none
+ */
+uint32_t dtx_take(dtx_t *dtx)
+{
+	uint32_t ms = (uint32_t)((uint64_t)dtx->samples * 1000 / dtx->sample_rate);
+	
+	if (ms == 0) {
+		return 0;
+	}
+	
+	dtx->samples -= (uint32_t)((uint64_t)ms * dtx->sample_rate / 1000);
+	dtx->ms += ms;
+	dtx->descriptors++;
+	
+	return ms;
+}
+
+/**
+ * @brief Get the oldest record of the lead-in
+ * @param [in]  dtx The state
+ * @param [out] len The size of the record in bytes
+ * @return The record, NULL once the lead-in is empty
+ */
+const void *dtx_lead_peek(dtx_t *dtx, int *len)
+{
+	if (dtx->leads == 0) {
+		return NULL;
+	}
+	
+	*len = dtx->lead_len[0];
+	return dtx->lead;
+}
+
+/**
+ * @brief Drop the oldest record of the lead-in, once it went out
+ * @param [in] dtx The state
+ */
+void dtx_lead_pop(dtx_t *dtx)
+{
+	int len = dtx->lead_len[0];
+	
+	if (dtx->leads == 0) {
+		return;
+	}
+	
+	dtx->lead_bytes -= len;
+	dtx->lead_total -= dtx->lead_samples[0];
+	dtx->leads--;
+	memmove(dtx->lead, dtx->lead + len, dtx->lead_bytes);
+	memmove(dtx->lead_len, dtx->lead_len + 1, dtx->leads * sizeof(dtx->lead_len[0]));
+	memmove(dtx->lead_samples, dtx->lead_samples + 1, dtx->leads * sizeof(dtx->lead_samples[0]));
+}
+
+/**
+ * @brief Take the silence at the end of an upload, the lead-in included
+ * @param [in] dtx The state
+ * @return The milliseconds of silence to describe now, 0 for none
+ */
+uint32_t dtx_finish(dtx_t *dtx)
+{
+	while (dtx->leads > 0) {
+		dtx_lead_drop(dtx);
+	}
+	
+	return dtx_take(dtx);
+}
+
+#endif /* CONFIG_RECORDER_DTX */
@@ -0,0 +1,122 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _DTX_H_
+#define _DTX_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DTX_LEAD_SIZE		(2048)
+#define DTX_LEAD_RECORDS	(8)
+
+/**
+ * @brief Silence left out of an upload, and how it has been described
+ *
+ * The last silent records are held back as lead-in. Speech is only told
+ * apart from silence a frame or two after it starts, the lead-in goes out
+ * ahead of it so its onset is kept.
+ */
+typedef struct {
+	int sample_rate;							/*!< Sample rate of the audio */
+	uint32_t max_ms;							/*!< Longest silence a single descriptor stands for */
+	uint32_t lead_max;							/*!< Lead-in held back, in samples */
+	uint32_t samples;							/*!< Silence left out and not described yet */
+	uint32_t ms;								/*!< Silence described so far */
+	uint32_t bytes;								/*!< Bytes left out so far */
+	uint32_t descriptors;						/*!< Descriptors due so far */
+	uint8_t lead[DTX_LEAD_SIZE];				/*!< The lead-in records back to back */
+	uint16_t lead_len[DTX_LEAD_RECORDS];
+	uint32_t lead_samples[DTX_LEAD_RECORDS];
+	int leads;									/*!< Records held in the lead-in */
+	int lead_bytes;
+	uint32_t lead_total;						/*!< Samples held in the lead-in */
+} dtx_t;
+
+/**
+ * @brief Start leaving silence out of a new upload
+ * @param [out] dtx 		The state
+ * @param [in] sample_rate 	The sample rate of the audio
+ * @param [in] max_ms 		The longest silence a single descriptor stands for
+ * @param [in] lead_ms 		The silence held back as lead-in, 0 for none
+ */
+void dtx_init(dtx_t *dtx, int sample_rate, uint32_t max_ms, uint32_t lead_ms);
+
+/**
+ * @brief Leave a silent record out
+ *
+ * The record joins the lead-in, and what falls out of the lead-in is left
+ * out. Once the silence left out and not described yet reaches max_ms, it
+ * is taken as by dtx_take, so a long pause is still described every so
+ * often.
+ *
+ * @param [in] dtx 		The state
+ * @param [in] buf 		The record
+ * @param [in] samples 	The duration of the record in samples
+ * @param [in] len 		The size of the record in bytes
+ * @return The milliseconds of silence to describe now, 0 for none
+ */
+uint32_t dtx_skip(dtx_t *dtx, const void *buf, uint32_t samples, int len);
+
+/**
+ * @brief Take the silence left out and not described yet
+ *
+ * Called before audio goes out again, which is preceded by the descriptor
+ * and then the lead-in. The fraction of a millisecond is kept for the
+ * next descriptor.
+ *
+ * @param [in] dtx The state
+ * @return The milliseconds of silence to describe now, 0 for none
+ */
+uint32_t dtx_take(dtx_t *dtx);
+
+/**
+ * @brief Get the oldest record of the lead-in
+ * @param [in]  dtx The state
+ * @param [out] len The size of the record in bytes
+ * @return The record, NULL once the lead-in is empty
+ */
+const void *dtx_lead_peek(dtx_t *dtx, int *len);
+
+/**
+ * @brief Drop the oldest record of the lead-in, once it went out
+ * @param [in] dtx The state
+ */
+void dtx_lead_pop(dtx_t *dtx);
+
+/**
+ * @brief Take the silence at the end of an upload, the lead-in included
+ * @param [in] dtx The state
+ * @return The milliseconds of silence to describe now, 0 for none
+ */
+uint32_t dtx_finish(dtx_t *dtx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DTX_H_ */
@@ -0,0 +1,317 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vad.h"
+#include "sdkconfig.h"
+
+#include "endpoint.h"
+
+#if defined(CONFIG_RECORDER_ENDPOINT) || defined(CONFIG_RECORDER_DTX) || defined(CONFIG_VAD_HANDS_FREE)
+
+/* the floor never goes below this, digital silence would pin it there */
+#define ENDPOINT_FLOOR_DB			(-80.0f)
+/* quieter frames are never speech, whatever the floor */
+#define ENDPOINT_SPEECH_MIN_DB		(-60.0f)
+/* how fast the floor follows a louder background, per frame */
+#define ENDPOINT_NOISE_RISE_DB		(0.03f)
+/* and how much of a drop it takes over per frame */
+#define ENDPOINT_NOISE_FALL			(0.5f)
+/* with the gate, frames crossing zero at more than 3 of 4 samples are hiss */
+#define ENDPOINT_GATE_ZCR_NUM		3
+#define ENDPOINT_GATE_ZCR_DEN		4
+
+static const char *TAG = "ENDPOINT";
+
+struct endpoint {
+	endpoint_cfg_t					cfg;
+	vad_handle_t					vad;
+	int16_t							*frame;
+	int								frame_samples;
+	int								frame_len;
+	float							noise_db;
+	bool							noise_valid;
+	/* frames in a row of the current kind */
+	int								speech_run;
+	int								silence_run;
+	bool							done;
+	endpoint_stats_t				stats;
+	endpoint_load_t					load;
+};
+
+/*
+ * Energy and zero crossings of a frame in a single integer pass. The core
+ * has no SIMD, taking four samples per iteration saves most of the loop
+ * overhead. A square fits 32 bits unsigned, two of them still do.
+ */
+static int64_t endpoint_measure(const int16_t *pcm, int samples, int *crossings)
+{
+	int64_t energy = 0;
+	int32_t a, b, c, d, prev;
+	int zc = 0, i;
+	
+	if (samples <= 0) {
+		*crossings = 0;
+		return 0;
+	}
+	prev = pcm[0];
+	
+	for (i = 0; i + 4 <= samples; i += 4) {
+		a = pcm[i];
+		b = pcm[i + 1];
+		c = pcm[i + 2];
+		d = pcm[i + 3];
+		energy += (uint32_t)(a * a) + (uint32_t)(b * b);
+		energy += (uint32_t)(c * c) + (uint32_t)(d * d);
+		zc += ((prev ^ a) < 0) + ((a ^ b) < 0) + ((b ^ c) < 0) + ((c ^ d) < 0);
+		prev = d;
+	}
+	for (; i < samples; i++) {
+		a = pcm[i];
+		energy += (uint32_t)(a * a);
+		zc += (prev ^ a) < 0;
+		prev = a;
+	}
+	
+	*crossings = zc;
+	return energy;
+}
+
+static endpoint_event_t endpoint_classify(endpoint_handle_t ep)
+{
+	int64_t start = esp_timer_get_time();
+	int crossings;
+	int64_t energy = endpoint_measure(ep->frame, ep->frame_samples, &crossings);
+	float level = ENDPOINT_FLOOR_DB;
+	bool speech, hiss;
+	
+	if (energy) {
+		level = 10.0f * log10f((float)energy / ep->frame_samples / (32768.0f * 32768.0f));
+	}
+	
+	speech = level > ep->noise_db + ep->cfg.margin_db && level > ENDPOINT_SPEECH_MIN_DB;
+	hiss = crossings * ENDPOINT_GATE_ZCR_DEN > ep->frame_samples * ENDPOINT_GATE_ZCR_NUM;
+	ep->load.gate_us += esp_timer_get_time() - start;
+	ep->load.frames++;
+	
+	if (ep->vad && ep->cfg.gate && (!speech || hiss)) {
+		/* too quiet or too hissy for speech, the VAD is not asked */
+		ep->load.gated++;
+		speech = false;
+	} else if (ep->vad) {
+		/* without the gate the VAD sees every frame, which keeps its models current */
+		start = esp_timer_get_time();
+		if (vad_process(ep->vad, ep->frame) != VAD_SPEECH) {
+			speech = false;
+		}
+		ep->load.vad_us += esp_timer_get_time() - start;
+	}
+	
+	if (!ep->noise_valid) {
+		ep->noise_db = level;
+		ep->noise_valid = true;
+	} else if (level < ep->noise_db) {
+		ep->noise_db += (level - ep->noise_db) * ENDPOINT_NOISE_FALL;
+	} else {
+		ep->noise_db += fminf(level - ep->noise_db, ENDPOINT_NOISE_RISE_DB);
+	}
+	if (ep->noise_db < ENDPOINT_FLOOR_DB) {
+		ep->noise_db = ENDPOINT_FLOOR_DB;
+	}
+	
+	ep->stats.frames++;
+	ep->stats.level_db = (int)level;
+	ep->stats.noise_db = (int)ep->noise_db;
+	if (speech) {
+		ep->stats.speech_ms += ep->cfg.frame_ms;
+		ep->speech_run++;
+		ep->silence_run = 0;
+	} else {
+		ep->speech_run = 0;
+		ep->silence_run++;
+	}
+	
+	if (ep->done) {
+		return ENDPOINT_NONE;
+	}
+	
+	if (!ep->stats.started) {
+		if (ep->speech_run * ep->cfg.frame_ms >= ep->cfg.min_speech_ms) {
+			ep->stats.started = true;
+			return ENDPOINT_SPEECH_START;
+		}
+		if (ep->cfg.no_speech_ms && ep->stats.frames * ep->cfg.frame_ms >= ep->cfg.no_speech_ms) {
+			ep->done = true;
+			return ENDPOINT_NO_SPEECH;
+		}
+	} else if (ep->silence_run * ep->cfg.frame_ms >= ep->cfg.hangover_ms) {
+		ep->done = true;
+		return ENDPOINT_SPEECH_END;
+	}
+	
+	return ENDPOINT_NONE;
+}
+
+/**
+ * @brief Create an endpointer
+ * @param [in] cfg The endpointer configuration
+ * @return endpointer handle on success, NULL otherwise
+ */
+endpoint_handle_t endpoint_create(const endpoint_cfg_t *cfg)
+{
+	endpoint_handle_t ep;
+	
+	if (cfg->sample_rate <= 0 || cfg->frame_ms <= 0) {
+		return NULL;
+	}
+	
+	ep = calloc(1, sizeof(struct endpoint));
+	if (!ep) {
+		return NULL;
+	}
+	
+	ep->cfg = *cfg;
+	ep->frame_samples = cfg->sample_rate * cfg->frame_ms / 1000;
+	ep->frame = malloc(ep->frame_samples * sizeof(int16_t));
+	if (!ep->frame) {
+		goto errout;
+	}
+	
+	if (cfg->use_vad) {
+		ep->vad = vad_create(VAD_MODE_3, cfg->sample_rate, cfg->frame_ms);
+		if (!ep->vad) {
+			ESP_LOGE(TAG, "No VAD for %d Hz in %d ms frames", cfg->sample_rate, cfg->frame_ms);
+			goto errout;
+		}
+	}
+	
+	endpoint_reset(ep);
+	
+	return ep;
+	
+errout:
+	free(ep->frame);
+	free(ep);
+	return NULL;
+}
+
+/**
+ * @brief Destroy an endpointer
+ * @param [in] ep The endpointer handle
+ */
+void endpoint_destroy(endpoint_handle_t ep)
+{
+	if (ep->vad) {
+		vad_destroy(ep->vad);
+	}
+	free(ep->frame);
+	free(ep);
+}
+
+/**
+ * @brief Start looking for a new utterance, the noise floor is kept
+ * @param [in] ep The endpointer handle
+ */
+void endpoint_reset(endpoint_handle_t ep)
+{
+	memset(&ep->stats, 0, sizeof(ep->stats));
+	ep->stats.noise_db = (int)ep->noise_db;
+	ep->done = false;
+	/* 
+	 * The runs of speech and silence are left alone: speech going on
+	 * across the reset counts towards min_speech_ms, and
+	 * endpoint_silence_ms keeps counting
+	 */
+}
+
+/**
+ * @brief Feed audio to the endpointer
+ * @param [in] ep 		The endpointer handle
+ * @param [in] pcm 		The mono 16 bit samples
+ * @param [in] samples 	The number of samples
+ * @return The first event raised by these samples, ENDPOINT_NONE otherwise
+ */
+endpoint_event_t endpoint_feed(endpoint_handle_t ep, const int16_t *pcm, int samples)
+{
+	endpoint_event_t event = ENDPOINT_NONE, ret;
+	int n;
+	
+	while (samples > 0) {
+		n = ep->frame_samples - ep->frame_len;
+		if (n > samples) {
+			n = samples;
+		}
+		
+		memcpy(ep->frame + ep->frame_len, pcm, n * sizeof(int16_t));
+		ep->frame_len += n;
+		pcm += n;
+		samples -= n;
+		
+		if (ep->frame_len == ep->frame_samples) {
+			ep->frame_len = 0;
+			ret = endpoint_classify(ep);
+			if (event == ENDPOINT_NONE) {
+				event = ret;
+			}
+		}
+	}
+	
+	return event;
+}
+
+/**
+ * @brief Get how long the input has been silent
+ * @param [in] ep The endpointer handle
+ * @return The time since the latest speech frame, 0 during speech
+ */
+uint32_t endpoint_silence_ms(endpoint_handle_t ep)
+{
+	return (uint32_t)ep->silence_run * ep->cfg.frame_ms;
+}
+
+/**
+ * @brief Get the endpointer state since the last reset
+ * @param [in]  ep 		The endpointer handle
+ * @param [out] stats 	The state
+ */
+void endpoint_get_stats(endpoint_handle_t ep, endpoint_stats_t *stats)
+{
+	*stats = ep->stats;
+}
+
+/**
+ * @brief Get the work done by the endpointer since it was created
+ * @param [in]  ep 		The endpointer handle
+ * @param [out] load 	The counters
+ */
+void endpoint_get_load(endpoint_handle_t ep, endpoint_load_t *load)
+{
+	*load = ep->load;
+}
+
+#endif /* CONFIG_RECORDER_ENDPOINT || CONFIG_RECORDER_DTX || CONFIG_VAD_HANDS_FREE */
@@ -0,0 +1,165 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _ENDPOINT_H_
+#define _ENDPOINT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Endpointer events
+ */
+typedef enum {
+	ENDPOINT_NONE = 0,			/*!< Nothing new */
+	ENDPOINT_SPEECH_START,		/*!< Speech began */
+	ENDPOINT_SPEECH_END,		/*!< Speech was followed by the hangover of silence */
+	ENDPOINT_NO_SPEECH,			/*!< Nothing was said within the no-speech timeout */
+} endpoint_event_t;
+
+/**
+ * @brief Endpointer configuration
+ */
+typedef struct {
+	int sample_rate;			/*!< Sample rate of the mono 16 bit input, 8000 or 16000 with use_vad */
+	int frame_ms;				/*!< Frame length, 10, 20 or 30 with use_vad */
+	int min_speech_ms;			/*!< Speech needed in a row before it counts as started */
+	int hangover_ms;			/*!< Silence after speech which ends it */
+	int no_speech_ms;			/*!< Time without speech which ends a turn, 0 to wait forever */
+	int margin_db;				/*!< How far above the noise floor speech has to be */
+	bool use_vad;				/*!< Also require esp_vad to call a frame speech */
+	bool gate;					/*!< Only hand esp_vad the frames loud enough to be speech */
+} endpoint_cfg_t;
+
+#define DEFAULT_ENDPOINT_CONFIG() {		\
+	.sample_rate	= 8000,				\
+	.frame_ms		= 30,				\
+	.min_speech_ms	= 90,				\
+	.hangover_ms	= 700,				\
+	.no_speech_ms	= 6000,				\
+	.margin_db		= 12,				\
+	.use_vad		= true,				\
+	.gate			= false,			\
+}
+
+/**
+ * @brief Endpointer state since the last reset
+ */
+typedef struct {
+	uint32_t frames;			/*!< Frames classified */
+	uint32_t speech_ms;			/*!< Audio classified as speech */
+	int level_db;				/*!< Level of the latest frame, in dBFS */
+	int noise_db;				/*!< Current noise floor estimate, in dBFS */
+	bool started;				/*!< Whether speech began */
+} endpoint_stats_t;
+
+/**
+ * @brief Work done by an endpointer since it was created
+ */
+typedef struct {
+	uint32_t frames;			/*!< Frames classified */
+	uint32_t gated;				/*!< Frames the gate kept from esp_vad */
+	uint64_t gate_us;			/*!< Time spent measuring the frames */
+	uint64_t vad_us;			/*!< Time spent in esp_vad */
+} endpoint_load_t;
+
+typedef struct endpoint *endpoint_handle_t;
+
+/**
+ * @brief Create an endpointer
+ *
+ * Frames are speech when they stand out of a noise floor tracked all the
+ * time, which follows drops at once and rises slowly, and optionally
+ * when esp_vad agrees.
+ *
+ * With cfg->gate, esp_vad is only run on frames which pass the level
+ * test and do not cross zero as often as hiss does. Nothing else can be
+ * speech, so in a quiet room the VAD is hardly ever run. Its models then
+ * only learn from louder frames, which the recorder's endpointing would
+ * rather not depend on.
+ *
+ * @param [in] cfg The endpointer configuration
+ * @return endpointer handle on success, NULL otherwise
+ */
+endpoint_handle_t endpoint_create(const endpoint_cfg_t *cfg);
+
+/**
+ * @brief Destroy an endpointer
+ * @param [in] ep The endpointer handle
+ */
+void endpoint_destroy(endpoint_handle_t ep);
+
+/**
+ * @brief Start looking for a new utterance, the noise floor is kept
+ * @param [in] ep The endpointer handle
+ */
+void endpoint_reset(endpoint_handle_t ep);
+
+/**
+ * @brief Feed audio to the endpointer
+ *
+ * Any number of samples may be passed, they are classified in frames of
+ * cfg->frame_ms. Once speech ended or never came, no more events are
+ * raised until endpoint_reset.
+ *
+ * @param [in] ep 		The endpointer handle
+ * @param [in] pcm 		The mono 16 bit samples
+ * @param [in] samples 	The number of samples
+ * @return The first event raised by these samples, ENDPOINT_NONE otherwise
+ */
+endpoint_event_t endpoint_feed(endpoint_handle_t ep, const int16_t *pcm, int samples);
+
+/**
+ * @brief Get how long the input has been silent
+ *
+ * Runs on across endpoint_reset, unlike the events.
+ *
+ * @param [in] ep The endpointer handle
+ * @return The time since the latest speech frame, 0 during speech
+ */
+uint32_t endpoint_silence_ms(endpoint_handle_t ep);
+
+/**
+ * @brief Get the endpointer state since the last reset
+ * @param [in]  ep 		The endpointer handle
+ * @param [out] stats 	The state
+ */
+void endpoint_get_stats(endpoint_handle_t ep, endpoint_stats_t *stats);
+
+/**
+ * @brief Get the work done by the endpointer since it was created
+ * @param [in]  ep 		The endpointer handle
+ * @param [out] load 	The counters
+ */
+void endpoint_get_load(endpoint_handle_t ep, endpoint_load_t *load);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ENDPOINT_H_ */
@@ -0,0 +1,298 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+
+#include "link_quality.h"
+
+/* RTO = SRTT + max(G, 4 * RTTVAR), G being the timer granularity */
+#define LINK_CLOCK_GRANULARITY_MS	10
+/* at most this many timeout doublings after failed turns */
+#define LINK_MAX_BACKOFF			3
+/* goodput samples above this only say the link was not the bottleneck */
+#define LINK_GOODPUT_CAP_BPS		4000000
+/* signal levels below which the upload bitrate is capped */
+#define LINK_RSSI_FAIR				(-67)
+#define LINK_RSSI_WEAK				(-75)
+#define LINK_BITRATE_FAIR			64000
+#define LINK_BITRATE_WEAK			32000
+
+static const char *TAG = "LINKQ";
+
+static SemaphoreHandle_t s_lock = NULL;
+/* kept in microseconds, the EWMA steps would vanish in milliseconds */
+static int32_t s_srtt_us = 0;
+static int32_t s_rttvar_us = 0;
+static int32_t s_gap_us = 0;
+static int32_t s_gapvar_us = 0;
+static uint32_t s_goodput_bps = 0;
+/* in quarter dB, in whole dB the smoothing would stall a few dB short */
+static int s_rssi_q = 0;
+static unsigned int s_backoff = 0;
+
+/**
+ * @brief Jacobson/Karels update, gain 1/8 for the mean and 1/4 for the variation
+ */
+static void link_quality_smooth(int32_t *mean, int32_t *var, int32_t sample)
+{
+	if (*mean == 0) {
+		*mean = sample;
+		*var = sample / 2;
+		return;
+	}
+	
+	*var += (abs(sample - *mean) - *var) / 4;
+	*mean += (sample - *mean) / 8;
+}
+
+static void link_quality_sample_rssi(void)
+{
+	wifi_ap_record_t ap;
+	
+	if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+		return;
+	}
+	
+	s_rssi_q = s_rssi_q ? s_rssi_q - s_rssi_q / 4 + ap.rssi : 4 * ap.rssi;
+}
+
+/* must be called with the lock held */
+static unsigned int link_quality_timeout(void)
+{
+	int32_t rto, gap, var;
+	unsigned int timeout;
+	
+	if (s_gap_us == 0) {
+		/* the RTT alone says nothing about how long the server thinks */
+		timeout = CONFIG_TCP_TIMEOUT;
+	} else {
+		var = 4 * s_rttvar_us;
+		if (var < LINK_CLOCK_GRANULARITY_MS * 1000) {
+			var = LINK_CLOCK_GRANULARITY_MS * 1000;
+		}
+		rto = s_srtt_us + var;
+		gap = s_gap_us + 4 * s_gapvar_us;
+		timeout = (unsigned int)((rto + gap) / 1000);
+	}
+	
+	timeout <<= s_backoff;
+	
+	if (timeout < CONFIG_LINK_TIMEOUT_MIN) {
+		timeout = CONFIG_LINK_TIMEOUT_MIN;
+	} else if (timeout > CONFIG_LINK_TIMEOUT_MAX) {
+		timeout = CONFIG_LINK_TIMEOUT_MAX;
+	}
+	
+	return timeout;
+}
+
+/* must be called with the lock held */
+static uint32_t link_quality_bitrate(void)
+{
+	uint32_t bitrate = CONFIG_LINK_BITRATE_MAX;
+	int rssi = s_rssi_q / 4;
+	
+	/* leave room for retransmissions and the reply coming the other way */
+	if (s_goodput_bps && s_goodput_bps / 2 < bitrate) {
+		bitrate = s_goodput_bps / 2;
+	}
+	
+	if (rssi && rssi < LINK_RSSI_WEAK && bitrate > LINK_BITRATE_WEAK) {
+		bitrate = LINK_BITRATE_WEAK;
+	} else if (rssi && rssi < LINK_RSSI_FAIR && bitrate > LINK_BITRATE_FAIR) {
+		bitrate = LINK_BITRATE_FAIR;
+	}
+	
+	if (bitrate < CONFIG_LINK_BITRATE_MIN) {
+		bitrate = CONFIG_LINK_BITRATE_MIN;
+	}
+	
+	return bitrate;
+}
+
+/**
+ * @brief Set up the link quality estimator
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t link_quality_init(void)
+{
+	if (s_lock) {
+		return ESP_OK;
+	}
+	
+	s_lock = xSemaphoreCreateMutex();
+	if (!s_lock) {
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Add a round trip time sample, e.g. a TCP connect time
+ * @param [in] rtt_ms The round trip time in milliseconds
+ */
+void link_quality_add_rtt(uint32_t rtt_ms)
+{
+	if (!s_lock) {
+		return;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	/* the sample was truncated to whole milliseconds */
+	link_quality_smooth(&s_srtt_us, &s_rttvar_us, (int32_t)rtt_ms * 1000 + 500);
+	xSemaphoreGive(s_lock);
+}
+
+/**
+ * @brief Feed the statistics of a finished or failed turn
+ * @param [in] turn The turn statistics from tcp_stream_get_turn_stats
+ */
+void link_quality_update(const tcp_stream_stats_t *turn)
+{
+	link_quality_t lq;
+	uint32_t gap_ms;
+	
+	if (!s_lock) {
+		return;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	
+	link_quality_sample_rssi();
+	
+	if (turn->connect_time.count > 0) {
+		link_quality_smooth(&s_srtt_us, &s_rttvar_us, (int32_t)(turn->connect_time.total_us / turn->connect_time.count));
+	}
+	
+	if (turn->read_timeouts || turn->write_timeouts) {
+		/* a timed out read says nothing about the gap, except that it was longer */
+		if (s_backoff < LINK_MAX_BACKOFF) {
+			s_backoff++;
+		}
+	} else {
+		s_backoff = 0;
+		/* the longest read of the turn, truncated to whole milliseconds */
+		if (turn->read_latency.count > 0) {
+			gap_ms = turn->read_latency.max_ms;
+			link_quality_smooth(&s_gap_us, &s_gapvar_us, (int32_t)gap_ms * 1000 + 500);
+		}
+	}
+	
+	/* 
+	 * Time spent handing the data to the socket is what the link needed to
+	 * take it, as long as it was the bottleneck. Otherwise the sample is
+	 * large and only says the link kept up. Time inside write would not
+	 * do, with the write buffer most writes are a copy.
+	 */
+	if (turn->bytes_sent > 0 && turn->send_us > 0) {
+		uint64_t bps = turn->bytes_sent * 8 * 1000000 / turn->send_us;
+		if (bps > LINK_GOODPUT_CAP_BPS) {
+			bps = LINK_GOODPUT_CAP_BPS;
+		}
+		/* 
+		 * A drop is taken at once, the next upload must not overrun the
+		 * link again. Smoothing it from the cap would take some twenty turns.
+		 */
+		if (s_goodput_bps == 0 || bps < s_goodput_bps) {
+			s_goodput_bps = (uint32_t)bps;
+		} else {
+			s_goodput_bps = (uint32_t)((3 * (uint64_t)s_goodput_bps + bps) / 4);
+		}
+	}
+	
+	xSemaphoreGive(s_lock);
+	
+	link_quality_get(&lq);
+	ESP_LOGI(TAG, "rtt %u/%u ms, gap %u/%u ms, goodput %u kbit/s, rssi %d dBm -> timeout %u ms%s, bitrate %u kbit/s",
+			 lq.srtt_ms, lq.rttvar_ms, lq.gap_ms, lq.gapvar_ms, lq.goodput_bps / 1000, lq.rssi,
+			 lq.timeout_ms, lq.backoff ? " (backed off)" : "", lq.bitrate_bps / 1000);
+}
+
+/**
+ * @brief Get the I/O timeout to apply with tcp_stream_set_timeout
+ * @return The timeout in milliseconds
+ */
+unsigned int link_quality_get_timeout(void)
+{
+	unsigned int timeout;
+	
+	if (!s_lock) {
+		return CONFIG_TCP_TIMEOUT;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	timeout = link_quality_timeout();
+	xSemaphoreGive(s_lock);
+	
+	return timeout;
+}
+
+/**
+ * @brief Get the upload bitrate the link is expected to sustain
+ * @return The bitrate in bits per second
+ */
+uint32_t link_quality_get_bitrate(void)
+{
+	uint32_t bitrate;
+	
+	if (!s_lock) {
+		return CONFIG_LINK_BITRATE_MAX;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	bitrate = link_quality_bitrate();
+	xSemaphoreGive(s_lock);
+	
+	return bitrate;
+}
+
+/**
+ * @brief Get the whole current estimate
+ * @param [out] lq The estimate
+ */
+void link_quality_get(link_quality_t *lq)
+{
+	if (!s_lock) {
+		return;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	lq->srtt_ms = s_srtt_us / 1000;
+	lq->rttvar_ms = s_rttvar_us / 1000;
+	lq->gap_ms = s_gap_us / 1000;
+	lq->gapvar_ms = s_gapvar_us / 1000;
+	lq->goodput_bps = s_goodput_bps;
+	lq->rssi = s_rssi_q / 4;
+	lq->backoff = s_backoff;
+	lq->timeout_ms = link_quality_timeout();
+	lq->bitrate_bps = link_quality_bitrate();
+	xSemaphoreGive(s_lock);
+}
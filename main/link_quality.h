@@ -0,0 +1,106 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _LINK_QUALITY_H_
+#define _LINK_QUALITY_H_
+
+#include "tcp_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Current estimate of the link to the server
+ */
+typedef struct {
+	uint32_t srtt_ms;		/*!< Smoothed round trip time, 0 if not measured yet */
+	uint32_t rttvar_ms;		/*!< Round trip time variation */
+	uint32_t gap_ms;		/*!< Smoothed longest wait for server data in a turn */
+	uint32_t gapvar_ms;		/*!< Variation of gap_ms */
+	uint32_t goodput_bps;	/*!< Smoothed upload goodput, 0 if not measured yet */
+	int rssi;				/*!< Smoothed Wi-Fi signal strength in dBm, 0 if unknown */
+	unsigned int backoff;	/*!< Timeout doublings after turns which timed out */
+	unsigned int timeout_ms;	/*!< I/O timeout derived from the above */
+	uint32_t bitrate_bps;	/*!< Recommended upload bitrate derived from the above */
+} link_quality_t;
+
+/**
+ * @brief Set up the link quality estimator
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t link_quality_init(void);
+
+/**
+ * @brief Add a round trip time sample, e.g. a TCP connect time
+ * @param [in] rtt_ms The round trip time in milliseconds
+ */
+void link_quality_add_rtt(uint32_t rtt_ms);
+
+/**
+ * @brief Feed the statistics of a finished or failed turn
+ *
+ * Takes RTT samples from the connects, the longest wait for server data
+ * and the upload goodput from the turn, and samples the Wi-Fi RSSI. A turn
+ * which hit the I/O timeout doubles the timeout until a turn succeeds.
+ *
+ * @param [in] turn The turn statistics from tcp_stream_get_turn_stats
+ */
+void link_quality_update(const tcp_stream_stats_t *turn);
+
+/**
+ * @brief Get the I/O timeout to apply with tcp_stream_set_timeout
+ *
+ * Covers the RTT (SRTT + 4 * RTTVAR, as for a TCP retransmission timeout)
+ * plus the longest wait for server data seen in past turns and its
+ * variation, clamped to CONFIG_LINK_TIMEOUT_MIN..CONFIG_LINK_TIMEOUT_MAX.
+ * Until a turn has succeeded CONFIG_TCP_TIMEOUT is used in place of the
+ * estimate.
+ *
+ * @return The timeout in milliseconds
+ */
+unsigned int link_quality_get_timeout(void);
+
+/**
+ * @brief Get the upload bitrate the link is expected to sustain
+ *
+ * Half of the measured goodput, which follows a drop at once and a rise
+ * smoothed over a few turns, further capped while the Wi-Fi signal is
+ * weak, within CONFIG_LINK_BITRATE_MIN..CONFIG_LINK_BITRATE_MAX.
+ *
+ * @return The bitrate in bits per second
+ */
+uint32_t link_quality_get_bitrate(void);
+
+/**
+ * @brief Get the whole current estimate
+ * @param [out] lq The estimate
+ */
+void link_quality_get(link_quality_t *lq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LINK_QUALITY_H_ */
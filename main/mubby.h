@@ -27,6 +27,9 @@
 
 #include "player.h"
 #include "recorder.h"
+#include "conn_manager.h"
+#include "vad.h"
+#include "wake_word.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,6 +57,11 @@ extern "C" {
 
 #define MUBBY_ID_VAD			(4)
 
+/**
+ * Indicates an event is from the wake word spotter
+ */
+#define MUBBY_ID_WAKE_WORD		(5)
+
 
 /**
  * @brief Incidates application is in which state
@@ -115,6 +123,20 @@ struct app_context {
 	 */
 	audio_recorder_handle_t 	ar;
 	
+#ifdef CONFIG_VAD_HANDS_FREE
+	/**
+	 * Starts turns when someone speaks
+	 */
+	audio_voice_detector_handle_t	av;
+	
+#endif
+#ifdef CONFIG_WAKE_WORD
+	/**
+	 * Starts turns when the wake word is heard
+	 */
+	audio_wake_word_handle_t	aw;
+	
+#endif
 	/**
 	 * Event listener
 	 */
@@ -125,6 +147,23 @@ struct app_context {
 	 */
 	tcp_stream_handle_t			stream;
 	
+	/**
+	 * Backend protocol on top of the TCP stream
+	 */
+	protocol_handle_t			proto;
+	
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+	/**
+	 * UDP stream carrying the audio of a turn
+	 */
+	tcp_stream_handle_t			audio;
+#endif
+	
+	/**
+	 * Keeps the TCP stream connected between turns
+	 */
+	conn_manager_handle_t		conn;
+	
 	/**
 	 * Device MAC address
 	 */
@@ -144,20 +183,16 @@ struct app_context {
 	 * Continue chatting or not
 	 */
 	bool						cnt_chat;
+	
+	/**
+	 * When the current turn was requested, in microseconds since boot
+	 */
+	int64_t						turn_requested;
 };
 
 typedef struct app_context *app_context_handle_t;
 typedef struct app_context app_context_t;
 
-#ifdef CONFIG_ENABLE_SECURITY_PROTO
-extern unsigned char cacert_pem_start[] asm("_binary_cacert_pem_start");
-extern unsigned char cacert_pem_end[] asm("_binary_cacert_pem_end");
-extern unsigned char cert_pem_start[] asm("_binary_cert_pem_start");
-extern unsigned char cert_pem_end[] asm("_binary_cert_pem_end");
-extern unsigned char privkey_pem_start[] asm("_binary_privkey_pem_start");
-extern unsigned char privkey_pem_end[] asm("_binary_privkey_pem_end");
-#endif
-
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,7 @@
 #include "sdkconfig.h"
 #include "cJSON.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
 #include "nvs_flash.h"
 #include "periph_button.h"
@@ -38,11 +39,23 @@
 
 #include "http_server.h"
 #include "wifi_manager.h"
+#include "credentials.h"
+#include "resolver.h"
+#include "backend.h"
+#include "link_quality.h"
+#include "udp_stream.h"
 
 #include "mubby.h"
 #include "player.h"
 #include "recorder.h"
 
+/* both tasks write frames through the TLS stream, which needs the room */
+#define MUBBY_EVENT_TASK_SIZE		4096
+#define MUBBY_CORE_TASK_SIZE		4096
+
+/* how long to wait before trying to start MQTT again */
+#define MUBBY_MQTT_RETRY_MS			5000
+
 static const char *TAG = "MUBBY";
 static int s_player_volume = -1;
 
@@ -98,7 +111,7 @@ static esp_err_t msg_parser(app_context_handle_t ctx, esp_mqtt_client_handle_t c
 			free(macaddr);
 			esp_mqtt_client_publish(client, topic, "{\"state\": \"ok\"}", 0, 1, 0);
 		}
-		ctx->stream->write(ctx->stream, (char []){'e', 'n', 'd'}, 3);
+		protocol_send_control(ctx->proto, PROTOCOL_CONTROL_END);
 	} else if (!strcmp(header->valuestring, "control")) {
 		cJSON *sub = cJSON_GetObjectItem(root, "sub");
 		if (!sub) {
@@ -207,14 +220,26 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 
 static esp_err_t mqtt_start(app_context_handle_t ctx)
 {
-	const esp_mqtt_client_config_t mqtt_cfg = {
+	backend_endpoint_t ep;
+	char uri[16 + BACKEND_MAX_HOSTNAME];
+	
+	/* the broker runs next to the audio server */
+	if (backend_select(&ep) < 0) {
+		ESP_LOGE(TAG, "No server to connect MQTT to");
+		return ESP_FAIL;
+	}
 #ifdef CONFIG_ENABLE_SECURITY_PROTO
-		.uri = "mqtts://"CONFIG_SERVER_HOST":8889",
-		.cert_pem = (const char *)cert_pem_start,
-		.client_cert_pem = (const char *)cert_pem_start,
-		.client_key_pem = (const char *)privkey_pem_start,
+	snprintf(uri, sizeof(uri), "mqtts://%s:8889", ep.host);
 #else
-		.uri = "mqtt://"CONFIG_SERVER_HOST":8889",
+	snprintf(uri, sizeof(uri), "mqtt://%s:8889", ep.host);
+#endif
+	
+	const esp_mqtt_client_config_t mqtt_cfg = {
+		.uri = uri,
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+		.cert_pem = credentials_get_pem(CREDENTIAL_CA_CERT),
+		.client_cert_pem = credentials_get_pem(CREDENTIAL_CLIENT_CERT),
+		.client_key_pem = credentials_get_pem(CREDENTIAL_CLIENT_KEY),
 #endif
 		.event_handle = mqtt_event_handler,
 		.user_context = ctx,
@@ -222,23 +247,65 @@ static esp_err_t mqtt_start(app_context_handle_t ctx)
 	};
 	
 	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-	return esp_mqtt_client_start(mqtt_client);
+	if (!mqtt_client) {
+		return ESP_FAIL;
+	}
+	
+	/* once started, the client reconnects by itself */
+	if (esp_mqtt_client_start(mqtt_client) != ESP_OK) {
+		esp_mqtt_client_destroy(mqtt_client);
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
 }
 
-static bool mubby_auth(app_context_handle_t app_ctx)
+static void mubby_protocol_event(protocol_handle_t p, int event, const uint8_t *data, int len, void *arg)
 {
-	tcp_stream_handle_t stream = app_ctx->stream;
+	app_context_handle_t ctx = (app_context_handle_t)arg;
+	
+	switch (event) {
+	case PROTOCOL_EVENT_STT_END:
+		ESP_LOGI(TAG, "End of speech");
+		recorder_stop(ctx->ar);
+		break;
+		
+	case PROTOCOL_EVENT_CHAT:
+		ctx->cnt_chat = len > 0 && data[0];
+		protocol_send_control(p, PROTOCOL_CONTROL_END);
+		break;
+		
+	default:
+		ESP_LOGW(TAG, "Unknown server event %d", event);
+		break;
+	}
+}
+
+static bool mubby_auth(tcp_stream_handle_t stream, void *arg)
+{
+	app_context_handle_t app_ctx = (app_context_handle_t)arg;
 	char macbuf[18] = {0};
 	
 	snprintf(macbuf, sizeof(macbuf), "%02x:%02x:%02x:%02x:%02x:%02x",
 		app_ctx->macaddr[0], app_ctx->macaddr[1], app_ctx->macaddr[2], 
 		app_ctx->macaddr[3], app_ctx->macaddr[4], app_ctx->macaddr[5]);
 	
-	if (stream->write(stream, macbuf, sizeof(macbuf)) < 0) {
+	if (protocol_send_hello(app_ctx->proto, macbuf) != ESP_OK) {
 		ESP_LOGE(TAG, "failed to send auth message");
 		return false;
 	}
 	
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+	const backend_endpoint_t *ep = conn_manager_get_endpoint(app_ctx->conn);
+	char host[sizeof(ep->host)];
+	
+	snprintf(host, sizeof(host), "%s", ep->host);
+	if (protocol_open_audio(app_ctx->proto, app_ctx->audio, host, CONFIG_UDP_AUDIO_PORT) != ESP_OK) {
+		ESP_LOGE(TAG, "failed to move the audio to UDP");
+		return false;
+	}
+#endif
+	
 #if 0
 	char resp[8] = {0};
 	if (stream->read(stream, resp, sizeof(resp)) < 0) {
@@ -262,14 +329,23 @@ static void event_monitor_task(void *pvParameters)
 	audio_event_iface_handle_t evt = ctx->evt;
 	
 	bool pushed = false;
+	/* MQTT failed to start and is tried again while waiting for events */
+	bool mqtt_retry = false;
+	bool mqtt_started = false;
 	
 	ESP_LOGI(TAG, "EventMonitor created");
 	
 	for (;;) {
 		audio_event_iface_msg_t msg;
-		esp_err_t ret = audio_event_iface_listen(evt, &msg, portMAX_DELAY);
+		esp_err_t ret = audio_event_iface_listen(evt, &msg, mqtt_retry ? pdMS_TO_TICKS(MUBBY_MQTT_RETRY_MS)
+																		: portMAX_DELAY);
 		
 		if (ret != ESP_OK) {
+			if (mqtt_retry) {
+				mqtt_started = mqtt_start(ctx) == ESP_OK;
+				mqtt_retry = !mqtt_started;
+				continue;
+			}
 			ESP_LOGE(TAG, "Event interface error: %d", ret);
 			continue;
 		}
@@ -279,9 +355,16 @@ static void event_monitor_task(void *pvParameters)
 			if ((int)msg.data == GPIO_NUM_36) {	
 				if (msg.cmd == PERIPH_BUTTON_PRESSED) {
 					pushed = true;
+#ifdef CONFIG_SPECULATIVE_CONNECT
+					/* the user is about to talk, have the connection ready by release */
+					if (ctx->cur_state == MUBBY_STATE_STANDBY) {
+						conn_manager_preconnect(ctx->conn);
+					}
+#endif
 				} else if (pushed && (msg.cmd == PERIPH_BUTTON_RELEASE || msg.cmd == PERIPH_BUTTON_LONG_RELEASE)) {
 					pushed = false;
 					if (ctx->cur_state == MUBBY_STATE_STANDBY) {
+						ctx->turn_requested = esp_timer_get_time();
 						push_state(ctx, MUBBY_STATE_CONNECTING);
 					}				
 				}
@@ -294,7 +377,7 @@ static void event_monitor_task(void *pvParameters)
 					} else if (ctx->cur_state == MUBBY_STATE_RECORDING) {
 						printf("stopping recorder\n");
 						ESP_ERROR_CHECK(recorder_stop(ctx->ar));
-						ctx->stream->write(ctx->stream, (char []){'b', 'r', 'k'}, 3);
+						protocol_send_control(ctx->proto, PROTOCOL_CONTROL_BREAK);
 					}
 				}
 			}
@@ -322,9 +405,40 @@ static void event_monitor_task(void *pvParameters)
 			}
 			break;
 			
+#ifdef CONFIG_VAD_HANDS_FREE
+		case MUBBY_ID_VAD:
+			/* the same as a button release, the pre-roll holds the first words */
+			if ((int)msg.data == VAD_STATE_SPEECH_STARTED && ctx->cur_state == MUBBY_STATE_STANDBY) {
+				ESP_LOGI(TAG, "Speech detected, starting a turn");
+				ctx->turn_requested = esp_timer_get_time();
+				push_state(ctx, MUBBY_STATE_CONNECTING);
+			}
+			break;
+			
+#endif
+#ifdef CONFIG_WAKE_WORD
+		case MUBBY_ID_WAKE_WORD:
+			/* the pre-roll still holds what was said up to the detection */
+			if ((int)msg.data == WAKE_WORD_STATE_DETECTED && ctx->cur_state == MUBBY_STATE_STANDBY) {
+				ctx->turn_requested = esp_timer_get_time();
+				push_state(ctx, MUBBY_STATE_CONNECTING);
+			}
+			break;
+			
+#endif
 		case MUBBY_ID_WIFIMGR:
 			if ((int)msg.data == WIFI_MANAGER_STATE_CONNECTED) {
-				ESP_ERROR_CHECK(mqtt_start(ctx));
+				ESP_ERROR_CHECK(resolver_start());
+				ESP_ERROR_CHECK(backend_start());
+				/* turns do not need MQTT, a failure must not take them down */
+				if (!mqtt_started) {
+					mqtt_started = mqtt_start(ctx) == ESP_OK;
+					mqtt_retry = !mqtt_started;
+					if (mqtt_retry) {
+						ESP_LOGW(TAG, "Failed to start MQTT, retrying every %d ms", MUBBY_MQTT_RETRY_MS);
+					}
+				}
+				ESP_ERROR_CHECK(conn_manager_start(ctx->conn));
 			} else if ((int)msg.data == WIFI_MANAGER_STATE_DISCONNECTED) {
 				ESP_LOGW(TAG, "STA failed to attach AP");
 			}
@@ -340,36 +454,54 @@ static void event_monitor_task(void *pvParameters)
 static void core_task(void *pvParameters)
 {
 	app_context_handle_t ctx = (app_context_handle_t)pvParameters;
+	bool ready = false;
 	
 	for (;;) {
 		xQueueReceive(ctx->msg_queue, (void *)&ctx->cur_state, portMAX_DELAY);
 		switch (ctx->cur_state) {
 		case MUBBY_STATE_RESET:
 			ESP_LOGE(TAG, "Reseting...");
-			ctx->stream->close(ctx->stream);
+			{
+				/* timeouts of the failed turn back the timeout off */
+				tcp_stream_stats_t stats;
+				tcp_stream_get_turn_stats(ctx->stream, &stats);
+				link_quality_update(&stats);
+				tcp_stream_begin_turn(ctx->stream);
+			}
+			conn_manager_release(ctx->conn, false);
+			recorder_discard(ctx->ar);
 			push_state(ctx, MUBBY_STATE_STANDBY);
 			break;
 			
 		case MUBBY_STATE_STANDBY:
 			ESP_LOGI(TAG, "Mubby is ready. Press REC key to start recording");
+			backend_set_probing(true);
+			if (!ready) {
+				ready = true;
+				ESP_LOGI(TAG, "[APP] Ready %d ms after boot, minimum free heap: %d bytes",
+						 (int)(esp_timer_get_time() / 1000), esp_get_minimum_free_heap_size());
+			}
 			break;
 		
 		case MUBBY_STATE_CONNECTING:
 			ESP_LOGI(TAG, "Connecting to server");
-			if (!ctx->stream->open(ctx->stream, CONFIG_SERVER_HOST, CONFIG_SERVER_PORT)) {
+			/* the user may already be talking, keep it all for the upload */
+			recorder_hold(ctx->ar);
+			backend_set_probing(false);
+			if (!conn_manager_acquire(ctx->conn, CONN_MANAGER_CONNECT_TIMEOUT)) {
 				push_state(ctx, MUBBY_STATE_RESET);
 				continue;
-			} else {
-				tcp_stream_set_timeout(ctx->stream, CONFIG_TCP_TIMEOUT);
-				if (!mubby_auth(ctx)) {
-					push_state(ctx, MUBBY_STATE_RESET);
-					continue;
-				}
 			}
-			if (ctx->stream->write(ctx->stream, (char []){'r', 'e', 'c'}, 3) != 3) {
-				ESP_LOGE(TAG, "Failed to send 'rec' to server");
+			tcp_stream_begin_turn(ctx->stream);
+			tcp_stream_set_timeout(ctx->stream, link_quality_get_timeout());
+			recorder_set_bitrate(ctx->ar, link_quality_get_bitrate());
+			if (protocol_send_control(ctx->proto, PROTOCOL_CONTROL_REC) != ESP_OK) {
+				ESP_LOGE(TAG, "Failed to start the turn on the server");
 				push_state(ctx, MUBBY_STATE_RESET);
+				continue;
 			}
+			ESP_LOGI(TAG, "First byte uploaded %d ms after the turn was requested",
+					 (int)((esp_timer_get_time() - ctx->turn_requested) / 1000));
 			ESP_ERROR_CHECK(recorder_start(ctx->ar));
 			break;
 			
@@ -388,8 +520,26 @@ static void core_task(void *pvParameters)
 			
 		case MUBBY_STATE_PLAYING_FINISHED:
 			ESP_LOGI(TAG, "Playing finished");
-			ctx->stream->close(ctx->stream);
+			{
+				tcp_stream_stats_t stats;
+				tcp_stream_get_turn_stats(ctx->stream, &stats);
+				tcp_stream_log_stats("Turn", &stats);
+				link_quality_update(&stats);
+				tcp_stream_begin_turn(ctx->stream);
+			}
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+			{
+				udp_stream_stats_t stats;
+				udp_stream_get_stats(ctx->audio, &stats);
+				ESP_LOGI(TAG, "Datagrams: %u sent, %u parity, %u received, %u recovered, %u reordered, %u late, %u lost",
+					stats.sent, stats.fec_sent, stats.received, stats.recovered, stats.reordered, stats.late, stats.lost);
+			}
+#endif
+			conn_manager_release(ctx->conn, true);
+			/* the pre-roll so far is the reply played back */
+			recorder_discard(ctx->ar);
 			if (ctx->cnt_chat) {
+				ctx->turn_requested = esp_timer_get_time();
 				push_state(ctx, MUBBY_STATE_CONNECTING);
 			} else {
 				push_state(ctx, MUBBY_STATE_STANDBY);
@@ -444,17 +594,52 @@ void app_main(void)
 	esp_periph_start(periph_set, button_handle);
 	ESP_ERROR_CHECK(audio_event_iface_set_listener(esp_periph_set_get_event_iface(periph_set), app_ctx->evt));
 
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+	ESP_ERROR_CHECK(credentials_init());
+#endif
+
 	app_ctx->stream = tcp_stream_create();
 	mem_assert(app_ctx->stream);
 	
+	app_ctx->proto = protocol_create(app_ctx->stream);
+	mem_assert(app_ctx->proto);
+	protocol_set_event_handler(app_ctx->proto, mubby_protocol_event, app_ctx);
+	
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+	app_ctx->audio = udp_stream_create();
+	mem_assert(app_ctx->audio);
+#endif
+	
+	ESP_ERROR_CHECK(link_quality_init());
+	ESP_ERROR_CHECK(backend_init());
+	app_ctx->conn = conn_manager_create(app_ctx->stream, mubby_auth, app_ctx);
+	mem_assert(app_ctx->conn);
+	
 	app_ctx->ap = player_create();
 	mem_assert(app_ctx->ap);
 	ESP_ERROR_CHECK(player_set_event_listener(app_ctx->ap, app_ctx->evt));
-	ESP_ERROR_CHECK(player_set_tcp_stream(app_ctx->ap, app_ctx->stream));
+	ESP_ERROR_CHECK(player_set_protocol(app_ctx->ap, app_ctx->proto));
 
 	app_ctx->ar = recorder_create();
 	ESP_ERROR_CHECK(recorder_set_event_listener(app_ctx->ar, app_ctx->evt));
-	ESP_ERROR_CHECK(recorder_set_tcp_stream(app_ctx->ar, app_ctx->stream));
+	ESP_ERROR_CHECK(recorder_set_protocol(app_ctx->ar, app_ctx->proto));
+	
+#ifdef CONFIG_VAD_HANDS_FREE
+	/* listens to what the recorder captures, there is only one microphone */
+	app_ctx->av = voice_detector_create();
+	mem_assert(app_ctx->av);
+	ESP_ERROR_CHECK(voice_detector_set_event_listener(app_ctx->av, app_ctx->evt));
+	ESP_ERROR_CHECK(recorder_set_monitor(app_ctx->ar, voice_detector_feed, app_ctx->av));
+	ESP_ERROR_CHECK(voice_detector_start(app_ctx->av));
+#endif
+#ifdef CONFIG_WAKE_WORD
+	/* the spotter wants the full bandwidth, not the 8 kHz upload */
+	app_ctx->aw = wake_word_create();
+	mem_assert(app_ctx->aw);
+	ESP_ERROR_CHECK(wake_word_set_event_listener(app_ctx->aw, app_ctx->evt));
+	ESP_ERROR_CHECK(recorder_set_capture_monitor(app_ctx->ar, wake_word_feed, app_ctx->aw));
+	ESP_ERROR_CHECK(wake_word_start(app_ctx->aw));
+#endif
 	 
 	app_ctx->msg_queue = xQueueCreate(10, sizeof(int));
 	mem_assert(app_ctx->msg_queue);
@@ -467,10 +652,10 @@ void app_main(void)
 	/* start the wifi manager task */
 	ESP_ERROR_CHECK(wifi_manager_start(app_ctx, app_ctx->evt));
 	
-	xReturned = xTaskCreate(event_monitor_task, "event_monitor", 2048, (void *)app_ctx, tskIDLE_PRIORITY + 2, NULL);
+	xReturned = xTaskCreate(event_monitor_task, "event_monitor", MUBBY_EVENT_TASK_SIZE, (void *)app_ctx, tskIDLE_PRIORITY + 2, NULL);
 	configASSERT(xReturned == pdPASS);
 	
-	xReturned = xTaskCreate(core_task, "core_task", 2048, (void *)app_ctx, tskIDLE_PRIORITY, NULL);
+	xReturned = xTaskCreate(core_task, "core_task", MUBBY_CORE_TASK_SIZE, (void *)app_ctx, tskIDLE_PRIORITY, NULL);
 	configASSERT(xReturned == pdPASS);
 	
 	push_state(app_ctx, MUBBY_STATE_STANDBY);
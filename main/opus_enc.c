@@ -0,0 +1,272 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "audio_element.h"
+
+#include "opus_enc.h"
+
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+
+#include "opus.h"
+
+static const char *TAG = "OPUS_ENC";
+
+struct opus_enc {
+	OpusEncoder						*enc;
+	opus_enc_cfg_t					cfg;
+	/* one frame of interleaved input */
+	int16_t							*pcm;
+	int								pcm_size;
+	int								pcm_len;
+	int								frame_samples;
+	/* requested by opus_enc_set_bitrate, applied between frames */
+	volatile int					bitrate;
+	int								applied_bitrate;
+	bool							input_done;
+	opus_enc_stats_t				stats;
+	uint8_t							packet[OPUS_ENC_MAX_PACKET];
+};
+
+static esp_err_t opus_enc_open(audio_element_handle_t self)
+{
+	struct opus_enc *oe = (struct opus_enc *)audio_element_getdata(self);
+	opus_int32 lookahead = 0;
+	int err;
+	
+	oe->enc = opus_encoder_create(oe->cfg.sample_rate, 1, OPUS_APPLICATION_VOIP, &err);
+	if (err != OPUS_OK) {
+		ESP_LOGE(TAG, "Failed to create the encoder: %s", opus_strerror(err));
+		oe->enc = NULL;
+		return ESP_FAIL;
+	}
+	
+	oe->applied_bitrate = oe->bitrate;
+	opus_encoder_ctl(oe->enc, OPUS_SET_BITRATE(oe->applied_bitrate));
+	opus_encoder_ctl(oe->enc, OPUS_SET_COMPLEXITY(oe->cfg.complexity));
+	opus_encoder_ctl(oe->enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+	opus_encoder_ctl(oe->enc, OPUS_GET_LOOKAHEAD(&lookahead));
+	
+	memset(&oe->stats, 0, sizeof(oe->stats));
+	oe->stats.latency_ms = oe->cfg.frame_ms + lookahead * 1000 / oe->cfg.sample_rate;
+	oe->pcm_len = 0;
+	oe->input_done = false;
+	
+	return ESP_OK;
+}
+
+static esp_err_t opus_enc_close(audio_element_handle_t self)
+{
+	struct opus_enc *oe = (struct opus_enc *)audio_element_getdata(self);
+	
+	if (oe->enc) {
+		opus_encoder_destroy(oe->enc);
+		oe->enc = NULL;
+	}
+	
+	return ESP_OK;
+}
+
+static esp_err_t opus_enc_destroy(audio_element_handle_t self)
+{
+	struct opus_enc *oe = (struct opus_enc *)audio_element_getdata(self);
+	
+	free(oe->pcm);
+	free(oe);
+	
+	return ESP_OK;
+}
+
+/* encodes the frame in oe->pcm and writes the packet out */
+static int opus_enc_frame(audio_element_handle_t self, struct opus_enc *oe)
+{
+	int16_t *pcm = oe->pcm;
+	int64_t started;
+	uint32_t elapsed;
+	int len;
+	
+	if (oe->cfg.channels == 2) {
+		/* in place, sample i never overtakes pair 2i */
+		for (int i = 0; i < oe->frame_samples; i++) {
+			pcm[i] = ((int32_t)pcm[2 * i] + pcm[2 * i + 1]) / 2;
+		}
+	}
+	
+	if (oe->bitrate != oe->applied_bitrate) {
+		oe->applied_bitrate = oe->bitrate;
+		opus_encoder_ctl(oe->enc, OPUS_SET_BITRATE(oe->applied_bitrate));
+	}
+	
+	started = esp_timer_get_time();
+	len = opus_encode(oe->enc, pcm, oe->frame_samples, oe->packet, sizeof(oe->packet));
+	elapsed = (uint32_t)(esp_timer_get_time() - started);
+	
+	oe->pcm_len = 0;
+	
+	if (len < 0) {
+		ESP_LOGE(TAG, "Failed to encode: %s", opus_strerror(len));
+		return AEL_PROCESS_FAIL;
+	}
+	
+	oe->stats.frames++;
+	oe->stats.bytes += len;
+	oe->stats.audio_ms += oe->cfg.frame_ms;
+	oe->stats.encode_us += elapsed;
+	if (elapsed > oe->stats.max_encode_us) {
+		oe->stats.max_encode_us = elapsed;
+	}
+	
+	return audio_element_output(self, (char *)oe->packet, len);
+}
+
+static int opus_enc_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+	struct opus_enc *oe = (struct opus_enc *)audio_element_getdata(self);
+	int ret;
+	
+	if (oe->input_done) {
+		return AEL_IO_DONE;
+	}
+	
+	while (oe->pcm_len < oe->pcm_size) {
+		ret = audio_element_input(self, (char *)oe->pcm + oe->pcm_len, oe->pcm_size - oe->pcm_len);
+		if (ret > 0) {
+			oe->pcm_len += ret;
+			continue;
+		}
+		
+		if ((ret == AEL_IO_DONE || ret == AEL_IO_OK) && oe->pcm_len > 0) {
+			/* pad the tail to a whole frame, it is the last one */
+			memset((char *)oe->pcm + oe->pcm_len, 0, oe->pcm_size - oe->pcm_len);
+			oe->input_done = true;
+			break;
+		}
+		
+		return ret == AEL_IO_OK ? AEL_IO_DONE : ret;
+	}
+	
+	return opus_enc_frame(self, oe);
+}
+
+/**
+ * @brief Create an element encoding 16 bit PCM into Opus packets
+ * @param [in] config The encoder configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t opus_enc_init(opus_enc_cfg_t *config)
+{
+	audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+	audio_element_handle_t el;
+	struct opus_enc *oe;
+	
+	if (config->frame_ms != 10 && config->frame_ms != 20 && config->frame_ms != 40 && config->frame_ms != 60) {
+		ESP_LOGE(TAG, "Unsupported frame duration %d ms", config->frame_ms);
+		return NULL;
+	}
+	
+	if (config->channels != 1 && config->channels != 2) {
+		ESP_LOGE(TAG, "Unsupported channel count %d", config->channels);
+		return NULL;
+	}
+	
+	oe = calloc(1, sizeof(struct opus_enc));
+	if (!oe) {
+		return NULL;
+	}
+	
+	oe->cfg = *config;
+	oe->bitrate = config->bitrate;
+	oe->frame_samples = config->sample_rate * config->frame_ms / 1000;
+	oe->pcm_size = oe->frame_samples * config->channels * sizeof(int16_t);
+	oe->pcm = malloc(oe->pcm_size);
+	if (!oe->pcm) {
+		free(oe);
+		return NULL;
+	}
+	
+	cfg.open = opus_enc_open;
+	cfg.close = opus_enc_close;
+	cfg.process = opus_enc_process;
+	cfg.destroy = opus_enc_destroy;
+	cfg.task_stack = config->task_stack;
+	cfg.task_prio = config->task_prio;
+	cfg.task_core = config->task_core;
+	cfg.out_rb_size = config->out_rb_size;
+	cfg.tag = "opus";
+	
+	el = audio_element_init(&cfg);
+	if (!el) {
+		free(oe->pcm);
+		free(oe);
+		return NULL;
+	}
+	
+	audio_element_setdata(el, oe);
+	
+	return el;
+}
+
+/**
+ * @brief Change the target bitrate of an Opus encoder
+ * @param [in] self		The audio element handle
+ * @param [in] bitrate	The bitrate in bits per second
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t opus_enc_set_bitrate(audio_element_handle_t self, int bitrate)
+{
+	struct opus_enc *oe = (struct opus_enc *)audio_element_getdata(self);
+	
+	if (!oe || bitrate <= 0) {
+		return ESP_FAIL;
+	}
+	
+	oe->bitrate = bitrate;
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Get the statistics of an Opus encoder since it was last opened
+ * @param [in]  self 	The audio element handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t opus_enc_get_stats(audio_element_handle_t self, opus_enc_stats_t *stats)
+{
+	struct opus_enc *oe = (struct opus_enc *)audio_element_getdata(self);
+	
+	if (!oe) {
+		return ESP_FAIL;
+	}
+	
+	*stats = oe->stats;
+	
+	return ESP_OK;
+}
+
+#endif /* CONFIG_RECORDER_CODEC_OPUS */
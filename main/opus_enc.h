@@ -0,0 +1,118 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _OPUS_ENC_H_
+#define _OPUS_ENC_H_
+
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Largest packet produced for a single frame
+ */
+#define OPUS_ENC_MAX_PACKET			(1276)
+
+#define OPUS_ENC_TASK_STACK			(30 * 1024)
+#define OPUS_ENC_TASK_PRIORITY		(5)
+#define OPUS_ENC_TASK_CORE			(0)
+#define OPUS_ENC_RINGBUFFER_SIZE	(2 * 1024)
+
+/**
+ * @brief Opus encoder configuration
+ */
+typedef struct {
+	int sample_rate;	/*!< Input sample rate: 8000, 12000, 16000, 24000 or 48000 Hz */
+	int channels;		/*!< Interleaved 16 bit input channels, stereo is mixed down to mono */
+	int bitrate;		/*!< Target bitrate in bits per second */
+	int frame_ms;		/*!< Frame duration: 10, 20, 40 or 60 ms */
+	int complexity;		/*!< Encoder complexity from 0 (fastest) to 10 */
+	int out_rb_size;	/*!< Size of the output ring buffer */
+	int task_stack;		/*!< Task stack size, libopus keeps its scratch buffers there */
+	int task_prio;		/*!< Task priority */
+	int task_core;		/*!< Core the task runs on */
+} opus_enc_cfg_t;
+
+#define DEFAULT_OPUS_ENC_CONFIG() {				\
+	.sample_rate	= 8000,						\
+	.channels		= 2,						\
+	.bitrate		= 16000,					\
+	.frame_ms		= 20,						\
+	.complexity		= 3,						\
+	.out_rb_size	= OPUS_ENC_RINGBUFFER_SIZE,	\
+	.task_stack		= OPUS_ENC_TASK_STACK,		\
+	.task_prio		= OPUS_ENC_TASK_PRIORITY,	\
+	.task_core		= OPUS_ENC_TASK_CORE,		\
+}
+
+/**
+ * @brief Statistics of an Opus encoder since it was last opened
+ */
+typedef struct {
+	uint32_t frames;			/*!< Packets produced */
+	uint32_t bytes;				/*!< Encoded bytes handed on */
+	uint32_t audio_ms;			/*!< Duration of the audio encoded */
+	uint64_t encode_us;			/*!< Time spent in opus_encode */
+	uint32_t max_encode_us;		/*!< Longest opus_encode call */
+	uint32_t latency_ms;		/*!< Frame duration plus encoder lookahead */
+} opus_enc_stats_t;
+
+/**
+ * @brief Create an element encoding 16 bit PCM into Opus packets
+ *
+ * Every buffer the element writes out, to its ring buffer or write
+ * callback, is exactly one Opus packet of one frame. A partial frame left
+ * at the end of the input is padded with silence.
+ *
+ * @param [in] config The encoder configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t opus_enc_init(opus_enc_cfg_t *config);
+
+/**
+ * @brief Change the target bitrate of an Opus encoder
+ *
+ * Applies from the next frame, also while the element is running.
+ *
+ * @param [in] self		The audio element handle
+ * @param [in] bitrate	The bitrate in bits per second
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t opus_enc_set_bitrate(audio_element_handle_t self, int bitrate);
+
+/**
+ * @brief Get the statistics of an Opus encoder since it was last opened
+ * @param [in]  self 	The audio element handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t opus_enc_get_stats(audio_element_handle_t self, opus_enc_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _OPUS_ENC_H_ */
@@ -0,0 +1,324 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_element.h"
+
+#include "pcm_dsp.h"
+
+static const char *TAG = "PCM_DSP";
+
+struct pcm_dsp {
+	pcm_dsp_cfg_t					cfg;
+	/* the input format currently converted from, no rate until it is known */
+	int								in_rate;
+	int								in_channels;
+	resample_t						rs;
+	/* input frames, mixed down in place */
+	int16_t							*in;
+	int								in_size;
+	/* bytes of a partial frame left over from the previous read */
+	int								carry;
+	int16_t							*out;
+	int								out_size;
+	pcm_dsp_monitor_cb_t			monitor;
+	void							*monitor_ctx;
+	pcm_dsp_monitor_cb_t			input_monitor;
+	void							*input_monitor_ctx;
+	pcm_dsp_stats_t					stats;
+};
+
+static esp_err_t pcm_dsp_configure(struct pcm_dsp *ds, int rate, int channels)
+{
+	int size;
+	
+	if (channels != 1 && channels != 2) {
+		ESP_LOGE(TAG, "Unsupported channel count %d", channels);
+		return ESP_FAIL;
+	}
+	
+	resample_deinit(&ds->rs);
+	ds->in_rate = 0;
+	if (resample_init(&ds->rs, rate, ds->cfg.dst_rate) != 0) {
+		ESP_LOGE(TAG, "Cannot convert %d Hz to %d Hz", rate, ds->cfg.dst_rate);
+		return ESP_FAIL;
+	}
+	
+	/* mono input takes twice the frames per read */
+	size = RESAMPLE_MAX_OUTPUT(&ds->rs, ds->in_size / (channels * sizeof(int16_t)))
+		   * ds->cfg.dst_channels * sizeof(int16_t);
+	if (size > ds->out_size) {
+		free(ds->out);
+		ds->out = malloc(size);
+		ds->out_size = ds->out ? size : 0;
+		if (!ds->out) {
+			return ESP_FAIL;
+		}
+	}
+	
+	ds->in_rate = rate;
+	ds->in_channels = channels;
+	ds->stats.taps = ds->rs.taps;
+	
+	ESP_LOGI(TAG, "Converting %d Hz %d ch to %d Hz %d ch, %d taps",
+			 rate, channels, ds->cfg.dst_rate, ds->cfg.dst_channels, ds->rs.taps);
+	
+	return ESP_OK;
+}
+
+static esp_err_t pcm_dsp_open(audio_element_handle_t self)
+{
+	struct pcm_dsp *ds = (struct pcm_dsp *)audio_element_getdata(self);
+	audio_element_info_t info = {0};
+	
+	audio_element_getinfo(self, &info);
+	info.sample_rates = ds->cfg.dst_rate;
+	info.channels = ds->cfg.dst_channels;
+	info.bits = 16;
+	audio_element_setinfo(self, &info);
+	audio_element_report_info(self);
+	
+	memset(&ds->stats, 0, sizeof(ds->stats));
+	ds->stats.taps = ds->rs.taps;
+	ds->carry = 0;
+	
+	/* a new stream, the filter must not ring on with the old one */
+	resample_reset(&ds->rs);
+	
+	if (!ds->cfg.src_info_el && !ds->in_rate) {
+		return pcm_dsp_configure(ds, ds->cfg.src_rate, ds->cfg.src_channels);
+	}
+	
+	return ESP_OK;
+}
+
+static esp_err_t pcm_dsp_close(audio_element_handle_t self)
+{
+	return ESP_OK;
+}
+
+static esp_err_t pcm_dsp_destroy(audio_element_handle_t self)
+{
+	struct pcm_dsp *ds = (struct pcm_dsp *)audio_element_getdata(self);
+	
+	resample_deinit(&ds->rs);
+	free(ds->in);
+	free(ds->out);
+	free(ds);
+	
+	return ESP_OK;
+}
+
+static int pcm_dsp_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+	struct pcm_dsp *ds = (struct pcm_dsp *)audio_element_getdata(self);
+	const int dst_channels = ds->cfg.dst_channels;
+	int16_t *pcm = ds->in, *out = ds->out;
+	int64_t started;
+	int ret, len, frame, frames, samples = 0;
+	
+	ret = audio_element_input(self, (char *)ds->in + ds->carry, ds->in_size - ds->carry);
+	if (ret <= 0) {
+		return ret;
+	}
+	len = ds->carry + ret;
+	
+	/* the decoder sets its info before it writes the samples it describes */
+	if (ds->cfg.src_info_el) {
+		audio_element_info_t info = {0};
+		
+		audio_element_getinfo(ds->cfg.src_info_el, &info);
+		if ((info.sample_rates != ds->in_rate || info.channels != ds->in_channels)
+			&& pcm_dsp_configure(ds, info.sample_rates, info.channels) != ESP_OK) {
+			return AEL_PROCESS_FAIL;
+		}
+	}
+	
+	frame = ds->in_channels * sizeof(int16_t);
+	frames = len / frame;
+	
+	if (frames > 0 && !ds->rs.taps && ds->in_channels == dst_channels) {
+		if (ds->input_monitor && dst_channels == 1) {
+			ds->input_monitor(pcm, frames, ds->input_monitor_ctx);
+		}
+		if (ds->monitor && dst_channels == 1) {
+			ds->monitor(pcm, frames, ds->monitor_ctx);
+		}
+		ret = audio_element_output(self, (char *)pcm, frames * frame);
+		samples = frames;
+	} else if (frames > 0) {
+		started = esp_timer_get_time();
+		if (ds->in_channels == 2) {
+			/* in place, sample i never overtakes pair 2i */
+			for (int i = 0; i < frames; i++) {
+				pcm[i] = ((int32_t)pcm[2 * i] + pcm[2 * i + 1]) >> 1;
+			}
+		}
+		if (ds->input_monitor) {
+			ds->input_monitor(pcm, frames, ds->input_monitor_ctx);
+		}
+		samples = resample_process(&ds->rs, pcm, frames, out);
+		if (dst_channels == 2) {
+			/* backwards, pair i lands on or after sample i */
+			for (int i = samples - 1; i >= 0; i--) {
+				out[2 * i + 1] = out[2 * i] = out[i];
+			}
+		}
+		ds->stats.dsp_us += esp_timer_get_time() - started;
+		
+		if (ds->monitor && dst_channels == 1 && samples > 0) {
+			ds->monitor(out, samples, ds->monitor_ctx);
+		}
+		if (samples > 0) {
+			ret = audio_element_output(self, (char *)out, samples * dst_channels * sizeof(int16_t));
+		}
+	}
+	
+	ds->stats.frames_in += frames;
+	ds->stats.frames_out += samples;
+	
+	ds->carry = len - frames * frame;
+	if (ds->carry) {
+		memmove(ds->in, (char *)ds->in + frames * frame, ds->carry);
+	}
+	
+	return ret;
+}
+
+/**
+ * @brief Create an element converting 16 bit PCM between formats
+ * @param [in] config The converter configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t pcm_dsp_init(pcm_dsp_cfg_t *config)
+{
+	audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+	audio_element_handle_t el;
+	struct pcm_dsp *ds;
+	
+	if (config->dst_channels != 1 && config->dst_channels != 2) {
+		ESP_LOGE(TAG, "Unsupported channel count %d", config->dst_channels);
+		return NULL;
+	}
+	
+	ds = calloc(1, sizeof(struct pcm_dsp));
+	if (!ds) {
+		return NULL;
+	}
+	
+	ds->cfg = *config;
+	ds->in_size = PCM_DSP_FRAMES * 2 * sizeof(int16_t);
+	ds->in = malloc(ds->in_size);
+	if (!ds->in) {
+		goto errout;
+	}
+	
+	cfg.open = pcm_dsp_open;
+	cfg.close = pcm_dsp_close;
+	cfg.process = pcm_dsp_process;
+	cfg.destroy = pcm_dsp_destroy;
+	cfg.task_stack = config->task_stack;
+	cfg.task_prio = config->task_prio;
+	cfg.task_core = config->task_core;
+	cfg.out_rb_size = config->out_rb_size;
+	cfg.tag = "pcm_dsp";
+	
+	el = audio_element_init(&cfg);
+	if (!el) {
+		goto errout;
+	}
+	
+	audio_element_setdata(el, ds);
+	
+	return el;
+	
+errout:
+	free(ds->in);
+	free(ds);
+	return NULL;
+}
+
+/**
+ * @brief Watch the output of a mono PCM converter, e.g. for voice activity
+ * @param [in] self The audio element handle
+ * @param [in] cb 	The callback, NULL to stop monitoring
+ * @param [in] ctx 	The user argument passed to cb
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t pcm_dsp_set_monitor(audio_element_handle_t self, pcm_dsp_monitor_cb_t cb, void *ctx)
+{
+	struct pcm_dsp *ds = (struct pcm_dsp *)audio_element_getdata(self);
+	
+	if (!ds) {
+		return ESP_FAIL;
+	}
+	
+	ds->monitor_ctx = ctx;
+	ds->monitor = cb;
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Watch the input of a PCM converter, mixed down to mono
+ * @param [in] self The audio element handle
+ * @param [in] cb 	The callback, NULL to stop monitoring
+ * @param [in] ctx 	The user argument passed to cb
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t pcm_dsp_set_input_monitor(audio_element_handle_t self, pcm_dsp_monitor_cb_t cb, void *ctx)
+{
+	struct pcm_dsp *ds = (struct pcm_dsp *)audio_element_getdata(self);
+	
+	if (!ds) {
+		return ESP_FAIL;
+	}
+	
+	ds->input_monitor_ctx = ctx;
+	ds->input_monitor = cb;
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Get the statistics of a PCM converter since it was last opened
+ * @param [in]  self 	The audio element handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t pcm_dsp_get_stats(audio_element_handle_t self, pcm_dsp_stats_t *stats)
+{
+	struct pcm_dsp *ds = (struct pcm_dsp *)audio_element_getdata(self);
+	
+	if (!ds) {
+		return ESP_FAIL;
+	}
+	
+	*stats = ds->stats;
+	
+	return ESP_OK;
+}
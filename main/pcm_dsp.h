@@ -0,0 +1,148 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PCM_DSP_H_
+#define _PCM_DSP_H_
+
+#include "audio_element.h"
+#include "resample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_DSP_TASK_STACK			(4 * 1024)
+#define PCM_DSP_TASK_PRIORITY		(5)
+#define PCM_DSP_TASK_CORE			(0)
+#define PCM_DSP_RINGBUFFER_SIZE		(4 * 1024)
+
+/**
+ * Input frames taken per process call
+ */
+#define PCM_DSP_FRAMES				(256)
+
+/**
+ * @brief PCM converter configuration
+ */
+typedef struct {
+	int src_rate;				/*!< Input sample rate */
+	int src_channels;			/*!< Interleaved 16 bit input channels, 1 or 2 */
+	audio_element_handle_t src_info_el;	/*!< Element whose music info gives the input format instead, e.g. a decoder */
+	int dst_rate;				/*!< Output sample rate */
+	int dst_channels;			/*!< Output channels, mono is duplicated into 2 */
+	int out_rb_size;			/*!< Size of the output ring buffer */
+	int task_stack;				/*!< Task stack size */
+	int task_prio;				/*!< Task priority */
+	int task_core;				/*!< Core the task runs on */
+} pcm_dsp_cfg_t;
+
+#define DEFAULT_PCM_DSP_CONFIG() {				\
+	.src_rate		= 16000,					\
+	.src_channels	= 2,						\
+	.src_info_el	= NULL,						\
+	.dst_rate		= 8000,						\
+	.dst_channels	= 1,						\
+	.out_rb_size	= PCM_DSP_RINGBUFFER_SIZE,	\
+	.task_stack		= PCM_DSP_TASK_STACK,		\
+	.task_prio		= PCM_DSP_TASK_PRIORITY,	\
+	.task_core		= PCM_DSP_TASK_CORE,		\
+}
+
+/**
+ * @brief Statistics of a PCM converter since it was last opened
+ */
+typedef struct {
+	uint32_t frames_in;			/*!< Frames consumed */
+	uint32_t frames_out;		/*!< Frames produced */
+	uint64_t dsp_us;			/*!< Time spent mixing and resampling */
+	int taps;					/*!< Filter taps of the current conversion, 0 for none */
+} pcm_dsp_stats_t;
+
+/**
+ * @brief Called from the element task with every converted block
+ * @param [in] pcm 		The mono 16 bit samples, at the output rate or
+ *                      for an input monitor at the input rate
+ * @param [in] samples 	The number of samples
+ * @param [in] ctx 		The user argument given to pcm_dsp_set_monitor
+ */
+typedef void (*pcm_dsp_monitor_cb_t)(const int16_t *pcm, int samples, void *ctx);
+
+/**
+ * @brief Create an element converting 16 bit PCM between formats
+ *
+ * Stereo input is mixed down to mono, resampled to the output rate and,
+ * for stereo output, copied into both channels. Input already in the
+ * output format passes through untouched. The output format is reported
+ * as music info when the element opens.
+ *
+ * With config->src_info_el set, the input format is taken from the music
+ * info of that element whenever it changes, which a decoder sets before
+ * it writes out the first samples in the new format.
+ *
+ * @param [in] config The converter configuration
+ * @return audio element handle on success, NULL otherwise
+ */
+audio_element_handle_t pcm_dsp_init(pcm_dsp_cfg_t *config);
+
+/**
+ * @brief Watch the output of a mono PCM converter, e.g. for voice activity
+ *
+ * The callback runs before the block is written out, so it should be
+ * quick. Stereo outputs are not monitored.
+ *
+ * @param [in] self The audio element handle
+ * @param [in] cb 	The callback, NULL to stop monitoring
+ * @param [in] ctx 	The user argument passed to cb
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t pcm_dsp_set_monitor(audio_element_handle_t self, pcm_dsp_monitor_cb_t cb, void *ctx);
+
+/**
+ * @brief Watch the input of a PCM converter, mixed down to mono
+ *
+ * For listeners which want the full bandwidth of the input rather than
+ * the converted audio, e.g. a keyword spotter. Runs in the element task
+ * like pcm_dsp_set_monitor, but before resampling. Stereo input which
+ * is passed through to a stereo output is not monitored.
+ *
+ * @param [in] self The audio element handle
+ * @param [in] cb 	The callback, NULL to stop monitoring
+ * @param [in] ctx 	The user argument passed to cb
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t pcm_dsp_set_input_monitor(audio_element_handle_t self, pcm_dsp_monitor_cb_t cb, void *ctx);
+
+/**
+ * @brief Get the statistics of a PCM converter since it was last opened
+ * @param [in]  self 	The audio element handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t pcm_dsp_get_stats(audio_element_handle_t self, pcm_dsp_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PCM_DSP_H_ */
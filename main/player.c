@@ -32,6 +32,7 @@
 #include "lwip/err.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
 #include "audio_common.h"
 #include "audio_element.h"
@@ -39,6 +40,8 @@
 #include "audio_pipeline.h"
 #include "i2s_stream.h"
 #include "mp3_decoder.h"
+#include "adpcm_codec.h"
+#include "pcm_dsp.h"
 #include "board.h"
 
 #include "mubby.h"
@@ -55,10 +58,12 @@ struct audio_player {
 	audio_event_iface_handle_t 		external_event;
 	audio_event_iface_handle_t 		internal_event;
 	audio_element_handle_t 			i2s_stream_writer;
-	audio_element_handle_t 			mp3_decoder;
+	audio_element_handle_t 			decoder;
+	audio_element_handle_t 			dsp;
 	audio_pipeline_handle_t 		pipeline;
-	tcp_stream_handle_t				stream;
+	protocol_handle_t				proto;
 	bool 							is_running;	
+	volatile bool					stopping;
 };
 
 static esp_err_t player_notify_sync(audio_player_handle_t ap, int state)
@@ -73,14 +78,33 @@ static esp_err_t player_notify_sync(audio_player_handle_t ap, int state)
 
 static int player_read_cb(audio_element_handle_t el, char *buf, int len, TickType_t wait_time, void *ctx)
 {
-	tcp_stream_handle_t stream = (tcp_stream_handle_t)ctx;
+	audio_player_handle_t ap = (audio_player_handle_t)ctx;
+	int64_t stalled_since = 0, now;
+	int read_len;
 	
-	int read_len = stream->read(stream, buf, len);
-	if (read_len == 0 || (read_len == -1 && errno == EAGAIN)) {
-		read_len = AEL_IO_DONE;
+	for (;;) {
+		read_len = protocol_read_audio(ap->proto, buf, len);
+		if (read_len == 0) {
+			return AEL_IO_DONE;
+		} else if (read_len > 0 || errno != EAGAIN) {
+			return read_len;
+		}
+		
+		/* a timeout is a stall, the end of the reply is marked as such */
+		now = esp_timer_get_time() / 1000;
+		if (!stalled_since) {
+			stalled_since = now;
+		}
+		
+		if (ap->stopping) {
+			return AEL_IO_DONE;
+		} else if (now - stalled_since >= CONFIG_PLAYER_STALL_TIMEOUT) {
+			ESP_LOGE(TAG, "[ * ] Reply stalled for %d ms, giving up", (int)(now - stalled_since));
+			return AEL_IO_DONE;
+		}
+		
+		ESP_LOGW(TAG, "[ * ] Reply stalled, waiting");
 	}
-
-	return read_len;
 }
 
 static void player_task(void *pvParameters)
@@ -106,18 +130,15 @@ static void player_task(void *pvParameters)
 			continue;
 		}
         
-		if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg.source == (void *)ap->mp3_decoder
+		if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg.source == (void *)ap->decoder
 			&& msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
 			audio_element_info_t music_info = {0};
-			audio_element_getinfo(ap->mp3_decoder, &music_info);
+			audio_element_getinfo(ap->decoder, &music_info);
 			
-			ESP_LOGI(TAG, "[ * ] Receive music info from mp3 decoder, sample_rate=%d, bits=%d, ch=%d",
+			/* the converter picks the format up itself, the I2S clock stays as it is */
+			ESP_LOGI(TAG, "[ * ] Receive music info from decoder, sample_rate=%d, bits=%d, ch=%d",
 						music_info.sample_rates, music_info.bits, music_info.channels);
 			
-			audio_element_setinfo(ap->i2s_stream_writer, &music_info);
-			
-			i2s_stream_set_clk(ap->i2s_stream_writer, music_info.sample_rates, music_info.bits, music_info.channels);
-			
 			continue;
 		}
 		
@@ -168,28 +189,46 @@ audio_player_handle_t player_create(void)
 	ap->internal_event = audio_event_iface_init(&cfg);
 	mem_assert(ap->internal_event);
 	
-	/* Create the I2S writer stream */
+	/* Create the I2S writer stream, on the clock the recorder captures with */
 	i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
+	i2s_cfg.i2s_config.sample_rate = CONFIG_AUDIO_I2S_SAMPLE_RATE;
 	i2s_cfg.type = AUDIO_STREAM_WRITER;
 	ap->i2s_stream_writer = i2s_stream_init(&i2s_cfg);
 	mem_assert(ap->i2s_stream_writer);
 	
+#ifdef CONFIG_PLAYER_CODEC_ADPCM
+	/* Create the IMA-ADPCM decoder */
+	adpcm_codec_cfg_t adpcm_cfg = DEFAULT_ADPCM_CODEC_CONFIG();
+	adpcm_cfg.sample_rate = CONFIG_PLAYER_ADPCM_SAMPLE_RATE;
+	adpcm_cfg.block_size = CONFIG_ADPCM_BLOCK_SIZE;
+	ap->decoder = adpcm_decoder_init(&adpcm_cfg);
+#else
 	/* Create the MP3 decoder */
 	mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
-	ap->mp3_decoder = mp3_decoder_init(&mp3_cfg);
-	mem_assert(ap->mp3_decoder);
+	ap->decoder = mp3_decoder_init(&mp3_cfg);
+#endif
+	mem_assert(ap->decoder);
+	
+	/* Create the converter from whatever the decoder outputs to the I2S format */
+	pcm_dsp_cfg_t dsp_cfg = DEFAULT_PCM_DSP_CONFIG();
+	dsp_cfg.src_info_el = ap->decoder;
+	dsp_cfg.dst_rate = CONFIG_AUDIO_I2S_SAMPLE_RATE;
+	dsp_cfg.dst_channels = 2;
+	ap->dsp = pcm_dsp_init(&dsp_cfg);
+	mem_assert(ap->dsp);
 	
 	/*
-	 * Create the pipeline and connect the MP3 decoder and I2S writer stream
-	 * Pipeline structure: TCP stream --> MP3 decoder --> I2S writer 
+	 * Create the pipeline and connect the decoder, converter and I2S writer stream
+	 * Pipeline structure: TCP stream --> MP3/ADPCM decoder --> converter --> I2S writer 
 	 */
 	audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
 	ap->pipeline = audio_pipeline_init(&pipeline_cfg);
 	mem_assert(ap->pipeline);
 
-	audio_pipeline_register(ap->pipeline, ap->mp3_decoder, "mp3");
+	audio_pipeline_register(ap->pipeline, ap->decoder, "dec");
+	audio_pipeline_register(ap->pipeline, ap->dsp, "dsp");
 	audio_pipeline_register(ap->pipeline, ap->i2s_stream_writer, "i2s");
-	audio_pipeline_link(ap->pipeline, (const char *[]){"mp3", "i2s"}, 2);
+	audio_pipeline_link(ap->pipeline, (const char *[]){"dec", "dsp", "i2s"}, 3);
 	
 	ap->is_running = false;
 	
@@ -213,6 +252,8 @@ esp_err_t player_destroy(audio_player_handle_t ap)
  */
 esp_err_t player_start(audio_player_handle_t ap)
 {
+	ap->stopping = false;
+	
 	if (xTaskCreate(player_task, "player_task", PLAYER_TASK_SIZE, (void *)ap, PLAYER_TASK_PRIORITY, &ap->task) != pdPASS) {
 		ESP_LOGE(TAG, "Failed to create player task");
 		return ESP_FAIL;
@@ -229,6 +270,9 @@ esp_err_t player_start(audio_player_handle_t ap)
 esp_err_t player_stop(audio_player_handle_t ap)
 {
 	if (ap->is_running) {
+		/* do not sit out a stall first */
+		ap->stopping = true;
+		
 		audio_event_iface_msg_t msg = {
 			.source_type = MUBBY_ID_CORE,
 			.data = (void *)"stop"
@@ -252,13 +296,16 @@ esp_err_t player_set_event_listener(audio_player_handle_t ap, audio_event_iface_
 }
 
 /**
- * @brief Set a data stream source for the player
+ * @brief Set the server connection the player reads reply audio from
  * @param [in] ap		The player handle
- * @param [in] stream	The TCP stream handle
+ * @param [in] proto	The protocol handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
-esp_err_t player_set_tcp_stream(audio_player_handle_t ap, tcp_stream_handle_t stream)
+esp_err_t player_set_protocol(audio_player_handle_t ap, protocol_handle_t proto)
 {
-	ap->stream = stream;
-	return audio_element_set_read_cb(ap->mp3_decoder, player_read_cb, ap->stream);
+	ap->proto = proto;
+#ifdef CONFIG_PLAYER_CODEC_ADPCM
+	protocol_set_reply_codec(proto, PROTOCOL_CODEC_ADPCM);
+#endif
+	return audio_element_set_read_cb(ap->decoder, player_read_cb, ap);
 }
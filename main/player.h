@@ -25,7 +25,7 @@
 #ifndef _PLAYER_H_
 #define _PLAYER_H_
 
-#include "tcp_stream.h"
+#include "protocol.h"
 #include "audio_event_iface.h"
 
 #ifdef __cplusplus
@@ -81,12 +81,12 @@ esp_err_t player_set_event_listener(audio_player_handle_t ap, audio_event_iface_
 
 
 /**
- * @brief Set a data stream for the player
+ * @brief Set the server connection the player reads reply audio from
  * @param [in] ap		The player handle
- * @param [in] stream	The TCP stream handle
+ * @param [in] proto	The protocol handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
-esp_err_t player_set_tcp_stream(audio_player_handle_t ap, tcp_stream_handle_t stream);
+esp_err_t player_set_protocol(audio_player_handle_t ap, protocol_handle_t proto);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,540 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "protocol.h"
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+#include "udp_stream.h"
+#endif
+
+static const char *TAG = "PROTOCOL";
+
+#ifdef CONFIG_BACKEND_PROTOCOL_LEGACY
+/* markers of the legacy protocol, indexed by protocol_control_t - 1 */
+static const char s_legacy_markers[][3] = {
+	{'r', 'e', 'c'}, {'e', 'n', 'd'}, {'b', 'r', 'k'}
+};
+#endif
+
+struct protocol {
+	tcp_stream_handle_t				stream;
+	/* datagram stream carrying the audio, NULL to keep it on stream */
+	tcp_stream_handle_t				audio;
+	protocol_codec_t				tx_codec;
+	protocol_codec_t				rx_codec;
+	SemaphoreHandle_t				tx_lock;
+	protocol_event_cb_t				event_cb;
+	void							*event_arg;
+	int64_t							turn_started;
+	uint8_t							rx_hdr[PROTOCOL_HEADER_SIZE];
+	int								rx_hdr_len;
+	int								rx_type;
+	int								rx_sub;
+	uint32_t						rx_left;
+	uint8_t							rx_evt[PROTOCOL_MAX_EVENT_SIZE];
+	int								rx_evt_len;
+	bool							rx_in_frame;
+	bool							audio_end;
+};
+
+static inline void protocol_put_u16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void protocol_put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint16_t protocol_get_u16(const uint8_t *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t protocol_get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void protocol_reset_rx(protocol_handle_t p)
+{
+	p->rx_hdr_len = 0;
+	p->rx_left = 0;
+	p->rx_evt_len = 0;
+	p->rx_in_frame = false;
+	p->audio_end = false;
+}
+
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+static int protocol_send_frame(protocol_handle_t p, int type, int sub, const void *payload, int len)
+{
+	uint8_t hdr[PROTOCOL_HEADER_SIZE];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)payload, .iov_len = len }
+	};
+	int ret = 0;
+	
+	hdr[0] = PROTOCOL_VERSION;
+	hdr[1] = type;
+	protocol_put_u16(hdr + 2, sub);
+	protocol_put_u32(hdr + 4, len);
+	protocol_put_u32(hdr + 8, (uint32_t)((esp_timer_get_time() - p->turn_started) / 1000));
+	
+	/* header and payload must not interleave with frames from other tasks */
+	xSemaphoreTake(p->tx_lock, portMAX_DELAY);
+	if (p->stream->writev(p->stream, iov, len > 0 ? 2 : 1) < 0) {
+		ret = -1;
+	}
+	xSemaphoreGive(p->tx_lock);
+	
+	return ret;
+}
+
+/* returns true if the frame ended the reply audio */
+static bool protocol_dispatch(protocol_handle_t p)
+{
+	if (p->rx_type != PROTOCOL_TYPE_EVENT) {
+		/* newer servers may send frames this client does not know yet */
+		ESP_LOGW(TAG, "Ignoring frame of type %d", p->rx_type);
+		return false;
+	}
+	
+	if (p->rx_sub == PROTOCOL_EVENT_AUDIO_END) {
+		p->audio_end = true;
+		return true;
+	}
+	
+	if (p->event_cb) {
+		p->event_cb(p, p->rx_sub, p->rx_evt, p->rx_evt_len, p->event_arg);
+	}
+	
+	return false;
+}
+
+/* with events_only nothing is read unless the socket polled readable */
+static int protocol_read(protocol_handle_t p, void *buf, int len, bool events_only)
+{
+	int ret = p->stream->read(p->stream, buf, len);
+	
+	/* readable but empty, the peer closed the connection */
+	if (ret == 0 && events_only) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	
+	return ret;
+}
+
+/**
+ * @brief Run the receive state machine
+ *
+ * Partial headers and payloads are kept across calls, so a read timeout
+ * never desynchronizes the stream.
+ *
+ * @return audio bytes read, 0 at the end of the reply or, with events_only,
+ *         when no more data is pending, -1 on error, a peer which closed
+ *         while events were polled for included
+ */
+static int protocol_receive(protocol_handle_t p, void *buf, int len, bool events_only)
+{
+	tcp_stream_handle_t stream = p->stream;
+	int ret;
+	
+	for (;;) {
+		if (events_only && stream->poll(stream, TCP_STREAM_POLL_READ, 0) <= 0) {
+			return 0;
+		}
+		
+		if (!p->rx_in_frame) {
+			ret = protocol_read(p, p->rx_hdr + p->rx_hdr_len, PROTOCOL_HEADER_SIZE - p->rx_hdr_len, events_only);
+			if (ret <= 0) {
+				return ret;
+			}
+			
+			p->rx_hdr_len += ret;
+			if (p->rx_hdr_len < PROTOCOL_HEADER_SIZE) {
+				continue;
+			}
+			
+			p->rx_hdr_len = 0;
+			if (p->rx_hdr[0] != PROTOCOL_VERSION) {
+				ESP_LOGE(TAG, "Unsupported protocol version %u", p->rx_hdr[0]);
+				errno = EPROTO;
+				return -1;
+			}
+			
+			p->rx_type = p->rx_hdr[1];
+			p->rx_sub = protocol_get_u16(p->rx_hdr + 2);
+			p->rx_left = protocol_get_u32(p->rx_hdr + 4);
+			p->rx_evt_len = 0;
+			p->rx_in_frame = true;
+		}
+		
+		if (p->rx_type == PROTOCOL_TYPE_AUDIO) {
+			if (events_only) {
+				return 0;
+			}
+			
+			if (p->rx_left == 0) {
+				p->rx_in_frame = false;
+				continue;
+			}
+			
+			ret = protocol_read(p, buf, p->rx_left < (uint32_t)len ? (int)p->rx_left : len, events_only);
+			if (ret > 0) {
+				p->rx_left -= ret;
+				p->rx_in_frame = p->rx_left > 0;
+			}
+			return ret;
+		}
+		
+		/* anything else is small, collect it and dispatch it whole */
+		if (p->rx_left > 0) {
+			if (p->rx_evt_len < PROTOCOL_MAX_EVENT_SIZE) {
+				int want = PROTOCOL_MAX_EVENT_SIZE - p->rx_evt_len;
+				ret = protocol_read(p, p->rx_evt + p->rx_evt_len, p->rx_left < (uint32_t)want ? (int)p->rx_left : want, events_only);
+				if (ret > 0) {
+					p->rx_evt_len += ret;
+				}
+			} else {
+				uint8_t discard[16];
+				ret = protocol_read(p, discard, p->rx_left < sizeof(discard) ? (int)p->rx_left : (int)sizeof(discard), events_only);
+			}
+			
+			if (ret <= 0) {
+				return ret;
+			}
+			
+			p->rx_left -= ret;
+			if (p->rx_left > 0) {
+				continue;
+			}
+		}
+		
+		p->rx_in_frame = false;
+		if (protocol_dispatch(p) && !events_only) {
+			return 0;
+		}
+	}
+}
+#endif
+
+/**
+ * @brief Create a protocol instance on top of a TCP stream
+ * @param [in] stream The TCP stream handle
+ * @return protocol handle on success, NULL otherwise
+ */
+protocol_handle_t protocol_create(tcp_stream_handle_t stream)
+{
+	protocol_handle_t p = calloc(1, sizeof(struct protocol));
+	if (!p) {
+		return NULL;
+	}
+	
+	p->tx_lock = xSemaphoreCreateMutex();
+	if (!p->tx_lock) {
+		free(p);
+		return NULL;
+	}
+	
+	p->stream = stream;
+	p->rx_codec = PROTOCOL_CODEC_MP3;
+	protocol_reset_rx(p);
+	
+	return p;
+}
+
+/**
+ * @brief Destroy a protocol instance
+ * @param [in] p The protocol handle
+ */
+void protocol_destroy(protocol_handle_t p)
+{
+	if (p) {
+		vSemaphoreDelete(p->tx_lock);
+		free(p);
+	}
+}
+
+/**
+ * @brief Set the server event handler
+ * @param [in] p 	The protocol handle
+ * @param [in] cb 	The event handler
+ * @param [in] arg 	The user argument passed to cb
+ */
+void protocol_set_event_handler(protocol_handle_t p, protocol_event_cb_t cb, void *arg)
+{
+	p->event_cb = cb;
+	p->event_arg = arg;
+}
+
+/**
+ * @brief Identify the client on a freshly opened connection
+ * @param [in] p 		The protocol handle
+ * @param [in] macaddr 	The MAC address string
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t protocol_send_hello(protocol_handle_t p, const char *macaddr)
+{
+	int ret;
+	
+	protocol_reset_rx(p);
+	p->turn_started = esp_timer_get_time();
+	/* until protocol_open_audio moves it again */
+	p->audio = NULL;
+	
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+	/* MP3 is what servers without codec negotiation send anyway */
+	ret = protocol_send_frame(p, PROTOCOL_TYPE_HELLO, p->rx_codec == PROTOCOL_CODEC_MP3 ? 0 : p->rx_codec,
+							  macaddr, strlen(macaddr));
+#else
+	/* the legacy server expects the terminating NUL as well */
+	ret = p->stream->write(p->stream, macaddr, strlen(macaddr) + 1);
+#endif
+	
+	if (ret < 0 || p->stream->flush(p->stream) < 0) {
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Send a control message and flush it out
+ * @param [in] p 		The protocol handle
+ * @param [in] control 	The control message, one of protocol_control_t
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t protocol_send_control(protocol_handle_t p, protocol_control_t control)
+{
+	int ret;
+	
+	if (control == PROTOCOL_CONTROL_REC) {
+		p->turn_started = esp_timer_get_time();
+		p->audio_end = false;
+	}
+	
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+	ret = protocol_send_frame(p, PROTOCOL_TYPE_CONTROL, control, NULL, 0);
+#else
+	if (control < PROTOCOL_CONTROL_REC || control > PROTOCOL_CONTROL_BREAK) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	ret = p->stream->write(p->stream, s_legacy_markers[control - 1], 3);
+#endif
+	
+	if (ret < 0 || p->stream->flush(p->stream) < 0) {
+		ESP_LOGE(TAG, "Failed to send control %d", control);
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Set the codec of the recorded audio passed to protocol_send_audio
+ * @param [in] p 		The protocol handle
+ * @param [in] codec 	The upload codec, PROTOCOL_CODEC_PCM by default
+ */
+void protocol_set_audio_codec(protocol_handle_t p, protocol_codec_t codec)
+{
+	p->tx_codec = codec;
+}
+
+/**
+ * @brief Set the codec the server should send reply audio in
+ * @param [in] p 		The protocol handle
+ * @param [in] codec 	The reply codec, PROTOCOL_CODEC_MP3 by default
+ */
+void protocol_set_reply_codec(protocol_handle_t p, protocol_codec_t codec)
+{
+	p->rx_codec = codec;
+}
+
+/**
+ * @brief Move the audio of this connection to a UDP stream
+ * @param [in] p 		The protocol handle
+ * @param [in] audio 	The UDP stream handle
+ * @param [in] hostname The server hostname
+ * @param [in] port 	The server UDP port
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t protocol_open_audio(protocol_handle_t p, tcp_stream_handle_t audio, char *hostname, int port)
+{
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+	uint8_t session[6];
+	
+	/* a new connection gets a new session */
+	audio->close(audio);
+	p->audio = NULL;
+	
+	if (!audio->open(audio, hostname, port)) {
+		ESP_LOGE(TAG, "Failed to open the audio stream to %s:%d", hostname, port);
+		return ESP_FAIL;
+	}
+	
+	protocol_put_u32(session, udp_stream_get_session(audio));
+	protocol_put_u16(session + 4, p->tx_codec);
+	if (protocol_send_frame(p, PROTOCOL_TYPE_CONTROL, PROTOCOL_CONTROL_UDP, session, sizeof(session)) < 0 ||
+		p->stream->flush(p->stream) < 0) {
+		audio->close(audio);
+		return ESP_FAIL;
+	}
+	
+	p->audio = audio;
+	
+	return ESP_OK;
+#else
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Send a block of recorded audio
+ * @param [in] p 	The protocol handle
+ * @param [in] buf 	The audio data
+ * @param [in] len 	The data length
+ * @return len on success, -1 otherwise
+ */
+int protocol_send_audio(protocol_handle_t p, const void *buf, int len)
+{
+	if (p->audio) {
+		return p->audio->write(p->audio, buf, len);
+	}
+	
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+	if (protocol_send_frame(p, PROTOCOL_TYPE_AUDIO, p->tx_codec, buf, len) < 0) {
+		return -1;
+	}
+	return len;
+#else
+	return p->stream->write(p->stream, buf, len);
+#endif
+}
+
+/**
+ * @brief Stand in for recorded audio which was left out as silence
+ * @param [in] p 			The protocol handle
+ * @param [in] duration_ms 	The length of the silence left out
+ * @param [in] level_db 	The background level in dBFS, at most 0
+ * @return 0 on success, -1 otherwise
+ */
+int protocol_send_silence(protocol_handle_t p, uint16_t duration_ms, int level_db)
+{
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+	uint8_t sid[3];
+	
+	/* datagrams have no room to tell a descriptor from audio */
+	if (p->audio) {
+		return -1;
+	}
+	
+	protocol_put_u16(sid, duration_ms);
+	sid[2] = level_db > 0 ? 0 : (level_db < -127 ? 127 : -level_db);
+	
+	return protocol_send_frame(p, PROTOCOL_TYPE_AUDIO, PROTOCOL_CODEC_SILENCE, sid, sizeof(sid)) < 0 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * @brief Push out any buffered data
+ * @param [in] p The protocol handle
+ * @return 0 on success, -1 otherwise
+ */
+int protocol_flush(protocol_handle_t p)
+{
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+	if (p->audio && udp_stream_finish(p->audio) < 0) {
+		return -1;
+	}
+#endif
+	return p->stream->flush(p->stream);
+}
+
+/**
+ * @brief Read reply audio, dispatching any events in between
+ * @param [in]  p 	The protocol handle
+ * @param [out] buf The audio buffer
+ * @param [in]  len The buffer size
+ * @return number of bytes read, 0 at the end of the reply, -1 on error
+ *         (errno is EAGAIN if the stream timed out)
+ */
+int protocol_read_audio(protocol_handle_t p, void *buf, int len)
+{
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+	int ret;
+	
+	if (p->audio) {
+		if (protocol_poll_events(p) != ESP_OK) {
+			return -1;
+		}
+		
+		ret = p->audio->read(p->audio, buf, len);
+		/* the end datagram may be lost, the event on the connection is not */
+		if (ret < 0 && errno == EAGAIN && p->audio_end) {
+			return 0;
+		}
+		return ret;
+	}
+	
+	if (p->audio_end) {
+		return 0;
+	}
+	return protocol_receive(p, buf, len, false);
+#else
+	return p->stream->read(p->stream, buf, len);
+#endif
+}
+
+/**
+ * @brief Dispatch server events which already arrived, without blocking
+ * @param [in] p The protocol handle
+ * @return ESP_OK on success, ESP_FAIL if the connection failed
+ */
+esp_err_t protocol_poll_events(protocol_handle_t p)
+{
+#ifdef CONFIG_BACKEND_PROTOCOL_FRAMED
+	if (protocol_receive(p, NULL, 0, true) < 0 && errno != EAGAIN) {
+		return ESP_FAIL;
+	}
+#endif
+	return ESP_OK;
+}
@@ -0,0 +1,241 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include "tcp_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Version carried in every frame header
+ */
+#define PROTOCOL_VERSION				(1)
+
+/**
+ * Size of a frame header on the wire
+ *
+ * | version (1) | type (1) | sub (2) | length (4) | timestamp (4) |
+ *
+ * Multi-byte fields are in network byte order, length counts the payload
+ * following the header and timestamp is in milliseconds since the turn
+ * started.
+ */
+#define PROTOCOL_HEADER_SIZE			(12)
+
+/**
+ * Largest payload accepted for non-audio frames
+ */
+#define PROTOCOL_MAX_EVENT_SIZE			(64)
+
+/**
+ * @brief Frame types
+ */
+typedef enum {
+	PROTOCOL_TYPE_HELLO = 1,	/*!< Client identification, payload is the MAC address string, sub the reply codec wanted or 0 for MP3 */
+	PROTOCOL_TYPE_AUDIO,		/*!< Audio data, sub is the codec */
+	PROTOCOL_TYPE_CONTROL,		/*!< Client to server control, sub is a protocol_control_t */
+	PROTOCOL_TYPE_EVENT,		/*!< Server to client event, sub is a protocol_event_t */
+} protocol_type_t;
+
+/**
+ * @brief Audio codecs
+ */
+typedef enum {
+	PROTOCOL_CODEC_PCM = 0,		/*!< 16 bit mono PCM */
+	PROTOCOL_CODEC_MP3,			/*!< MP3 stream */
+	PROTOCOL_CODEC_OPUS,		/*!< Mono Opus, one packet per frame or datagram */
+	PROTOCOL_CODEC_ADPCM,		/*!< Mono IMA-ADPCM blocks as laid out by adpcm_encode_block */
+	PROTOCOL_CODEC_SILENCE,		/*!< Silence descriptor in place of dropped audio, see protocol_send_silence */
+} protocol_codec_t;
+
+/**
+ * @brief Client to server control messages
+ */
+typedef enum {
+	PROTOCOL_CONTROL_REC = 1,	/*!< A turn starts, audio follows */
+	PROTOCOL_CONTROL_END,		/*!< The turn result was received */
+	PROTOCOL_CONTROL_BREAK,		/*!< The user cancelled the turn */
+	PROTOCOL_CONTROL_UDP,		/*!< Audio moves to UDP, payload is the 4 byte session id and the 2 byte upload codec */
+	PROTOCOL_CONTROL_EOS,		/*!< The client detected the end of speech, no more audio follows this turn */
+} protocol_control_t;
+
+/**
+ * @brief Server to client events
+ */
+typedef enum {
+	PROTOCOL_EVENT_STT_END = 1,	/*!< End of speech detected, stop recording */
+	PROTOCOL_EVENT_CHAT,		/*!< Turn result, payload byte 0 is non-zero to continue chatting */
+	PROTOCOL_EVENT_AUDIO_END,	/*!< The reply audio is complete */
+} protocol_event_t;
+
+typedef struct protocol *protocol_handle_t;
+
+/**
+ * @brief Called for every server event except PROTOCOL_EVENT_AUDIO_END
+ * @param [in] p 		The protocol handle
+ * @param [in] event 	The event, one of protocol_event_t
+ * @param [in] data 	The event payload
+ * @param [in] len 		The payload length
+ * @param [in] arg 		The user argument given to protocol_set_event_handler
+ */
+typedef void (*protocol_event_cb_t)(protocol_handle_t p, int event, const uint8_t *data, int len, void *arg);
+
+/**
+ * @brief Create a protocol instance on top of a TCP stream
+ * @param [in] stream The TCP stream handle
+ * @return protocol handle on success, NULL otherwise
+ */
+protocol_handle_t protocol_create(tcp_stream_handle_t stream);
+
+/**
+ * @brief Destroy a protocol instance
+ * @param [in] p The protocol handle
+ */
+void protocol_destroy(protocol_handle_t p);
+
+/**
+ * @brief Set the server event handler
+ * @param [in] p 	The protocol handle
+ * @param [in] cb 	The event handler
+ * @param [in] arg 	The user argument passed to cb
+ */
+void protocol_set_event_handler(protocol_handle_t p, protocol_event_cb_t cb, void *arg);
+
+/**
+ * @brief Identify the client on a freshly opened connection
+ *
+ * Also resets the receive state left over from a previous connection.
+ *
+ * @param [in] p 		The protocol handle
+ * @param [in] macaddr 	The MAC address string
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t protocol_send_hello(protocol_handle_t p, const char *macaddr);
+
+/**
+ * @brief Send a control message and flush it out
+ * @param [in] p 		The protocol handle
+ * @param [in] control 	The control message, one of protocol_control_t
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t protocol_send_control(protocol_handle_t p, protocol_control_t control);
+
+/**
+ * @brief Set the codec of the recorded audio passed to protocol_send_audio
+ *
+ * Each block sent must then be one complete packet of that codec, unless
+ * it is PROTOCOL_CODEC_PCM. Over UDP a block never spans datagrams.
+ *
+ * @param [in] p 		The protocol handle
+ * @param [in] codec 	The upload codec, PROTOCOL_CODEC_PCM by default
+ */
+void protocol_set_audio_codec(protocol_handle_t p, protocol_codec_t codec);
+
+/**
+ * @brief Set the codec the server should send reply audio in
+ *
+ * Requested with protocol_send_hello, so it applies from the next
+ * connection on.
+ *
+ * @param [in] p 		The protocol handle
+ * @param [in] codec 	The reply codec, PROTOCOL_CODEC_MP3 by default
+ */
+void protocol_set_reply_codec(protocol_handle_t p, protocol_codec_t codec);
+
+/**
+ * @brief Move the audio of this connection to a UDP stream
+ *
+ * Opens the UDP stream to the given server and announces its session id
+ * with PROTOCOL_CONTROL_UDP, after which recorded audio is sent and reply
+ * audio is received as datagrams. Control messages and events stay on the
+ * TCP stream. Call it after protocol_send_hello on every new connection.
+ *
+ * @param [in] p 		The protocol handle
+ * @param [in] audio 	The UDP stream handle
+ * @param [in] hostname The server hostname
+ * @param [in] port 	The server UDP port
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t protocol_open_audio(protocol_handle_t p, tcp_stream_handle_t audio, char *hostname, int port);
+
+/**
+ * @brief Send a block of recorded audio
+ * @param [in] p 	The protocol handle
+ * @param [in] buf 	The audio data
+ * @param [in] len 	The data length
+ * @return len on success, -1 otherwise
+ */
+int protocol_send_audio(protocol_handle_t p, const void *buf, int len);
+
+/**
+ * @brief Stand in for recorded audio which was left out as silence
+ *
+ * Sent as an audio frame with sub PROTOCOL_CODEC_SILENCE, whose 3 byte
+ * payload is the 2 byte duration in milliseconds and the 1 byte level of
+ * the background in -dBFS, for the server to fill the gap with comfort
+ * noise or to skip it. Only the framed protocol over TCP carries it.
+ *
+ * @param [in] p 			The protocol handle
+ * @param [in] duration_ms 	The length of the silence left out
+ * @param [in] level_db 	The background level in dBFS, at most 0
+ * @return 0 on success, -1 otherwise
+ */
+int protocol_send_silence(protocol_handle_t p, uint16_t duration_ms, int level_db);
+
+/**
+ * @brief Push out any buffered data
+ * @param [in] p The protocol handle
+ * @return 0 on success, -1 otherwise
+ */
+int protocol_flush(protocol_handle_t p);
+
+/**
+ * @brief Read reply audio, dispatching any events in between
+ * @param [in]  p 	The protocol handle
+ * @param [out] buf The audio buffer
+ * @param [in]  len The buffer size
+ * @return number of bytes read, 0 at the end of the reply, -1 on error
+ *         (errno is EAGAIN if the stream timed out)
+ */
+int protocol_read_audio(protocol_handle_t p, void *buf, int len);
+
+/**
+ * @brief Dispatch server events which already arrived, without blocking
+ *
+ * Stops at the first audio frame, which is left for protocol_read_audio.
+ *
+ * @param [in] p The protocol handle
+ * @return ESP_OK on success, ESP_FAIL if the connection failed
+ */
+esp_err_t protocol_poll_events(protocol_handle_t p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PROTOCOL_H_ */
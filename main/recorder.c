@@ -32,18 +32,55 @@
 #include "lwip/err.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
 #include "audio_element.h"
+#include "audio_pipeline.h"
 #include "audio_common.h"
 #include "i2s_stream.h"
 #include "board.h"
 
 #include "mubby.h"
 #include "recorder.h"
+#include "opus_enc.h"
+#include "adpcm_codec.h"
+#include "capture_ring.h"
+#include "pcm_dsp.h"
+#include "endpoint.h"
+#include "dtx.h"
 
 #define RECORDER_TASK_SIZE			4096
 #define RECORDER_TASK_PRIORITY		5
 
+/* how often server events are checked for while recording */
+#define RECORDER_EVENT_POLL_MS		20
+
+/* largest record kept in the capture ring, encoded packets are smaller */
+#define RECORDER_RECORD_MAX			2048
+
+/* 16 bit mono PCM as it leaves the converter */
+#define RECORDER_PCM_BITRATE		(RECORDER_SAMPLE_RATE * 16)
+/* 4 bits per sample, the block headers aside */
+#define RECORDER_ADPCM_BITRATE		(RECORDER_SAMPLE_RATE * 4)
+
+#if defined(CONFIG_RECORDER_CODEC_OPUS) || defined(CONFIG_RECORDER_CODEC_ADPCM)
+/* an encoder element sits between the converter and the upload */
+#define RECORDER_ENCODER
+#endif
+
+#if defined(CONFIG_RECORDER_ENDPOINT) || defined(CONFIG_RECORDER_DTX)
+/* the converter output is told apart into speech and silence */
+#define RECORDER_CLASSIFY
+#endif
+
+/* ring record flag, the audio was captured well away from any speech */
+#define RECORDER_RECORD_SILENT		(1 << 0)
+
+/* a long silence is described at least this often */
+#define RECORDER_DTX_MAX_MS			1000
+/* silence held back and sent ahead of speech, which is only told apart a frame or two late */
+#define RECORDER_DTX_LEAD_MS		100
+
 static const char *TAG = "RECORDER";
 
 struct audio_recorder {
@@ -52,16 +89,140 @@ struct audio_recorder {
 	audio_event_iface_handle_t 		external_event;
 	audio_event_iface_handle_t 		internal_event;
 	audio_element_handle_t 			i2s_stream_reader;
-	tcp_stream_handle_t				stream;
+	audio_element_handle_t 			dsp;
+#ifdef RECORDER_ENCODER
+	audio_element_handle_t 			encoder;
+#endif
+	audio_pipeline_handle_t 		pipeline;
+	/* the element whose output goes to the server */
+	audio_element_handle_t 			sink;
+	protocol_handle_t				proto;
+	/* captured audio waiting for the upload, always fed */
+	capture_ring_handle_t			ring;
+	uint8_t							*record;
+	/* set from recorder_hold until the turn is over, trims the ring otherwise */
+	volatile bool					held;
+	/* audio captured before this is never uploaded */
+	volatile uint32_t				discarded_at;
+	pcm_dsp_stats_t					dsp_base;
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	opus_enc_stats_t				enc_base;
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	adpcm_codec_stats_t				enc_base;
+#endif
+#ifdef RECORDER_CLASSIFY
+	endpoint_handle_t				ep;
+#endif
+#ifdef CONFIG_RECORDER_ENDPOINT
+	/* set by recorder_start, the converter task resets the endpointer */
+	volatile bool					ep_reset;
+	volatile bool					ep_armed;
+	/* how the current turn ended on the device and when, ENDPOINT_NONE until then */
+	volatile endpoint_event_t		ep_event;
+	volatile uint32_t				endpoint_at;
+#endif
+	/* recorder_set_monitor, called after the recorder's own classification */
+	pcm_dsp_monitor_cb_t volatile	tap;
+	void * volatile					tap_ctx;
+#ifdef CONFIG_RECORDER_DTX
+	/* set by the converter task, what is written to the ring now is silence */
+	volatile bool					silent;
+	/* silence left out of the upload */
+	dtx_t							dtx;
+#endif
+	uint32_t						bitrate;
+	uint32_t						bytes_sent;
+	uint32_t						first_ts;
+	uint32_t						last_ts;
+	uint32_t						backlog_ms;
 	bool							is_running;
 };
 
+static inline uint32_t recorder_now_ms(void)
+{
+	return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
 static int recorder_write_cb(audio_element_handle_t el, char *buf, int len, TickType_t wait_time, void *ctx)
 {
-	tcp_stream_handle_t stream = (tcp_stream_handle_t)ctx;
-	int write_len = stream->write(stream, buf, len);
-	return write_len;
+	audio_recorder_handle_t ar = (audio_recorder_handle_t)ctx;
+	uint32_t now = recorder_now_ms();
+	uint16_t flags = 0;
+	int left = len, chunk;
+	
+#ifdef CONFIG_RECORDER_DTX
+	if (ar->silent) {
+		flags |= RECORDER_RECORD_SILENT;
+	}
+#endif
+	
+	/*
+	 * Packets always fit a record, raw PCM may be split anywhere. When the
+	 * ring is full the block is dropped rather than waited for, the I2S
+	 * DMA must keep going whatever the network does.
+	 */
+	while (left > 0) {
+		chunk = left < RECORDER_RECORD_MAX ? left : RECORDER_RECORD_MAX;
+		capture_ring_write(ar->ring, buf, chunk, now, flags);
+		buf += chunk;
+		left -= chunk;
+	}
+	
+	return len;
+}
+
+/* runs in the converter task with every block of 8 kHz mono audio */
+static void recorder_monitor_cb(const int16_t *pcm, int samples, void *ctx)
+{
+	audio_recorder_handle_t ar = (audio_recorder_handle_t)ctx;
+	pcm_dsp_monitor_cb_t tap = ar->tap;
+	
+#ifdef CONFIG_RECORDER_ENDPOINT
+	/* read first, recorder_start requests the reset before it arms */
+	bool armed = ar->ep_armed;
+	endpoint_event_t event;
+	
+	if (ar->ep_reset) {
+		endpoint_reset(ar->ep);
+		ar->ep_reset = false;
+	}
+	
+	/* fed between turns as well, which keeps the noise floor current */
+	event = endpoint_feed(ar->ep, pcm, samples);
+	if (armed && (event == ENDPOINT_SPEECH_END || event == ENDPOINT_NO_SPEECH)) {
+		ar->endpoint_at = recorder_now_ms();
+		ar->ep_event = event;
+		ar->ep_armed = false;
+	}
+#elif defined(RECORDER_CLASSIFY)
+	endpoint_feed(ar->ep, pcm, samples);
+#endif
+	
+#ifdef CONFIG_RECORDER_DTX
+	ar->silent = endpoint_silence_ms(ar->ep) >= CONFIG_RECORDER_DTX_HANGOVER_MS;
+#endif
+	
+	if (tap) {
+		tap(pcm, samples, ar->tap_ctx);
+	}
+}
+
+#ifdef CONFIG_RECORDER_ENDPOINT
+
+static void recorder_log_endpoint(audio_recorder_handle_t ar)
+{
+	endpoint_stats_t stats;
+	
+	endpoint_get_stats(ar->ep, &stats);
+	if (ar->ep_event == ENDPOINT_NO_SPEECH) {
+		ESP_LOGW(TAG, "Nothing said for %d ms, noise floor %d dBFS",
+				 CONFIG_RECORDER_ENDPOINT_NO_SPEECH_MS, stats.noise_db);
+	} else {
+		ESP_LOGI(TAG, "End of speech after %u ms of speech, noise floor %d dBFS, uploaded %u ms later",
+				 stats.speech_ms, stats.noise_db, recorder_now_ms() - ar->endpoint_at);
+	}
 }
+#endif
 
 static esp_err_t recorder_notify_sync(audio_recorder_handle_t ar, int state)
 {
@@ -73,49 +234,264 @@ static esp_err_t recorder_notify_sync(audio_recorder_handle_t ar, int state)
 	return audio_event_iface_sendout(ar->external_event, &msg);
 }
 
-static void recorder_task(void *pvParameters)
+static void recorder_log_stats(audio_recorder_handle_t ar)
 {
-	audio_recorder_handle_t ar = (audio_recorder_handle_t)pvParameters;
+	uint32_t audio_ms = ar->last_ts - ar->first_ts;
+	capture_ring_stats_t ring;
 	
-	audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
-	audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+	if (ar->bytes_sent == 0 || audio_ms == 0) {
+		return;
+	}
 	
-	audio_event_iface_set_listener(ar->internal_event, evt);
-    
-	audio_element_run(ar->i2s_stream_reader);
-	audio_element_resume(ar->i2s_stream_reader, 0, 0);
+	capture_ring_get_stats(ar->ring, &ring);
+	ESP_LOGI(TAG, "Utterance: %u ms, %u bytes on air (%u bit/s), %u ms of it held before the upload",
+			 audio_ms, ar->bytes_sent, (uint32_t)((uint64_t)ar->bytes_sent * 8000 / audio_ms), ar->backlog_ms);
+	ESP_LOGI(TAG, "Capture ring: %u of %u bytes at most, %u overruns (%u bytes) since boot",
+			 ring.high_water, ring.size, ring.overruns, ring.overrun_bytes);
+	
+	pcm_dsp_stats_t dsp;
+	
+	pcm_dsp_get_stats(ar->dsp, &dsp);
+	if (dsp.frames_out != ar->dsp_base.frames_out) {
+		/* conversion time per second of audio, in tenths of a percent */
+		uint32_t dsp_load = (uint32_t)((dsp.dsp_us - ar->dsp_base.dsp_us) * RECORDER_SAMPLE_RATE / 1000
+									   / (dsp.frames_out - ar->dsp_base.frames_out));
+		
+		ESP_LOGI(TAG, "Converter: %d taps, %u.%u%% CPU", dsp.taps, dsp_load / 10, dsp_load % 10);
+	}
+	
+#ifdef CONFIG_RECORDER_DTX
+	ESP_LOGI(TAG, "Silence: %u ms left out in %u descriptors, %u bytes saved (%u%% of the audio)",
+			 ar->dtx.ms, ar->dtx.descriptors, ar->dtx.bytes,
+			 (uint32_t)((uint64_t)ar->dtx.bytes * 100 / (ar->dtx.bytes + ar->bytes_sent)));
+#endif
+	
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	opus_enc_stats_t stats;
+	
+	opus_enc_get_stats(ar->encoder, &stats);
+	audio_ms = stats.audio_ms - ar->enc_base.audio_ms;
+	if (audio_ms == 0) {
+		return;
+	}
+	
+	/* encode time per second of audio, in tenths of a percent */
+	uint32_t load = (uint32_t)((stats.encode_us - ar->enc_base.encode_us) / audio_ms);
+	
+	ESP_LOGI(TAG, "Encoder: %u frames, %u.%u%% CPU, %u ms latency + %u us worst encode",
+			 stats.frames - ar->enc_base.frames, load / 10, load % 10, stats.latency_ms, stats.max_encode_us);
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	adpcm_codec_stats_t stats;
+	
+	adpcm_codec_get_stats(ar->encoder, &stats);
+	uint32_t samples = stats.samples - ar->enc_base.samples;
+	if (samples == 0) {
+		return;
+	}
+	
+	uint32_t load = (uint32_t)((stats.codec_us - ar->enc_base.codec_us) * RECORDER_SAMPLE_RATE / 1000 / samples);
+	
+	ESP_LOGI(TAG, "Encoder: %u blocks, %u.%u%% CPU",
+			 stats.blocks - ar->enc_base.blocks, load / 10, load % 10);
+#endif
+}
+
+#ifdef CONFIG_RECORDER_DTX
+/* samples of audio in a record, as the sink writes them */
+static uint32_t recorder_record_samples(int len)
+{
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	return RECORDER_SAMPLE_RATE * CONFIG_RECORDER_OPUS_FRAME_MS / 1000;
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	return ADPCM_BLOCK_SAMPLES(len);
+#else
+	return len / sizeof(int16_t);
+#endif
+}
+
+/* describes ms of silence left out, if there are any */
+static int recorder_send_silence(audio_recorder_handle_t ar, uint32_t ms)
+{
+	endpoint_stats_t stats;
+	
+	if (ms == 0) {
+		return 0;
+	}
+	
+	endpoint_get_stats(ar->ep, &stats);
+	return protocol_send_silence(ar->proto, ms, stats.noise_db);
+}
+#endif
+
+/* sends a record taken from the ring, or leaves it out as silence */
+static int recorder_send_record(audio_recorder_handle_t ar, int len, uint16_t flags)
+{
+#ifdef CONFIG_RECORDER_DTX
+	const void *lead;
+	int lead_len;
+	
+	if (flags & RECORDER_RECORD_SILENT) {
+		return recorder_send_silence(ar, dtx_skip(&ar->dtx, ar->record, recorder_record_samples(len), len));
+	}
+	
+	if (recorder_send_silence(ar, dtx_take(&ar->dtx)) < 0) {
+		return -1;
+	}
+	
+	/* the onset of speech is in the lead-in */
+	while ((lead = dtx_lead_peek(&ar->dtx, &lead_len))) {
+		if (protocol_send_audio(ar->proto, lead, lead_len) < 0) {
+			return -1;
+		}
+		ar->bytes_sent += lead_len;
+		dtx_lead_pop(&ar->dtx);
+	}
+#endif
+	
+	if (protocol_send_audio(ar->proto, ar->record, len) < 0) {
+		return -1;
+	}
+	ar->bytes_sent += len;
+	
+	return len;
+}
+
+/* must only be called by the recorder task, the reader of the ring */
+static void recorder_trim(audio_recorder_handle_t ar)
+{
+	uint32_t oldest = ar->discarded_at;
+	uint32_t preroll = recorder_now_ms() - CONFIG_RECORDER_PREROLL_MS;
+	
+	/* outside a turn only the pre-roll is kept */
+	if (!ar->held && (int32_t)(preroll - oldest) > 0) {
+		oldest = preroll;
+	}
+	
+	capture_ring_trim(ar->ring, oldest);
+}
+
+static void recorder_upload(audio_recorder_handle_t ar, audio_event_iface_handle_t evt)
+{
+	audio_event_iface_msg_t msg;
+	uint32_t ts, last_poll = 0;
+	uint16_t flags;
+	bool first = true;
+	bool lost = false;
+#ifdef CONFIG_RECORDER_ENDPOINT
+	bool endpointed = false;
+#endif
+	int len;
+	
+	/* a stop which came in too late for the previous turn */
+	while (audio_event_iface_listen(evt, &msg, 0) == ESP_OK);
+	
+	ar->bytes_sent = 0;
+	ar->first_ts = 0;
+	ar->last_ts = 0;
+#ifdef CONFIG_RECORDER_DTX
+	dtx_init(&ar->dtx, RECORDER_SAMPLE_RATE, RECORDER_DTX_MAX_MS, RECORDER_DTX_LEAD_MS);
+#endif
 	
 	/* notify the main task recorder is starting now */
 	recorder_notify_sync(ar, RECORDER_STATE_STARTED);
 	ar->is_running = true;
 	
 	for (;;) {
-		audio_event_iface_msg_t msg = {0};
-		
-		esp_err_t ret = audio_event_iface_listen(evt, &msg, portMAX_DELAY);
-		if (ret != ESP_OK) {
-			ESP_LOGE(TAG, "[ * ] Event interface error : %d", ret);
-			continue;
-		}
-		
 		/* recorder received the stop instruction from the external */
-		if (msg.source_type == MUBBY_ID_CORE) {
+		if (audio_event_iface_listen(evt, &msg, 0) == ESP_OK && msg.source_type == MUBBY_ID_CORE) {
 			if (!strncmp((char *)msg.data, "stop", 4)) {
 				ESP_LOGW(TAG, "[ * ] Interrupted externally");
 				break;
 			}
 		}
+		
+		/* the pre-roll and whatever came in while connecting go out back to back */
+		len = capture_ring_read(ar->ring, ar->record, RECORDER_RECORD_MAX, &ts, &flags, RECORDER_EVENT_POLL_MS);
+#ifdef CONFIG_RECORDER_ENDPOINT
+		/* everything captured up to the end of speech still goes out */
+		if (ar->ep_event != ENDPOINT_NONE && (len <= 0 || (int32_t)(ts - ar->endpoint_at) > 0)) {
+			endpointed = true;
+			break;
+		}
+#endif
+		if (len > 0) {
+			if (first) {
+				first = false;
+				ar->first_ts = ts;
+				ar->backlog_ms = recorder_now_ms() - ts;
+			}
+			ar->last_ts = ts;
+			
+			if (recorder_send_record(ar, len, flags) < 0) {
+				ESP_LOGE(TAG, "[ * ] Connection lost");
+				lost = true;
+				break;
+			}
+		}
+		
+		/* see whether the server has something to say */
+		if (recorder_now_ms() - last_poll >= RECORDER_EVENT_POLL_MS) {
+			last_poll = recorder_now_ms();
+			if (protocol_poll_events(ar->proto) != ESP_OK) {
+				ESP_LOGE(TAG, "[ * ] Connection lost");
+				lost = true;
+				break;
+			}
+		}
 	}
 	
 	ar->is_running = false;
 	
-	audio_event_iface_remove_listener(evt, ar->internal_event);
-	audio_element_terminate(ar->i2s_stream_reader);
-	audio_event_iface_destroy(evt);
+	/* nothing more goes out on a dead connection */
+	if (!lost) {
+#ifdef CONFIG_RECORDER_DTX
+		/* the silence at the end counts too, the server learns where the audio stops */
+		recorder_send_silence(ar, dtx_finish(&ar->dtx));
+#endif
+		
+		/* push out the tail of the recording before anything else is written */
+		protocol_flush(ar->proto);
+	}
+	
+#ifdef CONFIG_RECORDER_ENDPOINT
+	ar->ep_armed = false;
+	if (endpointed) {
+		recorder_log_endpoint(ar);
+		protocol_send_control(ar->proto, PROTOCOL_CONTROL_EOS);
+	}
+#endif
+	
+	recorder_log_stats(ar);
+	
+	/* what is left belongs to this turn, start over with the pre-roll */
+	recorder_discard(ar);
+	recorder_trim(ar);
 
-	recorder_notify_sync(ar, RECORDER_STATE_FINISHED);
+	recorder_notify_sync(ar, lost ? RECORDER_STATE_ERROR : RECORDER_STATE_FINISHED);
+}
+
+/*
+ * The only reader of the capture ring. Sends the audio during a turn and
+ * trims the ring to the pre-roll in between, so socket writes never run
+ * in the capture task.
+ */
+static void recorder_task(void *pvParameters)
+{
+	audio_recorder_handle_t ar = (audio_recorder_handle_t)pvParameters;
+	
+	audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+	audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+	
+	audio_event_iface_set_listener(ar->internal_event, evt);
 	
-	vTaskDelete(NULL);
+	for (;;) {
+		recorder_trim(ar);
+		
+		/* woken up by recorder_start */
+		if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RECORDER_EVENT_POLL_MS)) > 0) {
+			recorder_upload(ar, evt);
+		}
+	}
 }
 
 /**
@@ -140,13 +516,91 @@ audio_recorder_handle_t recorder_create(void)
 	
 	/* Create the I2S reader stream */
 	i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
-	i2s_cfg.i2s_config.sample_rate = 8000;
+	i2s_cfg.i2s_config.sample_rate = CONFIG_AUDIO_I2S_SAMPLE_RATE;
 	i2s_cfg.type = AUDIO_STREAM_READER;
 	ar->i2s_stream_reader = i2s_stream_init(&i2s_cfg);
 	mem_assert(ar->i2s_stream_reader);
 	
+	/* I2S_STREAM_CFG_DEFAULT captures both slots, the converter mixes them down */
+	pcm_dsp_cfg_t dsp_cfg = DEFAULT_PCM_DSP_CONFIG();
+	dsp_cfg.src_rate = CONFIG_AUDIO_I2S_SAMPLE_RATE;
+	dsp_cfg.src_channels = 2;
+	dsp_cfg.dst_rate = RECORDER_SAMPLE_RATE;
+	dsp_cfg.dst_channels = 1;
+	ar->dsp = pcm_dsp_init(&dsp_cfg);
+	mem_assert(ar->dsp);
+	ar->sink = ar->dsp;
+	
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	opus_enc_cfg_t opus_cfg = DEFAULT_OPUS_ENC_CONFIG();
+	opus_cfg.sample_rate = RECORDER_SAMPLE_RATE;
+	opus_cfg.channels = 1;
+	opus_cfg.bitrate = CONFIG_RECORDER_OPUS_BITRATE;
+	opus_cfg.frame_ms = CONFIG_RECORDER_OPUS_FRAME_MS;
+	opus_cfg.complexity = CONFIG_RECORDER_OPUS_COMPLEXITY;
+	ar->encoder = opus_enc_init(&opus_cfg);
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	adpcm_codec_cfg_t adpcm_cfg = DEFAULT_ADPCM_CODEC_CONFIG();
+	adpcm_cfg.sample_rate = RECORDER_SAMPLE_RATE;
+	adpcm_cfg.channels = 1;
+	adpcm_cfg.block_size = CONFIG_ADPCM_BLOCK_SIZE;
+	ar->encoder = adpcm_encoder_init(&adpcm_cfg);
+#endif
+
+	/*
+	 * Create the pipeline and connect the I2S reader stream, converter and encoder
+	 * Pipeline structure: I2S reader --> converter [--> Opus/IMA-ADPCM encoder] --> capture ring
+	 */
+	audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+	ar->pipeline = audio_pipeline_init(&pipeline_cfg);
+	mem_assert(ar->pipeline);
+	
+	audio_pipeline_register(ar->pipeline, ar->i2s_stream_reader, "i2s");
+	audio_pipeline_register(ar->pipeline, ar->dsp, "dsp");
+#ifdef RECORDER_ENCODER
+	mem_assert(ar->encoder);
+	audio_pipeline_register(ar->pipeline, ar->encoder, "enc");
+	audio_pipeline_link(ar->pipeline, (const char *[]){"i2s", "dsp", "enc"}, 3);
+	ar->sink = ar->encoder;
+#else
+	audio_pipeline_link(ar->pipeline, (const char *[]){"i2s", "dsp"}, 2);
+#endif
+	
+#ifdef RECORDER_CLASSIFY
+	endpoint_cfg_t ep_cfg = DEFAULT_ENDPOINT_CONFIG();
+	ep_cfg.sample_rate = RECORDER_SAMPLE_RATE;
+#ifdef CONFIG_RECORDER_ENDPOINT
+	ep_cfg.hangover_ms = CONFIG_RECORDER_ENDPOINT_HANGOVER_MS;
+	ep_cfg.no_speech_ms = CONFIG_RECORDER_ENDPOINT_NO_SPEECH_MS;
+#endif
+#ifndef CONFIG_RECORDER_ENDPOINT_VAD
+	ep_cfg.use_vad = false;
+#endif
+	ar->ep = endpoint_create(&ep_cfg);
+	mem_assert(ar->ep);
+#endif
+	pcm_dsp_set_monitor(ar->dsp, recorder_monitor_cb, ar);
+	
+	ar->ring = capture_ring_create(CONFIG_RECORDER_RING_SIZE);
+	mem_assert(ar->ring);
+	ar->record = malloc(RECORDER_RECORD_MAX);
+	mem_assert(ar->record);
+	
+	ar->bitrate = RECORDER_PCM_BITRATE;
 	ar->is_running = false;
 	
+	/* capture never stops, the ring holds the pre-roll between turns */
+	audio_element_set_write_cb(ar->sink, recorder_write_cb, ar);
+	if (audio_pipeline_run(ar->pipeline) != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to start capturing");
+		return NULL;
+	}
+	
+	if (xTaskCreate(recorder_task, "recorder_task", RECORDER_TASK_SIZE, (void *)ar, RECORDER_TASK_PRIORITY, &ar->task) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create recorder task");
+		return NULL;
+	}
+	
 	return ar;
 }
 
@@ -167,10 +621,32 @@ esp_err_t recorder_destroy(audio_recorder_handle_t ar)
  */
 esp_err_t recorder_start(audio_recorder_handle_t ar)
 {
-	if (xTaskCreate(recorder_task, "recorder_task", RECORDER_TASK_SIZE, (void *)ar, RECORDER_TASK_PRIORITY, &ar->task) != pdPASS) {
-		ESP_LOGE(TAG, "Failed to create recorder task");
-		return ESP_FAIL;
+	recorder_hold(ar);
+	
+#ifdef CONFIG_RECORDER_ENDPOINT
+	ar->ep_event = ENDPOINT_NONE;
+	ar->ep_reset = true;
+	ar->ep_armed = true;
+#endif
+	
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	uint32_t bitrate = ar->bitrate < CONFIG_RECORDER_OPUS_BITRATE ? ar->bitrate : CONFIG_RECORDER_OPUS_BITRATE;
+	
+	opus_enc_set_bitrate(ar->encoder, bitrate);
+	ESP_LOGI(TAG, "Encoding at %u bit/s", bitrate);
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	if (ar->bitrate < RECORDER_ADPCM_BITRATE) {
+		ESP_LOGW(TAG, "Link suits %u kbit/s, IMA-ADPCM needs %u kbit/s",
+				 ar->bitrate / 1000, RECORDER_ADPCM_BITRATE / 1000);
+	}
+#else
+	if (ar->bitrate < RECORDER_PCM_BITRATE) {
+		ESP_LOGW(TAG, "Link suits %u kbit/s, raw PCM needs %u kbit/s",
+				 ar->bitrate / 1000, RECORDER_PCM_BITRATE / 1000);
 	}
+#endif
+	
+	xTaskNotifyGive(ar->task);
 	
 	return ESP_OK;
 }
@@ -206,12 +682,86 @@ esp_err_t recorder_set_event_listener(audio_recorder_handle_t ar, audio_event_if
 }
 
 /**
- * @brief Set a data stream for the recorder
+ * @brief Set the server connection the recorder uploads to
+ * @param [in] ar		The recorder handle
+ * @param [in] proto	The protocol handle
+ */
+esp_err_t recorder_set_protocol(audio_recorder_handle_t ar, protocol_handle_t proto)
+{
+	ar->proto = proto;
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	protocol_set_audio_codec(proto, PROTOCOL_CODEC_OPUS);
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	protocol_set_audio_codec(proto, PROTOCOL_CODEC_ADPCM);
+#endif
+	return ESP_OK;
+}
+
+/**
+ * @brief Set the upload bitrate the recorder should aim for
  * @param [in] ar		The recorder handle
- * @param [in] stream	The TCP stream
+ * @param [in] bitrate	The bitrate in bits per second
+ */
+void recorder_set_bitrate(audio_recorder_handle_t ar, uint32_t bitrate)
+{
+	ar->bitrate = bitrate;
+}
+
+/**
+ * @brief Watch the captured audio as it is recorded
+ * @param [in] ar	The recorder handle
+ * @param [in] cb	The callback, NULL to stop watching
+ * @param [in] ctx	The user argument passed to the callback
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t recorder_set_monitor(audio_recorder_handle_t ar, pcm_dsp_monitor_cb_t cb, void *ctx)
+{
+	/* the converter task loads the callback first, the context must be there by then */
+	ar->tap = NULL;
+	ar->tap_ctx = ctx;
+	ar->tap = cb;
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Watch the audio as it is captured, before it is downsampled
+ * @param [in] ar	The recorder handle
+ * @param [in] cb	The callback, NULL to stop watching
+ * @param [in] ctx	The user argument passed to the callback
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t recorder_set_capture_monitor(audio_recorder_handle_t ar, pcm_dsp_monitor_cb_t cb, void *ctx)
+{
+	return pcm_dsp_set_input_monitor(ar->dsp, cb, ctx);
+}
+
+/**
+ * @brief Keep the audio captured from now on, and the pre-roll before it
+ * @param [in] ar The recorder handle
+ */
+void recorder_hold(audio_recorder_handle_t ar)
+{
+	if (ar->held) {
+		return;
+	}
+	
+	pcm_dsp_get_stats(ar->dsp, &ar->dsp_base);
+#ifdef CONFIG_RECORDER_CODEC_OPUS
+	opus_enc_get_stats(ar->encoder, &ar->enc_base);
+#elif defined(CONFIG_RECORDER_CODEC_ADPCM)
+	adpcm_codec_get_stats(ar->encoder, &ar->enc_base);
+#endif
+	ar->held = true;
+}
+
+/**
+ * @brief Drop the audio captured so far and only keep a pre-roll again
+ * @param [in] ar The recorder handle
  */
-esp_err_t recorder_set_tcp_stream(audio_recorder_handle_t ar, tcp_stream_handle_t stream)
+void recorder_discard(audio_recorder_handle_t ar)
 {
-	ar->stream = stream;
-	return audio_element_set_write_cb(ar->i2s_stream_reader, recorder_write_cb, ar->stream);
+	/* the recorder task trims the ring, it is the only one allowed to */
+	ar->discarded_at = recorder_now_ms();
+	ar->held = false;
 }
@@ -25,7 +25,8 @@
 #ifndef _RECORDER_H_
 #define _RECORDER_H_
 
-#include "tcp_stream.h"
+#include "protocol.h"
+#include "pcm_dsp.h"
 #include "audio_event_iface.h"
 
 #ifdef __cplusplus
@@ -37,11 +38,18 @@ extern "C" {
 #define RECORDER_STATE_ABORTED	(2)
 #define RECORDER_STATE_ERROR	(3)
 
+/* the rate of the uploaded audio and of what recorder_set_monitor sees */
+#define RECORDER_SAMPLE_RATE	(8000)
+
 typedef struct audio_recorder *audio_recorder_handle_t;
 
 
 /**
  * @brief Create a recorder
+ *
+ * Capturing starts right away and never stops. Between turns only the
+ * last CONFIG_RECORDER_PREROLL_MS of audio are kept.
+ *
  * @return recorder handle on success, NULL otherwise
  */
 audio_recorder_handle_t recorder_create(void);
@@ -56,7 +64,11 @@ esp_err_t recorder_destroy(audio_recorder_handle_t ar);
 
 
 /**
- * @brief Start the recorder
+ * @brief Start uploading
+ *
+ * Whatever was held since recorder_hold, pre-roll included, goes out first
+ * as fast as the connection allows, then the live audio follows.
+ *
  * @param [in] ar The recorder handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
@@ -81,11 +93,76 @@ esp_err_t recorder_set_event_listener(audio_recorder_handle_t ar, audio_event_if
 
 
 /**
- * @brief Set a data stream for the recorder
+ * @brief Set the server connection the recorder uploads to
+ * @param [in] ar		The recorder handle
+ * @param [in] proto	The protocol handle
+ */
+esp_err_t recorder_set_protocol(audio_recorder_handle_t ar, protocol_handle_t proto);
+
+
+/**
+ * @brief Set the upload bitrate the recorder should aim for
+ *
+ * Takes effect at the next recorder_start. With CONFIG_RECORDER_CODEC_OPUS
+ * the encoder runs at this bitrate or CONFIG_RECORDER_OPUS_BITRATE,
+ * whichever is lower. Raw PCM is always sent at 128 kbit/s.
+ *
  * @param [in] ar		The recorder handle
- * @param [in] stream	The TCP stream
+ * @param [in] bitrate	The bitrate in bits per second
+ */
+void recorder_set_bitrate(audio_recorder_handle_t ar, uint32_t bitrate);
+
+
+/**
+ * @brief Watch the captured audio as it is recorded
+ *
+ * The callback gets every block of RECORDER_SAMPLE_RATE mono audio, in
+ * turns and between them, from the task which converts it. It must not
+ * block, the capture would fall behind.
+ *
+ * @param [in] ar	The recorder handle
+ * @param [in] cb	The callback, NULL to stop watching
+ * @param [in] ctx	The user argument passed to the callback
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t recorder_set_monitor(audio_recorder_handle_t ar, pcm_dsp_monitor_cb_t cb, void *ctx);
+
+
+/**
+ * @brief Watch the audio as it is captured, before it is downsampled
+ *
+ * Like recorder_set_monitor, but the callback gets the microphone mixed
+ * down to mono at CONFIG_AUDIO_I2S_SAMPLE_RATE, for listeners which need
+ * more than the 4 kHz of bandwidth the upload keeps.
+ *
+ * @param [in] ar	The recorder handle
+ * @param [in] cb	The callback, NULL to stop watching
+ * @param [in] ctx	The user argument passed to the callback
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t recorder_set_capture_monitor(audio_recorder_handle_t ar, pcm_dsp_monitor_cb_t cb, void *ctx);
+
+
+/**
+ * @brief Keep the audio captured from now on, and the pre-roll before it
+ *
+ * Call it as soon as a turn is wanted, so that nothing said while the
+ * connection is being set up is lost.
+ *
+ * @param [in] ar The recorder handle
+ */
+void recorder_hold(audio_recorder_handle_t ar);
+
+
+/**
+ * @brief Drop the audio captured so far and only keep a pre-roll again
+ *
+ * Done by the recorder itself when an upload ends. Call it when a turn is
+ * given up before recorder_start.
+ *
+ * @param [in] ar The recorder handle
  */
-esp_err_t recorder_set_tcp_stream(audio_recorder_handle_t ar, tcp_stream_handle_t stream);
+void recorder_discard(audio_recorder_handle_t ar);
 
 #ifdef __cplusplus
 }
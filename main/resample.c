@@ -0,0 +1,313 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#include "resample.h"
+
+#define RESAMPLE_MAX_RATE		48000
+#define RESAMPLE_MAX_TAPS		128
+
+/* zero crossings of the sinc on either side of the centre tap */
+#define RESAMPLE_ZERO_CROSSINGS	8
+
+/* the cutoff as a fraction of the lower Nyquist frequency */
+#define RESAMPLE_BANDWIDTH		0.9
+
+/*
+ * The cutoff in cycles per input sample and the filter length, rounded
+ * up to a multiple of 4 for the unrolled dot product. Shared with the
+ * reference, so both evaluate the same filter.
+ */
+static int resample_design(int in_rate, int out_rate, double *fc)
+{
+	int low = in_rate < out_rate ? in_rate : out_rate;
+	int taps;
+	
+	*fc = 0.5 * RESAMPLE_BANDWIDTH * low / in_rate;
+	taps = (int)ceil(RESAMPLE_ZERO_CROSSINGS / *fc);
+	taps = (taps + 3) & ~3;
+	
+	return taps > RESAMPLE_MAX_TAPS ? RESAMPLE_MAX_TAPS : taps;
+}
+
+/*
+ * Blackman windowed sinc, tau is the distance from the output instant
+ * in input samples
+ */
+static double resample_filter(double tau, double fc, int taps)
+{
+	double half = taps / 2.0;
+	double x, w;
+	
+	if (tau <= -half || tau >= half) {
+		return 0.0;
+	}
+	
+	w = 0.42 + 0.5 * cos(M_PI * tau / half) + 0.08 * cos(2.0 * M_PI * tau / half);
+	x = 2.0 * fc * tau;
+	
+	return x == 0.0 ? 2.0 * fc * w : 2.0 * fc * sin(M_PI * x) / (M_PI * x) * w;
+}
+
+static inline int16_t resample_clamp(int32_t v)
+{
+	if (v > INT16_MAX) {
+		return INT16_MAX;
+	} else if (v < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return v;
+}
+
+/**
+ * @brief Set up a converter and design its anti-aliasing filter
+ *
+ * Any pair of rates up to 48 kHz works, e.g. 8, 16, 44.1 and 48 kHz.
+ * Equal rates make the converter a plain copy.
+ *
+ * @param [out] rs 			The converter
+ * @param [in]  in_rate 	The input sample rate
+ * @param [in]  out_rate 	The output sample rate
+ * @return 0 on success, -1 otherwise
+ */
+int resample_init(resample_t *rs, int in_rate, int out_rate)
+{
+	double fc;
+	
+	memset(rs, 0, sizeof(resample_t));
+	
+	if (in_rate <= 0 || out_rate <= 0 || in_rate > RESAMPLE_MAX_RATE || out_rate > RESAMPLE_MAX_RATE) {
+		return -1;
+	}
+	
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	if (in_rate == out_rate) {
+		return 0;
+	}
+	
+	rs->taps = resample_design(in_rate, out_rate, &fc);
+	rs->step_int = in_rate / out_rate;
+	rs->step_num = in_rate % out_rate;
+	rs->phase_recip = ((uint32_t)RESAMPLE_PHASES << 16) / out_rate;
+	
+	/* one row more than there are phases, rounding up to a whole sample lands on it */
+	rs->coefs = malloc((RESAMPLE_PHASES + 1) * rs->taps * sizeof(int16_t));
+	rs->buf = malloc((rs->taps - 1 + RESAMPLE_MAX_BLOCK) * sizeof(int16_t));
+	if (!rs->coefs || !rs->buf) {
+		resample_deinit(rs);
+		return -1;
+	}
+	
+	for (int p = 0; p <= RESAMPLE_PHASES; p++) {
+		int16_t *row = rs->coefs + p * rs->taps;
+		double centre = rs->taps / 2 - 1 + (double)p / RESAMPLE_PHASES;
+		double h[RESAMPLE_MAX_TAPS], sum = 0.0;
+		int32_t total = 0;
+		int peak = 0;
+		
+		for (int m = 0; m < rs->taps; m++) {
+			h[m] = resample_filter(centre - m, fc, rs->taps);
+			sum += h[m];
+		}
+		
+		/* unity gain at DC for every phase, the rounding error goes to the largest tap */
+		for (int m = 0; m < rs->taps; m++) {
+			row[m] = (int16_t)lrint(h[m] / sum * 32768.0);
+			total += row[m];
+			if (row[m] > row[peak]) {
+				peak = m;
+			}
+		}
+		row[peak] += 32768 - total;
+	}
+	
+	resample_reset(rs);
+	
+	return 0;
+}
+
+/**
+ * @brief Free the memory of a converter
+ * @param [in] rs The converter
+ */
+void resample_deinit(resample_t *rs)
+{
+	free(rs->coefs);
+	free(rs->buf);
+	rs->coefs = NULL;
+	rs->buf = NULL;
+}
+
+/**
+ * @brief Forget the input history, e.g. at the start of a new stream
+ * @param [in] rs The converter
+ */
+void resample_reset(resample_t *rs)
+{
+	if (!rs->taps) {
+		return;
+	}
+	
+	/* silence before the first sample, which is then under the centre tap */
+	rs->buf_len = rs->taps / 2 - 1;
+	memset(rs->buf, 0, rs->buf_len * sizeof(int16_t));
+	rs->idx = 0;
+	rs->num = 0;
+}
+
+/*
+ * Q15 dot product, taps is a multiple of 4. Products are summed in 32 bits:
+ * the coefficients of a phase add up to 1.0, so only a full scale input
+ * against the ringing of the filter can come close to overflowing.
+ */
+static inline int16_t resample_dot(const int16_t *x, const int16_t *c, int taps)
+{
+	int32_t acc = 1 << 14;
+	
+	for (int m = 0; m < taps; m += 4) {
+		acc += x[m] * c[m] + x[m + 1] * c[m + 1] + x[m + 2] * c[m + 2] + x[m + 3] * c[m + 3];
+	}
+	
+	return resample_clamp(acc >> 15);
+}
+
+/**
+ * @brief Convert a block of samples
+ *
+ * The output lags the input by half the filter length, the samples held
+ * back come out with the next block.
+ *
+ * @param [in]  rs 		The converter
+ * @param [in]  in 		The input samples
+ * @param [in]  samples The number of input samples
+ * @param [out] out 	The output, room for RESAMPLE_MAX_OUTPUT(rs, samples)
+ * @return The number of output samples
+ */
+IRAM_ATTR int resample_process(resample_t *rs, const int16_t *in, int samples, int16_t *out)
+{
+	const int taps = rs->taps;
+	const int step_int = rs->step_int;
+	const uint32_t step_num = rs->step_num;
+	const uint32_t out_rate = rs->out_rate;
+	const uint32_t recip = rs->phase_recip;
+	int16_t *start = out;
+	
+	if (!taps) {
+		memcpy(out, in, samples * sizeof(int16_t));
+		return samples;
+	}
+	
+	while (samples > 0) {
+		int n = samples < RESAMPLE_MAX_BLOCK ? samples : RESAMPLE_MAX_BLOCK;
+		int idx = rs->idx, len, drop;
+		uint32_t num = rs->num;
+		
+		memcpy(rs->buf + rs->buf_len, in, n * sizeof(int16_t));
+		len = rs->buf_len + n;
+		in += n;
+		samples -= n;
+		
+		while (idx + taps <= len) {
+			uint32_t phase = (num * recip + (1 << 15)) >> 16;
+			
+			*out++ = resample_dot(rs->buf + idx, rs->coefs + phase * taps, taps);
+			
+			idx += step_int;
+			num += step_num;
+			if (num >= out_rate) {
+				num -= out_rate;
+				idx++;
+			}
+		}
+		
+		/* keep what the next outputs still need, when decimating idx may already be past the end */
+		drop = idx < len ? idx : len;
+		memmove(rs->buf, rs->buf + drop, (len - drop) * sizeof(int16_t));
+		rs->buf_len = len - drop;
+		rs->idx = idx - drop;
+		rs->num = num;
+	}
+	
+	return out - start;
+}
+
+#ifdef RESAMPLE_REFERENCE
+
+/**
+ * @brief Double precision converter for checking the kernel on the host
+ *
+ * Evaluates the same filter at the exact output instants, with the same
+ * delay as a fresh resample_t, over a whole signal at once.
+ *
+ * @return The number of output samples
+ */
+int resample_ref_process(int in_rate, int out_rate, const int16_t *in, int samples, int16_t *out)
+{
+	double fc;
+	int taps, count = 0;
+	
+	if (in_rate == out_rate) {
+		memcpy(out, in, samples * sizeof(int16_t));
+		return samples;
+	}
+	
+	taps = resample_design(in_rate, out_rate, &fc);
+	
+	/* the kernel only emits an output once its last tap has arrived */
+	for (int64_t k = 0; ; k++) {
+		double t = (double)k * in_rate / out_rate;
+		int64_t base = (int64_t)floor(t);
+		double acc = 0.0, sum = 0.0;
+		
+		if (base + taps / 2 >= samples) {
+			break;
+		}
+		
+		for (int64_t n = base - taps / 2 + 1; n <= base + taps / 2; n++) {
+			double h = resample_filter(t - n, fc, taps);
+			
+			sum += h;
+			if (n >= 0) {
+				acc += in[n] * h;
+			}
+		}
+		
+		out[count++] = resample_clamp((int32_t)lrint(acc / sum));
+	}
+	
+	return count;
+}
+
+#endif /* RESAMPLE_REFERENCE */
@@ -0,0 +1,123 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of filter phases, the output instants are rounded to 1/128 of
+ * an input sample
+ */
+#define RESAMPLE_PHASES			(128)
+
+/**
+ * Most input samples buffered at once, longer inputs are taken in pieces
+ */
+#define RESAMPLE_MAX_BLOCK		(512)
+
+/**
+ * Upper bound of the output sample count for a given input
+ */
+#define RESAMPLE_MAX_OUTPUT(rs, samples) \
+	((int)(((int64_t)(samples) * (rs)->out_rate + (rs)->in_rate - 1) / (rs)->in_rate) + 1)
+
+/**
+ * @brief Streaming mono 16 bit sample rate converter
+ */
+typedef struct {
+	int in_rate;
+	int out_rate;
+	int taps;				/*!< Filter taps per phase, a multiple of 4 */
+	int16_t *coefs;			/*!< RESAMPLE_PHASES rows of taps, Q15 */
+	int16_t *buf;			/*!< Input history and the block being converted */
+	int buf_len;
+	int idx;				/*!< First input sample under the filter for the next output */
+	uint32_t num;			/*!< Fraction of an input sample past idx, in 1/out_rate */
+	int step_int;
+	uint32_t step_num;
+	uint32_t phase_recip;	/*!< Turns num into a phase with a multiply and a shift */
+} resample_t;
+
+/**
+ * @brief Set up a converter and design its anti-aliasing filter
+ *
+ * Any pair of rates up to 48 kHz works, e.g. 8, 16, 44.1 and 48 kHz.
+ * Equal rates make the converter a plain copy.
+ *
+ * @param [out] rs 			The converter
+ * @param [in]  in_rate 	The input sample rate
+ * @param [in]  out_rate 	The output sample rate
+ * @return 0 on success, -1 otherwise
+ */
+int resample_init(resample_t *rs, int in_rate, int out_rate);
+
+/**
+ * @brief Free the memory of a converter
+ * @param [in] rs The converter
+ */
+void resample_deinit(resample_t *rs);
+
+/**
+ * @brief Forget the input history, e.g. at the start of a new stream
+ * @param [in] rs The converter
+ */
+void resample_reset(resample_t *rs);
+
+/**
+ * @brief Convert a block of samples
+ *
+ * The output lags the input by half the filter length, the samples held
+ * back come out with the next block.
+ *
+ * @param [in]  rs 		The converter
+ * @param [in]  in 		The input samples
+ * @param [in]  samples The number of input samples
+ * @param [out] out 	The output, room for RESAMPLE_MAX_OUTPUT(rs, samples)
+ * @return The number of output samples
+ */
+int resample_process(resample_t *rs, const int16_t *in, int samples, int16_t *out);
+
+#ifdef RESAMPLE_REFERENCE
+/**
+ * @brief Double precision converter for checking the kernel on the host
+ *
+ * Evaluates the same filter at the exact output instants, with the same
+ * delay as a fresh resample_t, over a whole signal at once.
+ *
+ * @return The number of output samples
+ */
+int resample_ref_process(int in_rate, int out_rate, const int16_t *in, int samples, int16_t *out);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RESAMPLE_H_ */
@@ -0,0 +1,291 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include "lwip/netdb.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "resolver.h"
+
+#define RESOLVER_TASK_SIZE			3072
+#define RESOLVER_TASK_PRIORITY		2
+
+#define RESOLVER_MAX_ENTRIES		4
+#define RESOLVER_MAX_HOSTNAME		64
+
+/* refresh this long before an entry expires, so lookups never see it stale */
+#define RESOLVER_REFRESH_AHEAD_MS	(10 * 1000)
+/* wait this long before retrying a failed refresh */
+#define RESOLVER_RETRY_MS			(5 * 1000)
+
+#define RESOLVER_REFRESH_BIT		BIT0
+
+struct resolver_entry {
+	char 			hostname[RESOLVER_MAX_HOSTNAME];
+	struct in_addr 	addr;
+	int64_t			refresh_at;
+	bool			valid;
+};
+
+static const char *TAG = "RESOLVER";
+
+static struct resolver_entry s_entries[RESOLVER_MAX_ENTRIES];
+static SemaphoreHandle_t s_lock = NULL;
+static EventGroupHandle_t s_event_group = NULL;
+static TaskHandle_t s_task = NULL;
+
+static inline int64_t resolver_now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static bool resolver_init(void)
+{
+	if (!s_lock) {
+		s_lock = xSemaphoreCreateMutex();
+		s_event_group = xEventGroupCreate();
+	}
+	
+	return s_lock && s_event_group;
+}
+
+static bool resolver_query(const char *hostname, struct in_addr *addr)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res = NULL;
+	
+	if (getaddrinfo(hostname, NULL, &hints, &res) != 0 || !res) {
+		return false;
+	}
+	
+	*addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
+	
+	return true;
+}
+
+/* must be called with the lock held */
+static struct resolver_entry *resolver_find(const char *hostname)
+{
+	for (int i = 0; i < RESOLVER_MAX_ENTRIES; i++) {
+		if (s_entries[i].hostname[0] && !strcmp(s_entries[i].hostname, hostname)) {
+			return &s_entries[i];
+		}
+	}
+	
+	return NULL;
+}
+
+/* must be called with the lock held */
+static struct resolver_entry *resolver_insert(const char *hostname)
+{
+	struct resolver_entry *entry = resolver_find(hostname);
+	
+	if (entry) {
+		return entry;
+	}
+	
+	if (strlen(hostname) >= RESOLVER_MAX_HOSTNAME) {
+		return NULL;
+	}
+	
+	for (int i = 0; i < RESOLVER_MAX_ENTRIES; i++) {
+		if (!s_entries[i].hostname[0]) {
+			strcpy(s_entries[i].hostname, hostname);
+			s_entries[i].valid = false;
+			s_entries[i].refresh_at = 0;
+			return &s_entries[i];
+		}
+	}
+	
+	return NULL;
+}
+
+static void resolver_task(void *pvParameters)
+{
+	char hostname[RESOLVER_MAX_HOSTNAME];
+	struct in_addr addr;
+	
+	for (;;) {
+		int64_t next = resolver_now_ms() + RESOLVER_RETRY_MS;
+		
+		for (int i = 0; i < RESOLVER_MAX_ENTRIES; i++) {
+			xSemaphoreTake(s_lock, portMAX_DELAY);
+			if (!s_entries[i].hostname[0] || s_entries[i].refresh_at > resolver_now_ms()) {
+				if (s_entries[i].hostname[0] && s_entries[i].refresh_at < next) {
+					next = s_entries[i].refresh_at;
+				}
+				xSemaphoreGive(s_lock);
+				continue;
+			}
+			strcpy(hostname, s_entries[i].hostname);
+			xSemaphoreGive(s_lock);
+			
+			/* the query may block for seconds, do it without the lock */
+			bool ok = resolver_query(hostname, &addr);
+			
+			xSemaphoreTake(s_lock, portMAX_DELAY);
+			if (ok) {
+				s_entries[i].addr = addr;
+				s_entries[i].valid = true;
+				s_entries[i].refresh_at = resolver_now_ms() + CONFIG_RESOLVER_TTL * 1000 - RESOLVER_REFRESH_AHEAD_MS;
+				ESP_LOGI(TAG, "%s is %s", hostname, inet_ntoa(addr));
+			} else {
+				/* keep serving the last known good address */
+				s_entries[i].refresh_at = resolver_now_ms() + RESOLVER_RETRY_MS;
+				ESP_LOGW(TAG, "Failed to refresh %s%s", hostname, s_entries[i].valid ? ", keeping last address" : "");
+			}
+			xSemaphoreGive(s_lock);
+		}
+		
+		int64_t wait = next - resolver_now_ms();
+		if (wait < 100) {
+			wait = 100;
+		}
+		xEventGroupWaitBits(s_event_group, RESOLVER_REFRESH_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(wait));
+	}
+}
+
+/**
+ * @brief Start the background resolver task
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t resolver_start(void)
+{
+	if (!resolver_init()) {
+		return ESP_FAIL;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	for (int i = 0; i < RESOLVER_MAX_ENTRIES; i++) {
+		s_entries[i].refresh_at = 0;
+	}
+	xSemaphoreGive(s_lock);
+	
+	if (s_task) {
+		xEventGroupSetBits(s_event_group, RESOLVER_REFRESH_BIT);
+		return ESP_OK;
+	}
+	
+	if (xTaskCreate(resolver_task, "resolver", RESOLVER_TASK_SIZE, NULL, RESOLVER_TASK_PRIORITY, &s_task) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create resolver task");
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Register a hostname to be resolved and kept fresh in the background
+ * @param [in] hostname The hostname
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the cache is full
+ */
+esp_err_t resolver_add(const char *hostname)
+{
+	struct in_addr addr;
+	struct resolver_entry *entry;
+	
+	/* nothing to resolve for a literal address */
+	if (inet_pton(AF_INET, hostname, &addr) == 1) {
+		return ESP_OK;
+	}
+	
+	if (!resolver_init()) {
+		return ESP_FAIL;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	entry = resolver_insert(hostname);
+	xSemaphoreGive(s_lock);
+	
+	if (!entry) {
+		return ESP_ERR_NO_MEM;
+	}
+	
+	if (s_task) {
+		xEventGroupSetBits(s_event_group, RESOLVER_REFRESH_BIT);
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Look up the IPv4 address of a hostname
+ * @param [in]  hostname 	The hostname
+ * @param [out] addr 		The resolved address
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t resolver_lookup(const char *hostname, struct in_addr *addr)
+{
+	struct resolver_entry *entry;
+	bool found = false;
+	
+	if (inet_pton(AF_INET, hostname, addr) == 1) {
+		return ESP_OK;
+	}
+	
+	if (!resolver_init()) {
+		return ESP_FAIL;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	entry = resolver_find(hostname);
+	if (entry && entry->valid) {
+		*addr = entry->addr;
+		found = true;
+	}
+	xSemaphoreGive(s_lock);
+	
+	if (found) {
+		return ESP_OK;
+	}
+	
+	/* cold miss, pay for the round trip once */
+	ESP_LOGW(TAG, "%s not cached, resolving now", hostname);
+	if (!resolver_query(hostname, addr)) {
+		ESP_LOGE(TAG, "Failed to resolve %s", hostname);
+		return ESP_FAIL;
+	}
+	
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	entry = resolver_insert(hostname);
+	if (entry) {
+		entry->addr = *addr;
+		entry->valid = true;
+		entry->refresh_at = resolver_now_ms() + CONFIG_RESOLVER_TTL * 1000 - RESOLVER_REFRESH_AHEAD_MS;
+	}
+	xSemaphoreGive(s_lock);
+	
+	return ESP_OK;
+}
@@ -0,0 +1,69 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include "lwip/sockets.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Start the background resolver task
+ *
+ * Call once the station has an IP address. Calling it again, e.g. after a
+ * reconnect, refreshes every registered hostname right away.
+ *
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t resolver_start(void);
+
+/**
+ * @brief Register a hostname to be resolved and kept fresh in the background
+ * @param [in] hostname The hostname
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the cache is full
+ */
+esp_err_t resolver_add(const char *hostname);
+
+/**
+ * @brief Look up the IPv4 address of a hostname
+ *
+ * Literal addresses and cached names are answered immediately. A name
+ * which was never resolved is looked up synchronously and then cached.
+ * Once cached, the last known good address keeps being returned until a
+ * background refresh replaces it.
+ *
+ * @param [in]  hostname 	The hostname
+ * @param [out] addr 		The resolved address
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t resolver_lookup(const char *hostname, struct in_addr *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RESOLVER_H_ */
@@ -22,12 +22,21 @@
  * SOFTWARE.
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
 #include "sdkconfig.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "tcp_stream.h"
-#include "mubby.h"
+#include "resolver.h"
 #include "esp_log.h"
 
 #ifdef CONFIG_ENABLE_SECURITY_PROTO
+#include "credentials.h"
 #include "mbedtls/platform.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl.h"
@@ -35,6 +44,41 @@
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
 #include "mbedtls/certs.h"
+#ifdef CONFIG_TLS_SESSION_PERSIST
+#ifndef CONFIG_NVS_ENCRYPTION
+#error "CONFIG_TLS_SESSION_PERSIST writes the master secret to NVS, which needs CONFIG_NVS_ENCRYPTION"
+#endif
+#include "nvs.h"
+#endif
+#endif
+
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+#include "esp_system.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+#define TCP_STREAM_WS_FIN			(0x80)
+#define TCP_STREAM_WS_MASK			(0x80)
+#define TCP_STREAM_WS_CONTINUATION	(0x0)
+#define TCP_STREAM_WS_BINARY		(0x2)
+#define TCP_STREAM_WS_CLOSE			(0x8)
+#define TCP_STREAM_WS_PING			(0x9)
+#define TCP_STREAM_WS_PONG			(0xa)
+/* opcodes with this bit set are control frames */
+#define TCP_STREAM_WS_CONTROL		(0x8)
+#define TCP_STREAM_WS_MAX_CONTROL	(125)
+#define TCP_STREAM_WS_MAX_HEADER	(14)
+/* frames go out in pieces of one MSS, masked on the way */
+#define TCP_STREAM_WS_CHUNK			(1436)
+#define TCP_STREAM_WS_MAX_RESPONSE	(512)
+
+static const char *TCP_STREAM_WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+#endif
+
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+/* sends the buffer once it waited long enough, which may take an SSL/TLS record */
+#define TCP_STREAM_FLUSH_TASK_SIZE		4096
+#define TCP_STREAM_FLUSH_TASK_PRIORITY	5
 #endif
 
 struct tcp_stream_context {
@@ -42,134 +86,1229 @@ struct tcp_stream_context {
     mbedtls_entropy_context entropy;
 	mbedtls_ctr_drbg_context ctr_drbg;
 	mbedtls_ssl_context ssl;
-	mbedtls_x509_crt cacert;
-	mbedtls_x509_crt clntcert;
-	mbedtls_pk_context clntkey;
 	mbedtls_ssl_config conf;
 	mbedtls_net_context server_fd;
+	mbedtls_ssl_session session;
+	bool has_session;
+	tcp_stream_tls_stats_t tls_stats;
+	/* 
+	 * mbedtls must not be entered from two tasks at once, yet the flush
+	 * task writes while the reader sits in the read loop. Held around
+	 * single non-blocking calls only, the waits happen outside.
+	 */
+	SemaphoreHandle_t tls_lock;
 #else
 	int sock;
+#endif
+	unsigned int timeout_ms;
+	int64_t open_deadline;		/* while opening, the bound on all of it */
+	tcp_stream_stats_t stats;
+	tcp_stream_stats_t turn_base;
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+	SemaphoreHandle_t wlock;
+	uint8_t *wbuf;
+	int wlen;
+	int64_t wbuf_since;
+	bool corked;
+	TaskHandle_t flusher;
+#endif
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+	uint8_t *rbuf;
+	int rpos;
+	int rlen;
+#endif
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+	SemaphoreHandle_t ws_lock;
+	uint8_t ws_buf[TCP_STREAM_WS_CHUNK];
+	uint8_t ws_hdr[TCP_STREAM_WS_MAX_HEADER];
+	int ws_hdr_len;
+	int ws_opcode;
+	uint64_t ws_left;
+	uint8_t ws_ctl[TCP_STREAM_WS_MAX_CONTROL];
+	int ws_ctl_len;
+	bool ws_in_frame;
 #endif
 	bool is_open;
 };
 
 static const char *TAG = "STREAM";
 
-static bool tcp_stream_open(tcp_stream_handle_t s, char *hostname, int port)
+#ifdef CONFIG_TLS_SESSION_PERSIST
+static const char *TLS_NVS_NAMESPACE = "mubbytls";
+
+/**
+ * The parts of a session needed to resume it. The peer certificate is not
+ * kept, it is not looked at again on an abbreviated handshake. Neither is
+ * the start time, the wall clock is not set after a reboot. How old a
+ * session may be is left to the server, which answers one it no longer
+ * resumes with a full handshake.
+ */
+struct tcp_stream_saved_session {
+	int ciphersuite;
+	int compression;
+	uint32_t verify_result;
+	uint8_t id_len;
+	uint8_t id[32];
+	uint8_t master[48];
+};
+#endif
+
+static inline int64_t tcp_stream_now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static inline int tcp_stream_fd(tcp_stream_context_handle_t ctx)
+{
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+	return ctx->server_fd.fd;
+#else
+	return ctx->sock;
+#endif
+}
+
+/**
+ * @brief Wait for a socket to become readable and/or writable
+ * @return The ready events, 0 on timeout, -1 on error
+ */
+static int tcp_stream_wait_fd(int fd, int events, unsigned int timeout_ms)
+{
+	fd_set rfds, wfds;
+	struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+	int ret, ready = 0;
+	
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	if (events & TCP_STREAM_POLL_READ) {
+		FD_SET(fd, &rfds);
+	}
+	if (events & TCP_STREAM_POLL_WRITE) {
+		FD_SET(fd, &wfds);
+	}
+	
+	ret = select(fd + 1, &rfds, &wfds, NULL, &tv);
+	if (ret <= 0) {
+		return ret;
+	}
+	
+	if (FD_ISSET(fd, &rfds)) {
+		ready |= TCP_STREAM_POLL_READ;
+	}
+	if (FD_ISSET(fd, &wfds)) {
+		ready |= TCP_STREAM_POLL_WRITE;
+	}
+	
+	return ready;
+}
+
+static void tcp_stream_hist_add(tcp_stream_hist_t *hist, int64_t us)
+{
+	uint32_t ms = (uint32_t)(us / 1000);
+	int i = ms ? 32 - __builtin_clz(ms) : 0;
+	
+	if (i >= TCP_STREAM_HIST_BUCKETS) {
+		i = TCP_STREAM_HIST_BUCKETS - 1;
+	}
+	
+	hist->buckets[i]++;
+	hist->count++;
+	hist->total_us += us;
+	if (ms > hist->max_ms) {
+		hist->max_ms = ms;
+	}
+	if (ms > hist->turn_max_ms) {
+		hist->turn_max_ms = ms;
+	}
+}
+
+/**
+ * @brief Wait on the stream socket, accounting the time spent blocked
+ */
+static int tcp_stream_wait(tcp_stream_context_handle_t ctx, int events, unsigned int timeout_ms)
+{
+	int64_t started = esp_timer_get_time();
+	int ret = tcp_stream_wait_fd(tcp_stream_fd(ctx), events, timeout_ms);
+	int64_t blocked = esp_timer_get_time() - started;
+	
+	ctx->stats.eagain++;
+	if (events & TCP_STREAM_POLL_READ) {
+		ctx->stats.read_blocked_us += blocked;
+	} else {
+		ctx->stats.write_blocked_us += blocked;
+	}
+	
+	return ret;
+}
+
+/**
+ * @brief Milliseconds left until the deadline, 0 if it already passed
+ */
+static inline unsigned int tcp_stream_remaining_ms(int64_t deadline)
+{
+	int64_t left = deadline - tcp_stream_now_ms();
+	return left > 0 ? (unsigned int)left : 0;
+}
+
+/**
+ * @brief The deadline of an I/O call starting now
+ *
+ * While the stream is being opened, that is what is left of the bound on
+ * opening rather than the I/O timeout.
+ */
+static inline int64_t tcp_stream_io_deadline(tcp_stream_context_handle_t ctx)
+{
+	if (ctx->open_deadline) {
+		return ctx->open_deadline;
+	}
+	
+	return tcp_stream_now_ms() + ctx->timeout_ms;
+}
+
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+#ifdef CONFIG_TLS_SESSION_PERSIST
+static void tcp_stream_session_store(tcp_stream_context_handle_t ctx)
+{
+	struct tcp_stream_saved_session saved = {0};
+	nvs_handle handle;
+	
+	saved.ciphersuite = ctx->session.ciphersuite;
+	saved.compression = ctx->session.compression;
+	saved.verify_result = ctx->session.verify_result;
+	saved.id_len = ctx->session.id_len;
+	memcpy(saved.id, ctx->session.id, sizeof(saved.id));
+	memcpy(saved.master, ctx->session.master, sizeof(saved.master));
+	
+	if (nvs_open(TLS_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+		return;
+	}
+	
+	nvs_set_blob(handle, "session", &saved, sizeof(saved));
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	if (ctx->session.ticket && ctx->session.ticket_len > 0) {
+		nvs_set_blob(handle, "ticket", ctx->session.ticket, ctx->session.ticket_len);
+	} else {
+		nvs_erase_key(handle, "ticket");
+	}
+#endif
+	nvs_commit(handle);
+	nvs_close(handle);
+}
+
+static void tcp_stream_session_load(tcp_stream_context_handle_t ctx)
+{
+	struct tcp_stream_saved_session saved;
+	size_t sz = sizeof(saved);
+	nvs_handle handle;
+	
+	if (nvs_open(TLS_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+		return;
+	}
+	
+	if (nvs_get_blob(handle, "session", &saved, &sz) != ESP_OK || sz != sizeof(saved)) {
+		nvs_close(handle);
+		return;
+	}
+	
+	ctx->session.ciphersuite = saved.ciphersuite;
+	ctx->session.compression = saved.compression;
+	ctx->session.verify_result = saved.verify_result;
+	ctx->session.id_len = saved.id_len;
+	memcpy(ctx->session.id, saved.id, sizeof(saved.id));
+	memcpy(ctx->session.master, saved.master, sizeof(saved.master));
+	
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	if (nvs_get_blob(handle, "ticket", NULL, &sz) == ESP_OK && sz > 0) {
+		ctx->session.ticket = malloc(sz);
+		if (ctx->session.ticket && nvs_get_blob(handle, "ticket", ctx->session.ticket, &sz) == ESP_OK) {
+			ctx->session.ticket_len = sz;
+		} else {
+			free(ctx->session.ticket);
+			ctx->session.ticket = NULL;
+		}
+	}
+#endif
+	
+	nvs_close(handle);
+	ctx->has_session = true;
+	
+	ESP_LOGI(TAG, "Restored SSL/TLS session from NVS");
+}
+#endif
+
+/**
+ * @brief Keep the session of the handshake just completed for the next one
+ * @return true if the handshake resumed the previously kept session
+ */
+static bool tcp_stream_session_update(tcp_stream_context_handle_t ctx)
+{
+	mbedtls_ssl_session session;
+	bool resumed;
+	
+	mbedtls_ssl_session_init(&session);
+	if (mbedtls_ssl_get_session(&ctx->ssl, &session) != 0) {
+		mbedtls_ssl_session_free(&session);
+		return false;
+	}
+	
+	/* an abbreviated handshake reuses the master secret, a full one never does */
+	resumed = ctx->has_session && !memcmp(session.master, ctx->session.master, sizeof(session.master));
+	
+	mbedtls_ssl_session_free(&ctx->session);
+	ctx->session = session;
+	ctx->has_session = true;
+	
+#ifdef CONFIG_TLS_SESSION_PERSIST
+	if (!resumed) {
+		tcp_stream_session_store(ctx);
+	}
+#endif
+	
+	return resumed;
+}
+#endif
+
+/**
+ * @brief Open a plain TCP connection to hostname:port
+ * @param [in] hostname 	The server hostname
+ * @param [in] port 		The server port
+ * @param [in] timeout_ms 	How long to wait for the connect
+ * @return The socket descriptor on success, -1 on error or timeout
+ */
+int tcp_stream_connect_socket(const char *hostname, int port, unsigned int timeout_ms)
+{
+	struct sockaddr_in addr;
+	int sock, err = 0;
+	socklen_t len = sizeof(err);
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	
+	if (resolver_lookup(hostname, &addr.sin_addr) != ESP_OK) {
+		return -1;
+	}
+	
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (errno != EINPROGRESS) {
+			goto errout;
+		}
+		
+		if (tcp_stream_wait_fd(sock, TCP_STREAM_POLL_WRITE, timeout_ms) <= 0) {
+			ESP_LOGE(TAG, "Connection timed out after %u ms", timeout_ms);
+			goto errout;
+		}
+		
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			ESP_LOGE(TAG, "Connection failed, error=%d", err);
+			goto errout;
+		}
+	}
+	
+	return sock;
+	
+errout:
+	close(sock);
+	return -1;
+}
+
+/**
+ * @brief Connect and, with security protocols enabled, run the handshake
+ * @param [in] deadline When both have to be done by, in tcp_stream_now_ms time
+ */
+static bool tcp_stream_connect(tcp_stream_context_handle_t ctx, char *hostname, int port, int64_t deadline)
+{
+	int64_t connect_started = esp_timer_get_time();
+	int sock;
+	
+	ESP_LOGI(TAG, "Connecting to %s:%u...", hostname, (uint16_t)port);
+	
+	sock = tcp_stream_connect_socket(hostname, port, tcp_stream_remaining_ms(deadline));
+	if (sock < 0) {
+		ctx->stats.connect_failures++;
+		return false;
+	}
+	
+	tcp_stream_hist_add(&ctx->stats.connect_time, esp_timer_get_time() - connect_started);
+	
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+	/* writes are already coalesced here, Nagle would only add delay */
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+#endif
+	
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+	int flags, ret;
+	int64_t started = tcp_stream_now_ms();
+	unsigned int elapsed;
+	
+	mbedtls_net_init(&ctx->server_fd);
+	ctx->server_fd.fd = sock;
+
+	ESP_LOGI(TAG, "Connected.");
+
+	mbedtls_ssl_set_bio(&ctx->ssl, &ctx->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+	
+	if (ctx->has_session && (ret = mbedtls_ssl_set_session(&ctx->ssl, &ctx->session)) != 0) {
+		ESP_LOGW(TAG, "mbedtls_ssl_set_session returned -0x%x", -ret);
+	}
+
+	ESP_LOGI(TAG, "Performing the SSL/TLS handshake...");
+
+	for (;;) {
+		xSemaphoreTake(ctx->tls_lock, portMAX_DELAY);
+		ret = mbedtls_ssl_handshake(&ctx->ssl);
+		xSemaphoreGive(ctx->tls_lock);
+		if (ret == 0) {
+			break;
+		}
+		
+		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+			ESP_LOGE(TAG, "mbedtls_ssl_handshake returned -0x%x", -ret);
+			/* do not offer the same session again, it may be what the server chokes on */
+			ctx->has_session = false;
+			goto errout;
+		}
+		
+		if (tcp_stream_wait_fd(sock, ret == MBEDTLS_ERR_SSL_WANT_READ ? TCP_STREAM_POLL_READ : TCP_STREAM_POLL_WRITE,
+							   tcp_stream_remaining_ms(deadline)) <= 0) {
+			ESP_LOGE(TAG, "SSL/TLS handshake timed out");
+			goto errout;
+		}
+	}
+
+	ESP_LOGI(TAG, "Verifying peer X.509 certificate...");
+
+	if ((flags = mbedtls_ssl_get_verify_result(&ctx->ssl)) != 0) {
+		/* In real life, we probably want to close connection if ret != 0 */
+		ESP_LOGW(TAG, "Failed to verify peer certificate!");
+		goto errout;
+	} else {
+		ESP_LOGI(TAG, "Certificate verified.");
+	}
+
+	ESP_LOGI(TAG, "Cipher suite is %s", mbedtls_ssl_get_ciphersuite(&ctx->ssl));
+	
+	elapsed = (unsigned int)(tcp_stream_now_ms() - started);
+	tcp_stream_hist_add(&ctx->stats.handshake_time, (int64_t)elapsed * 1000);
+	ctx->tls_stats.last_ms = elapsed;
+	ctx->tls_stats.last_resumed = tcp_stream_session_update(ctx);
+	if (ctx->tls_stats.last_resumed) {
+		ctx->tls_stats.resumed_count++;
+		ctx->tls_stats.resumed_ms_total += elapsed;
+	} else {
+		ctx->tls_stats.full_count++;
+		ctx->tls_stats.full_ms_total += elapsed;
+	}
+	
+	ESP_LOGI(TAG, "%s handshake took %u ms (full: %u, resumed: %u)",
+			 ctx->tls_stats.last_resumed ? "Resumed" : "Full", elapsed,
+			 ctx->tls_stats.full_count, ctx->tls_stats.resumed_count);
+	
+#else
+	ctx->sock = sock;
+#endif
+
+	ctx->stats.connects++;
+	ctx->is_open = true;
+	
+	return true;
+	
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+errout:
+	ctx->stats.connect_failures++;
+	xSemaphoreTake(ctx->tls_lock, portMAX_DELAY);
+	mbedtls_ssl_session_reset(&ctx->ssl);
+	mbedtls_net_free(&ctx->server_fd);
+	xSemaphoreGive(ctx->tls_lock);
+	return false;
+#endif
+}
+
+static bool tcp_stream_close(tcp_stream_handle_t s)
+{
+	if (s) {
+		tcp_stream_context_handle_t ctx = s->context;
+		if (ctx && ctx->is_open) {
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+			xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+			ctx->wlen = 0;
+			xSemaphoreGive(ctx->wlock);
+#endif
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+			ctx->rpos = ctx->rlen = 0;
+#endif
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+			xSemaphoreTake(ctx->tls_lock, portMAX_DELAY);
+			mbedtls_ssl_session_reset(&ctx->ssl);
+			mbedtls_net_free(&ctx->server_fd);
+			xSemaphoreGive(ctx->tls_lock);
+#else
+			close(ctx->sock);
+			ctx->sock = -1;
+#endif
+			ctx->is_open = false;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+/**
+ * @brief Take data from the socket or SSL/TLS layer
+ * @param [in] wait false to fail with EAGAIN rather than wait for data
+ */
+static int tcp_stream_recv(tcp_stream_context_handle_t ctx, void *buffer, int bufsz, bool wait)
+{
+	int ret;
+	
+	for (;;) {
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+		xSemaphoreTake(ctx->tls_lock, portMAX_DELAY);
+		ret = mbedtls_ssl_read(&ctx->ssl, buffer, bufsz);
+		xSemaphoreGive(ctx->tls_lock);
+		if (ret >= 0) {
+			ctx->stats.recvs++;
+			return ret;
+		} else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+			return 0;
+		} else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+			ESP_LOGE(TAG, "mbedtls_ssl_read returned -0x%x", -ret);
+			return -1;
+		}
+#else
+		ret = recv(ctx->sock, buffer, bufsz, 0);
+		if (ret >= 0) {
+			ctx->stats.recvs++;
+			return ret;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return ret;
+		}
+#endif
+		if (!wait) {
+			errno = EAGAIN;
+			return -1;
+		}
+		
+		ret = tcp_stream_wait(ctx, TCP_STREAM_POLL_READ, tcp_stream_remaining_ms(tcp_stream_io_deadline(ctx)));
+		if (ret == 0) {
+			ctx->stats.read_timeouts++;
+			errno = EAGAIN;
+			return -1;
+		} else if (ret < 0) {
+			return -1;
+		}
+	}
+}
+
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+/**
+ * @brief Read through the read-ahead buffer
+ *
+ * Once the buffer runs dry it is refilled with as much as is ready,
+ * waiting only for the first bytes. Small reads, such as the decoder's or
+ * frame headers, are then served from memory.
+ */
+static int tcp_stream_read_raw(tcp_stream_context_handle_t ctx, void *buffer, int bufsz)
+{
+	int ret;
+	
+	if (ctx->rpos == ctx->rlen) {
+		/* nothing to gain from the detour */
+		if (bufsz >= CONFIG_TCP_STREAM_READ_AHEAD_SIZE) {
+			return tcp_stream_recv(ctx, buffer, bufsz, true);
+		}
+		
+		ret = tcp_stream_recv(ctx, ctx->rbuf, CONFIG_TCP_STREAM_READ_AHEAD_SIZE, true);
+		if (ret <= 0) {
+			return ret;
+		}
+		ctx->rpos = 0;
+		ctx->rlen = ret;
+		
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+		/* mbedtls hands out one record at a time, take the others which are in */
+		while (ctx->rlen < CONFIG_TCP_STREAM_READ_AHEAD_SIZE
+			   && (ret = tcp_stream_recv(ctx, ctx->rbuf + ctx->rlen, CONFIG_TCP_STREAM_READ_AHEAD_SIZE - ctx->rlen, false)) > 0) {
+			ctx->rlen += ret;
+		}
+#endif
+	}
+	
+	ret = ctx->rlen - ctx->rpos;
+	if (ret > bufsz) {
+		ret = bufsz;
+	}
+	memcpy(buffer, ctx->rbuf + ctx->rpos, ret);
+	ctx->rpos += ret;
+	
+	return ret;
+}
+#else
+static inline int tcp_stream_read_raw(tcp_stream_context_handle_t ctx, void *buffer, int bufsz)
+{
+	return tcp_stream_recv(ctx, buffer, bufsz, true);
+}
+#endif
+
+static int tcp_stream_send_all(tcp_stream_context_handle_t ctx, const void *buffer, int bufsz)
+{
+	const unsigned char *p = buffer;
+	int64_t deadline = tcp_stream_io_deadline(ctx);
+	int left = bufsz, ret;
+	
+	while (left > 0) {
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+		xSemaphoreTake(ctx->tls_lock, portMAX_DELAY);
+		ret = mbedtls_ssl_write(&ctx->ssl, p, left);
+		xSemaphoreGive(ctx->tls_lock);
+		if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+			ESP_LOGE(TAG, "mbedtls_ssl_write returned -0x%x", -ret);
+			return -1;
+		}
+#else
+		ret = send(ctx->sock, p, left, 0);
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+#endif
+		if (ret > 0) {
+			ctx->stats.sends++;
+			p += ret;
+			left -= ret;
+			continue;
+		}
+		
+		if (tcp_stream_wait(ctx, TCP_STREAM_POLL_WRITE, tcp_stream_remaining_ms(deadline)) <= 0) {
+			ctx->stats.write_timeouts++;
+			ESP_LOGE(TAG, "Write timed out, %d of %d bytes sent", bufsz - left, bufsz);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	
+	return bufsz;
+}
+
+/**
+ * @brief Write-all of several blocks, consuming iov
+ */
+static int tcp_stream_send_allv(tcp_stream_context_handle_t ctx, struct iovec *iov, int iovcnt)
+{
+	int total = 0;
+	
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+	/* mbedtls copies into its record buffer anyway, nothing to gather */
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > 0 && tcp_stream_send_all(ctx, iov[i].iov_base, iov[i].iov_len) < 0) {
+			return -1;
+		}
+	}
+#else
+	int64_t deadline = tcp_stream_io_deadline(ctx);
+	int ret;
+	
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+		
+		ret = writev(ctx->sock, iov, iovcnt);
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+		
+		if (ret > 0) {
+			ctx->stats.sends++;
+			while (ret > 0) {
+				if ((size_t)ret >= iov->iov_len) {
+					ret -= iov->iov_len;
+					iov++;
+					iovcnt--;
+				} else {
+					iov->iov_base = (char *)iov->iov_base + ret;
+					iov->iov_len -= ret;
+					ret = 0;
+				}
+			}
+			continue;
+		}
+		
+		if (tcp_stream_wait(ctx, TCP_STREAM_POLL_WRITE, tcp_stream_remaining_ms(deadline)) <= 0) {
+			ctx->stats.write_timeouts++;
+			ESP_LOGE(TAG, "Write timed out");
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+#endif
+	
+	return total;
+}
+
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+/**
+ * @brief Copy a block into a frame and mask it, a word at a time
+ * @param [in] offset Position of the block in the frame payload
+ */
+static void tcp_stream_ws_mask_copy(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4], size_t offset)
+{
+	uint8_t rot[4];
+	uint32_t mask, word;
+	size_t i = 0;
+	
+	for (; i < len && ((uintptr_t)(dst + i) & 3); i++) {
+		dst[i] = src[i] ^ key[(offset + i) & 3];
+	}
+	
+	/* the key as it lines up with the aligned words from here on */
+	for (int j = 0; j < 4; j++) {
+		rot[j] = key[(offset + i + j) & 3];
+	}
+	memcpy(&mask, rot, sizeof(mask));
+	
+	for (; i + 4 <= len; i += 4) {
+		memcpy(&word, src + i, sizeof(word));
+		*(uint32_t *)(dst + i) = word ^ mask;
+	}
+	
+	for (; i < len; i++) {
+		dst[i] = src[i] ^ key[(offset + i) & 3];
+	}
+}
+
+/**
+ * @brief Send the blocks as one masked WebSocket frame
+ */
+static int tcp_stream_ws_send(tcp_stream_context_handle_t ctx, int opcode, const struct iovec *iov, int iovcnt)
+{
+	uint8_t *buf = ctx->ws_buf;
+	uint8_t key[4];
+	uint32_t rnd = esp_random();
+	uint64_t total = 0;
+	size_t offset = 0;
+	int n = 0, ret = 0;
+	
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	
+	memcpy(key, &rnd, sizeof(key));
+	
+	/* frames from the reader (pongs) must not land inside a data frame */
+	xSemaphoreTake(ctx->ws_lock, portMAX_DELAY);
+	
+	buf[n++] = TCP_STREAM_WS_FIN | opcode;
+	if (total < 126) {
+		buf[n++] = TCP_STREAM_WS_MASK | total;
+	} else if (total <= 0xffff) {
+		buf[n++] = TCP_STREAM_WS_MASK | 126;
+		buf[n++] = total >> 8;
+		buf[n++] = total;
+	} else {
+		buf[n++] = TCP_STREAM_WS_MASK | 127;
+		for (int i = 7; i >= 0; i--) {
+			buf[n++] = total >> (8 * i);
+		}
+	}
+	memcpy(buf + n, key, sizeof(key));
+	n += sizeof(key);
+	
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		
+		while (left > 0) {
+			size_t len = TCP_STREAM_WS_CHUNK - n;
+			if (len > left) {
+				len = left;
+			}
+			
+			tcp_stream_ws_mask_copy(buf + n, p, len, key, offset);
+			n += len;
+			p += len;
+			left -= len;
+			offset += len;
+			
+			if (n == TCP_STREAM_WS_CHUNK) {
+				if (tcp_stream_send_all(ctx, buf, n) < 0) {
+					ret = -1;
+					goto out;
+				}
+				n = 0;
+			}
+		}
+	}
+	
+	if (n > 0 && tcp_stream_send_all(ctx, buf, n) < 0) {
+		ret = -1;
+	}
+	ctx->stats.bytes_copied += total;
+	
+out:
+	xSemaphoreGive(ctx->ws_lock);
+	return ret < 0 ? -1 : (int)total;
+}
+
+static inline int tcp_stream_ws_header_len(tcp_stream_context_handle_t ctx)
+{
+	if (ctx->ws_hdr_len < 2) {
+		return 2;
+	}
+	
+	switch (ctx->ws_hdr[1] & 0x7f) {
+	case 126:
+		return 4;
+	case 127:
+		return 10;
+	default:
+		return 2;
+	}
+}
+
+/**
+ * @brief Read the payload of data frames, answering control frames in between
+ *
+ * Partial headers are kept across calls, so a read timeout never
+ * desynchronizes the stream.
+ */
+static int tcp_stream_ws_read(tcp_stream_context_handle_t ctx, void *buffer, int bufsz)
+{
+	struct iovec iov;
+	int ret;
+	
+	for (;;) {
+		if (!ctx->ws_in_frame) {
+			ret = tcp_stream_read_raw(ctx, ctx->ws_hdr + ctx->ws_hdr_len, tcp_stream_ws_header_len(ctx) - ctx->ws_hdr_len);
+			if (ret <= 0) {
+				return ret;
+			}
+			
+			ctx->ws_hdr_len += ret;
+			if (ctx->ws_hdr_len < tcp_stream_ws_header_len(ctx)) {
+				continue;
+			}
+			
+			/* servers never mask their frames */
+			if (ctx->ws_hdr[1] & TCP_STREAM_WS_MASK) {
+				ESP_LOGE(TAG, "Masked frame from the server");
+				errno = EPROTO;
+				return -1;
+			}
+			
+			ctx->ws_left = ctx->ws_hdr[1] & 0x7f;
+			if (ctx->ws_hdr_len > 2) {
+				ctx->ws_left = 0;
+				for (int i = 2; i < ctx->ws_hdr_len; i++) {
+					ctx->ws_left = ctx->ws_left << 8 | ctx->ws_hdr[i];
+				}
+			}
+			
+			ctx->ws_opcode = ctx->ws_hdr[0] & 0x0f;
+			ctx->ws_hdr_len = 0;
+			ctx->ws_ctl_len = 0;
+			ctx->ws_in_frame = true;
+			
+			if ((ctx->ws_opcode & TCP_STREAM_WS_CONTROL) && ctx->ws_left > TCP_STREAM_WS_MAX_CONTROL) {
+				ESP_LOGE(TAG, "Oversized control frame");
+				errno = EPROTO;
+				return -1;
+			}
+		}
+		
+		if (!(ctx->ws_opcode & TCP_STREAM_WS_CONTROL)) {
+			/* binary, text and continuation frames all carry the stream */
+			if (ctx->ws_left == 0) {
+				ctx->ws_in_frame = false;
+				continue;
+			}
+			
+			ret = tcp_stream_read_raw(ctx, buffer, ctx->ws_left < (uint64_t)bufsz ? (int)ctx->ws_left : bufsz);
+			if (ret > 0) {
+				ctx->ws_left -= ret;
+				ctx->ws_in_frame = ctx->ws_left > 0;
+			}
+			return ret;
+		}
+		
+		if (ctx->ws_left > 0) {
+			ret = tcp_stream_read_raw(ctx, ctx->ws_ctl + ctx->ws_ctl_len, (int)ctx->ws_left);
+			if (ret <= 0) {
+				return ret;
+			}
+			
+			ctx->ws_ctl_len += ret;
+			ctx->ws_left -= ret;
+			if (ctx->ws_left > 0) {
+				continue;
+			}
+		}
+		
+		ctx->ws_in_frame = false;
+		
+		if (ctx->ws_opcode == TCP_STREAM_WS_CLOSE) {
+			ESP_LOGI(TAG, "Server closed the WebSocket");
+			return 0;
+		} else if (ctx->ws_opcode == TCP_STREAM_WS_PING) {
+			iov.iov_base = ctx->ws_ctl;
+			iov.iov_len = ctx->ws_ctl_len;
+			if (tcp_stream_ws_send(ctx, TCP_STREAM_WS_PONG, &iov, 1) < 0) {
+				return -1;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Upgrade a fresh connection to a WebSocket
+ */
+static bool tcp_stream_ws_handshake(tcp_stream_context_handle_t ctx, const char *hostname, int port)
+{
+	char *buf = (char *)ctx->ws_buf;
+	uint8_t nonce[16], digest[20];
+	char key[32], accept[32];
+	const char *field;
+	size_t olen;
+	int len = 0, ret;
+	
+	for (int i = 0; i < sizeof(nonce); i += 4) {
+		uint32_t rnd = esp_random();
+		memcpy(nonce + i, &rnd, 4);
+	}
+	mbedtls_base64_encode((unsigned char *)key, sizeof(key), &olen, nonce, sizeof(nonce));
+	
+	len = snprintf(buf, TCP_STREAM_WS_CHUNK,
+				   "GET %s HTTP/1.1\r\n"
+				   "Host: %s:%d\r\n"
+				   "Upgrade: websocket\r\n"
+				   "Connection: Upgrade\r\n"
+				   "Sec-WebSocket-Key: %s\r\n"
+				   "Sec-WebSocket-Version: 13\r\n"
+				   "\r\n",
+				   CONFIG_TCP_STREAM_WEBSOCKET_PATH, hostname, port, key);
+	if (tcp_stream_send_all(ctx, buf, len) < 0) {
+		return false;
+	}
+	
+	/* byte by byte, whatever follows the headers already belongs to the stream */
+	len = 0;
+	while (len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4)) {
+		if (len == TCP_STREAM_WS_MAX_RESPONSE - 1) {
+			ESP_LOGE(TAG, "WebSocket upgrade response too long");
+			return false;
+		}
+		
+		ret = tcp_stream_read_raw(ctx, buf + len, 1);
+		if (ret <= 0) {
+			ESP_LOGE(TAG, "No WebSocket upgrade response");
+			return false;
+		}
+		len += ret;
+	}
+	buf[len] = '\0';
+	
+	if (strncmp(buf, "HTTP/1.1 101", 12)) {
+		ESP_LOGE(TAG, "WebSocket upgrade refused: %.*s", (int)strcspn(buf, "\r"), buf);
+		return false;
+	}
+	
+	/* the expected Sec-WebSocket-Accept, computed over the key just sent */
+	len = snprintf((char *)ctx->ws_ctl, sizeof(ctx->ws_ctl), "%s%s", key, TCP_STREAM_WS_GUID);
+	mbedtls_sha1_ret(ctx->ws_ctl, len, digest);
+	mbedtls_base64_encode((unsigned char *)accept, sizeof(accept), &olen, digest, sizeof(digest));
+	
+	for (field = buf; (field = strchr(field, '\n')) != NULL; ) {
+		field++;
+		if (!strncasecmp(field, "Sec-WebSocket-Accept:", 21)) {
+			field += 21;
+			field += strspn(field, " \t");
+			if (!strncmp(field, accept, olen) && (field[olen] == '\r' || field[olen] == ' ')) {
+				return true;
+			}
+			break;
+		}
+	}
+	
+	ESP_LOGE(TAG, "Bad Sec-WebSocket-Accept from the server");
+	return false;
+}
+#endif
+
+static bool tcp_stream_open(tcp_stream_handle_t s, char *hostname, int port)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	/* one bound for the connection, the SSL/TLS handshake and the upgrade together */
+	int64_t deadline = tcp_stream_now_ms() + CONFIG_TCP_CONNECT_TIMEOUT;
+	
+	if (!tcp_stream_connect(ctx, hostname, port, deadline)) {
+		return false;
+	}
+	
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+	int64_t started = esp_timer_get_time();
+	bool upgraded;
+	
+	ctx->ws_hdr_len = 0;
+	ctx->ws_left = 0;
+	ctx->ws_in_frame = false;
+	
+	ctx->open_deadline = deadline;
+	upgraded = tcp_stream_ws_handshake(ctx, hostname, port);
+	ctx->open_deadline = 0;
+	
+	if (!upgraded) {
+		ctx->stats.connect_failures++;
+		s->close(s);
+		return false;
+	}
+	
+	ESP_LOGI(TAG, "WebSocket upgrade took %u ms", (unsigned int)((esp_timer_get_time() - started) / 1000));
+#endif
+	
+	return true;
+}
+
+static int tcp_stream_read(tcp_stream_handle_t s, void *buffer, int bufsz)
 {
 	tcp_stream_context_handle_t ctx = s->context;
+	int64_t started = esp_timer_get_time();
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+	int ret = tcp_stream_ws_read(ctx, buffer, bufsz);
+#else
+	int ret = tcp_stream_read_raw(ctx, buffer, bufsz);
+#endif
 	
-	ESP_LOGI(TAG, "Connecting to %s:%u...", hostname, (uint16_t)port);
+	ctx->stats.read_calls++;
+	if (ret > 0) {
+		ctx->stats.bytes_read += ret;
+	}
+	tcp_stream_hist_add(&ctx->stats.read_latency, esp_timer_get_time() - started);
 	
-#ifdef CONFIG_ENABLE_SECURITY_PROTO
-	int flags, ret;
-	char str_port[6] = {0};
+	return ret;
+}
+
+/**
+ * @brief Send the blocks as one message, in a frame if the stream is a WebSocket
+ *
+ * Timed, since with the write buffer in front this is where writing waits
+ * for the link, rather than in write.
+ */
+static int tcp_stream_send_msg(tcp_stream_context_handle_t ctx, struct iovec *iov, int iovcnt)
+{
+	int64_t started = esp_timer_get_time();
+	int ret;
 	
-	snprintf(str_port, sizeof(str_port), "%u", (uint16_t)port);
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+	ret = tcp_stream_ws_send(ctx, TCP_STREAM_WS_BINARY, iov, iovcnt);
+#else
+	ret = tcp_stream_send_allv(ctx, iov, iovcnt);
+#endif
 	
-	mbedtls_net_init(&ctx->server_fd);
-
-	if ((ret = mbedtls_net_connect(&ctx->server_fd, hostname,
-								  str_port, MBEDTLS_NET_PROTO_TCP)) != 0) {
-		ESP_LOGE(TAG, "mbedtls_net_connect returned -%x", -ret);
-		return false;
+	ctx->stats.send_us += esp_timer_get_time() - started;
+	if (ret > 0) {
+		ctx->stats.bytes_sent += ret;
 	}
+	
+	return ret;
+}
 
-	ESP_LOGI(TAG, "Connected.");
-
-	mbedtls_ssl_set_bio(&ctx->ssl, &ctx->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
-
-	ESP_LOGI(TAG, "Performing the SSL/TLS handshake...");
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+static int tcp_stream_flush_locked(tcp_stream_context_handle_t ctx)
+{
+	struct iovec iov = {
+		.iov_base = ctx->wbuf,
+		.iov_len = ctx->wlen
+	};
+	
+	ctx->wlen = 0;
+	if (iov.iov_len > 0 && tcp_stream_send_msg(ctx, &iov, 1) < 0) {
+		return -1;
+	}
+	
+	return 0;
+}
 
-	while ((ret = mbedtls_ssl_handshake(&ctx->ssl)) != 0) {
-		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-			ESP_LOGE(TAG, "mbedtls_ssl_handshake returned -0x%x", -ret);
-			return false;
+/* sends buffered data once it waited CONFIG_TCP_STREAM_FLUSH_INTERVAL, even when no write follows */
+static void tcp_stream_flush_task(void *pvParameters)
+{
+	tcp_stream_context_handle_t ctx = (tcp_stream_context_handle_t)pvParameters;
+	int64_t age;
+	
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		
+		for (;;) {
+			xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+			/* sent meanwhile, or held back until the uncork flushes it */
+			if (ctx->wlen == 0 || ctx->corked) {
+				xSemaphoreGive(ctx->wlock);
+				break;
+			}
+			
+			age = tcp_stream_now_ms() - ctx->wbuf_since;
+			if (age >= CONFIG_TCP_STREAM_FLUSH_INTERVAL) {
+				if (tcp_stream_flush_locked(ctx) < 0) {
+					ESP_LOGW(TAG, "Flushing the write buffer failed");
+				}
+				xSemaphoreGive(ctx->wlock);
+				break;
+			}
+			xSemaphoreGive(ctx->wlock);
+			
+			vTaskDelay(pdMS_TO_TICKS(CONFIG_TCP_STREAM_FLUSH_INTERVAL - age) + 1);
 		}
 	}
+}
+#endif
 
-	ESP_LOGI(TAG, "Verifying peer X.509 certificate...");
-
-	if ((flags = mbedtls_ssl_get_verify_result(&ctx->ssl)) != 0) {
-		/* In real life, we probably want to close connection if ret != 0 */
-		ESP_LOGW(TAG, "Failed to verify peer certificate!");
-		return false;
-	} else {
-		ESP_LOGI(TAG, "Certificate verified.");
+static int tcp_stream_writev_data(tcp_stream_context_handle_t ctx, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[TCP_STREAM_MAX_IOV + 1];
+	int total = 0;
+	
+	if (iovcnt > TCP_STREAM_MAX_IOV) {
+		errno = EINVAL;
+		return -1;
 	}
-
-	ESP_LOGI(TAG, "Cipher suite is %s", mbedtls_ssl_get_ciphersuite(&ctx->ssl));
 	
-#else
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
 	
-	struct sockaddr_in addr;
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+	int ret = total;
+	bool started;
 	
-	ctx->sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (ctx->sock < 0) {
-		return false;
-	}
+	xSemaphoreTake(ctx->wlock, portMAX_DELAY);
 	
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons((uint16_t)port);
+	if (ctx->wlen + total > CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE) {
+		/* 
+		 * Does not fit, send what is pending together with the new blocks
+		 * straight from the caller's memory rather than copying them
+		 */
+		vec[0].iov_base = ctx->wbuf;
+		vec[0].iov_len = ctx->wlen;
+		memcpy(vec + 1, iov, iovcnt * sizeof(struct iovec));
+		ctx->wlen = 0;
+		if (tcp_stream_send_msg(ctx, vec, iovcnt + 1) < 0) {
+			ret = -1;
+		}
+		goto out;
+	}
 	
-	if (inet_pton(AF_INET, hostname, &addr.sin_addr) < 0) {
-		close(ctx->sock);
-		return false;
+	started = ctx->wlen == 0 && total > 0;
+	if (started) {
+		ctx->wbuf_since = tcp_stream_now_ms();
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(ctx->wbuf + ctx->wlen, iov[i].iov_base, iov[i].iov_len);
+		ctx->wlen += iov[i].iov_len;
 	}
+	ctx->stats.bytes_copied += total;
 	
-	if (connect(ctx->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		close(ctx->sock);
-		return false;
+	if (ctx->wlen == CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE
+		|| (!ctx->corked && tcp_stream_now_ms() - ctx->wbuf_since >= CONFIG_TCP_STREAM_FLUSH_INTERVAL)) {
+		if (tcp_stream_flush_locked(ctx) < 0) {
+			ret = -1;
+		}
+	} else if (started) {
+		/* nothing else may come, have the buffer sent when it is due */
+		xTaskNotifyGive(ctx->flusher);
 	}
+	
+out:
+	xSemaphoreGive(ctx->wlock);
+	return ret;
+#else
+	memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+	return tcp_stream_send_msg(ctx, vec, iovcnt);
 #endif
+}
 
-	ctx->is_open = true;
+static int tcp_stream_writev(tcp_stream_handle_t s, const struct iovec *iov, int iovcnt)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	int64_t started = esp_timer_get_time();
+	int ret = tcp_stream_writev_data(ctx, iov, iovcnt);
 	
-	return true;
+	ctx->stats.write_calls++;
+	if (ret > 0) {
+		ctx->stats.bytes_written += ret;
+	}
+	tcp_stream_hist_add(&ctx->stats.write_latency, esp_timer_get_time() - started);
+	
+	return ret;
 }
 
-static bool tcp_stream_close(tcp_stream_handle_t s)
+static int tcp_stream_write(tcp_stream_handle_t s, const void *buffer, int bufsz)
 {
-	if (s) {
-		tcp_stream_context_handle_t ctx = s->context;
-		if (ctx && ctx->is_open) {
-#ifdef CONFIG_ENABLE_SECURITY_PROTO
-			mbedtls_ssl_session_reset(&ctx->ssl);
-			mbedtls_net_free(&ctx->server_fd);
-#else
-			close(ctx->sock);
-			ctx->sock = -1;
-#endif
-			ctx->is_open = false;
-			return true;
-		}
-	}
+	struct iovec iov = {
+		.iov_base = (void *)buffer,
+		.iov_len = bufsz
+	};
 	
-	return false;
+	return tcp_stream_writev(s, &iov, 1);
 }
 
-static int tcp_stream_read(tcp_stream_handle_t s, void *buffer, int bufsz)
+static int tcp_stream_flush(tcp_stream_handle_t s)
 {
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
 	tcp_stream_context_handle_t ctx = s->context;
-#ifdef CONFIG_ENABLE_SECURITY_PROTO
-	return mbedtls_ssl_read(&ctx->ssl, buffer, bufsz);
+	int ret;
+	
+	xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+	ret = tcp_stream_flush_locked(ctx);
+	xSemaphoreGive(ctx->wlock);
+	
+	return ret;
 #else
-	return recv(ctx->sock, buffer, bufsz, 0);
+	return 0;
 #endif
 }
 
-static int tcp_stream_write(tcp_stream_handle_t s, const void *buffer, int bufsz)
+static int tcp_stream_poll(tcp_stream_handle_t s, int events, unsigned int timeout_ms)
 {
 	tcp_stream_context_handle_t ctx = s->context;
+	
+	if (!ctx->is_open) {
+		return -1;
+	}
+	
 #ifdef CONFIG_ENABLE_SECURITY_PROTO
-	return mbedtls_ssl_write(&ctx->ssl, buffer, bufsz);
-#else
-	return send(ctx->sock, buffer, bufsz, 0);
+	/* decrypted data may already be waiting inside the SSL context */
+	if (events & TCP_STREAM_POLL_READ) {
+		size_t avail;
+		
+		xSemaphoreTake(ctx->tls_lock, portMAX_DELAY);
+		avail = mbedtls_ssl_get_bytes_avail(&ctx->ssl);
+		xSemaphoreGive(ctx->tls_lock);
+		if (avail > 0) {
+			return TCP_STREAM_POLL_READ;
+		}
+	}
 #endif
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+	if ((events & TCP_STREAM_POLL_READ) && ctx->rpos < ctx->rlen) {
+		return TCP_STREAM_POLL_READ;
+	}
+#endif
+	
+	return tcp_stream_wait_fd(tcp_stream_fd(ctx), events, timeout_ms);
 }
 
-
 /**
  * @brief Create a TCP stream
  * @return TCP stream handle on success, NULL otherwise
@@ -189,51 +1328,63 @@ tcp_stream_handle_t tcp_stream_create(void)
 		free(s);
 		return NULL;
 	}
-
-#ifdef CONFIG_ENABLE_SECURITY_PROTO
-	int ret;
 	
-	mbedtls_ssl_init(&ctx->ssl);
-    mbedtls_x509_crt_init(&ctx->cacert);
-    mbedtls_x509_crt_init(&ctx->clntcert);
-    mbedtls_pk_init(&ctx->clntkey);
-    mbedtls_ctr_drbg_init(&ctx->ctr_drbg);
-	mbedtls_ssl_config_init(&ctx->conf);
-    mbedtls_entropy_init(&ctx->entropy);
-    
-	if ((ret = mbedtls_ctr_drbg_seed(&ctx->ctr_drbg, mbedtls_entropy_func, &ctx->entropy, NULL, 0)) != 0) {
-		ESP_LOGE(TAG, "mbedtls_ctr_drbg_seed returned %d", ret);
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+	ctx->wbuf = malloc(CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE);
+	ctx->wlock = xSemaphoreCreateMutex();
+	if (!ctx->wbuf || !ctx->wlock) {
+		ESP_LOGE(TAG, "Failed to allocate the write buffer");
+		return NULL;
+	}
+	if (xTaskCreate(tcp_stream_flush_task, "tcp_flush", TCP_STREAM_FLUSH_TASK_SIZE, (void *)ctx,
+					TCP_STREAM_FLUSH_TASK_PRIORITY, &ctx->flusher) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create the flush task");
 		return NULL;
 	}
+#endif
 
-    ESP_LOGI(TAG, "Loading the CA root certificate...");
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+	ctx->rbuf = malloc(CONFIG_TCP_STREAM_READ_AHEAD_SIZE);
+	if (!ctx->rbuf) {
+		ESP_LOGE(TAG, "Failed to allocate the read-ahead buffer");
+		return NULL;
+	}
+#endif
 
-	ret = mbedtls_x509_crt_parse(&ctx->cacert, cacert_pem_start,
-								 strlen((char *)cacert_pem_start) + 1);
-	if (ret < 0) {
-		ESP_LOGE(TAG, "Failed to parse CA root certificate ret=-0x%x\n\n", -ret);
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+	ctx->ws_lock = xSemaphoreCreateMutex();
+	if (!ctx->ws_lock) {
 		return NULL;
 	}
+#endif
+
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+	credentials_handle_t cred = credentials_get();
+	int ret;
 	
-	ESP_LOGI(TAG, "Loading the client certificate...");
-	
-	ret = mbedtls_x509_crt_parse(&ctx->clntcert, cert_pem_start, strlen((char *)cert_pem_start) + 1);
-	if (ret < 0) {
-		ESP_LOGE(TAG, "Failed to parse client certificate, ret=-0x%x", -ret);
+	if (!cred) {
+		ESP_LOGE(TAG, "Credentials are not loaded");
 		return NULL;
 	}
 	
-	ESP_LOGI(TAG, "Loading the client private key...");
+	ctx->tls_lock = xSemaphoreCreateMutex();
+	if (!ctx->tls_lock) {
+		return NULL;
+	}
 	
-	ret = mbedtls_pk_parse_key(&ctx->clntkey, privkey_pem_start, strlen((char *)privkey_pem_start) + 1, NULL, 0);
-	if (ret < 0) {
-		ESP_LOGE(TAG, "Failed to parse private key, ret=-0x%x", -ret);
+	mbedtls_ssl_init(&ctx->ssl);
+    mbedtls_ctr_drbg_init(&ctx->ctr_drbg);
+	mbedtls_ssl_config_init(&ctx->conf);
+    mbedtls_entropy_init(&ctx->entropy);
+    
+	if ((ret = mbedtls_ctr_drbg_seed(&ctx->ctr_drbg, mbedtls_entropy_func, &ctx->entropy, NULL, 0)) != 0) {
+		ESP_LOGE(TAG, "mbedtls_ctr_drbg_seed returned %d", ret);
 		return NULL;
 	}
 	
 	ESP_LOGI(TAG, "Setting the client certificate...");
 	
-	ret = mbedtls_ssl_conf_own_cert(&ctx->conf, &ctx->clntcert, &ctx->clntkey);
+	ret = mbedtls_ssl_conf_own_cert(&ctx->conf, &cred->clntcert, &cred->clntkey);
 	if (ret < 0) {
 		ESP_LOGE(TAG, "Failed to set client certificate, ret=-0x%x", -ret);
 		return NULL;
@@ -250,16 +1401,25 @@ tcp_stream_handle_t tcp_stream_create(void)
 	}
 	
 	mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-    mbedtls_ssl_conf_ca_chain(&ctx->conf, &ctx->cacert, NULL);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	mbedtls_ssl_conf_session_tickets(&ctx->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    mbedtls_ssl_conf_ca_chain(&ctx->conf, &cred->cacert, NULL);
     mbedtls_ssl_conf_rng(&ctx->conf, mbedtls_ctr_drbg_random, &ctx->ctr_drbg);
 
 	if ((ret = mbedtls_ssl_setup(&ctx->ssl, &ctx->conf)) != 0) {
 		ESP_LOGE(TAG, "mbedtls_ssl_setup returned -0x%x\n\n", -ret);
 		return NULL;
 	}
+	
+	mbedtls_ssl_session_init(&ctx->session);
+#ifdef CONFIG_TLS_SESSION_PERSIST
+	tcp_stream_session_load(ctx);
+#endif
 #else
 	ctx->sock = -1;
 #endif
+	ctx->timeout_ms = CONFIG_TCP_TIMEOUT;
 	ctx->is_open = false;
 
 	s->context = ctx;
@@ -267,6 +1427,9 @@ tcp_stream_handle_t tcp_stream_create(void)
 	s->close = tcp_stream_close;
 	s->read = tcp_stream_read;
 	s->write = tcp_stream_write;
+	s->writev = tcp_stream_writev;
+	s->poll = tcp_stream_poll;
+	s->flush = tcp_stream_flush;
 	
 	return s;
 }
@@ -283,6 +1446,23 @@ esp_err_t tcp_stream_destroy(tcp_stream_handle_t s)
 		if (ctx->is_open) {
 			s->close(s);
 		}
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+		/* with the lock held the flush task is never stopped halfway through a send */
+		xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+		vTaskDelete(ctx->flusher);
+		xSemaphoreGive(ctx->wlock);
+		vSemaphoreDelete(ctx->wlock);
+		free(ctx->wbuf);
+#endif
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+		free(ctx->rbuf);
+#endif
+#ifdef CONFIG_TCP_STREAM_WEBSOCKET
+		vSemaphoreDelete(ctx->ws_lock);
+#endif
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+		vSemaphoreDelete(ctx->tls_lock);
+#endif
 		free(ctx);
 		free(s);
 		return ESP_OK;
@@ -299,11 +1479,238 @@ esp_err_t tcp_stream_destroy(tcp_stream_handle_t s)
 void tcp_stream_set_timeout(tcp_stream_handle_t s, unsigned int ms)
 {
 	tcp_stream_context_handle_t ctx = s->context;
-#ifndef CONFIG_ENABLE_SECURITY_PROTO
-	struct timeval timeout = {ms / 1000, (ms % 1000) * 1000};
-	setsockopt(ctx->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+	ctx->timeout_ms = ms;
+}
+
+/**
+ * @brief Enable TCP keepalive probes on an open TCP stream
+ * @param [in] s 		The TCP stream handle
+ * @param [in] idle 	Idle time in seconds before the first probe
+ * @param [in] interval Interval in seconds between probes
+ * @param [in] count 	Number of unanswered probes before the link is dropped
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t tcp_stream_set_keepalive(tcp_stream_handle_t s, int idle, int interval, int count)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	int fd = tcp_stream_fd(ctx), on = 1;
+	
+	if (!ctx->is_open) {
+		return ESP_FAIL;
+	}
+	
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0) {
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Check without blocking whether an idle TCP stream is still usable
+ * @param [in] s The TCP stream handle
+ * @return true if the stream is open and alive, false otherwise
+ */
+bool tcp_stream_is_alive(tcp_stream_handle_t s)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	int fd, err = 0, ret;
+	socklen_t len = sizeof(err);
+	char c;
+	
+	if (!ctx->is_open) {
+		return false;
+	}
+	
+	fd = tcp_stream_fd(ctx);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		return false;
+	}
+	
+	if (tcp_stream_wait_fd(fd, TCP_STREAM_POLL_READ, 0) <= 0) {
+		return true;
+	}
+	
+	/* readable: either data is waiting or the peer has gone away */
+	ret = recv(fd, &c, 1, MSG_PEEK);
+	if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * @brief Enable or disable TCP_NODELAY on an open TCP stream
+ * @param [in] s 		The TCP stream handle
+ * @param [in] enable 	true to disable Nagle's algorithm
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t tcp_stream_set_nodelay(tcp_stream_handle_t s, bool enable)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	int val = enable ? 1 : 0;
+	
+	if (!ctx->is_open) {
+		return ESP_FAIL;
+	}
+	
+	if (setsockopt(tcp_stream_fd(ctx), IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) < 0) {
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Cork or uncork the write buffer of a TCP stream
+ * @param [in] s 		The TCP stream handle
+ * @param [in] enable 	true to cork, false to uncork
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t tcp_stream_set_cork(tcp_stream_handle_t s, bool enable)
+{
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+	tcp_stream_context_handle_t ctx = s->context;
+	
+	ctx->corked = enable;
+	if (!enable && ctx->is_open) {
+		return s->flush(s) < 0 ? ESP_FAIL : ESP_OK;
+	}
+	
+	return ESP_OK;
+#else
+	return ESP_FAIL;
+#endif
+}
+
+/**
+ * @brief Get the SSL/TLS handshake statistics of a TCP stream
+ * @param [in]  s 		The TCP stream handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL if security protocols are disabled
+ */
+esp_err_t tcp_stream_get_tls_stats(tcp_stream_handle_t s, tcp_stream_tls_stats_t *stats)
+{
+#ifdef CONFIG_ENABLE_SECURITY_PROTO
+	tcp_stream_context_handle_t ctx = s->context;
+	*stats = ctx->tls_stats;
+	return ESP_OK;
 #else
-	mbedtls_ssl_conf_read_timeout(&ctx->conf, (uint32_t)ms);
-	mbedtls_ssl_set_bio(&ctx->ssl, &ctx->server_fd, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+	memset(stats, 0, sizeof(*stats));
+	return ESP_FAIL;
 #endif
 }
+
+/**
+ * @brief Get the I/O statistics of a TCP stream since it was created
+ * @param [in]  s 		The TCP stream handle
+ * @param [out] stats 	The statistics
+ */
+void tcp_stream_get_stats(tcp_stream_handle_t s, tcp_stream_stats_t *stats)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	*stats = ctx->stats;
+}
+
+/**
+ * @brief Mark the start of a conversation turn for tcp_stream_get_turn_stats
+ * @param [in] s The TCP stream handle
+ */
+void tcp_stream_begin_turn(tcp_stream_handle_t s)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	
+	ctx->stats.read_latency.turn_max_ms = 0;
+	ctx->stats.write_latency.turn_max_ms = 0;
+	ctx->stats.connect_time.turn_max_ms = 0;
+	ctx->stats.handshake_time.turn_max_ms = 0;
+	ctx->turn_base = ctx->stats;
+}
+
+static void tcp_stream_hist_sub(tcp_stream_hist_t *hist, const tcp_stream_hist_t *base)
+{
+	hist->count -= base->count;
+	hist->total_us -= base->total_us;
+	for (int i = 0; i < TCP_STREAM_HIST_BUCKETS; i++) {
+		hist->buckets[i] -= base->buckets[i];
+	}
+	hist->max_ms = hist->turn_max_ms;
+}
+
+/**
+ * @brief Get the I/O statistics of a TCP stream since tcp_stream_begin_turn
+ * @param [in]  s 		The TCP stream handle
+ * @param [out] stats 	The statistics
+ */
+void tcp_stream_get_turn_stats(tcp_stream_handle_t s, tcp_stream_stats_t *stats)
+{
+	tcp_stream_context_handle_t ctx = s->context;
+	const tcp_stream_stats_t *base = &ctx->turn_base;
+	
+	*stats = ctx->stats;
+	stats->bytes_read -= base->bytes_read;
+	stats->bytes_written -= base->bytes_written;
+	stats->read_calls -= base->read_calls;
+	stats->write_calls -= base->write_calls;
+	stats->sends -= base->sends;
+	stats->recvs -= base->recvs;
+	stats->bytes_copied -= base->bytes_copied;
+	stats->bytes_sent -= base->bytes_sent;
+	stats->send_us -= base->send_us;
+	stats->read_blocked_us -= base->read_blocked_us;
+	stats->write_blocked_us -= base->write_blocked_us;
+	stats->eagain -= base->eagain;
+	stats->read_timeouts -= base->read_timeouts;
+	stats->write_timeouts -= base->write_timeouts;
+	stats->connects -= base->connects;
+	stats->connect_failures -= base->connect_failures;
+	tcp_stream_hist_sub(&stats->read_latency, &base->read_latency);
+	tcp_stream_hist_sub(&stats->write_latency, &base->write_latency);
+	tcp_stream_hist_sub(&stats->connect_time, &base->connect_time);
+	tcp_stream_hist_sub(&stats->handshake_time, &base->handshake_time);
+}
+
+static void tcp_stream_log_hist(const char *label, const char *name, const tcp_stream_hist_t *hist)
+{
+	char line[TCP_STREAM_HIST_BUCKETS * 11 + 1];
+	int len = 0;
+	
+	if (!hist->count) {
+		return;
+	}
+	
+	for (int i = 0; i < TCP_STREAM_HIST_BUCKETS; i++) {
+		len += snprintf(line + len, sizeof(line) - len, " %u", (unsigned int)hist->buckets[i]);
+	}
+	
+	ESP_LOGI(TAG, "%s %s: n=%u avg=%u ms max=%u ms |%s", label, name, (unsigned int)hist->count,
+			 (unsigned int)(hist->total_us / hist->count / 1000), (unsigned int)hist->max_ms, line);
+}
+
+/**
+ * @brief Print a summary of TCP stream statistics to the log
+ * @param [in] label 	Prefix of the log lines
+ * @param [in] stats 	The statistics
+ */
+void tcp_stream_log_stats(const char *label, const tcp_stream_stats_t *stats)
+{
+	ESP_LOGI(TAG, "%s rx: %u bytes in %u calls / %u recvs, blocked %u ms, %u timeouts", label,
+			 (unsigned int)stats->bytes_read, (unsigned int)stats->read_calls, (unsigned int)stats->recvs,
+			 (unsigned int)(stats->read_blocked_us / 1000), (unsigned int)stats->read_timeouts);
+	ESP_LOGI(TAG, "%s tx: %u bytes in %u calls / %u sends, blocked %u ms, %u timeouts", label,
+			 (unsigned int)stats->bytes_written, (unsigned int)stats->write_calls,
+			 (unsigned int)stats->sends, (unsigned int)(stats->write_blocked_us / 1000),
+			 (unsigned int)stats->write_timeouts);
+	ESP_LOGI(TAG, "%s sent: %u bytes in %u ms, copied: %u bytes, waits: %u, connects: %u ok / %u failed", label,
+			 (unsigned int)stats->bytes_sent, (unsigned int)(stats->send_us / 1000),
+			 (unsigned int)stats->bytes_copied, (unsigned int)stats->eagain, (unsigned int)stats->connects,
+			 (unsigned int)stats->connect_failures);
+	tcp_stream_log_hist(label, "read", &stats->read_latency);
+	tcp_stream_log_hist(label, "write", &stats->write_latency);
+	tcp_stream_log_hist(label, "connect", &stats->connect_time);
+	tcp_stream_log_hist(label, "handshake", &stats->handshake_time);
+}
@@ -32,7 +32,21 @@
 extern "C" {
 #endif
 
+/**
+ * Readiness flags for tcp_stream poll
+ */
+#define TCP_STREAM_POLL_READ	(1 << 0)
+#define TCP_STREAM_POLL_WRITE	(1 << 1)
+
+/**
+ * Maximum number of blocks passed to writev at once
+ */
+#define TCP_STREAM_MAX_IOV			(4)
+
 typedef struct tcp_stream_context tcp_stream_context_t, *tcp_stream_context_handle_t;
+typedef struct tcp_stream_tls_stats tcp_stream_tls_stats_t;
+typedef struct tcp_stream_hist tcp_stream_hist_t;
+typedef struct tcp_stream_stats tcp_stream_stats_t;
 typedef struct tcp_stream tcp_stream_t, *tcp_stream_handle_t;
 
 struct tcp_stream {
@@ -59,25 +73,126 @@ struct tcp_stream {
     
     /**
      * @brief Read a data block from the TCP stream
+     *
+     * Waits at most the I/O timeout for data to arrive. On timeout -1 is
+     * returned and errno is set to EAGAIN.
+     *
      * @param [in]  s		The TCP stream handle
      * @param [out]	buffer	The buffer in which the data will be saved
      * @param [in]	bufsz	The buffer size
-     * @return The number of bytes read, -1 on error
+     * @return The number of bytes read, 0 on EOF, -1 on error
      */
     int (*read)(tcp_stream_handle_t s, void *buffer, int bufsz);
     
     /**
      * @brief Write a data block to the TCP stream
+     *
+     * The whole block is written unless the I/O timeout expires first,
+     * in which case -1 is returned and errno is set to ETIMEDOUT.
+     *
      * @param [in] s		The TCP stream handle
      * @param [in] buffer	The buffer in which the data will be written
      * @param [in] bufsz	The buffer size
-     * @return The number of bytes written, -1 on error
+     * @return bufsz on success, -1 on error
      */
     int (*write)(tcp_stream_handle_t s, const void *buffer, int bufsz); 
+    
+    /**
+     * @brief Write several data blocks to the TCP stream as one
+     *
+     * Same as write, but blocks large enough to bypass the write buffer
+     * are handed to the socket together without being copied first.
+     *
+     * @param [in] s		The TCP stream handle
+     * @param [in] iov		The data blocks
+     * @param [in] iovcnt	The number of blocks, at most TCP_STREAM_MAX_IOV
+     * @return The total size on success, -1 on error
+     */
+    int (*writev)(tcp_stream_handle_t s, const struct iovec *iov, int iovcnt);
+    
+    /**
+     * @brief Wait until the TCP stream is readable and/or writable
+     * @param [in] s			The TCP stream handle
+     * @param [in] events		TCP_STREAM_POLL_READ and/or TCP_STREAM_POLL_WRITE
+     * @param [in] timeout_ms	The maximum time to wait in milliseconds
+     * @return The ready events, 0 on timeout, -1 on error
+     */
+    int (*poll)(tcp_stream_handle_t s, int events, unsigned int timeout_ms);
+    
+    /**
+     * @brief Send out any data held in the write buffer
+     * @param [in] s The TCP stream handle
+     * @return 0 on success, -1 on error
+     */
+    int (*flush)(tcp_stream_handle_t s);
+};
+
+/**
+ * @brief SSL/TLS handshake statistics
+ */
+struct tcp_stream_tls_stats {
+	unsigned int full_count;		/*!< Number of full handshakes */
+	unsigned int resumed_count;		/*!< Number of abbreviated handshakes */
+	unsigned int full_ms_total;		/*!< Total time spent in full handshakes */
+	unsigned int resumed_ms_total;	/*!< Total time spent in abbreviated handshakes */
+	unsigned int last_ms;			/*!< Duration of the latest handshake */
+	bool last_resumed;				/*!< Whether the latest handshake was abbreviated */
+};
+
+/**
+ * Number of buckets of a latency histogram
+ */
+#define TCP_STREAM_HIST_BUCKETS		12
+
+/**
+ * @brief Latency histogram with power-of-two millisecond buckets
+ *
+ * Bucket 0 counts samples below 1 ms, bucket i counts samples in
+ * [2^(i-1), 2^i) ms and the last bucket everything longer.
+ * turn_max_ms is the longest sample since tcp_stream_begin_turn.
+ */
+struct tcp_stream_hist {
+	uint32_t count;
+	uint32_t max_ms;
+	uint32_t turn_max_ms;
+	uint64_t total_us;
+	uint32_t buckets[TCP_STREAM_HIST_BUCKETS];
+};
+
+/**
+ * @brief I/O statistics of a TCP stream
+ */
+struct tcp_stream_stats {
+	uint64_t bytes_read;				/*!< Bytes returned by read */
+	uint64_t bytes_written;				/*!< Bytes accepted by write */
+	uint32_t read_calls;				/*!< Calls to read */
+	uint32_t write_calls;				/*!< Calls to write */
+	uint32_t sends;						/*!< Blocks handed to the socket or SSL/TLS layer */
+	uint32_t recvs;						/*!< Blocks taken from the socket or SSL/TLS layer */
+	uint64_t bytes_copied;				/*!< Bytes copied into the write buffer or masked into WebSocket frames */
+	uint64_t bytes_sent;				/*!< Bytes handed to the socket or SSL/TLS layer, framing excluded */
+	uint64_t send_us;					/*!< Time spent handing them over, the waits for send space included */
+	uint64_t read_blocked_us;			/*!< Time spent waiting for data */
+	uint64_t write_blocked_us;			/*!< Time spent waiting for send space */
+	uint32_t eagain;					/*!< Times an operation had to wait */
+	uint32_t read_timeouts;				/*!< Reads which gave up after the I/O timeout */
+	uint32_t write_timeouts;			/*!< Writes which gave up after the I/O timeout */
+	uint32_t connects;					/*!< Successful connects */
+	uint32_t connect_failures;			/*!< Failed connects and handshakes */
+	tcp_stream_hist_t read_latency;		/*!< Duration of read calls */
+	tcp_stream_hist_t write_latency;	/*!< Duration of write calls */
+	tcp_stream_hist_t connect_time;		/*!< Duration of TCP connects */
+	tcp_stream_hist_t handshake_time;	/*!< Duration of SSL/TLS handshakes */
 };
 
 /**
  * @brief Create a TCP stream
+ *
+ * With CONFIG_TCP_STREAM_WEBSOCKET every connection is upgraded to a
+ * WebSocket when it is opened. Writes then go out as masked binary frames
+ * and reads return the payload of the frames received, so callers see the
+ * same byte stream either way.
+ *
  * @return TCP stream handle on success, NULL otherwise
  */
 tcp_stream_handle_t tcp_stream_create(void);
@@ -89,6 +204,19 @@ tcp_stream_handle_t tcp_stream_create(void);
  */
 esp_err_t tcp_stream_destroy(tcp_stream_handle_t s);
 
+/**
+ * @brief Open a plain TCP connection to hostname:port
+ *
+ * The address comes from the resolver cache. The socket is left
+ * non-blocking.
+ *
+ * @param [in] hostname 	The server hostname
+ * @param [in] port 		The server port
+ * @param [in] timeout_ms 	How long to wait for the connect
+ * @return The socket descriptor on success, -1 on error or timeout
+ */
+int tcp_stream_connect_socket(const char *hostname, int port, unsigned int timeout_ms);
+
 /**
  * @brief Set a timeout for the TCP I/O
  * @param [in] s 	The TCP stream handle
@@ -96,6 +224,82 @@ esp_err_t tcp_stream_destroy(tcp_stream_handle_t s);
  */
 void tcp_stream_set_timeout(tcp_stream_handle_t s, unsigned int ms);
 
+/**
+ * @brief Enable TCP keepalive probes on an open TCP stream
+ * @param [in] s 		The TCP stream handle
+ * @param [in] idle 	Idle time in seconds before the first probe
+ * @param [in] interval Interval in seconds between probes
+ * @param [in] count 	Number of unanswered probes before the link is dropped
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t tcp_stream_set_keepalive(tcp_stream_handle_t s, int idle, int interval, int count);
+
+/**
+ * @brief Check without blocking whether an idle TCP stream is still usable
+ *
+ * Pending data is left in place. The stream is reported dead once the
+ * peer has closed it or the socket has a pending error.
+ *
+ * @param [in] s The TCP stream handle
+ * @return true if the stream is open and alive, false otherwise
+ */
+bool tcp_stream_is_alive(tcp_stream_handle_t s);
+
+/**
+ * @brief Enable or disable TCP_NODELAY on an open TCP stream
+ * @param [in] s 		The TCP stream handle
+ * @param [in] enable 	true to disable Nagle's algorithm
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t tcp_stream_set_nodelay(tcp_stream_handle_t s, bool enable);
+
+/**
+ * @brief Cork or uncork the write buffer of a TCP stream
+ *
+ * While corked, buffered data is only sent once the buffer is full or the
+ * stream is flushed. Uncorking flushes whatever is pending.
+ *
+ * @param [in] s 		The TCP stream handle
+ * @param [in] enable 	true to cork, false to uncork
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t tcp_stream_set_cork(tcp_stream_handle_t s, bool enable);
+
+/**
+ * @brief Get the SSL/TLS handshake statistics of a TCP stream
+ * @param [in]  s 		The TCP stream handle
+ * @param [out] stats 	The statistics
+ * @return ESP_OK on success, ESP_FAIL if security protocols are disabled
+ */
+esp_err_t tcp_stream_get_tls_stats(tcp_stream_handle_t s, tcp_stream_tls_stats_t *stats);
+
+/**
+ * @brief Get the I/O statistics of a TCP stream since it was created
+ * @param [in]  s 		The TCP stream handle
+ * @param [out] stats 	The statistics
+ */
+void tcp_stream_get_stats(tcp_stream_handle_t s, tcp_stream_stats_t *stats);
+
+/**
+ * @brief Mark the start of a conversation turn for tcp_stream_get_turn_stats
+ * @param [in] s The TCP stream handle
+ */
+void tcp_stream_begin_turn(tcp_stream_handle_t s);
+
+/**
+ * @brief Get the I/O statistics of a TCP stream since tcp_stream_begin_turn
+ * @param [in]  s 		The TCP stream handle
+ * @param [out] stats 	The statistics
+ */
+void tcp_stream_get_turn_stats(tcp_stream_handle_t s, tcp_stream_stats_t *stats);
+
+/**
+ * @brief Print a summary of TCP stream statistics to the log
+ * @param [in] label 	Prefix of the log lines
+ * @param [in] stats 	The statistics
+ */
+void tcp_stream_log_stats(const char *label, const tcp_stream_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
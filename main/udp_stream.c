@@ -0,0 +1,726 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "udp_stream.h"
+#include "resolver.h"
+
+#ifdef CONFIG_AUDIO_TRANSPORT_UDP
+
+#define UDP_STREAM_VERSION			(1)
+#define UDP_STREAM_FEC_PREFIX		(8)
+#define UDP_STREAM_MTU				(UDP_STREAM_HEADER_SIZE + UDP_STREAM_FEC_PREFIX + UDP_STREAM_MAX_PAYLOAD)
+
+#define UDP_STREAM_GROUP			CONFIG_UDP_FEC_GROUP
+#define UDP_STREAM_WINDOW			CONFIG_UDP_REORDER_WINDOW
+/* groups whose parity may still be outstanding */
+#define UDP_STREAM_FEC_SLOTS		(2)
+/* attempts to hand a datagram to lwIP while it is out of buffers */
+#define UDP_STREAM_SEND_RETRIES		(10)
+
+/* sequence numbers wrap, both must divide 65536 */
+#if (UDP_STREAM_GROUP & (UDP_STREAM_GROUP - 1)) || UDP_STREAM_GROUP > 32
+#error "CONFIG_UDP_FEC_GROUP must be a power of two no larger than 32"
+#endif
+#if (UDP_STREAM_WINDOW & (UDP_STREAM_WINDOW - 1))
+#error "CONFIG_UDP_REORDER_WINDOW must be a power of two"
+#endif
+
+static const char *TAG = "UDP_STREAM";
+
+struct udp_stream_slot {
+	uint16_t	seq;
+	uint16_t	len;
+	uint8_t		flags;
+	bool		present;
+	uint8_t		data[UDP_STREAM_MAX_PAYLOAD];
+};
+
+/* running XOR over one FEC group, the parity included once it arrives */
+struct udp_stream_fec {
+	uint16_t	base;
+	uint16_t	len;
+	uint16_t	max_len;
+	uint8_t		flags;
+	uint8_t		k;
+	uint8_t		count;
+	bool		used;
+	bool		has_parity;
+	bool		done;
+	uint32_t	mask;
+	uint32_t	ts;
+	uint8_t		data[UDP_STREAM_MAX_PAYLOAD];
+};
+
+struct udp_stream_context {
+	int							sock;
+	bool						is_open;
+	uint32_t					session;
+	int64_t						opened_ms;
+	unsigned int				timeout_ms;
+	SemaphoreHandle_t			wlock;
+	
+	/* sender */
+	uint16_t					tx_seq;
+	struct udp_stream_fec		tx_fec;
+	uint8_t						tx_pkt[UDP_STREAM_MTU];
+	
+	/* receiver */
+	struct udp_stream_slot		*window;
+	struct udp_stream_fec		rx_fec[UDP_STREAM_FEC_SLOTS];
+	uint16_t					rx_next;
+	uint16_t					rx_highest;
+	bool						rx_synced;
+	int							rx_offset;
+	int64_t						gap_since;
+	uint8_t						rx_pkt[UDP_STREAM_MTU];
+	
+	udp_stream_stats_t			stats;
+};
+
+typedef struct udp_stream_context *udp_stream_context_handle_t;
+
+static inline int64_t udp_stream_now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static inline void udp_stream_put_u16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void udp_stream_put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint16_t udp_stream_get_u16(const uint8_t *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t udp_stream_get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int udp_stream_wait_fd(int fd, unsigned int timeout_ms)
+{
+	struct timeval tv;
+	fd_set rfds;
+	
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	
+	return select(fd + 1, &rfds, NULL, NULL, &tv);
+}
+
+static void udp_stream_fec_add(struct udp_stream_fec *fec, uint8_t flags, uint16_t len, uint32_t ts,
+							   const uint8_t *data, int dlen)
+{
+	fec->flags ^= flags;
+	fec->len ^= len;
+	fec->ts ^= ts;
+	for (int i = 0; i < dlen; i++) {
+		fec->data[i] ^= data[i];
+	}
+	if (dlen > fec->max_len) {
+		fec->max_len = dlen;
+	}
+}
+
+static void udp_stream_fec_reset(struct udp_stream_fec *fec, uint16_t base)
+{
+	memset(fec, 0, sizeof(*fec));
+	fec->base = base;
+	fec->used = true;
+}
+
+/* must be called with the write lock held */
+static void udp_stream_send_datagram(udp_stream_context_handle_t ctx, uint8_t flags, uint16_t seq, uint32_t ts,
+									 const void *prefix, int prefix_len, const void *data, int len)
+{
+	uint8_t *pkt = ctx->tx_pkt;
+	int size = UDP_STREAM_HEADER_SIZE + prefix_len + len;
+	
+	pkt[0] = UDP_STREAM_VERSION;
+	pkt[1] = flags;
+	udp_stream_put_u16(pkt + 2, seq);
+	udp_stream_put_u32(pkt + 4, ts);
+	udp_stream_put_u32(pkt + 8, ctx->session);
+	if (prefix_len > 0) {
+		memcpy(pkt + UDP_STREAM_HEADER_SIZE, prefix, prefix_len);
+	}
+	if (len > 0) {
+		memcpy(pkt + UDP_STREAM_HEADER_SIZE + prefix_len, data, len);
+	}
+	
+	for (int i = 0; i < UDP_STREAM_SEND_RETRIES; i++) {
+		if (send(ctx->sock, pkt, size, 0) >= 0) {
+			return;
+		}
+		if (errno != ENOMEM && errno != EAGAIN && errno != EWOULDBLOCK) {
+			break;
+		}
+		vTaskDelay(1);
+	}
+	
+	/* a datagram which never left counts as lost, the parity may still cover it */
+	ESP_LOGW(TAG, "Dropped datagram %u, errno=%d", seq, errno);
+}
+
+/* must be called with the write lock held */
+static void udp_stream_send_parity(udp_stream_context_handle_t ctx)
+{
+	struct udp_stream_fec *fec = &ctx->tx_fec;
+	uint8_t prefix[UDP_STREAM_FEC_PREFIX];
+	
+	prefix[0] = fec->count;
+	prefix[1] = fec->flags;
+	udp_stream_put_u16(prefix + 2, fec->len);
+	udp_stream_put_u32(prefix + 4, fec->ts);
+	
+	udp_stream_send_datagram(ctx, UDP_STREAM_FLAG_FEC, fec->base, (uint32_t)(udp_stream_now_ms() - ctx->opened_ms),
+							 prefix, sizeof(prefix), fec->data, fec->max_len);
+	ctx->stats.fec_sent++;
+	fec->count = 0;
+}
+
+/* must be called with the write lock held */
+static void udp_stream_send_data(udp_stream_context_handle_t ctx, uint8_t flags, const void *data, int len)
+{
+	struct udp_stream_fec *fec = &ctx->tx_fec;
+	uint16_t seq = ctx->tx_seq++;
+	uint32_t ts = (uint32_t)(udp_stream_now_ms() - ctx->opened_ms);
+	
+	if (fec->count == 0) {
+		udp_stream_fec_reset(fec, seq & ~(UDP_STREAM_GROUP - 1));
+	}
+	
+	udp_stream_send_datagram(ctx, flags, seq, ts, NULL, 0, data, len);
+	udp_stream_fec_add(fec, flags, len, ts, data, len);
+	fec->count++;
+	ctx->stats.sent++;
+	
+	if ((ctx->tx_seq & (UDP_STREAM_GROUP - 1)) == 0) {
+		udp_stream_send_parity(ctx);
+	}
+}
+
+/**
+ * @brief Put a data datagram into the reorder window
+ * @return true if it was stored, false if it was late or a duplicate
+ */
+static bool udp_stream_store(udp_stream_context_handle_t ctx, uint16_t seq, uint8_t flags,
+							 const uint8_t *data, int len)
+{
+	struct udp_stream_slot *slot;
+	int16_t d;
+	
+	if (!ctx->rx_synced) {
+		/* audio always starts on a group boundary, earlier datagrams may still come */
+		ctx->rx_next = seq & ~(UDP_STREAM_GROUP - 1);
+		ctx->rx_highest = seq;
+		ctx->rx_synced = true;
+	}
+	
+	d = (int16_t)(seq - ctx->rx_next);
+	if (d < 0) {
+		ctx->stats.late++;
+		return false;
+	}
+	
+	/* too far ahead, give up on the missing datagrams at the head */
+	while (d >= UDP_STREAM_WINDOW) {
+		slot = &ctx->window[ctx->rx_next & (UDP_STREAM_WINDOW - 1)];
+		if (slot->present && slot->seq == ctx->rx_next) {
+			/* the reader has not caught up, nothing may be dropped */
+			ctx->stats.late++;
+			return false;
+		}
+		ctx->stats.lost++;
+		ctx->rx_next++;
+		ctx->rx_offset = 0;
+		d--;
+	}
+	
+	slot = &ctx->window[seq & (UDP_STREAM_WINDOW - 1)];
+	if (slot->present && slot->seq == seq) {
+		return false;
+	}
+	
+	if ((int16_t)(seq - ctx->rx_highest) < 0) {
+		ctx->stats.reordered++;
+	} else {
+		ctx->rx_highest = seq;
+	}
+	
+	slot->seq = seq;
+	slot->flags = flags;
+	slot->len = len;
+	slot->present = true;
+	if (len > 0) {
+		memcpy(slot->data, data, len);
+	}
+	
+	return true;
+}
+
+static struct udp_stream_fec *udp_stream_rx_fec(udp_stream_context_handle_t ctx, uint16_t base)
+{
+	struct udp_stream_fec *fec = &ctx->rx_fec[(base / UDP_STREAM_GROUP) % UDP_STREAM_FEC_SLOTS];
+	
+	if (!fec->used || fec->base != base) {
+		if (fec->used && (int16_t)(base - fec->base) < 0) {
+			/* an older group than the one being collected */
+			return NULL;
+		}
+		udp_stream_fec_reset(fec, base);
+	}
+	
+	return fec;
+}
+
+static void udp_stream_rx_recover(udp_stream_context_handle_t ctx, struct udp_stream_fec *fec)
+{
+	if (fec->done || !fec->has_parity || fec->count + 1 != fec->k) {
+		return;
+	}
+	
+	/* everything but one datagram is in, the running XOR is the missing one */
+	for (int i = 0; i < fec->k; i++) {
+		if (!(fec->mask & (1u << i))) {
+			if (fec->len <= UDP_STREAM_MAX_PAYLOAD
+				&& udp_stream_store(ctx, fec->base + i, fec->flags, fec->data, fec->len)) {
+				ctx->stats.recovered++;
+			}
+			break;
+		}
+	}
+	
+	fec->done = true;
+}
+
+static void udp_stream_handle_datagram(udp_stream_context_handle_t ctx, const uint8_t *pkt, int n)
+{
+	struct udp_stream_fec *fec;
+	uint16_t seq;
+	uint8_t flags;
+	
+	if (n < UDP_STREAM_HEADER_SIZE || pkt[0] != UDP_STREAM_VERSION
+		|| udp_stream_get_u32(pkt + 8) != ctx->session) {
+		return;
+	}
+	
+	flags = pkt[1];
+	seq = udp_stream_get_u16(pkt + 2);
+	
+	if (flags & UDP_STREAM_FLAG_FEC) {
+		const uint8_t *prefix = pkt + UDP_STREAM_HEADER_SIZE;
+		int dlen = n - UDP_STREAM_HEADER_SIZE - UDP_STREAM_FEC_PREFIX;
+		
+		if (dlen < 0 || prefix[0] == 0 || prefix[0] > UDP_STREAM_GROUP) {
+			return;
+		}
+		
+		fec = udp_stream_rx_fec(ctx, seq);
+		if (!fec || fec->has_parity) {
+			return;
+		}
+		
+		fec->has_parity = true;
+		fec->k = prefix[0];
+		udp_stream_fec_add(fec, prefix[1], udp_stream_get_u16(prefix + 2), udp_stream_get_u32(prefix + 4),
+						   prefix + UDP_STREAM_FEC_PREFIX, dlen);
+		
+		/* a short group was closed by the sender, the rest of it never comes */
+		for (int i = fec->k; i < UDP_STREAM_GROUP; i++) {
+			udp_stream_store(ctx, seq + i, 0, NULL, 0);
+		}
+		
+		udp_stream_rx_recover(ctx, fec);
+		return;
+	}
+	
+	ctx->stats.received++;
+	udp_stream_store(ctx, seq, flags, pkt + UDP_STREAM_HEADER_SIZE, n - UDP_STREAM_HEADER_SIZE);
+	
+	fec = udp_stream_rx_fec(ctx, seq & ~(UDP_STREAM_GROUP - 1));
+	if (fec && !(fec->mask & (1u << (seq & (UDP_STREAM_GROUP - 1))))) {
+		fec->mask |= 1u << (seq & (UDP_STREAM_GROUP - 1));
+		fec->count++;
+		udp_stream_fec_add(fec, flags, n - UDP_STREAM_HEADER_SIZE, udp_stream_get_u32(pkt + 4),
+						   pkt + UDP_STREAM_HEADER_SIZE, n - UDP_STREAM_HEADER_SIZE);
+		udp_stream_rx_recover(ctx, fec);
+	}
+}
+
+/* how far past the missing head the furthest waiting datagram is, 0 if none */
+static int udp_stream_ahead(udp_stream_context_handle_t ctx)
+{
+	int ahead = 0;
+	
+	for (int i = 0; i < UDP_STREAM_WINDOW; i++) {
+		const struct udp_stream_slot *slot = &ctx->window[i];
+		int16_t d = (int16_t)(slot->seq - ctx->rx_next);
+		
+		if (slot->present && d > ahead && d < UDP_STREAM_WINDOW) {
+			ahead = d;
+		}
+	}
+	
+	return ahead;
+}
+
+static void udp_stream_reset(udp_stream_context_handle_t ctx)
+{
+	memset(ctx->window, 0, UDP_STREAM_WINDOW * sizeof(struct udp_stream_slot));
+	memset(ctx->rx_fec, 0, sizeof(ctx->rx_fec));
+	memset(&ctx->tx_fec, 0, sizeof(ctx->tx_fec));
+	ctx->tx_seq = 0;
+	ctx->rx_synced = false;
+	ctx->rx_offset = 0;
+	ctx->gap_since = 0;
+}
+
+static bool udp_stream_open(tcp_stream_handle_t s, char *hostname, int port)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	struct sockaddr_in addr;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	
+	if (resolver_lookup(hostname, &addr.sin_addr) != ESP_OK) {
+		return false;
+	}
+	
+	ctx->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ctx->sock < 0) {
+		return false;
+	}
+	
+	fcntl(ctx->sock, F_SETFL, fcntl(ctx->sock, F_GETFL, 0) | O_NONBLOCK);
+	
+	/* fixes the peer, datagrams from anywhere else are filtered by lwIP */
+	if (connect(ctx->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(ctx->sock);
+		ctx->sock = -1;
+		return false;
+	}
+	
+	udp_stream_reset(ctx);
+	ctx->session = esp_random();
+	ctx->opened_ms = udp_stream_now_ms();
+	ctx->is_open = true;
+	
+	ESP_LOGI(TAG, "Audio datagrams to %s:%d, session %08x", hostname, port, ctx->session);
+	
+	return true;
+}
+
+static bool udp_stream_close(tcp_stream_handle_t s)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	
+	if (!ctx->is_open) {
+		return false;
+	}
+	
+	close(ctx->sock);
+	ctx->sock = -1;
+	ctx->is_open = false;
+	
+	return true;
+}
+
+static int udp_stream_read(tcp_stream_handle_t s, void *buffer, int bufsz)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	int64_t deadline = udp_stream_now_ms() + ctx->timeout_ms;
+	struct udp_stream_slot *slot;
+	int64_t now;
+	unsigned int wait_ms;
+	int n, ahead;
+	
+	for (;;) {
+		slot = &ctx->window[ctx->rx_next & (UDP_STREAM_WINDOW - 1)];
+		if (ctx->rx_synced && slot->present && slot->seq == ctx->rx_next) {
+			ctx->gap_since = 0;
+			
+			n = slot->len - ctx->rx_offset;
+			if (n > bufsz) {
+				n = bufsz;
+			}
+			memcpy(buffer, slot->data + ctx->rx_offset, n);
+			ctx->rx_offset += n;
+			
+			if (ctx->rx_offset == slot->len) {
+				slot->present = false;
+				ctx->rx_next++;
+				ctx->rx_offset = 0;
+				if (slot->flags & UDP_STREAM_FLAG_END) {
+					return 0;
+				}
+			}
+			
+			if (n > 0) {
+				return n;
+			}
+			continue;
+		}
+		
+		now = udp_stream_now_ms();
+		if (now >= deadline) {
+			errno = EAGAIN;
+			return -1;
+		}
+		wait_ms = (unsigned int)(deadline - now);
+		
+		ahead = ctx->rx_synced ? udp_stream_ahead(ctx) : 0;
+		if (ahead > 0) {
+			/* 
+			 * The head is missing but later datagrams are in. Give the
+			 * parity or a late arrival a moment before skipping it. A full
+			 * window cannot wait, the next datagram would find no slot.
+			 */
+			if (!ctx->gap_since) {
+				ctx->gap_since = now;
+			}
+			if (ahead == UDP_STREAM_WINDOW - 1 || now - ctx->gap_since >= CONFIG_UDP_REORDER_DELAY) {
+				ctx->stats.lost++;
+				ctx->rx_next++;
+				ctx->rx_offset = 0;
+				continue;
+			}
+			if (ctx->gap_since + CONFIG_UDP_REORDER_DELAY - now < wait_ms) {
+				wait_ms = (unsigned int)(ctx->gap_since + CONFIG_UDP_REORDER_DELAY - now);
+			}
+		}
+		
+		n = udp_stream_wait_fd(ctx->sock, wait_ms);
+		if (n < 0) {
+			return -1;
+		} else if (n == 0) {
+			continue;
+		}
+		
+		n = recv(ctx->sock, ctx->rx_pkt, sizeof(ctx->rx_pkt), 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				continue;
+			}
+			return -1;
+		}
+		
+		udp_stream_handle_datagram(ctx, ctx->rx_pkt, n);
+	}
+}
+
+static int udp_stream_writev(tcp_stream_handle_t s, const struct iovec *iov, int iovcnt)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	int total = 0;
+	
+	if (!ctx->is_open) {
+		return -1;
+	}
+	
+	xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		int left = iov[i].iov_len;
+		
+		while (left > 0) {
+			int len = left < UDP_STREAM_MAX_PAYLOAD ? left : UDP_STREAM_MAX_PAYLOAD;
+			udp_stream_send_data(ctx, 0, p, len);
+			p += len;
+			left -= len;
+		}
+		total += iov[i].iov_len;
+	}
+	xSemaphoreGive(ctx->wlock);
+	
+	return total;
+}
+
+static int udp_stream_write(tcp_stream_handle_t s, const void *buffer, int bufsz)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buffer,
+		.iov_len = bufsz
+	};
+	
+	return udp_stream_writev(s, &iov, 1);
+}
+
+static int udp_stream_poll(tcp_stream_handle_t s, int events, unsigned int timeout_ms)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	
+	if (!ctx->is_open) {
+		return -1;
+	}
+	
+	/* datagrams are never held back on the sending side */
+	if (events & TCP_STREAM_POLL_WRITE) {
+		return events & TCP_STREAM_POLL_WRITE;
+	}
+	
+	return udp_stream_wait_fd(ctx->sock, timeout_ms) > 0 ? TCP_STREAM_POLL_READ : 0;
+}
+
+static int udp_stream_flush(tcp_stream_handle_t s)
+{
+	return 0;
+}
+
+/**
+ * @brief Create a UDP stream
+ * @return UDP stream handle on success, NULL otherwise
+ */
+tcp_stream_handle_t udp_stream_create(void)
+{
+	tcp_stream_handle_t s;
+	udp_stream_context_handle_t ctx;
+	
+	s = calloc(1, sizeof(struct tcp_stream));
+	if (!s) {
+		return NULL;
+	}
+	
+	ctx = calloc(1, sizeof(struct udp_stream_context));
+	if (!ctx) {
+		free(s);
+		return NULL;
+	}
+	
+	ctx->window = calloc(UDP_STREAM_WINDOW, sizeof(struct udp_stream_slot));
+	ctx->wlock = xSemaphoreCreateMutex();
+	if (!ctx->window || !ctx->wlock) {
+		ESP_LOGE(TAG, "Failed to allocate the reorder window");
+		free(ctx->window);
+		free(ctx);
+		free(s);
+		return NULL;
+	}
+	
+	ctx->sock = -1;
+	ctx->timeout_ms = CONFIG_TCP_TIMEOUT;
+	
+	s->context = ctx;
+	s->open = udp_stream_open;
+	s->close = udp_stream_close;
+	s->read = udp_stream_read;
+	s->write = udp_stream_write;
+	s->writev = udp_stream_writev;
+	s->poll = udp_stream_poll;
+	s->flush = udp_stream_flush;
+	
+	return s;
+}
+
+/**
+ * @brief Destroy a UDP stream
+ * @param [in] s The UDP stream handle
+ */
+void udp_stream_destroy(tcp_stream_handle_t s)
+{
+	if (s) {
+		udp_stream_context_handle_t ctx = s->context;
+		udp_stream_close(s);
+		vSemaphoreDelete(ctx->wlock);
+		free(ctx->window);
+		free(ctx);
+		free(s);
+	}
+}
+
+/**
+ * @brief Get the random session id which tags the datagrams of a UDP stream
+ * @param [in] s The UDP stream handle
+ * @return The session id
+ */
+uint32_t udp_stream_get_session(tcp_stream_handle_t s)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	return ctx->session;
+}
+
+/**
+ * @brief Mark the end of the audio written to a UDP stream
+ * @param [in] s The UDP stream handle
+ * @return 0 on success, -1 on error
+ */
+int udp_stream_finish(tcp_stream_handle_t s)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	
+	if (!ctx->is_open) {
+		return -1;
+	}
+	
+	xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+	udp_stream_send_data(ctx, UDP_STREAM_FLAG_END, NULL, 0);
+	if (ctx->tx_fec.count > 0) {
+		udp_stream_send_parity(ctx);
+		/* the next audio starts a fresh group */
+		ctx->tx_seq = (ctx->tx_seq + UDP_STREAM_GROUP) & ~(UDP_STREAM_GROUP - 1);
+	}
+	xSemaphoreGive(ctx->wlock);
+	
+	return 0;
+}
+
+/**
+ * @brief Get the datagram statistics of a UDP stream
+ * @param [in]  s 		The UDP stream handle
+ * @param [out] stats 	The statistics
+ */
+void udp_stream_get_stats(tcp_stream_handle_t s, udp_stream_stats_t *stats)
+{
+	udp_stream_context_handle_t ctx = s->context;
+	*stats = ctx->stats;
+}
+
+#endif /* CONFIG_AUDIO_TRANSPORT_UDP */
@@ -0,0 +1,128 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _UDP_STREAM_H_
+#define _UDP_STREAM_H_
+
+#include "tcp_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Size of the datagram header
+ *
+ * | version (1) | flags (1) | sequence (2) | timestamp (4) | session (4) |
+ *
+ * Multi-byte fields are in network byte order. The timestamp is in
+ * milliseconds since the sender opened the stream.
+ */
+#define UDP_STREAM_HEADER_SIZE		(12)
+
+/**
+ * Largest payload carried by a single datagram, larger writes are split
+ */
+#define UDP_STREAM_MAX_PAYLOAD		(1024)
+
+/**
+ * The datagram is an XOR parity of its group of data datagrams
+ *
+ * Groups are CONFIG_UDP_FEC_GROUP consecutive sequence numbers aligned to
+ * a multiple of the group size. The parity payload starts with the number
+ * of data datagrams in the group (1), the XOR of their flags (1), lengths
+ * (2) and timestamps (4), followed by the XOR of their payloads.
+ */
+#define UDP_STREAM_FLAG_FEC			(1 << 0)
+
+/**
+ * The datagram ends the audio, read returns 0 once it is reached
+ */
+#define UDP_STREAM_FLAG_END			(1 << 1)
+
+/**
+ * @brief Datagram statistics of a UDP stream
+ */
+typedef struct {
+	uint32_t sent;			/*!< Data datagrams sent */
+	uint32_t fec_sent;		/*!< Parity datagrams sent */
+	uint32_t received;		/*!< Data datagrams received */
+	uint32_t recovered;		/*!< Data datagrams rebuilt from parity */
+	uint32_t reordered;		/*!< Data datagrams which arrived out of order */
+	uint32_t late;			/*!< Datagrams which arrived after being skipped */
+	uint32_t lost;			/*!< Data datagrams skipped as lost */
+} udp_stream_stats_t;
+
+/**
+ * @brief Create a UDP stream
+ *
+ * The stream implements the same interface as a TCP stream. Writes are sent
+ * as sequenced, timestamped datagrams protected by XOR parity, and reads
+ * deliver the received datagrams in order through a small reorder window,
+ * giving up on a missing one after CONFIG_UDP_REORDER_DELAY. The
+ * tcp_stream_* helper functions must not be used on it.
+ *
+ * @return UDP stream handle on success, NULL otherwise
+ */
+tcp_stream_handle_t udp_stream_create(void);
+
+/**
+ * @brief Destroy a UDP stream
+ * @param [in] s The UDP stream handle
+ */
+void udp_stream_destroy(tcp_stream_handle_t s);
+
+/**
+ * @brief Get the random session id which tags the datagrams of a UDP stream
+ *
+ * A new id is chosen every time the stream is opened.
+ *
+ * @param [in] s The UDP stream handle
+ * @return The session id
+ */
+uint32_t udp_stream_get_session(tcp_stream_handle_t s);
+
+/**
+ * @brief Mark the end of the audio written to a UDP stream
+ *
+ * Sends a datagram flagged UDP_STREAM_FLAG_END followed by the parity of
+ * the incomplete group, and starts the next write on a new group.
+ *
+ * @param [in] s The UDP stream handle
+ * @return 0 on success, -1 on error
+ */
+int udp_stream_finish(tcp_stream_handle_t s);
+
+/**
+ * @brief Get the datagram statistics of a UDP stream
+ * @param [in]  s 		The UDP stream handle
+ * @param [out] stats 	The statistics
+ */
+void udp_stream_get_stats(tcp_stream_handle_t s, udp_stream_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UDP_STREAM_H_ */
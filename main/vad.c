@@ -22,57 +22,58 @@
  * SOFTWARE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
-
-#include "lwip/sockets.h"
-#include "lwip/err.h"
 
 #include "esp_log.h"
-#include "esp_vad.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
-#include "audio_element.h"
 #include "audio_common.h"
-#include "audio_pipeline.h"
-#include "i2s_stream.h"
-#include "raw_stream.h"
-#include "board.h"
+#include "audio_event_iface.h"
 
 #include "mubby.h"
 #include "vad.h"
+#include "capture_ring.h"
+#include "endpoint.h"
+
+#ifdef CONFIG_VAD_HANDS_FREE
 
 #define VAD_TASK_SIZE			4096
 #define VAD_TASK_PRIORITY		5
 
-#define VAD_SAMPLE_RATE_HZ 16000
-#define VAD_FRAME_LENGTH_MS 30
-#define VAD_BUFFER_LENGTH (VAD_FRAME_LENGTH_MS * VAD_SAMPLE_RATE_HZ / 1000)
+#define VAD_SAMPLE_RATE_HZ		RECORDER_SAMPLE_RATE
+#define VAD_FRAME_LENGTH_MS		30
+
+/* silence which ends speech, long enough to bridge the gaps between words */
+#define VAD_HANGOVER_MS			600
+
+/* audio waiting for the detector, a quarter of a second at 8 kHz */
+#define VAD_QUEUE_SIZE			4096
+/* largest block queued at once */
+#define VAD_BLOCK_MAX			1024
+/* how long a stop request waits at most */
+#define VAD_POLL_MS				100
+/* how often the work saved by the gate is logged */
+#define VAD_REPORT_MS			60000
 
 static const char *TAG = "VAD";
 
 struct audio_voice_detector {
 	TaskHandle_t 					task;
-	app_context_handle_t			app_ctx;
 	audio_event_iface_handle_t 		external_event;
 	audio_event_iface_handle_t 		internal_event;
-	audio_element_handle_t 			i2s_stream_reader;
-	audio_element_handle_t			filter;
-	audio_element_handle_t			raw_read;
-	audio_pipeline_handle_t			pipeline;
-	tcp_stream_handle_t				stream;
-	bool							is_running;
+	/* filled by voice_detector_feed, emptied by the detector task */
+	capture_ring_handle_t			queue;
+	int16_t							*block;
+	endpoint_handle_t				ep;
+	/* endpointer load at the latest report */
+	endpoint_load_t					load_base;
+	uint32_t						vad_frame_us;
+	volatile bool					is_running;
 };
 
-static int voice_detector_write_cb(audio_element_handle_t el, char *buf, int len, TickType_t wait_time, void *ctx)
-{
-	tcp_stream_handle_t stream = (tcp_stream_handle_t)ctx;
-	int write_len = stream->write(stream, buf, len);
-	return write_len;
-}
-
 static esp_err_t voice_detector_notify_sync(audio_voice_detector_handle_t av, int state)
 {
 	audio_event_iface_msg_t msg;
@@ -83,62 +84,95 @@ static esp_err_t voice_detector_notify_sync(audio_voice_detector_handle_t av, in
 	return audio_event_iface_sendout(av->external_event, &msg);
 }
 
+static void voice_detector_report(audio_voice_detector_handle_t av, uint32_t period_ms)
+{
+	endpoint_load_t load;
+	uint32_t frames, gated, saved_ms;
+	
+	endpoint_get_load(av->ep, &load);
+	frames = load.frames - av->load_base.frames;
+	gated = load.gated - av->load_base.gated;
+	if (!frames || !period_ms) {
+		return;
+	}
+	
+	/* a gated frame saves what a frame costs the VAD, known from the frames it did get */
+	if (frames > gated) {
+		av->vad_frame_us = (uint32_t)((load.vad_us - av->load_base.vad_us) / (frames - gated));
+	}
+	saved_ms = (uint32_t)((uint64_t)gated * av->vad_frame_us / 1000);
+	
+	ESP_LOGI(TAG, "Gate: %u%% of %u frames, %u us per frame, VAD %u us per frame, %u ms of CPU saved (%u.%u%%)",
+			 gated * 100 / frames, frames, (uint32_t)((load.gate_us - av->load_base.gate_us) / frames),
+			 av->vad_frame_us, saved_ms, saved_ms * 100 / period_ms, saved_ms * 1000 / period_ms % 10);
+	
+	av->load_base = load;
+}
+
 static void voice_detector_task(void *pvParameters)
 {
 	audio_voice_detector_handle_t av = (audio_voice_detector_handle_t)pvParameters;
+	capture_ring_stats_t stats;
+	endpoint_stats_t ep_stats;
+	endpoint_event_t event;
+	int64_t reported;
+	int len;
 	
 	audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
 	audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
 	
 	audio_event_iface_set_listener(av->internal_event, evt);
-    
 	
 	/* notify the main task voice_detector is starting now */
 	voice_detector_notify_sync(av, VAD_STATE_STARTED);
 	av->is_running = true;
-	
-	audio_pipeline_run(av->pipeline);
-	
-	vad_handle_t vad_inst = vad_create(VAD_MODE_4, VAD_SAMPLE_RATE_HZ, VAD_FRAME_LENGTH_MS);
-	
-	int16_t *vad_buff = (int16_t *)malloc(VAD_BUFFER_LENGTH * sizeof(short));
-	mem_assert(vad_buff);
+	reported = esp_timer_get_time();
 	
 	for (;;) {
 		audio_event_iface_msg_t msg = {0};
 		
-		esp_err_t ret = audio_event_iface_listen(evt, &msg, portMAX_DELAY);
-		if (ret != ESP_OK) {
-			ESP_LOGE(TAG, "[ * ] Event interface error : %d", ret);
-			continue;
-		}
-		
 		/* voice_detector received the stop instruction from the external */
-		if (msg.source_type == MUBBY_ID_CORE) {
+		if (audio_event_iface_listen(evt, &msg, 0) == ESP_OK && msg.source_type == MUBBY_ID_CORE) {
 			if (!strncmp((char *)msg.data, "stop", 4)) {
 				ESP_LOGW(TAG, "[ * ] Interrupted externally");
 				break;
 			}
 		}
 		
-		raw_stream_read(av->raw_read, (char *)vad_buff, VAD_BUFFER_LENGTH * sizeof(short));
+		if (esp_timer_get_time() - reported >= VAD_REPORT_MS * 1000LL) {
+			voice_detector_report(av, VAD_REPORT_MS);
+			reported += VAD_REPORT_MS * 1000LL;
+		}
+		
+		len = capture_ring_read(av->queue, av->block, VAD_BLOCK_MAX, NULL, NULL, VAD_POLL_MS);
+		if (len <= 0) {
+			continue;
+		}
 		
-		vad_state_t vad_state = vad_process(vad_inst, vad_buff);
-		if (vad_state == VAD_SPEECH) {
-			// TODO: connect to server, send vad_buff to server
+		/* the endpointer cuts the blocks into 30 ms frames, esp_vad runs on those the gate lets through */
+		event = endpoint_feed(av->ep, av->block, len / sizeof(int16_t));
+		if (event == ENDPOINT_SPEECH_START) {
+			endpoint_get_stats(av->ep, &ep_stats);
+			ESP_LOGI(TAG, "Speech started, %d dB over the noise floor", ep_stats.level_db - ep_stats.noise_db);
+			voice_detector_notify_sync(av, VAD_STATE_SPEECH_STARTED);
+		} else if (event == ENDPOINT_SPEECH_END) {
+			voice_detector_notify_sync(av, VAD_STATE_SPEECH_ENDED);
+			/* wait for the next utterance, the noise floor is kept */
+			endpoint_reset(av->ep);
 		}
 	}
 	
 	av->is_running = false;
 	
 	audio_event_iface_remove_listener(evt, av->internal_event);
-	audio_pipeline_terminate(av->pipeline);
 	audio_event_iface_destroy(evt);
-
-	voice_detector_notify_sync(av, VAD_STATE_FINISHED);
 	
-	free(vad_buff);
-	vad_buff = NULL;
+	capture_ring_get_stats(av->queue, &stats);
+	if (stats.overruns) {
+		ESP_LOGW(TAG, "Fell behind %u times, %u bytes of audio skipped", stats.overruns, stats.overrun_bytes);
+	}
+	
+	voice_detector_notify_sync(av, VAD_STATE_FINISHED);
 	
 	vTaskDelete(NULL);
 }
@@ -163,22 +197,23 @@ audio_voice_detector_handle_t voice_detector_create(void)
 	av->internal_event = audio_event_iface_init(&cfg);
 	mem_assert(av->internal_event);
 	
-	/* Create the I2S reader stream */
-	i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
-	i2s_cfg.i2s_config.sample_rate = 8000;
-	i2s_cfg.type = AUDIO_STREAM_READER;
-	av->i2s_stream_reader = i2s_stream_init(&i2s_cfg);
-	mem_assert(av->i2s_stream_reader);
+	endpoint_cfg_t ep_cfg = DEFAULT_ENDPOINT_CONFIG();
+	ep_cfg.sample_rate = VAD_SAMPLE_RATE_HZ;
+	ep_cfg.frame_ms = VAD_FRAME_LENGTH_MS;
+	ep_cfg.min_speech_ms = CONFIG_VAD_HANDS_FREE_MIN_SPEECH_MS;
+	ep_cfg.hangover_ms = VAD_HANGOVER_MS;
+	/* nobody talking is the normal case here */
+	ep_cfg.no_speech_ms = 0;
+	ep_cfg.use_vad = true;
+	/* hours of standby silence, the VAD only needs to see what might be speech */
+	ep_cfg.gate = true;
+	av->ep = endpoint_create(&ep_cfg);
+	mem_assert(av->ep);
 	
-	raw_stream_cfg_t raw_cfg = {
-		.out_rb_size = 8 * 1024,
-		.type = AUDIO_STREAM_READER,
-	};
-	av->raw_read = raw_stream_init(&raw_cfg);
-	
-	audio_pipeline_register(av->pipeline, av->i2s_stream_reader, "i2s");
-	audio_pipeline_register(av->pipeline, av->raw_read, "raw");
-	audio_pipeline_link(av->pipeline, (const char *[]){"i2s", "raw"}, 2);
+	av->queue = capture_ring_create(VAD_QUEUE_SIZE);
+	mem_assert(av->queue);
+	av->block = malloc(VAD_BLOCK_MAX);
+	mem_assert(av->block);
 	
 	av->is_running = false;
 	
@@ -186,21 +221,34 @@ audio_voice_detector_handle_t voice_detector_create(void)
 }
 
 /**
- * @brief Destroy a voice_detector
- * @param [in] ar The voice_detector handle
+ * @brief Destroy a voice_detector, stopping it first
+ * @param [in] av The voice_detector handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
 esp_err_t voice_detector_destroy(audio_voice_detector_handle_t av)
-{	
-	vad_destroy(vad_inst);
-	audio_pipeline_terminate(av->pipeline);
+{
+	if (!av) {
+		return ESP_FAIL;
+	}
+	
+	voice_detector_stop(av);
+	while (av->is_running) {
+		vTaskDelay(pdMS_TO_TICKS(VAD_POLL_MS / 2));
+	}
+	
+	audio_event_iface_destroy(av->internal_event);
+	audio_event_iface_destroy(av->external_event);
+	endpoint_destroy(av->ep);
+	capture_ring_destroy(av->queue);
+	free(av->block);
+	free(av);
 	
 	return ESP_OK;
 }
 
 /**
  * @brief Start the voice_detector
- * @param [in] ar The voice_detector handle
+ * @param [in] av The voice_detector handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
 esp_err_t voice_detector_start(audio_voice_detector_handle_t av)
@@ -215,7 +263,7 @@ esp_err_t voice_detector_start(audio_voice_detector_handle_t av)
 
 /**
  * @brief Stop the voice_detector
- * @param [in] ar The voice_detector handle
+ * @param [in] av The voice_detector handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
 esp_err_t voice_detector_stop(audio_voice_detector_handle_t av)
@@ -234,7 +282,7 @@ esp_err_t voice_detector_stop(audio_voice_detector_handle_t av)
 
 /**
  * @brief Set an event listener
- * @param [in] ar 	The voice_detector handle
+ * @param [in] av 	The voice_detector handle
  * @param [in] evt 	The event listener handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
@@ -244,13 +292,28 @@ esp_err_t voice_detector_set_event_listener(audio_voice_detector_handle_t av, au
 }
 
 /**
- * @brief Set a data stream for the voice_detector
- * @param [in] ar		The voice_detector handle
- * @param [in] stream	The TCP stream
+ * @brief Hand audio to the voice_detector, never blocks
+ * @param [in] pcm 		The samples
+ * @param [in] samples 	The number of samples
+ * @param [in] ctx 		The voice_detector handle
  */
-esp_err_t voice_detector_set_tcp_stream(audio_voice_detector_handle_t av, tcp_stream_handle_t stream)
+void voice_detector_feed(const int16_t *pcm, int samples, void *ctx)
 {
-	av->stream = stream;
-	return audio_element_set_write_cb(av->i2s_stream_reader, voice_detector_write_cb, av->stream);
+	audio_voice_detector_handle_t av = (audio_voice_detector_handle_t)ctx;
+	uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+	int left = samples * sizeof(int16_t), chunk;
+	
+	if (!av->is_running) {
+		return;
+	}
+	
+	/* a full queue drops the block, the capture must not wait for the detector */
+	while (left > 0) {
+		chunk = left < VAD_BLOCK_MAX ? left : VAD_BLOCK_MAX;
+		capture_ring_write(av->queue, pcm, chunk, now, 0);
+		pcm += chunk / sizeof(int16_t);
+		left -= chunk;
+	}
 }
 
+#endif /* CONFIG_VAD_HANDS_FREE */
@@ -25,7 +25,8 @@
 #ifndef _VAD_H_
 #define _VAD_H_
 
-#include "tcp_stream.h"
+#include <stdint.h>
+#include "esp_err.h"
 #include "audio_event_iface.h"
  
 #ifdef __cplusplus
@@ -36,56 +37,69 @@ extern "C" {
 #define VAD_STATE_FINISHED (1)
 #define VAD_STATE_ABORTED	(2)
 #define VAD_STATE_ERROR	(3)
+#define VAD_STATE_SPEECH_STARTED	(4)
+#define VAD_STATE_SPEECH_ENDED	(5)
 
 typedef struct audio_voice_detector *audio_voice_detector_handle_t;
 
 
 /**
  * @brief Create a voice_detector
+ *
+ * The detector listens to the audio handed to voice_detector_feed and
+ * sends VAD_STATE_SPEECH_STARTED to the event listener when someone
+ * starts talking, VAD_STATE_SPEECH_ENDED when they stop.
+ *
  * @return voice_detector handle on success, NULL otherwise
  */
 audio_voice_detector_handle_t voice_detector_create(void);
 
 
 /**
- * @brief Destroy a voice_detector
- * @param [in] ar The voice_detector handle
+ * @brief Destroy a voice_detector, stopping it first
+ * @param [in] av The voice_detector handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
-esp_err_t voice_detector_destroy(audio_voice_detector_handle_t ar);
+esp_err_t voice_detector_destroy(audio_voice_detector_handle_t av);
 
 
 /**
  * @brief Start the voice_detector
- * @param [in] ar The voice_detector handle
+ * @param [in] av The voice_detector handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
-esp_err_t voice_detector_start(audio_voice_detector_handle_t ar);
+esp_err_t voice_detector_start(audio_voice_detector_handle_t av);
 
 
 /**
  * @brief Stop the voice_detector
- * @param [in] ar The voice_detector handle
+ * @param [in] av The voice_detector handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
-esp_err_t voice_detector_stop(audio_voice_detector_handle_t ar);
+esp_err_t voice_detector_stop(audio_voice_detector_handle_t av);
 
 
 /**
  * @brief Set an event listener
- * @param [in] ar 	The voice_detector handle
+ * @param [in] av 	The voice_detector handle
  * @param [in] evt 	The event listener handle
  * @return ESP_OK on success, ESP_FAIL otherwise
  */
-esp_err_t voice_detector_set_event_listener(audio_voice_detector_handle_t ar, audio_event_iface_handle_t evt);
+esp_err_t voice_detector_set_event_listener(audio_voice_detector_handle_t av, audio_event_iface_handle_t evt);
 
 
 /**
- * @brief Set a data stream for the voice_detector
- * @param [in] ar		The voice_detector handle
- * @param [in] stream	The TCP stream
+ * @brief Hand audio to the voice_detector, never blocks
+ *
+ * Takes 16 bit mono audio at RECORDER_SAMPLE_RATE, so it can be given to
+ * recorder_set_monitor as it is. Audio arriving while the detector is
+ * stopped, or faster than it keeps up with, is dropped.
+ *
+ * @param [in] pcm 		The samples
+ * @param [in] samples 	The number of samples
+ * @param [in] ctx 		The voice_detector handle
  */
-esp_err_t voice_detector_set_tcp_stream(audio_voice_detector_handle_t ar, tcp_stream_handle_t stream);
+void voice_detector_feed(const int16_t *pcm, int samples, void *ctx);
  
 #ifdef __cplusplus
 }
@@ -0,0 +1,384 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "audio_common.h"
+#include "audio_event_iface.h"
+
+#include "mubby.h"
+#include "wake_word.h"
+#include "capture_ring.h"
+#include "resample.h"
+
+#ifdef CONFIG_WAKE_WORD
+
+#include "esp_wn_iface.h"
+#include "esp_wn_models.h"
+
+#define WAKE_WORD_TASK_SIZE			8192
+#define WAKE_WORD_TASK_PRIORITY		4
+/* Wi-Fi and lwIP keep core 0 busy */
+#define WAKE_WORD_TASK_CORE			1
+
+/* audio waiting for the spotter, a quarter of a second at 16 kHz */
+#define WAKE_WORD_QUEUE_SIZE		8192
+/* largest block queued at once */
+#define WAKE_WORD_BLOCK_MAX			1024
+/* how long a stop request waits at most */
+#define WAKE_WORD_POLL_MS			100
+/* the CPU budget holds over windows this long */
+#define WAKE_WORD_WINDOW_MS			1000
+/* how often the load is logged */
+#define WAKE_WORD_REPORT_MS			60000
+
+static const char *TAG = "WAKE_WORD";
+
+static const esp_wn_iface_t *wakenet = &WAKENET_MODEL;
+static const model_coeff_getter_t *model_coeff_getter = &WAKENET_COEFF;
+
+struct audio_wake_word {
+	TaskHandle_t 					task;
+	audio_event_iface_handle_t 		external_event;
+	audio_event_iface_handle_t 		internal_event;
+	/* filled by wake_word_feed, emptied by the spotter task */
+	capture_ring_handle_t			queue;
+	int16_t							*block;
+	/* from the capture rate to the model rate, a copy when they match */
+	resample_t						rs;
+	int16_t							*conv;
+	/* what the model takes at once */
+	int16_t							*chunk;
+	int								chunk_samples;
+	int								chunk_len;
+	model_iface_data_t				*model;
+	/* time the model had in the current window */
+	int64_t							window_start;
+	uint32_t						window_us;
+	uint32_t						budget_us;
+	/* counters since the latest report */
+	uint32_t						chunks;
+	uint32_t						skipped;
+	uint64_t						detect_us;
+	volatile bool					is_running;
+};
+
+static esp_err_t wake_word_notify_sync(audio_wake_word_handle_t aw, int state)
+{
+	audio_event_iface_msg_t msg;
+	
+	msg.source_type = MUBBY_ID_WAKE_WORD;
+	msg.data = (void *)state;
+	
+	return audio_event_iface_sendout(aw->external_event, &msg);
+}
+
+static void wake_word_report(audio_wake_word_handle_t aw, uint32_t period_ms)
+{
+	capture_ring_stats_t stats;
+	uint32_t total = aw->chunks + aw->skipped;
+	
+	if (!total) {
+		return;
+	}
+	
+	capture_ring_get_stats(aw->queue, &stats);
+	ESP_LOGI(TAG, "%u chunks, %u us each, %u%% of core %d, %u skipped over budget, %u overruns",
+			 aw->chunks, aw->chunks ? (uint32_t)(aw->detect_us / aw->chunks) : 0,
+			 (uint32_t)(aw->detect_us / 10 / period_ms), WAKE_WORD_TASK_CORE, aw->skipped, stats.overruns);
+	
+	aw->chunks = 0;
+	aw->skipped = 0;
+	aw->detect_us = 0;
+}
+
+/* runs the model on a full chunk, unless the window's budget is spent */
+static void wake_word_detect(audio_wake_word_handle_t aw, uint32_t ts_ms)
+{
+	int64_t now = esp_timer_get_time();
+	uint32_t spent;
+	int word;
+	
+	if (now - aw->window_start >= WAKE_WORD_WINDOW_MS * 1000LL) {
+		aw->window_start = now;
+		aw->window_us = 0;
+	}
+	if (aw->window_us >= aw->budget_us) {
+		aw->skipped++;
+		return;
+	}
+	
+	word = wakenet->detect(aw->model, aw->chunk);
+	spent = (uint32_t)(esp_timer_get_time() - now);
+	aw->window_us += spent;
+	aw->detect_us += spent;
+	aw->chunks++;
+	
+	if (word > 0) {
+		/* from the capture of the latest block to the decision */
+		ESP_LOGI(TAG, "Heard \"%s\", %u ms after capture", wakenet->get_word_name(aw->model, word),
+				 (uint32_t)(esp_timer_get_time() / 1000) - ts_ms);
+		wake_word_notify_sync(aw, WAKE_WORD_STATE_DETECTED);
+	}
+}
+
+static void wake_word_task(void *pvParameters)
+{
+	audio_wake_word_handle_t aw = (audio_wake_word_handle_t)pvParameters;
+	int64_t reported;
+	uint32_t ts;
+	int len, samples, n, i;
+	
+	audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+	audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+	
+	audio_event_iface_set_listener(aw->internal_event, evt);
+	
+	/* notify the main task the spotter is starting now */
+	wake_word_notify_sync(aw, WAKE_WORD_STATE_STARTED);
+	aw->is_running = true;
+	aw->window_start = reported = esp_timer_get_time();
+	aw->window_us = 0;
+	
+	for (;;) {
+		audio_event_iface_msg_t msg = {0};
+		
+		/* the spotter received the stop instruction from the external */
+		if (audio_event_iface_listen(evt, &msg, 0) == ESP_OK && msg.source_type == MUBBY_ID_CORE) {
+			if (!strncmp((char *)msg.data, "stop", 4)) {
+				ESP_LOGW(TAG, "[ * ] Interrupted externally");
+				break;
+			}
+		}
+		
+		if (esp_timer_get_time() - reported >= WAKE_WORD_REPORT_MS * 1000LL) {
+			wake_word_report(aw, WAKE_WORD_REPORT_MS);
+			reported += WAKE_WORD_REPORT_MS * 1000LL;
+		}
+		
+		len = capture_ring_read(aw->queue, aw->block, WAKE_WORD_BLOCK_MAX, &ts, NULL, WAKE_WORD_POLL_MS);
+		if (len <= 0) {
+			continue;
+		}
+		
+		samples = resample_process(&aw->rs, aw->block, len / sizeof(int16_t), aw->conv);
+		for (i = 0; i < samples; i += n) {
+			n = aw->chunk_samples - aw->chunk_len;
+			if (n > samples - i) {
+				n = samples - i;
+			}
+			memcpy(aw->chunk + aw->chunk_len, aw->conv + i, n * sizeof(int16_t));
+			aw->chunk_len += n;
+			
+			if (aw->chunk_len == aw->chunk_samples) {
+				aw->chunk_len = 0;
+				wake_word_detect(aw, ts);
+			}
+		}
+	}
+	
+	aw->is_running = false;
+	
+	audio_event_iface_remove_listener(evt, aw->internal_event);
+	audio_event_iface_destroy(evt);
+	
+	wake_word_notify_sync(aw, WAKE_WORD_STATE_FINISHED);
+	
+	vTaskDelete(NULL);
+}
+
+/**
+ * @brief Create a wake word spotter
+ * @return wake word handle on success, NULL otherwise
+ */
+audio_wake_word_handle_t wake_word_create(void)
+{
+	audio_wake_word_handle_t aw;
+	int rate;
+	
+	aw = calloc(1, sizeof(struct audio_wake_word));
+	if (!aw) {
+		return NULL;
+	}
+	
+#ifdef CONFIG_WAKE_WORD_STRICT
+	aw->model = wakenet->create(model_coeff_getter, DET_MODE_95);
+#else
+	aw->model = wakenet->create(model_coeff_getter, DET_MODE_90);
+#endif
+	if (!aw->model) {
+		ESP_LOGE(TAG, "Failed to load the WakeNet model");
+		goto errout;
+	}
+	
+	rate = wakenet->get_samp_rate(aw->model);
+	aw->chunk_samples = wakenet->get_samp_chunksize(aw->model);
+	if (resample_init(&aw->rs, CONFIG_AUDIO_I2S_SAMPLE_RATE, rate) != 0) {
+		ESP_LOGE(TAG, "Cannot convert %d Hz to %d Hz", CONFIG_AUDIO_I2S_SAMPLE_RATE, rate);
+		goto errout;
+	}
+	
+	aw->queue = capture_ring_create(WAKE_WORD_QUEUE_SIZE);
+	aw->block = malloc(WAKE_WORD_BLOCK_MAX);
+	aw->conv = malloc(RESAMPLE_MAX_OUTPUT(&aw->rs, WAKE_WORD_BLOCK_MAX / sizeof(int16_t)) * sizeof(int16_t));
+	aw->chunk = malloc(aw->chunk_samples * sizeof(int16_t));
+	if (!aw->queue || !aw->block || !aw->conv || !aw->chunk) {
+		goto errout;
+	}
+	
+	/* Create the external and internal event interface */
+	audio_event_iface_cfg_t cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+	aw->external_event = audio_event_iface_init(&cfg);
+	mem_assert(aw->external_event);
+	aw->internal_event = audio_event_iface_init(&cfg);
+	mem_assert(aw->internal_event);
+	
+	aw->budget_us = WAKE_WORD_WINDOW_MS * 1000 / 100 * CONFIG_WAKE_WORD_CPU_BUDGET;
+	aw->is_running = false;
+	
+	ESP_LOGI(TAG, "Listening for %d words at %d Hz in %d ms chunks", wakenet->get_word_num(aw->model),
+			 rate, aw->chunk_samples * 1000 / rate);
+	
+	return aw;
+	
+errout:
+	if (aw->model) {
+		wakenet->destroy(aw->model);
+	}
+	resample_deinit(&aw->rs);
+	capture_ring_destroy(aw->queue);
+	free(aw->block);
+	free(aw->conv);
+	free(aw->chunk);
+	free(aw);
+	return NULL;
+}
+
+/**
+ * @brief Destroy a wake word spotter, stopping it first
+ * @param [in] aw The wake word handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_destroy(audio_wake_word_handle_t aw)
+{
+	if (!aw) {
+		return ESP_FAIL;
+	}
+	
+	wake_word_stop(aw);
+	while (aw->is_running) {
+		vTaskDelay(pdMS_TO_TICKS(WAKE_WORD_POLL_MS / 2));
+	}
+	
+	audio_event_iface_destroy(aw->internal_event);
+	audio_event_iface_destroy(aw->external_event);
+	wakenet->destroy(aw->model);
+	resample_deinit(&aw->rs);
+	capture_ring_destroy(aw->queue);
+	free(aw->block);
+	free(aw->conv);
+	free(aw->chunk);
+	free(aw);
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Start spotting
+ * @param [in] aw The wake word handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_start(audio_wake_word_handle_t aw)
+{
+	if (xTaskCreatePinnedToCore(wake_word_task, "wake_word_task", WAKE_WORD_TASK_SIZE, (void *)aw,
+								WAKE_WORD_TASK_PRIORITY, &aw->task, WAKE_WORD_TASK_CORE) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create wake word task");
+		return ESP_FAIL;
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Stop spotting
+ * @param [in] aw The wake word handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_stop(audio_wake_word_handle_t aw)
+{
+	if (aw->is_running) {
+		audio_event_iface_msg_t msg = {
+			.source_type = MUBBY_ID_CORE,
+			.data = (void *)"stop"
+		};
+
+		return audio_event_iface_sendout(aw->internal_event, &msg);
+	}
+	
+	return ESP_OK;
+}
+
+/**
+ * @brief Set an event listener
+ * @param [in] aw 	The wake word handle
+ * @param [in] evt 	The event listener handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_set_event_listener(audio_wake_word_handle_t aw, audio_event_iface_handle_t evt)
+{
+	return audio_event_iface_set_listener(aw->external_event, evt);
+}
+
+/**
+ * @brief Hand audio to the spotter, never blocks
+ * @param [in] pcm 		The samples
+ * @param [in] samples 	The number of samples
+ * @param [in] ctx 		The wake word handle
+ */
+void wake_word_feed(const int16_t *pcm, int samples, void *ctx)
+{
+	audio_wake_word_handle_t aw = (audio_wake_word_handle_t)ctx;
+	uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+	int left = samples * sizeof(int16_t), chunk;
+	
+	if (!aw->is_running) {
+		return;
+	}
+	
+	/* a full queue drops the block, the capture must not wait for the spotter */
+	while (left > 0) {
+		chunk = left < WAKE_WORD_BLOCK_MAX ? left : WAKE_WORD_BLOCK_MAX;
+		capture_ring_write(aw->queue, pcm, chunk, now, 0);
+		pcm += chunk / sizeof(int16_t);
+		left -= chunk;
+	}
+}
+
+#endif /* CONFIG_WAKE_WORD */
@@ -0,0 +1,112 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+ 
+#ifndef _WAKE_WORD_H_
+#define _WAKE_WORD_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_event_iface.h"
+ 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WAKE_WORD_STATE_STARTED		(0)
+#define WAKE_WORD_STATE_FINISHED	(1)
+#define WAKE_WORD_STATE_ABORTED		(2)
+#define WAKE_WORD_STATE_ERROR		(3)
+#define WAKE_WORD_STATE_DETECTED	(4)
+
+typedef struct audio_wake_word *audio_wake_word_handle_t;
+
+
+/**
+ * @brief Create a wake word spotter
+ *
+ * Runs the WakeNet model chosen in the esp-sr configuration on the audio
+ * handed to wake_word_feed, and sends WAKE_WORD_STATE_DETECTED to the
+ * event listener whenever one of its words is heard.
+ *
+ * @return wake word handle on success, NULL otherwise
+ */
+audio_wake_word_handle_t wake_word_create(void);
+
+
+/**
+ * @brief Destroy a wake word spotter, stopping it first
+ * @param [in] aw The wake word handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_destroy(audio_wake_word_handle_t aw);
+
+
+/**
+ * @brief Start spotting
+ *
+ * The spotter task is pinned to core 1, away from Wi-Fi, and takes no
+ * more than CONFIG_WAKE_WORD_CPU_BUDGET percent of it. Audio it has no
+ * time for is skipped.
+ *
+ * @param [in] aw The wake word handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_start(audio_wake_word_handle_t aw);
+
+
+/**
+ * @brief Stop spotting
+ * @param [in] aw The wake word handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_stop(audio_wake_word_handle_t aw);
+
+
+/**
+ * @brief Set an event listener
+ * @param [in] aw 	The wake word handle
+ * @param [in] evt 	The event listener handle
+ * @return ESP_OK on success, ESP_FAIL otherwise
+ */
+esp_err_t wake_word_set_event_listener(audio_wake_word_handle_t aw, audio_event_iface_handle_t evt);
+
+
+/**
+ * @brief Hand audio to the spotter, never blocks
+ *
+ * Takes 16 bit mono audio at CONFIG_AUDIO_I2S_SAMPLE_RATE, so it can be
+ * given to recorder_set_capture_monitor as it is. Audio arriving while
+ * the spotter is stopped, or faster than it keeps up with, is dropped.
+ *
+ * @param [in] pcm 		The samples
+ * @param [in] samples 	The number of samples
+ * @param [in] ctx 		The wake word handle
+ */
+void wake_word_feed(const int16_t *pcm, int samples, void *ctx);
+ 
+#ifdef __cplusplus
+}
+#endif
+ 
+#endif /* _WAKE_WORD_H_ */
@@ -0,0 +1,37 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _HOST_ESP_LOG_H_
+#define _HOST_ESP_LOG_H_
+
+#include <stdio.h>
+
+/* warnings and errors only, the checks print their own verdict; the rest is still type checked */
+#define ESP_LOGE(tag, fmt, ...)		fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...)		fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)		do { if (0) fprintf(stderr, "%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, fmt, ...)		do { if (0) fprintf(stderr, "%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, fmt, ...)		do { if (0) fprintf(stderr, "%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+
+#endif /* _HOST_ESP_LOG_H_ */
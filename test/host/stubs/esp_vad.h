@@ -0,0 +1,52 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _HOST_ESP_VAD_H_
+#define _HOST_ESP_VAD_H_
+
+#include <stdint.h>
+
+typedef void *vad_handle_t;
+
+typedef enum {
+	VAD_MODE_0 = 0,
+	VAD_MODE_1,
+	VAD_MODE_2,
+	VAD_MODE_3,
+	VAD_MODE_4
+} vad_mode_t;
+
+typedef enum {
+	VAD_SILENCE = 0,
+	VAD_SPEECH
+} vad_state_t;
+
+/*
+ * esp-sr's VAD, provided by the checks which need it
+ */
+vad_handle_t vad_create(vad_mode_t vad_mode, int sample_rate_hz, int one_frame_duration_ms);
+vad_state_t vad_process(vad_handle_t inst, int16_t *data);
+void vad_destroy(vad_handle_t inst);
+
+#endif /* _HOST_ESP_VAD_H_ */
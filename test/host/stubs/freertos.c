@@ -0,0 +1,245 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct host_semaphore {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int count;
+};
+
+struct host_task {
+	pthread_t thread;
+	TaskFunction_t fn;
+	void *arg;
+	/* the notification value, counted up by xTaskNotifyGive */
+	struct host_semaphore notify;
+};
+
+static __thread struct host_task *s_self;
+
+static void host_deadline(struct timespec *deadline, TickType_t ticks)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ticks / 1000;
+	deadline->tv_nsec += (long)(ticks % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* a task deleted while it waits must not take the lock with it */
+static void host_unlock(void *lock)
+{
+	pthread_mutex_unlock(lock);
+}
+
+static void host_semaphore_init(struct host_semaphore *sem, int count)
+{
+	pthread_condattr_t attr;
+	
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&sem->lock, NULL);
+	pthread_cond_init(&sem->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	sem->count = count;
+}
+
+/* waits until the count is not 0, with the lock held on return */
+static int host_semaphore_wait(struct host_semaphore *sem, TickType_t ticks)
+{
+	struct timespec deadline;
+	int ret = 0;
+	
+	host_deadline(&deadline, ticks);
+	
+	pthread_mutex_lock(&sem->lock);
+	pthread_cleanup_push(host_unlock, &sem->lock);
+	while (!sem->count && ret != ETIMEDOUT) {
+		if (ticks == portMAX_DELAY) {
+			pthread_cond_wait(&sem->cond, &sem->lock);
+		} else {
+			ret = pthread_cond_timedwait(&sem->cond, &sem->lock, &deadline);
+		}
+	}
+	pthread_cleanup_pop(0);
+	
+	return sem->count;
+}
+
+static SemaphoreHandle_t host_semaphore_create(int count)
+{
+	SemaphoreHandle_t sem = calloc(1, sizeof(struct host_semaphore));
+	
+	if (!sem) {
+		return NULL;
+	}
+	
+	host_semaphore_init(sem, count);
+	
+	return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return host_semaphore_create(0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return host_semaphore_create(1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	BaseType_t taken = pdFALSE;
+	
+	if (host_semaphore_wait(sem, ticks)) {
+		sem->count--;
+		taken = pdTRUE;
+	}
+	pthread_mutex_unlock(&sem->lock);
+	
+	return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	BaseType_t given = pdFALSE;
+	
+	pthread_mutex_lock(&sem->lock);
+	if (!sem->count) {
+		sem->count = 1;
+		given = pdTRUE;
+		pthread_cond_signal(&sem->cond);
+	}
+	pthread_mutex_unlock(&sem->lock);
+	
+	return given;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+	pthread_cond_destroy(&sem->cond);
+	pthread_mutex_destroy(&sem->lock);
+	free(sem);
+}
+
+static void *host_task_main(void *arg)
+{
+	struct host_task *task = arg;
+	
+	s_self = task;
+	task->fn(task->arg);
+	
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+					   UBaseType_t priority, TaskHandle_t *task)
+{
+	struct host_task *t = calloc(1, sizeof(struct host_task));
+	
+	if (!t) {
+		return pdFALSE;
+	}
+	
+	t->fn = fn;
+	t->arg = arg;
+	host_semaphore_init(&t->notify, 0);
+	
+	if (pthread_create(&t->thread, NULL, host_task_main, t)) {
+		free(t);
+		return pdFALSE;
+	}
+	
+	if (task) {
+		*task = t;
+	}
+	
+	return pdPASS;
+}
+
+/* the task is stopped at its next wait, and gone on return */
+void vTaskDelete(TaskHandle_t task)
+{
+	if (!task || task == s_self) {
+		pthread_exit(NULL);
+	}
+	
+	pthread_cancel(task->thread);
+	pthread_join(task->thread, NULL);
+	pthread_cond_destroy(&task->notify.cond);
+	pthread_mutex_destroy(&task->notify.lock);
+	free(task);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+	struct host_semaphore *sem = &s_self->notify;
+	uint32_t value = host_semaphore_wait(sem, ticks);
+	
+	if (value) {
+		sem->count = clear ? 0 : sem->count - 1;
+	}
+	pthread_mutex_unlock(&sem->lock);
+	
+	return value;
+}
+
+void xTaskNotifyGive(TaskHandle_t task)
+{
+	pthread_mutex_lock(&task->notify.lock);
+	task->notify.count++;
+	pthread_cond_signal(&task->notify.cond);
+	pthread_mutex_unlock(&task->notify.lock);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	struct timespec ts = {
+		.tv_sec = ticks / 1000,
+		.tv_nsec = (long)(ticks % 1000) * 1000000
+	};
+	
+	nanosleep(&ts, NULL);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
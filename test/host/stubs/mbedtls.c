@@ -0,0 +1,137 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * SHA-1 and Base64 as the WebSocket upgrade uses them, from FIPS 180-4 and
+ * RFC 4648
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+static inline uint32_t rol(uint32_t x, int n)
+{
+	return x << n | x >> (32 - n);
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+	uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f, k, t;
+	
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	}
+	for (int i = 16; i < 80; i++) {
+		w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	
+	for (int i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol(b, 30);
+		b = a;
+		a = t;
+	}
+	
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+int mbedtls_sha1_ret(const unsigned char *input, size_t ilen, unsigned char output[20])
+{
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	unsigned char last[128] = { 0 };
+	uint64_t bits = (uint64_t)ilen * 8;
+	size_t full = ilen & ~(size_t)63, tail = ilen - full;
+	int blocks = tail < 56 ? 1 : 2;
+	
+	for (size_t i = 0; i < full; i += 64) {
+		sha1_block(h, input + i);
+	}
+	
+	memcpy(last, input + full, tail);
+	last[tail] = 0x80;
+	for (int i = 0; i < 8; i++) {
+		last[blocks * 64 - 1 - i] = bits >> (8 * i);
+	}
+	for (int i = 0; i < blocks; i++) {
+		sha1_block(h, last + 64 * i);
+	}
+	
+	for (int i = 0; i < 20; i++) {
+		output[i] = h[i / 4] >> (24 - 8 * (i % 4));
+	}
+	return 0;
+}
+
+int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+	static const char s_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t n = 0;
+	
+	*olen = (slen + 2) / 3 * 4 + 1;
+	if (dlen < *olen) {
+		return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+	}
+	
+	for (size_t i = 0; i < slen; i += 3) {
+		uint32_t v = src[i] << 16;
+		
+		if (i + 1 < slen) {
+			v |= src[i + 1] << 8;
+		}
+		if (i + 2 < slen) {
+			v |= src[i + 2];
+		}
+		dst[n++] = s_alphabet[v >> 18 & 63];
+		dst[n++] = s_alphabet[v >> 12 & 63];
+		dst[n++] = i + 1 < slen ? s_alphabet[v >> 6 & 63] : '=';
+		dst[n++] = i + 2 < slen ? s_alphabet[v & 63] : '=';
+	}
+	dst[n] = '\0';
+	
+	/* the terminator is not counted */
+	*olen = n;
+	return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The options the host builds are checked with, the Kconfig defaults
+ * unless a check needs otherwise
+ */
+
+#ifndef _HOST_SDKCONFIG_H_
+#define _HOST_SDKCONFIG_H_
+
+#define CONFIG_TCP_TIMEOUT				2000
+/* short, the check waits it out */
+#define CONFIG_TCP_CONNECT_TIMEOUT		1000
+#ifndef CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE
+#define CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE	1436
+#endif
+#define CONFIG_TCP_STREAM_FLUSH_INTERVAL	40
+#define CONFIG_TCP_STREAM_READ_AHEAD_SIZE	4096
+#define CONFIG_TCP_STREAM_WEBSOCKET_PATH	"/"
+#define CONFIG_AUDIO_TRANSPORT_UDP		1
+#define CONFIG_UDP_FEC_GROUP			4
+#define CONFIG_UDP_REORDER_WINDOW		8
+#define CONFIG_UDP_REORDER_DELAY		60
+#define CONFIG_LINK_TIMEOUT_MIN			500
+#define CONFIG_LINK_TIMEOUT_MAX			8000
+#define CONFIG_LINK_BITRATE_MIN			16000
+#define CONFIG_LINK_BITRATE_MAX			128000
+#define CONFIG_RECORDER_ENDPOINT_HANGOVER_MS	700
+#define CONFIG_RECORDER_ENDPOINT_NO_SPEECH_MS	6000
+#define CONFIG_RECORDER_DTX_HANGOVER_MS		400
+
+#endif /* _HOST_SDKCONFIG_H_ */
@@ -0,0 +1,226 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks the IMA-ADPCM kernel against the sample at a time reference
+ * byte for byte, and with "bench" measures both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "adpcm.h"
+#include "bench.h"
+
+#define RATE			16000
+#define SIGNAL_SAMPLES	(RATE * 4)
+#define MAX_BLOCK		1017
+#define BENCH_RUNS		20
+
+static int s_failures;
+
+static uint32_t s_seed = 1;
+
+static int16_t noise(void)
+{
+	s_seed = s_seed * 1664525 + 1013904223;
+	return (int16_t)(s_seed >> 16);
+}
+
+/* speech-like and pathological material, one after the other */
+static void make_signal(int16_t *pcm, int samples)
+{
+	for (int i = 0; i < samples; i++) {
+		int part = i * 5 / samples;
+		double t = (double)i / RATE;
+		
+		switch (part) {
+		case 0:
+			/* a sweep from 100 Hz to 7 kHz at two levels */
+			pcm[i] = (int16_t)((i & 0x2000 ? 30000 : 3000) * sin(2 * M_PI * (100 + 1000 * t) * t));
+			break;
+		case 1:
+			pcm[i] = noise();
+			break;
+		case 2:
+			/* full scale steps drive the index to both ends */
+			pcm[i] = (i / 40) & 1 ? INT16_MAX : INT16_MIN;
+			break;
+		case 3:
+			pcm[i] = 0;
+			break;
+		default:
+			pcm[i] = (int16_t)(noise() >> 6);
+			break;
+		}
+	}
+}
+
+static void check(int ok, const char *what, int at)
+{
+	if (!ok) {
+		if (s_failures++ < 10) {
+			printf("  FAIL %s at sample %d\n", what, at);
+		}
+	}
+}
+
+/* blocks of every size from 1 sample up, each encoded and decoded by both */
+static void test_blocks(const int16_t *pcm, int samples)
+{
+	adpcm_state_t kernel = { 0 }, ref = { 0 };
+	uint8_t kbuf[ADPCM_HEADER_SIZE + MAX_BLOCK], rbuf[ADPCM_HEADER_SIZE + MAX_BLOCK];
+	int16_t kpcm[MAX_BLOCK + 1], rpcm[MAX_BLOCK + 1];
+	int pos = 0, size = 1;
+	
+	while (pos < samples) {
+		int n = samples - pos < size ? samples - pos : size;
+		int klen = adpcm_encode_block(&kernel, pcm + pos, n, kbuf);
+		int rlen = adpcm_ref_encode_block(&ref, pcm + pos, n, rbuf);
+		
+		check(klen == rlen && !memcmp(kbuf, rbuf, klen), "encoded block", pos);
+		check(kernel.predictor == ref.predictor && kernel.index == ref.index, "encoder state", pos);
+		
+		int kn = adpcm_decode_block(kbuf, klen, kpcm);
+		int rn = adpcm_ref_decode_block(kbuf, klen, rpcm);
+		
+		check(kn == rn && kn == n + !(n & 1), "decoded length", pos);
+		check(kn == rn && !memcmp(kpcm, rpcm, kn * sizeof(int16_t)), "decoded block", pos);
+		check(kpcm[0] == pcm[pos], "verbatim first sample", pos);
+		
+		pos += n;
+		size = size % MAX_BLOCK + 1;
+	}
+}
+
+/* every byte value after every step index, the whole decoder state space */
+static void test_decoder(void)
+{
+	uint8_t block[ADPCM_HEADER_SIZE + 256];
+	int16_t kpcm[ADPCM_BLOCK_SAMPLES(sizeof(block))], rpcm[ADPCM_BLOCK_SAMPLES(sizeof(block))];
+	
+	for (int index = 0; index <= 89; index++) {
+		for (int first = -32768; first < 32768; first += 4369) {
+			block[0] = first & 0xff;
+			block[1] = (first >> 8) & 0xff;
+			block[2] = index;
+			block[3] = 0;
+			for (int i = 0; i < 256; i++) {
+				block[ADPCM_HEADER_SIZE + i] = (uint8_t)(i * 97 + index);
+			}
+			
+			int kn = adpcm_decode_block(block, sizeof(block), kpcm);
+			int rn = adpcm_ref_decode_block(block, sizeof(block), rpcm);
+			
+			check(kn == rn, "malformed block verdict", index);
+			check(kn < 0 || !memcmp(kpcm, rpcm, kn * sizeof(int16_t)), "decoded state space", index);
+			check(index <= 88 || kn == -1, "step index out of range accepted", index);
+		}
+	}
+	
+	check(adpcm_decode_block(block, ADPCM_HEADER_SIZE - 1, kpcm) == -1, "short block accepted", 0);
+}
+
+static double snr_db(const int16_t *a, const int16_t *b, int samples)
+{
+	double sig = 0, err = 0;
+	
+	for (int i = 0; i < samples; i++) {
+		sig += (double)a[i] * a[i];
+		err += (double)(a[i] - b[i]) * (a[i] - b[i]);
+	}
+	
+	return err > 0 ? 10 * log10(sig / err) : INFINITY;
+}
+
+static void bench(const int16_t *pcm, int samples)
+{
+	int block = ADPCM_BLOCK_SAMPLES(256);
+	int blocks = samples / block;
+	uint8_t *enc = malloc(blocks * 256);
+	int16_t *dec = malloc(blocks * block * sizeof(int16_t));
+	uint64_t best[4] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+	
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		adpcm_state_t state = { 0 };
+		uint64_t t[5];
+		
+		t[0] = bench_now();
+		for (int b = 0; b < blocks; b++) {
+			adpcm_encode_block(&state, pcm + b * block, block, enc + b * 256);
+		}
+		t[1] = bench_now();
+		memset(&state, 0, sizeof(state));
+		for (int b = 0; b < blocks; b++) {
+			adpcm_ref_encode_block(&state, pcm + b * block, block, enc + b * 256);
+		}
+		t[2] = bench_now();
+		for (int b = 0; b < blocks; b++) {
+			adpcm_decode_block(enc + b * 256, 256, dec + b * block);
+		}
+		t[3] = bench_now();
+		for (int b = 0; b < blocks; b++) {
+			adpcm_ref_decode_block(enc + b * 256, 256, dec + b * block);
+		}
+		t[4] = bench_now();
+		
+		for (int i = 0; i < 4; i++) {
+			if (t[i + 1] - t[i] < best[i]) {
+				best[i] = t[i + 1] - t[i];
+			}
+		}
+	}
+	
+	printf("adpcm, blocks of %d samples:\n", block);
+	BENCH_REPORT("encode", best[0], blocks * block);
+	BENCH_REPORT("encode (reference)", best[1], blocks * block);
+	BENCH_REPORT("decode", best[2], blocks * block);
+	BENCH_REPORT("decode (reference)", best[3], blocks * block);
+	printf("  sweep SNR %.1f dB\n", snr_db(pcm, dec, samples / 5));
+	
+	free(enc);
+	free(dec);
+}
+
+int main(int argc, char *argv[])
+{
+	int16_t *pcm = malloc(SIGNAL_SAMPLES * sizeof(int16_t));
+	
+	make_signal(pcm, SIGNAL_SAMPLES);
+	
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench(pcm, SIGNAL_SAMPLES);
+		free(pcm);
+		return 0;
+	}
+	
+	test_blocks(pcm, SIGNAL_SAMPLES);
+	test_decoder();
+	free(pcm);
+	
+	printf("adpcm: %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks the capture ring on its own and with a writer running at a
+ * steady rate against a reader which stalls now and then, the way the
+ * capture callback runs against a sender stuck in a socket write.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+/* built in, so the checks can place the indices right before the 2^32 wrap */
+#include "capture_ring.c"
+
+#define RING_SIZE			4096
+#define RECORDS				20000
+#define RECORD_MAX			200
+#define WRITE_INTERVAL_US	100
+#define STALL_EVERY			500
+#define STALL_MS			20
+
+static int s_failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+static int record_len(uint32_t seq)
+{
+	return 1 + seq * 37 % RECORD_MAX;
+}
+
+static void record_fill(uint8_t *buf, uint32_t seq)
+{
+	for (int i = 0; i < record_len(seq); i++) {
+		buf[i] = (uint8_t)(seq * 31 + i);
+	}
+}
+
+static int record_intact(const uint8_t *buf, int len, uint32_t seq)
+{
+	if (len != record_len(seq)) {
+		return 0;
+	}
+	for (int i = 0; i < len; i++) {
+		if (buf[i] != (uint8_t)(seq * 31 + i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void test_limits(void)
+{
+	capture_ring_handle_t r = capture_ring_create(RING_SIZE + 100);
+	uint8_t buf[RING_SIZE];
+	capture_ring_stats_t stats;
+	int writes = 0;
+	
+	CHECK(r->size == RING_SIZE, "size %u not rounded down to a power of two", r->size);
+	CHECK(capture_ring_write(r, buf, RING_SIZE, 0, 0) == -1, "a record larger than the ring accepted");
+	
+	/* fill up, the record which does not fit is dropped and the queue kept */
+	while (capture_ring_write(r, buf, 100, writes, 0) == 100) {
+		writes++;
+	}
+	capture_ring_get_stats(r, &stats);
+	CHECK(writes == RING_SIZE / 108, "%d records of 100 bytes fit", writes);
+	CHECK(stats.overruns == 1 && stats.overrun_bytes == 100, "overrun not counted");
+	CHECK(stats.high_water == writes * 108u, "high water %u", stats.high_water);
+	
+	/* a record too large for the reader is dropped, the next one comes out */
+	CHECK(capture_ring_read(r, buf, 50, NULL, NULL, 0) == -1, "oversized record read");
+	uint32_t ts;
+	CHECK(capture_ring_read(r, buf, sizeof(buf), &ts, NULL, 0) == 100 && ts == 1, "record after an oversized one");
+	capture_ring_get_stats(r, &stats);
+	CHECK(stats.oversized == 1 && stats.records_out == 1, "oversized not counted");
+	CHECK(stats.used == (writes - 2) * 108u, "fill level %u", stats.used);
+	
+	capture_ring_destroy(r);
+}
+
+static void test_wrap(void)
+{
+	capture_ring_handle_t r = capture_ring_create(RING_SIZE);
+	uint8_t buf[RECORD_MAX];
+	uint32_t ts;
+	uint16_t flags;
+	
+	/* the byte counters overflow in the middle of this */
+	r->head = r->tail = 0xffffffffu - 3 * RING_SIZE + 17;
+	
+	for (uint32_t seq = 0; seq < 400; seq++) {
+		record_fill(buf, seq);
+		CHECK(capture_ring_write(r, buf, record_len(seq), seq, (uint16_t)~seq) == record_len(seq),
+			  "write %u across the wrap", seq);
+		
+		int len = capture_ring_read(r, buf, sizeof(buf), &ts, &flags, 0);
+		CHECK(ts == seq && flags == (uint16_t)~seq && record_intact(buf, len, seq), "read %u across the wrap", seq);
+	}
+	
+	capture_ring_destroy(r);
+}
+
+static void test_trim(void)
+{
+	capture_ring_handle_t r = capture_ring_create(RING_SIZE);
+	uint8_t buf[RECORD_MAX];
+	uint32_t ts;
+	
+	/* capture times which wrap, trimming compares them modulo 2^32 */
+	for (uint32_t i = 0; i < 20; i++) {
+		capture_ring_write(r, buf, 10, 0xfffffff6u + i, 0);
+	}
+	
+	capture_ring_trim(r, 3);
+	CHECK(capture_ring_read(r, buf, sizeof(buf), &ts, NULL, 0) == 10 && ts == 3, "trim across the wrap kept %u", ts);
+	
+	capture_ring_trim(r, 100);
+	CHECK(capture_ring_read(r, buf, sizeof(buf), &ts, NULL, 0) == 0, "trim left a record behind");
+	
+	int64_t started = now_us();
+	CHECK(capture_ring_read(r, buf, sizeof(buf), &ts, NULL, 30) == 0, "read on an empty ring");
+	CHECK(now_us() - started >= 25000, "read on an empty ring returned early");
+	
+	capture_ring_destroy(r);
+}
+
+struct stall_test {
+	capture_ring_handle_t r;
+	uint8_t dropped[RECORDS];
+	uint32_t written;
+	uint32_t overruns;
+	int64_t longest_write_us;
+	int done;
+};
+
+static void *stall_writer(void *arg)
+{
+	struct stall_test *t = arg;
+	uint8_t buf[RECORD_MAX];
+	
+	for (uint32_t seq = 0; seq < RECORDS; seq++) {
+		int len = record_len(seq);
+		int64_t started;
+		int ret;
+		
+		record_fill(buf, seq);
+		started = now_us();
+		ret = capture_ring_write(t->r, buf, len, seq, (uint16_t)seq);
+		if (now_us() - started > t->longest_write_us) {
+			t->longest_write_us = now_us() - started;
+		}
+		
+		if (ret == 0) {
+			/* published to the reader by the next successful write */
+			t->dropped[seq] = 1;
+			t->overruns++;
+		} else if (ret == len) {
+			t->written++;
+		} else {
+			CHECK(0, "write %u returned %d", seq, ret);
+		}
+		
+		usleep(WRITE_INTERVAL_US);
+	}
+	
+	__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void test_stalls(void)
+{
+	struct stall_test *t = calloc(1, sizeof(*t));
+	capture_ring_stats_t stats;
+	uint8_t buf[RECORD_MAX];
+	uint32_t next = 0, received = 0, ts;
+	uint16_t flags;
+	pthread_t writer;
+	
+	t->r = capture_ring_create(RING_SIZE);
+	pthread_create(&writer, NULL, stall_writer, t);
+	
+	for (;;) {
+		int done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+		int len = capture_ring_read(t->r, buf, sizeof(buf), &ts, &flags, 10);
+		
+		if (len == 0) {
+			if (done) {
+				break;
+			}
+			continue;
+		}
+		
+		CHECK((int32_t)(ts - next) >= 0, "record %u after %u", ts, next - 1);
+		for (; next < ts; next++) {
+			CHECK(t->dropped[next], "record %u neither read nor dropped", next);
+		}
+		CHECK(!t->dropped[ts], "dropped record %u read", ts);
+		CHECK(flags == (uint16_t)ts && record_intact(buf, len, ts), "record %u torn", ts);
+		next = ts + 1;
+		
+		/* the sender stuck in a socket write */
+		if (++received % STALL_EVERY == 0) {
+			usleep(STALL_MS * 1000);
+		}
+	}
+	pthread_join(writer, NULL);
+	
+	for (; next < RECORDS; next++) {
+		CHECK(t->dropped[next], "record %u lost at the end", next);
+	}
+	
+	capture_ring_get_stats(t->r, &stats);
+	CHECK(stats.records_in == t->written && stats.records_out == received, "record counters");
+	CHECK(stats.overruns == t->overruns, "%u overruns counted, %u seen", stats.overruns, t->overruns);
+	CHECK(received + t->overruns == RECORDS, "%u read and %u dropped of %u", received, t->overruns, RECORDS);
+	CHECK(t->overruns > 0, "the stalls never filled the ring");
+	CHECK(stats.used == 0 && stats.high_water <= stats.size, "fill level %u, high water %u", stats.used, stats.high_water);
+	
+	printf("  %u records, %u dropped during %u stalls, longest write %lld us\n",
+		   RECORDS, t->overruns, received / STALL_EVERY, (long long)t->longest_write_us);
+	
+	capture_ring_destroy(t->r);
+	free(t);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		return 0;
+	}
+	
+	test_limits();
+	test_wrap();
+	test_trim();
+	test_stalls();
+	
+	printf("capture_ring: %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,339 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Runs silence, speech and silence through the recorder's DTX path: the
+ * endpointer gates each 20 ms record with the hangover, dtx holds the
+ * last silent ones back as lead-in and leaves the rest out, and
+ * protocol_send_silence describes them on a stream kept in memory. Checks that no speech is left out, that the markers
+ * add up to the silence they stand for, and what it saves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sdkconfig.h"
+/* DTX is only offered with the audio on the TCP stream */
+#undef CONFIG_AUDIO_TRANSPORT_UDP
+#include "protocol.c"
+#include "endpoint.h"
+#include "dtx.h"
+#include "esp_vad.h"
+
+/* as the recorder has them */
+#define RATE			8000
+#define RECORD_MS		20
+#define RECORD_SAMPLES	(RATE * RECORD_MS / 1000)
+#define DTX_MAX_MS		1000
+#define DTX_LEAD_MS		100
+
+#define LEAD_MS			2000
+#define SPEECH_MS		1500
+#define TAIL_MS			2500
+#define TOTAL_MS		(LEAD_MS + SPEECH_MS + TAIL_MS)
+#define MAX_FRAMES		(TOTAL_MS / RECORD_MS * 2)
+#define WORDS			3
+#define WORD_MS			(SPEECH_MS / WORDS)
+/* each word is followed by a pause */
+#define PAUSE_MS		100
+
+static int s_failures;
+
+static uint32_t s_seed = 1;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+/* what the server would have received */
+static uint8_t s_wire[TOTAL_MS * RATE / 1000 * 2 + MAX_FRAMES * (PROTOCOL_HEADER_SIZE + 3)];
+static int s_wire_len;
+
+static int mem_write(tcp_stream_handle_t s, const void *buf, int len)
+{
+	if (s_wire_len + len > (int)sizeof(s_wire)) {
+		return -1;
+	}
+	memcpy(s_wire + s_wire_len, buf, len);
+	s_wire_len += len;
+	return len;
+}
+
+static int mem_writev(tcp_stream_handle_t s, const struct iovec *iov, int iovcnt)
+{
+	int total = 0;
+	
+	for (int i = 0; i < iovcnt; i++) {
+		if (mem_write(s, iov[i].iov_base, iov[i].iov_len) < 0) {
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+static int mem_flush(tcp_stream_handle_t s)
+{
+	return 0;
+}
+
+static int16_t noise(void)
+{
+	s_seed = s_seed * 1664525 + 1013904223;
+	return (int16_t)(s_seed >> 16);
+}
+
+/* background throughout, three words in the middle */
+static int16_t *synthesize(int noise_db, int speech_db)
+{
+	int16_t *pcm = calloc(TOTAL_MS * RATE / 1000, sizeof(int16_t));
+	double noise_amp = 32768.0 * pow(10, noise_db / 20.0) * sqrt(3.0);
+	double speech_amp = 32768.0 * pow(10, speech_db / 20.0);
+	int lp = 0;
+	
+	for (int w = 0; w < WORDS; w++) {
+		int from = (LEAD_MS + w * WORD_MS) * RATE / 1000;
+		int n = (WORD_MS - PAUSE_MS) * RATE / 1000;
+		double f0 = 120 + 30 * w;
+		
+		for (int i = 0; i < n; i++) {
+			double env = 0.5 - 0.5 * cos(2 * M_PI * i / n), v = 0;
+			
+			for (int h = 1; h <= 10 && h * f0 < RATE / 2; h++) {
+				v += sin(2 * M_PI * h * f0 * i / RATE) / h;
+			}
+			pcm[from + i] = (int16_t)(speech_amp * env * v);
+		}
+	}
+	
+	for (int i = 0; i < TOTAL_MS * RATE / 1000; i++) {
+		int v;
+		
+		lp += (noise() - lp) / 2;
+		v = pcm[i] + (int)(noise_amp * lp / 32768);
+		pcm[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+	}
+	
+	return pcm;
+}
+
+static int send_silence(protocol_handle_t p, endpoint_handle_t ep, uint32_t ms)
+{
+	endpoint_stats_t stats;
+	
+	if (ms == 0) {
+		return 0;
+	}
+	endpoint_get_stats(ep, &stats);
+	return protocol_send_silence(p, ms, stats.noise_db);
+}
+
+/**
+ * @brief What went out for one upload
+ */
+typedef struct {
+	int audio_ms;			/* audio uploaded */
+	int silence_ms;			/* silence the markers stand for */
+	int markers;
+	int max_marker_ms;
+	int level_db;			/* of the last marker */
+	int speech_left_out;	/* ms of the words a marker stands for */
+	int tail_audio_ms;		/* audio uploaded after the last word */
+	int end_ms;				/* where the server puts the end of the upload */
+	int wire_bytes;
+	dtx_t dtx;
+} upload_t;
+
+/* the recorder's monitor, sink and sender for each record in turn */
+static void upload(const int16_t *pcm, upload_t *u)
+{
+	tcp_stream_t stream = {
+		.write = mem_write,
+		.writev = mem_writev,
+		.flush = mem_flush,
+	};
+	endpoint_cfg_t cfg = DEFAULT_ENDPOINT_CONFIG();
+	protocol_handle_t p = protocol_create(&stream);
+	endpoint_handle_t ep;
+	const void *lead;
+	int lead_len;
+	
+	cfg.sample_rate = RATE;
+	cfg.use_vad = false;
+	ep = endpoint_create(&cfg);
+	
+	memset(u, 0, sizeof(*u));
+	s_wire_len = 0;
+	dtx_init(&u->dtx, RATE, DTX_MAX_MS, DTX_LEAD_MS);
+	
+	for (int ms = 0; ms < TOTAL_MS; ms += RECORD_MS) {
+		const int16_t *rec = pcm + ms * RATE / 1000;
+		bool silent;
+		
+		endpoint_feed(ep, rec, RECORD_SAMPLES);
+		silent = endpoint_silence_ms(ep) >= CONFIG_RECORDER_DTX_HANGOVER_MS;
+		
+		if (silent) {
+			send_silence(p, ep, dtx_skip(&u->dtx, rec, RECORD_SAMPLES, RECORD_SAMPLES * 2));
+			continue;
+		}
+		
+		send_silence(p, ep, dtx_take(&u->dtx));
+		while ((lead = dtx_lead_peek(&u->dtx, &lead_len))) {
+			protocol_send_audio(p, lead, lead_len);
+			dtx_lead_pop(&u->dtx);
+		}
+		protocol_send_audio(p, rec, RECORD_SAMPLES * 2);
+	}
+	send_silence(p, ep, dtx_finish(&u->dtx));
+	
+	/* and what the server makes of it, on the timeline the markers keep */
+	for (int at = 0, t = 0; at + PROTOCOL_HEADER_SIZE <= s_wire_len; ) {
+		const uint8_t *hdr = s_wire + at;
+		int sub = hdr[2] << 8 | hdr[3];
+		int len = hdr[4] << 24 | hdr[5] << 16 | hdr[6] << 8 | hdr[7];
+		const uint8_t *payload = hdr + PROTOCOL_HEADER_SIZE;
+		
+		if (hdr[0] != PROTOCOL_VERSION || hdr[1] != PROTOCOL_TYPE_AUDIO) {
+			CHECK(0, "frame at %d is not audio", at);
+			break;
+		}
+		if (sub == PROTOCOL_CODEC_SILENCE) {
+			int dur = payload[0] << 8 | payload[1];
+			
+			CHECK(len == 3, "marker of %d bytes", len);
+			u->silence_ms += dur;
+			u->markers++;
+			u->max_marker_ms = dur > u->max_marker_ms ? dur : u->max_marker_ms;
+			u->level_db = -payload[2];
+			for (int w = 0; w < WORDS; w++) {
+				int from = LEAD_MS + w * WORD_MS, to = from + WORD_MS - PAUSE_MS;
+				
+				from = from > t ? from : t;
+				to = to < t + dur ? to : t + dur;
+				u->speech_left_out += to > from ? to - from : 0;
+			}
+			t += dur;
+		} else {
+			int dur = len / 2 * 1000 / RATE;
+			
+			u->audio_ms += dur;
+			t += dur;
+			if (t > LEAD_MS + SPEECH_MS - PAUSE_MS) {
+				u->tail_audio_ms = t - (LEAD_MS + SPEECH_MS - PAUSE_MS);
+			}
+		}
+		at += PROTOCOL_HEADER_SIZE + len;
+		u->end_ms = t;
+	}
+	u->wire_bytes = s_wire_len;
+	
+	endpoint_destroy(ep);
+	protocol_destroy(p);
+}
+
+static void check_upload(void)
+{
+	int16_t *pcm = synthesize(-55, -25);
+	int audio_bytes = TOTAL_MS * RATE / 1000 * 2;
+	upload_t u;
+	
+	upload(pcm, &u);
+	
+	CHECK(u.speech_left_out == 0, "%d ms of speech left out", u.speech_left_out);
+	CHECK(u.end_ms == TOTAL_MS, "%d ms audio + %d ms silence != %d ms",
+		  u.audio_ms, u.silence_ms, TOTAL_MS);
+	CHECK(u.silence_ms == (int)u.dtx.ms && u.markers == (int)u.dtx.descriptors,
+		  "%d ms in %d markers on the wire, %u ms in %u counted",
+		  u.silence_ms, u.markers, u.dtx.ms, u.dtx.descriptors);
+	CHECK(u.dtx.bytes == (uint32_t)u.silence_ms * RATE / 1000 * 2, "%u bytes saved for %d ms",
+		  u.dtx.bytes, u.silence_ms);
+	CHECK(u.max_marker_ms <= DTX_MAX_MS, "marker of %d ms", u.max_marker_ms);
+	/* the lead-in and the tail each left out in whole markers of at most 1 s */
+	CHECK(u.markers >= 4 && u.markers <= 6, "%d markers", u.markers);
+	/* the hangover after the last word still goes out, counted from its fading end */
+	CHECK(u.tail_audio_ms >= CONFIG_RECORDER_DTX_HANGOVER_MS - 2 * RECORD_MS, "%d ms after the speech uploaded",
+		  u.tail_audio_ms);
+	CHECK(u.silence_ms >= LEAD_MS + TAIL_MS - 2 * CONFIG_RECORDER_DTX_HANGOVER_MS - 300,
+		  "only %d ms left out", u.silence_ms);
+	CHECK(u.level_db <= -50 && u.level_db >= -62, "background at %d dB", u.level_db);
+	CHECK(u.wire_bytes + (int)u.dtx.bytes == audio_bytes + (TOTAL_MS / RECORD_MS - u.silence_ms / RECORD_MS) *
+		  PROTOCOL_HEADER_SIZE + u.markers * (PROTOCOL_HEADER_SIZE + 3),
+		  "%d bytes on the wire", u.wire_bytes);
+	
+	printf("dtx: %s\n", s_failures ? "FAILED" : "ok");
+	free(pcm);
+}
+
+/* what is saved over the background levels the endpoint corpus uses */
+static void report(void)
+{
+	static const int levels[] = { -65, -55, -45 };
+	int pcm_bytes = TOTAL_MS * RATE / 1000 * 2;
+	int framed = pcm_bytes + TOTAL_MS / RECORD_MS * PROTOCOL_HEADER_SIZE;
+	
+	printf("dtx, %d ms speech in %d ms, %d ms hangover:\n", SPEECH_MS, TOTAL_MS, CONFIG_RECORDER_DTX_HANGOVER_MS);
+	for (int i = 0; i < (int)(sizeof(levels) / sizeof(levels[0])); i++) {
+		int16_t *pcm = synthesize(levels[i], -25);
+		upload_t u;
+		
+		upload(pcm, &u);
+		printf("  %d dB background: %5d ms left out in %d markers, %6d of %6d bytes sent (%d%% saved)\n",
+			   levels[i], u.silence_ms, u.markers, u.wire_bytes, framed,
+			   (framed - u.wire_bytes) * 100 / framed);
+		free(pcm);
+	}
+}
+
+/* use_vad is never set here */
+vad_handle_t vad_create(vad_mode_t vad_mode, int sample_rate_hz, int one_frame_duration_ms)
+{
+	return NULL;
+}
+
+vad_state_t vad_process(vad_handle_t inst, int16_t *data)
+{
+	return VAD_SILENCE;
+}
+
+void vad_destroy(vad_handle_t inst)
+{
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		report();
+		return 0;
+	}
+	
+	check_upload();
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,569 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks the unrolled energy and zero crossing pass of the endpointer
+ * against a sample at a time reference, and with "bench" measures both.
+ *
+ * Also runs the endpointer, set up as the recorder sets it up, over
+ * utterances whose speech is labeled, and reports how long after the
+ * speech the end is called and how much speech it cuts off. The built in
+ * utterances are synthetic. "corpus <dir>" takes 16 bit mono WAV files
+ * instead, each with an Audacity label file of the same name ending in
+ * .txt which marks the speech.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <math.h>
+
+/* built in, the measuring pass is not exported */
+#include "endpoint.c"
+#include "bench.h"
+
+#define MAX_SAMPLES		301
+#define FRAME_SAMPLES	240
+#define BENCH_FRAMES	4000
+#define BENCH_RUNS		20
+
+/* the recorder's rate */
+#define CORPUS_RATE		8000
+#define MAX_LABELS		64
+#define MAX_UTTERANCES	256
+
+static int s_failures;
+
+static uint32_t s_seed = 1;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+static int16_t noise(void)
+{
+	s_seed = s_seed * 1664525 + 1013904223;
+	return (int16_t)(s_seed >> 16);
+}
+
+static int64_t measure_reference(const int16_t *pcm, int samples, int *crossings)
+{
+	int64_t energy = 0;
+	
+	*crossings = 0;
+	for (int i = 0; i < samples; i++) {
+		energy += (int64_t)pcm[i] * pcm[i];
+		if (i > 0 && (pcm[i] < 0) != (pcm[i - 1] < 0)) {
+			(*crossings)++;
+		}
+	}
+	
+	return energy;
+}
+
+static void compare(const char *what, const int16_t *pcm, int samples)
+{
+	int zc, ref_zc;
+	int64_t energy = endpoint_measure(pcm, samples, &zc);
+	int64_t ref = measure_reference(pcm, samples, &ref_zc);
+	
+	CHECK(energy == ref && zc == ref_zc, "%s, %d samples: energy %lld, %d crossings, %lld and %d expected",
+		  what, samples, (long long)energy, zc, (long long)ref, ref_zc);
+}
+
+/* every length up to a few frames, odd ones and those shorter than the unrolled step included */
+static void test_lengths(void)
+{
+	int16_t buf[MAX_SAMPLES + 1];
+	
+	for (int i = 0; i <= MAX_SAMPLES; i++) {
+		buf[i] = noise();
+	}
+	
+	for (int n = 0; n <= MAX_SAMPLES; n++) {
+		compare("noise", buf, n);
+		/* and from an address which is not 4 byte aligned */
+		compare("noise, unaligned", buf + 1, n);
+	}
+}
+
+static void test_full_scale(void)
+{
+	int16_t buf[MAX_SAMPLES];
+	
+	for (int i = 0; i < MAX_SAMPLES; i++) {
+		buf[i] = INT16_MIN;
+	}
+	for (int n = FRAME_SAMPLES - 3; n <= FRAME_SAMPLES + 3; n++) {
+		compare("-32768", buf, n);
+	}
+	
+	/* the largest squares pairwise in the unrolled sum, crossing all the time */
+	for (int i = 0; i < MAX_SAMPLES; i++) {
+		buf[i] = i & 1 ? INT16_MAX : INT16_MIN;
+	}
+	for (int n = FRAME_SAMPLES - 3; n <= FRAME_SAMPLES + 3; n++) {
+		compare("+32767/-32768", buf, n);
+	}
+	
+	for (int i = 0; i < MAX_SAMPLES; i++) {
+		buf[i] = i & 1 ? 0 : INT16_MIN;
+	}
+	compare("0/-32768", buf, FRAME_SAMPLES + 1);
+	
+	memset(buf, 0, sizeof(buf));
+	compare("digital silence", buf, FRAME_SAMPLES);
+}
+
+static void bench(void)
+{
+	int16_t *pcm = malloc(BENCH_FRAMES * FRAME_SAMPLES * sizeof(int16_t));
+	uint64_t best[2] = { UINT64_MAX, UINT64_MAX };
+	int64_t sink = 0;
+	int zc;
+	
+	for (int i = 0; i < BENCH_FRAMES * FRAME_SAMPLES; i++) {
+		pcm[i] = noise() >> 3;
+	}
+	
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t t[3];
+		
+		t[0] = bench_now();
+		for (int f = 0; f < BENCH_FRAMES; f++) {
+			sink += endpoint_measure(pcm + f * FRAME_SAMPLES, FRAME_SAMPLES, &zc) + zc;
+		}
+		t[1] = bench_now();
+		for (int f = 0; f < BENCH_FRAMES; f++) {
+			sink += measure_reference(pcm + f * FRAME_SAMPLES, FRAME_SAMPLES, &zc) + zc;
+		}
+		t[2] = bench_now();
+		
+		for (int i = 0; i < 2; i++) {
+			if (t[i + 1] - t[i] < best[i]) {
+				best[i] = t[i + 1] - t[i];
+			}
+		}
+	}
+	
+	printf("endpoint, frames of %d samples:\n", FRAME_SAMPLES);
+	BENCH_REPORT("measure", best[0], BENCH_FRAMES * FRAME_SAMPLES);
+	BENCH_REPORT("measure (reference)", best[1], BENCH_FRAMES * FRAME_SAMPLES);
+	/* keeps the loops from being optimized away */
+	if (sink == 42) {
+		printf("\n");
+	}
+	
+	free(pcm);
+}
+
+/**
+ * @brief A recording and where the speech in it is
+ */
+typedef struct {
+	char name[64];
+	int16_t *pcm;
+	int samples;
+	int rate;
+	int labels;
+	int start_ms[MAX_LABELS];
+	int end_ms[MAX_LABELS];
+} utterance_t;
+
+/**
+ * @brief What the endpointer made of an utterance
+ */
+typedef struct {
+	int start_at;		/* when speech was called started, -1 never */
+	int end_at;			/* when the end was called, -1 never */
+	bool no_speech;		/* the end was called with nothing said */
+	int clipped_ms;		/* labeled speech after the end */
+} verdict_t;
+
+/**
+ * @brief A synthetic talker in a synthetic room
+ */
+typedef struct {
+	const char *name;
+	int noise_db;		/* background level, dBFS RMS */
+	int speech_db;		/* level of the voiced part of syllables */
+	int words;
+	int pause_ms;		/* longest pause between words */
+} talker_t;
+
+static const talker_t s_talkers[] = {
+	{ "quiet room", -65, -25, 3, 250 },
+	{ "fan noise", -45, -28, 4, 300 },
+	{ "soft speaker", -60, -40, 3, 200 },
+	{ "long pauses", -55, -25, 4, 600 },
+	{ "one word", -55, -25, 1, 0 },
+};
+
+static int rand_range(int lo, int hi)
+{
+	return lo + (int)((uint16_t)noise() % (hi - lo + 1));
+}
+
+/* 1 s of background, the words, and background until the turn would time out */
+static void synthesize(const talker_t *t, int variant, utterance_t *u)
+{
+	double noise_amp = 32768.0 * pow(10, t->noise_db / 20.0) * sqrt(3.0);
+	double speech_amp = 32768.0 * pow(10, t->speech_db / 20.0);
+	int at = 1000, lp = 0;
+	
+	memset(u, 0, sizeof(*u));
+	snprintf(u->name, sizeof(u->name), "%s #%d", t->name, variant);
+	u->rate = CORPUS_RATE;
+	u->samples = CORPUS_RATE * 8;
+	u->pcm = calloc(u->samples, sizeof(int16_t));
+	
+	for (int w = 0; w < t->words; w++) {
+		int syllables = rand_range(1, 3);
+		
+		u->start_ms[u->labels] = at;
+		for (int k = 0; k < syllables; k++) {
+			int len = rand_range(120, 260);
+			double f0 = rand_range(100, 220);
+			int from = at * CORPUS_RATE / 1000, n = len * CORPUS_RATE / 1000;
+			
+			/* harmonics falling off like a glottal pulse, under a raised cosine */
+			for (int i = 0; i < n && from + i < u->samples; i++) {
+				double env = 0.5 - 0.5 * cos(2 * M_PI * i / n), v = 0;
+				
+				for (int h = 1; h <= 10 && h * f0 < CORPUS_RATE / 2; h++) {
+					v += sin(2 * M_PI * h * f0 * i / CORPUS_RATE) / h;
+				}
+				u->pcm[from + i] = (int16_t)(speech_amp * env * v);
+			}
+			at += len + (k + 1 < syllables ? rand_range(30, 80) : 0);
+		}
+		u->end_ms[u->labels++] = at;
+		at += w + 1 < t->words ? rand_range(t->pause_ms / 3, t->pause_ms) : 0;
+	}
+	
+	/* low-pass filtered noise under all of it */
+	for (int i = 0; i < u->samples; i++) {
+		int v;
+		
+		lp += (noise() - lp) / 2;
+		v = u->pcm[i] + (int)(noise_amp * lp / 32768);
+		u->pcm[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+	}
+}
+
+/* fed a frame at a time, so each event is placed exactly */
+static void endpoint_run(const utterance_t *u, verdict_t *v)
+{
+	endpoint_cfg_t cfg = DEFAULT_ENDPOINT_CONFIG();
+	endpoint_handle_t ep;
+	int frame, n;
+	
+	cfg.sample_rate = u->rate;
+	cfg.hangover_ms = CONFIG_RECORDER_ENDPOINT_HANGOVER_MS;
+	cfg.no_speech_ms = CONFIG_RECORDER_ENDPOINT_NO_SPEECH_MS;
+	cfg.use_vad = false;
+	ep = endpoint_create(&cfg);
+	frame = u->rate * cfg.frame_ms / 1000;
+	
+	v->start_at = v->end_at = -1;
+	v->no_speech = false;
+	v->clipped_ms = 0;
+	
+	for (int pos = 0; pos < u->samples && v->end_at < 0; pos += n) {
+		int at;
+		
+		n = u->samples - pos < frame ? u->samples - pos : frame;
+		at = (int)((int64_t)(pos + n) * 1000 / u->rate);
+		switch (endpoint_feed(ep, u->pcm + pos, n)) {
+		case ENDPOINT_SPEECH_START:
+			v->start_at = at;
+			break;
+		case ENDPOINT_SPEECH_END:
+			v->end_at = at;
+			break;
+		case ENDPOINT_NO_SPEECH:
+			v->end_at = at;
+			v->no_speech = true;
+			break;
+		default:
+			break;
+		}
+	}
+	
+	/* the recorder uploads up to the end, whatever comes later is lost */
+	for (int i = 0; i < u->labels && v->end_at >= 0; i++) {
+		int from = u->start_ms[i] > v->end_at ? u->start_ms[i] : v->end_at;
+		
+		if (u->end_ms[i] > from) {
+			v->clipped_ms += u->end_ms[i] - from;
+		}
+	}
+	
+	endpoint_destroy(ep);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* how the end was called over a whole corpus */
+static void report(const utterance_t *u, const verdict_t *v, int count, bool verbose)
+{
+	int latency[MAX_UTTERANCES], ended = 0, missed = 0, clipped = 0, clipped_ms = 0;
+	int start_total = 0, started = 0;
+	
+	for (int i = 0; i < count; i++) {
+		if (verbose) {
+			printf("  %-32s start %5d ms, end %5d ms, speech until %5d ms, %4d ms clipped%s\n",
+				   u[i].name, v[i].start_at, v[i].end_at, u[i].labels ? u[i].end_ms[u[i].labels - 1] : 0,
+				   v[i].clipped_ms, v[i].no_speech ? ", no speech" : "");
+		}
+		if (v[i].start_at >= 0 && u[i].labels) {
+			start_total += v[i].start_at - u[i].start_ms[0];
+			started++;
+		}
+		if (v[i].end_at >= 0 && !v[i].no_speech && u[i].labels) {
+			latency[ended++] = v[i].end_at - u[i].end_ms[u[i].labels - 1];
+		} else if (u[i].labels) {
+			missed++;
+		}
+		clipped += v[i].clipped_ms > 0;
+		clipped_ms += v[i].clipped_ms;
+	}
+	
+	qsort(latency, ended, sizeof(int), compare_int);
+	printf("  %d utterances, %d ended after speech, %d never or with no speech\n", count, ended, missed);
+	if (started) {
+		printf("  start called %d ms into the speech on average\n", start_total / started);
+	}
+	if (ended) {
+		printf("  end called after the speech: median %d ms, 95%% %d ms, max %d ms\n",
+			   latency[ended / 2], latency[ended * 95 / 100], latency[ended - 1]);
+	}
+	printf("  %d utterances clipped, %d ms of speech cut off\n", clipped, clipped_ms);
+}
+
+/* the end comes one hangover after the speech, no speech is cut off */
+static void test_corpus(void)
+{
+	int frame_ms = 30, variants = 8;
+	
+	for (int t = 0; t < sizeof(s_talkers) / sizeof(s_talkers[0]); t++) {
+		for (int k = 0; k < variants; k++) {
+			utterance_t u;
+			verdict_t v;
+			int last;
+			
+			synthesize(&s_talkers[t], k, &u);
+			endpoint_run(&u, &v);
+			last = u.end_ms[u.labels - 1];
+			
+			CHECK(!v.no_speech && v.start_at >= u.start_ms[0] && v.start_at <= u.start_ms[0] + 90 + 3 * frame_ms,
+				  "%s: speech at %d ms called started at %d ms", u.name, u.start_ms[0], v.start_at);
+			CHECK(v.end_at >= last + CONFIG_RECORDER_ENDPOINT_HANGOVER_MS - 3 * frame_ms
+				  && v.end_at <= last + CONFIG_RECORDER_ENDPOINT_HANGOVER_MS + 2 * frame_ms,
+				  "%s: speech until %d ms called ended at %d ms", u.name, last, v.end_at);
+			CHECK(v.clipped_ms == 0, "%s: %d ms of speech clipped", u.name, v.clipped_ms);
+			free(u.pcm);
+		}
+	}
+}
+
+static void bench_corpus(void)
+{
+	utterance_t *u = calloc(MAX_UTTERANCES, sizeof(utterance_t));
+	verdict_t *v = calloc(MAX_UTTERANCES, sizeof(verdict_t));
+	int count = 0;
+	
+	for (int t = 0; t < sizeof(s_talkers) / sizeof(s_talkers[0]); t++) {
+		for (int k = 0; k < 20; k++, count++) {
+			synthesize(&s_talkers[t], k, &u[count]);
+			endpoint_run(&u[count], &v[count]);
+		}
+	}
+	
+	printf("endpoint, synthetic corpus, %d ms hangover:\n", CONFIG_RECORDER_ENDPOINT_HANGOVER_MS);
+	report(u, v, count, false);
+	
+	for (int i = 0; i < count; i++) {
+		free(u[i].pcm);
+	}
+	free(u);
+	free(v);
+}
+
+static uint32_t wav_u32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* 16 bit PCM, of several channels only the first is kept */
+static bool wav_load(const char *path, utterance_t *u)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t hdr[12], chunk[8], fmt[16];
+	int channels = 0, bits = 0;
+	uint32_t len;
+	bool ok = false;
+	
+	if (!f) {
+		return false;
+	}
+	if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+		goto out;
+	}
+	
+	while (fread(chunk, 1, 8, f) == 8) {
+		len = wav_u32(chunk + 4);
+		if (!memcmp(chunk, "fmt ", 4) && len >= 16) {
+			if (fread(fmt, 1, 16, f) != 16) {
+				goto out;
+			}
+			channels = fmt[2] | fmt[3] << 8;
+			u->rate = (int)wav_u32(fmt + 4);
+			bits = fmt[14] | fmt[15] << 8;
+			fseek(f, (len - 16 + 1) & ~1u, SEEK_CUR);
+		} else if (!memcmp(chunk, "data", 4) && channels > 0 && bits == 16) {
+			int16_t *all = malloc(len);
+			
+			u->samples = (int)fread(all, 2 * channels, len / (2 * channels), f);
+			u->pcm = malloc(u->samples * sizeof(int16_t));
+			for (int i = 0; i < u->samples; i++) {
+				u->pcm[i] = all[i * channels];
+			}
+			free(all);
+			ok = u->samples > 0;
+			goto out;
+		} else {
+			fseek(f, (len + 1) & ~1u, SEEK_CUR);
+		}
+	}
+	
+out:
+	fclose(f);
+	return ok;
+}
+
+/* Audacity labels, start and end in seconds, one region per line */
+static void labels_load(const char *path, utterance_t *u)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	double start, end;
+	
+	if (!f) {
+		return;
+	}
+	while (u->labels < MAX_LABELS && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lf %lf", &start, &end) == 2) {
+			u->start_ms[u->labels] = (int)(start * 1000);
+			u->end_ms[u->labels++] = (int)(end * 1000);
+		}
+	}
+	fclose(f);
+}
+
+static int run_corpus(const char *dir)
+{
+	utterance_t *u = calloc(MAX_UTTERANCES, sizeof(utterance_t));
+	verdict_t *v = calloc(MAX_UTTERANCES, sizeof(verdict_t));
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	char path[1024];
+	int count = 0;
+	
+	if (!d) {
+		perror(dir);
+		return 1;
+	}
+	
+	while (count < MAX_UTTERANCES && (e = readdir(d)) != NULL) {
+		size_t len = strlen(e->d_name);
+		
+		if (len < 5 || strcmp(e->d_name + len - 4, ".wav")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (!wav_load(path, &u[count])) {
+			fprintf(stderr, "%s: not 16 bit PCM\n", path);
+			continue;
+		}
+		snprintf(u[count].name, sizeof(u[count].name), "%.*s", (int)(len - 4), e->d_name);
+		snprintf(path + strlen(path) - 4, 5, ".txt");
+		labels_load(path, &u[count]);
+		endpoint_run(&u[count], &v[count]);
+		count++;
+	}
+	closedir(d);
+	
+	printf("endpoint, %s, %d ms hangover:\n", dir, CONFIG_RECORDER_ENDPOINT_HANGOVER_MS);
+	report(u, v, count, true);
+	
+	for (int i = 0; i < count; i++) {
+		free(u[i].pcm);
+	}
+	free(u);
+	free(v);
+	return 0;
+}
+
+/* use_vad is never set here */
+vad_handle_t vad_create(vad_mode_t vad_mode, int sample_rate_hz, int one_frame_duration_ms)
+{
+	return NULL;
+}
+
+vad_state_t vad_process(vad_handle_t inst, int16_t *data)
+{
+	return VAD_SILENCE;
+}
+
+void vad_destroy(vad_handle_t inst)
+{
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 2 && !strcmp(argv[1], "corpus")) {
+		return run_corpus(argv[2]);
+	}
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench();
+		bench_corpus();
+		return 0;
+	}
+	
+	test_lengths();
+	test_full_scale();
+	test_corpus();
+	
+	printf("endpoint: %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays traces of conversation turns, each with the connect time, the
+ * longest wait for the server and the rate the upload went out at, through
+ * the link quality estimator, and checks the timeout and the bitrate it
+ * comes up with. A trace file given on the command line is replayed and
+ * printed turn by turn instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* built in, so every trace starts from a fresh estimate */
+#include "link_quality.c"
+
+#define TURNS				60
+/* 3 s of audio at the highest bitrate */
+#define TURN_BYTES			48000
+
+static int s_failures;
+static int s_rssi_now;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+/**
+ * @brief One turn of a trace
+ */
+typedef struct {
+	unsigned int rtt_ms;	/* connect time, 0 if the connection was reused */
+	unsigned int gap_ms;	/* longest wait for server data */
+	unsigned int kbps;		/* rate the upload went out at */
+	int timed_out;
+	int rssi;
+} turn_t;
+
+/**
+ * @brief A trace and what the estimate must look like along it
+ */
+typedef struct {
+	const char *name;
+	void (*turn)(int i, turn_t *t);
+	void (*check)(const char *name, int i, const turn_t *t, const link_quality_t *lq);
+} trace_t;
+
+static uint32_t hash(uint32_t i)
+{
+	uint32_t h = i * 2654435761u;
+	
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+/* a good link: 20 ms RTT with some jitter, a server thinking for 800 ms or so */
+static void turn_steady(int i, turn_t *t)
+{
+	t->rtt_ms = 15 + hash(i) % 11;
+	t->gap_ms = 700 + hash(i + 1000) % 201;
+	t->kbps = 2000;
+	t->timed_out = 0;
+	t->rssi = -55;
+}
+
+static void check_steady(const char *name, int i, const turn_t *t, const link_quality_t *lq)
+{
+	/* the turn that follows must not time out, nor wait for much longer */
+	if (i >= 10) {
+		CHECK(lq->timeout_ms >= 900 + 25 && lq->timeout_ms <= 2 * (900 + 25),
+			  "%s: turn %d, timeout %u ms", name, i, lq->timeout_ms);
+		CHECK(lq->srtt_ms >= 15 && lq->srtt_ms <= 25, "%s: turn %d, srtt %u ms", name, i, lq->srtt_ms);
+	}
+	CHECK(lq->bitrate_bps == CONFIG_LINK_BITRATE_MAX, "%s: turn %d, bitrate %u", name, i, lq->bitrate_bps);
+	CHECK(lq->backoff == 0, "%s: turn %d, backed off", name, i);
+}
+
+/* the upload crawls at 60 kbit/s for a while */
+static void turn_congested(int i, turn_t *t)
+{
+	turn_steady(i, t);
+	if (i >= 20 && i < 40) {
+		t->kbps = 60;
+	}
+}
+
+static void check_congested(const char *name, int i, const turn_t *t, const link_quality_t *lq)
+{
+	if (i >= 20 && i < 40) {
+		CHECK(lq->bitrate_bps <= 32000, "%s: turn %d, bitrate %u on a 60 kbit/s link", name, i, lq->bitrate_bps);
+	}
+	if (i >= 41) {
+		CHECK(lq->bitrate_bps == CONFIG_LINK_BITRATE_MAX, "%s: turn %d, bitrate %u after recovery",
+			  name, i, lq->bitrate_bps);
+	}
+}
+
+/* the server does not answer for five turns in a row, on a connection kept open */
+static void turn_outage(int i, turn_t *t)
+{
+	turn_steady(i, t);
+	if (i >= 20 && i < 25) {
+		t->rtt_ms = 0;
+		t->timed_out = 1;
+	}
+}
+
+static void check_outage(const char *name, int i, const turn_t *t, const link_quality_t *lq)
+{
+	static unsigned int before;
+	
+	if (i == 19) {
+		before = lq->timeout_ms;
+	}
+	if (i >= 20 && i < 25) {
+		unsigned int backoff = i - 19 < LINK_MAX_BACKOFF ? i - 19 : LINK_MAX_BACKOFF;
+		unsigned int expected = before << backoff;
+		
+		CHECK(lq->backoff == backoff, "%s: turn %d, backoff %u, %u expected", name, i, lq->backoff, backoff);
+		if (expected > CONFIG_LINK_TIMEOUT_MAX) {
+			expected = CONFIG_LINK_TIMEOUT_MAX;
+		}
+		CHECK(lq->timeout_ms == expected, "%s: turn %d, timeout %u ms, %u expected", name, i, lq->timeout_ms, expected);
+	}
+	if (i == 25) {
+		CHECK(lq->backoff == 0 && lq->timeout_ms <= 2 * before, "%s: timeout %u ms after the outage", name, lq->timeout_ms);
+	}
+}
+
+/* the RTT goes from 20 to 300 ms, e.g. after failing over to a far server */
+static void turn_rtt_step(int i, turn_t *t)
+{
+	turn_steady(i, t);
+	if (i >= 20) {
+		t->rtt_ms += 280;
+	}
+}
+
+static void check_rtt_step(const char *name, int i, const turn_t *t, const link_quality_t *lq)
+{
+	/* gain 1/8: 90% of the step within 18 samples */
+	if (i >= 38) {
+		CHECK(lq->srtt_ms >= 270 && lq->srtt_ms <= 305, "%s: turn %d, srtt %u ms", name, i, lq->srtt_ms);
+		CHECK(lq->timeout_ms >= 900 + 305, "%s: turn %d, timeout %u ms", name, i, lq->timeout_ms);
+	}
+}
+
+/* the signal fades to fair, then to weak */
+static void turn_fading(int i, turn_t *t)
+{
+	turn_steady(i, t);
+	t->rssi = i < 20 ? -55 : i < 40 ? -70 : -80;
+}
+
+static void check_fading(const char *name, int i, const turn_t *t, const link_quality_t *lq)
+{
+	unsigned int cap = i < 20 ? CONFIG_LINK_BITRATE_MAX : i < 40 ? LINK_BITRATE_FAIR : LINK_BITRATE_WEAK;
+	
+	/* the RSSI is smoothed too, with gain 1/4 a 15 dB step is within 2 dB after 7 turns */
+	if (i % 20 >= 7) {
+		CHECK(lq->bitrate_bps == cap, "%s: turn %d, bitrate %u, %u expected", name, i, lq->bitrate_bps, cap);
+	}
+}
+
+static const trace_t s_traces[] = {
+	{ "steady", turn_steady, check_steady },
+	{ "congested", turn_congested, check_congested },
+	{ "outage", turn_outage, check_outage },
+	{ "rtt step", turn_rtt_step, check_rtt_step },
+	{ "fading", turn_fading, check_fading },
+};
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info)
+{
+	ap_info->rssi = s_rssi_now;
+	return ESP_OK;
+}
+
+static void reset(void)
+{
+	s_srtt_us = s_rttvar_us = 0;
+	s_gap_us = s_gapvar_us = 0;
+	s_goodput_bps = 0;
+	s_rssi_q = 0;
+	s_backoff = 0;
+	link_quality_init();
+}
+
+/**
+ * @brief Feed one turn the way the recorder does, from the turn statistics
+ */
+static void feed(const turn_t *t, link_quality_t *lq)
+{
+	tcp_stream_stats_t stats;
+	
+	memset(&stats, 0, sizeof(stats));
+	if (t->rtt_ms) {
+		stats.connects = 1;
+		stats.connect_time.count = 1;
+		stats.connect_time.total_us = t->rtt_ms * 1000;
+	}
+	if (t->timed_out) {
+		stats.read_timeouts = 1;
+	} else {
+		stats.read_latency.count = 1;
+		stats.read_latency.max_ms = t->gap_ms;
+		stats.read_latency.total_us = t->gap_ms * 1000;
+	}
+	if (t->kbps) {
+		stats.bytes_sent = TURN_BYTES;
+		stats.send_us = (uint64_t)TURN_BYTES * 8 * 1000 / t->kbps;
+	}
+	s_rssi_now = t->rssi;
+	
+	link_quality_update(&stats);
+	link_quality_get(lq);
+}
+
+static void run(const trace_t *tr)
+{
+	link_quality_t lq;
+	turn_t t;
+	
+	reset();
+	link_quality_get(&lq);
+	CHECK(lq.timeout_ms == CONFIG_TCP_TIMEOUT && lq.bitrate_bps == CONFIG_LINK_BITRATE_MAX,
+		  "%s: %u ms, %u bit/s before the first turn", tr->name, lq.timeout_ms, lq.bitrate_bps);
+	
+	for (int i = 0; i < TURNS; i++) {
+		tr->turn(i, &t);
+		feed(&t, &lq);
+		tr->check(tr->name, i, &t, &lq);
+	}
+	
+	printf("  %-12s srtt %3u ms, gap %4u ms, timeout %4u ms, bitrate %3u kbit/s\n",
+		   tr->name, lq.srtt_ms, lq.gap_ms, lq.timeout_ms, lq.bitrate_bps / 1000);
+}
+
+/**
+ * @brief Replay a trace file, one turn per line: rtt_ms gap_ms kbps timed_out rssi
+ */
+static int replay(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	link_quality_t lq;
+	turn_t t;
+	int i = 0;
+	
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	
+	reset();
+	printf("turn   rtt   gap  kbps to rssi | srtt rttvar  gap gapvar goodput rssi bo timeout bitrate\n");
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%u %u %u %d %d", &t.rtt_ms, &t.gap_ms, &t.kbps, &t.timed_out, &t.rssi) != 5) {
+			continue;
+		}
+		feed(&t, &lq);
+		printf("%4d %5u %5u %5u %2d %4d | %4u %6u %4u %6u %7u %4d %2u %7u %7u\n", i++,
+			   t.rtt_ms, t.gap_ms, t.kbps, t.timed_out, t.rssi,
+			   lq.srtt_ms, lq.rttvar_ms, lq.gap_ms, lq.gapvar_ms, lq.goodput_bps / 1000, lq.rssi,
+			   lq.backoff, lq.timeout_ms, lq.bitrate_bps);
+	}
+	fclose(f);
+	
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		return 0;
+	}
+	if (argc > 1) {
+		return replay(argv[1]);
+	}
+	
+	for (int i = 0; i < sizeof(s_traces) / sizeof(s_traces[0]); i++) {
+		run(&s_traces[i]);
+	}
+	
+	printf("link_quality: %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks the polyphase resampler against the double precision reference,
+ * and that feeding it in pieces changes nothing. With "bench" measures
+ * both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "resample.h"
+#include "bench.h"
+
+#define SIGNAL_MS		1000
+#define MAX_TONE		0.37
+#define BENCH_RUNS		10
+
+static const int s_rates[][2] = {
+	{ 48000, 16000 }, { 16000, 48000 }, { 44100, 16000 }, { 16000, 44100 },
+	{ 16000, 8000 }, { 8000, 16000 }, { 22050, 16000 }, { 16000, 16000 },
+};
+
+static int s_failures;
+
+static uint32_t s_seed = 1;
+
+static int noise(void)
+{
+	s_seed = s_seed * 1664525 + 1013904223;
+	return (int16_t)(s_seed >> 16);
+}
+
+/* tones inside the passband of both rates over a little noise, in cycles per low rate sample */
+static int make_signal(int rate, int low_rate, int16_t *pcm)
+{
+	static const double tones[] = { 0.02, 0.11, 0.23, MAX_TONE };
+	int samples = rate * SIGNAL_MS / 1000;
+	
+	for (int i = 0; i < samples; i++) {
+		double v = 0;
+		
+		for (int t = 0; t < 4; t++) {
+			v += 6000 * sin(2 * M_PI * tones[t] * low_rate * i / rate + t);
+		}
+		pcm[i] = (int16_t)lrint(v) + (noise() >> 8);
+	}
+	
+	return samples;
+}
+
+/*
+ * The kernel rounds the output instants to 1/RESAMPLE_PHASES of an input
+ * sample, half of that at most. For a tone of f cycles per input sample
+ * the error is at most 2 pi f / (2 RESAMPLE_PHASES) of its amplitude,
+ * the Q15 taps add far less.
+ */
+static double min_snr_db(int in_rate, int low_rate)
+{
+	double f = MAX_TONE * low_rate / in_rate;
+	
+	return 20 * log10(2 * RESAMPLE_PHASES / (2 * M_PI * f));
+}
+
+static double snr_db(const int16_t *ref, const int16_t *out, int samples)
+{
+	double sig = 0, err = 0;
+	
+	for (int i = 0; i < samples; i++) {
+		sig += (double)ref[i] * ref[i];
+		err += (double)(ref[i] - out[i]) * (ref[i] - out[i]);
+	}
+	
+	return err > 0 ? 10 * log10(sig / err) : INFINITY;
+}
+
+/* feeds the input in pieces of 1 to 1500 samples */
+static int process_chunked(resample_t *rs, const int16_t *in, int samples, int16_t *out)
+{
+	int pos = 0, count = 0;
+	
+	while (pos < samples) {
+		int n = 1 + (int)((uint32_t)noise() % 1500);
+		
+		if (n > samples - pos) {
+			n = samples - pos;
+		}
+		count += resample_process(rs, in + pos, n, out + count);
+		pos += n;
+	}
+	
+	return count;
+}
+
+static void test_pair(int in_rate, int out_rate)
+{
+	int low = in_rate < out_rate ? in_rate : out_rate;
+	int16_t *in = malloc(in_rate * SIGNAL_MS / 1000 * sizeof(int16_t));
+	int samples = make_signal(in_rate, low, in);
+	int room = (int)((int64_t)samples * out_rate / in_rate) + 2;
+	int16_t *whole = malloc(room * sizeof(int16_t));
+	int16_t *chunked = malloc(room * sizeof(int16_t));
+	int16_t *ref = malloc(room * sizeof(int16_t));
+	int n_whole, n_chunked, n_ref, ok = 1;
+	double snr;
+	resample_t rs;
+	
+	if (resample_init(&rs, in_rate, out_rate) != 0) {
+		printf("  FAIL %d -> %d: init\n", in_rate, out_rate);
+		s_failures++;
+		return;
+	}
+	
+	n_whole = resample_process(&rs, in, samples, whole);
+	resample_reset(&rs);
+	n_chunked = process_chunked(&rs, in, samples, chunked);
+	n_ref = resample_ref_process(in_rate, out_rate, in, samples, ref);
+	resample_deinit(&rs);
+	
+	if (n_whole != n_ref || n_chunked != n_ref) {
+		printf("  FAIL %d -> %d: %d samples whole, %d in pieces, %d by the reference\n",
+			   in_rate, out_rate, n_whole, n_chunked, n_ref);
+		ok = 0;
+	} else if (memcmp(whole, chunked, n_whole * sizeof(int16_t))) {
+		printf("  FAIL %d -> %d: output depends on the block sizes\n", in_rate, out_rate);
+		ok = 0;
+	}
+	
+	snr = snr_db(ref, whole, n_whole < n_ref ? n_whole : n_ref);
+	if (in_rate != out_rate && snr < min_snr_db(in_rate, low)) {
+		printf("  FAIL %d -> %d: %.1f dB from the reference, at least %.1f dB expected\n",
+			   in_rate, out_rate, snr, min_snr_db(in_rate, low));
+		ok = 0;
+	} else if (in_rate == out_rate && snr != INFINITY) {
+		printf("  FAIL %d -> %d: not a copy\n", in_rate, out_rate);
+		ok = 0;
+	}
+	
+	if (!ok) {
+		s_failures++;
+	}
+	
+	free(in);
+	free(whole);
+	free(chunked);
+	free(ref);
+}
+
+static void test_init(void)
+{
+	resample_t rs;
+	
+	if (resample_init(&rs, 0, 16000) == 0 || resample_init(&rs, 16000, 96000) == 0) {
+		printf("  FAIL unsupported rate accepted\n");
+		s_failures++;
+	}
+}
+
+static void bench_pair(int in_rate, int out_rate)
+{
+	int low = in_rate < out_rate ? in_rate : out_rate;
+	int16_t *in = malloc(in_rate * SIGNAL_MS / 1000 * sizeof(int16_t));
+	int samples = make_signal(in_rate, low, in);
+	int16_t *out = malloc(((int64_t)samples * out_rate / in_rate + 2) * sizeof(int16_t));
+	uint64_t best = UINT64_MAX, best_ref = UINT64_MAX;
+	int count = 0;
+	resample_t rs;
+	char name[40];
+	
+	resample_init(&rs, in_rate, out_rate);
+	
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t t0, t1, t2;
+		
+		resample_reset(&rs);
+		t0 = bench_now();
+		count = resample_process(&rs, in, samples, out);
+		t1 = bench_now();
+		resample_ref_process(in_rate, out_rate, in, samples, out);
+		t2 = bench_now();
+		
+		if (t1 - t0 < best) {
+			best = t1 - t0;
+		}
+		if (t2 - t1 < best_ref) {
+			best_ref = t2 - t1;
+		}
+	}
+	
+	printf("resample %d -> %d, %d taps, per output sample:\n", in_rate, out_rate, rs.taps);
+	snprintf(name, sizeof(name), "kernel");
+	BENCH_REPORT(name, best, count);
+	snprintf(name, sizeof(name), "reference");
+	BENCH_REPORT(name, best_ref, count);
+	
+	resample_deinit(&rs);
+	free(in);
+	free(out);
+}
+
+int main(int argc, char *argv[])
+{
+	int pairs = sizeof(s_rates) / sizeof(s_rates[0]);
+	
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		for (int i = 0; i < pairs; i++) {
+			if (s_rates[i][0] != s_rates[i][1]) {
+				bench_pair(s_rates[i][0], s_rates[i][1]);
+			}
+		}
+		return 0;
+	}
+	
+	for (int i = 0; i < pairs; i++) {
+		test_pair(s_rates[i][0], s_rates[i][1]);
+	}
+	test_init();
+	
+	printf("resample: %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
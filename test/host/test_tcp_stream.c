@@ -0,0 +1,622 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Runs a TCP stream against servers on the loopback interface, each in a
+ * process of its own: connects which are refused or never answered, writes
+ * which the server drains slowly or not at all, and reads which time out.
+ * With "bench" it measures throughput and round trip latency, what an
+ * upload paced like the recorder's costs in segments and CPU time, and
+ * what large records cost per byte with and without the copy into the
+ * write buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* built in, so the checks can reach the socket of a stream */
+#include "tcp_stream.c"
+#include "bench.h"
+
+#define BIG_WRITE			(4 * 1024 * 1024)
+#define STALL_WRITE			(64 * 1024 * 1024)
+#define IO_TIMEOUT_MS		300
+#define BENCH_BYTES			(64 * 1024 * 1024)
+#define BENCH_ROUND_TRIPS	2000
+#define BENCH_MESSAGE		64
+/* 8 kHz PCM in framed records, as protocol_send_audio writes them */
+#define UPLOAD_MS			2000
+#define UPLOAD_RECORD_MS	20
+#define UPLOAD_RECORD		320
+#define UPLOAD_HEADER		12
+/* unpaced records, up to the largest the recorder reads from its ring */
+#define RECORDS_BYTES		(32 * 1024 * 1024)
+#define RECORDS_MAX			2048
+#define AUDIO_BYTES_PER_SEC	16000
+
+static int s_failures;
+
+uint32_t tcp_data_segs_out(int sock);
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+/**
+ * @brief What the server does with the one connection it accepts
+ */
+typedef enum {
+	SERVER_SINK,		/* reads everything as fast as it comes */
+	SERVER_SLOW_SINK,	/* reads a little every millisecond */
+	SERVER_STALL,		/* never reads */
+	SERVER_ECHO,		/* sends back whatever it reads */
+	SERVER_SILENT,		/* reads, never sends */
+} server_mode_t;
+
+/**
+ * @brief A server process and the pipe it reports on
+ */
+typedef struct {
+	pid_t pid;
+	int port;
+	int report;
+} server_t;
+
+/**
+ * @brief What a server received
+ */
+typedef struct {
+	uint64_t bytes;
+	uint32_t hash;
+} server_report_t;
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void pattern_fill(uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (uint8_t)(i * 131 + (i >> 11));
+	}
+}
+
+static void server_main(int lsock, server_mode_t mode, int report)
+{
+	server_report_t r = { 0, 2166136261u };
+	uint8_t *buf = malloc(65536);
+	int sock = accept(lsock, NULL, NULL);
+	ssize_t n;
+	
+	for (;;) {
+		n = recv(sock, buf, mode == SERVER_SLOW_SINK ? 4096 : 65536, 0);
+		if (n <= 0) {
+			break;
+		}
+		r.bytes += n;
+		r.hash = fnv1a(r.hash, buf, n);
+		if (mode == SERVER_ECHO) {
+			for (ssize_t off = 0, m; off < n; off += m) {
+				m = send(sock, buf + off, n - off, 0);
+				if (m <= 0) {
+					break;
+				}
+			}
+		} else if (mode == SERVER_SLOW_SINK) {
+			usleep(1000);
+		}
+	}
+	
+	write(report, &r, sizeof(r));
+	_exit(0);
+}
+
+static void server_start(server_t *srv, server_mode_t mode)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+	int fds[2], rcvbuf = 4096;
+	
+	/* a stalled server takes as little as it can */
+	if (mode == SERVER_STALL) {
+		setsockopt(lsock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	}
+	bind(lsock, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(lsock, (struct sockaddr *)&addr, &addrlen);
+	listen(lsock, 1);
+	pipe(fds);
+	
+	srv->port = ntohs(addr.sin_port);
+	srv->pid = fork();
+	if (srv->pid == 0) {
+		close(fds[0]);
+		if (mode == SERVER_STALL) {
+			accept(lsock, NULL, NULL);
+			pause();
+		}
+		server_main(lsock, mode, fds[1]);
+	}
+	
+	close(fds[1]);
+	close(lsock);
+	srv->report = fds[0];
+}
+
+static void server_finish(server_t *srv, server_report_t *r)
+{
+	memset(r, 0, sizeof(*r));
+	if (read(srv->report, r, sizeof(*r)) != sizeof(*r)) {
+		kill(srv->pid, SIGKILL);
+	}
+	waitpid(srv->pid, NULL, 0);
+	close(srv->report);
+}
+
+static int64_t now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static void check_connect(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+	int filler = socket(AF_INET, SOCK_STREAM, 0);
+	tcp_stream_stats_t stats;
+	server_report_t r;
+	server_t srv;
+	int64_t started;
+	bool ok;
+	
+	server_start(&srv, SERVER_SINK);
+	ok = s->open(s, "127.0.0.1", srv.port);
+	CHECK(ok, "connect to a listening server");
+	s->close(s);
+	server_finish(&srv, &r);
+	
+	/* nothing listens on the port the server had */
+	started = now_ms();
+	CHECK(!s->open(s, "127.0.0.1", srv.port), "connect to a closed port");
+	CHECK(now_ms() - started < 100, "refused connect took %d ms", (int)(now_ms() - started));
+	
+	/* the backlog is full, further SYNs go unanswered */
+	bind(lsock, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(lsock, (struct sockaddr *)&addr, &addrlen);
+	listen(lsock, 0);
+	connect(filler, (struct sockaddr *)&addr, sizeof(addr));
+	
+	started = now_ms();
+	ok = s->open(s, "127.0.0.1", ntohs(addr.sin_port));
+	started = now_ms() - started;
+	CHECK(!ok, "connect to a server which does not answer");
+	CHECK(started >= CONFIG_TCP_CONNECT_TIMEOUT - 10 && started < CONFIG_TCP_CONNECT_TIMEOUT + 200,
+		  "unanswered connect gave up after %d ms, not %d", (int)started, CONFIG_TCP_CONNECT_TIMEOUT);
+	
+	tcp_stream_get_stats(s, &stats);
+	CHECK(stats.connects == 1 && stats.connect_failures == 2, "%u connects, %u failed",
+		  stats.connects, stats.connect_failures);
+	
+	close(filler);
+	close(lsock);
+	tcp_stream_destroy(s);
+}
+
+static void check_write_all(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t *buf = malloc(BIG_WRITE);
+	server_report_t r;
+	server_t srv;
+	int ret;
+	
+	pattern_fill(buf, BIG_WRITE);
+	server_start(&srv, SERVER_SLOW_SINK);
+	s->open(s, "127.0.0.1", srv.port);
+	tcp_stream_set_timeout(s, 10000);
+	
+	/* many partial sends, one call */
+	ret = s->write(s, buf, BIG_WRITE);
+	CHECK(ret == BIG_WRITE, "write returned %d of %d", ret, BIG_WRITE);
+	CHECK(s->flush(s) == 0, "flush");
+	s->close(s);
+	
+	server_finish(&srv, &r);
+	CHECK(r.bytes == BIG_WRITE && r.hash == fnv1a(2166136261u, buf, BIG_WRITE),
+		  "server received %llu bytes, %d sent", (unsigned long long)r.bytes, BIG_WRITE);
+	
+	tcp_stream_destroy(s);
+	free(buf);
+}
+
+static void check_deadlines(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t *buf = calloc(1, STALL_WRITE);
+	tcp_stream_stats_t stats;
+	server_report_t r;
+	server_t srv;
+	int64_t started;
+	int ret;
+	
+	server_start(&srv, SERVER_STALL);
+	s->open(s, "127.0.0.1", srv.port);
+	tcp_stream_set_timeout(s, IO_TIMEOUT_MS);
+	
+	started = now_ms();
+	ret = s->write(s, buf, STALL_WRITE);
+	started = now_ms() - started;
+	CHECK(ret < 0 && errno == ETIMEDOUT, "write to a stalled server returned %d, errno %d", ret, errno);
+	CHECK(started >= IO_TIMEOUT_MS - 10 && started < IO_TIMEOUT_MS + 200,
+		  "write gave up after %d ms, not %d", (int)started, IO_TIMEOUT_MS);
+	
+	/* nor does it send anything */
+	started = now_ms();
+	ret = s->read(s, buf, 64);
+	started = now_ms() - started;
+	CHECK(ret < 0 && errno == EAGAIN, "read from a silent server returned %d, errno %d", ret, errno);
+	CHECK(started >= IO_TIMEOUT_MS - 10 && started < IO_TIMEOUT_MS + 200,
+		  "read gave up after %d ms, not %d", (int)started, IO_TIMEOUT_MS);
+	
+	tcp_stream_get_stats(s, &stats);
+	CHECK(stats.write_timeouts == 1 && stats.read_timeouts == 1, "%u write and %u read timeouts",
+		  stats.write_timeouts, stats.read_timeouts);
+	
+	s->close(s);
+	kill(srv.pid, SIGKILL);
+	server_finish(&srv, &r);
+	tcp_stream_destroy(s);
+	free(buf);
+}
+
+static void check_echo(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t out[3000], in[3000];
+	server_report_t r;
+	server_t srv;
+	int got = 0, ret;
+	
+	pattern_fill(out, sizeof(out));
+	server_start(&srv, SERVER_ECHO);
+	s->open(s, "127.0.0.1", srv.port);
+	
+	/* small reads, served from the read-ahead where there is one */
+	s->write(s, out, sizeof(out));
+	s->flush(s);
+	while (got < sizeof(in) && (ret = s->read(s, in + got, 7)) > 0) {
+		got += ret;
+	}
+	CHECK(got == sizeof(in) && !memcmp(in, out, sizeof(in)), "%d of %d bytes echoed", got, (int)sizeof(in));
+	
+	s->close(s);
+	server_finish(&srv, &r);
+	tcp_stream_destroy(s);
+}
+
+static void bench_throughput(int size)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t *buf = malloc(size);
+	server_report_t r;
+	server_t srv;
+	int64_t started;
+	double secs;
+	
+	pattern_fill(buf, size);
+	server_start(&srv, SERVER_SINK);
+	s->open(s, "127.0.0.1", srv.port);
+	
+	started = esp_timer_get_time();
+	for (int sent = 0; sent < BENCH_BYTES; sent += size) {
+		s->write(s, buf, size);
+	}
+	s->flush(s);
+	s->close(s);
+	server_finish(&srv, &r);
+	secs = (esp_timer_get_time() - started) / 1e6;
+	
+	printf("  write %-6d bytes             %8.1f MB/s\n", size, r.bytes / secs / 1e6);
+	
+	tcp_stream_destroy(s);
+	free(buf);
+}
+
+static int compare_us(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void bench_latency(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	int *rtt = malloc(BENCH_ROUND_TRIPS * sizeof(int));
+	uint8_t msg[BENCH_MESSAGE];
+	server_report_t r;
+	server_t srv;
+	
+	pattern_fill(msg, sizeof(msg));
+	server_start(&srv, SERVER_ECHO);
+	s->open(s, "127.0.0.1", srv.port);
+	
+	for (int i = 0; i < BENCH_ROUND_TRIPS; i++) {
+		int64_t started = esp_timer_get_time();
+		int got = 0, ret;
+		
+		s->write(s, msg, sizeof(msg));
+		s->flush(s);
+		while (got < sizeof(msg) && (ret = s->read(s, msg + got, sizeof(msg) - got)) > 0) {
+			got += ret;
+		}
+		rtt[i] = (int)(esp_timer_get_time() - started);
+	}
+	
+	s->close(s);
+	server_finish(&srv, &r);
+	
+	qsort(rtt, BENCH_ROUND_TRIPS, sizeof(int), compare_us);
+	printf("  round trip of %d bytes         %5d us median, %5d us 99th percentile\n", BENCH_MESSAGE,
+		   rtt[BENCH_ROUND_TRIPS / 2], rtt[BENCH_ROUND_TRIPS * 99 / 100]);
+	
+	tcp_stream_destroy(s);
+	free(rtt);
+}
+
+static int64_t cpu_us(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the server is a process of its own, the CPU time is the stream's alone */
+static void bench_upload(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t hdr[UPLOAD_HEADER] = { 0 }, record[UPLOAD_RECORD];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = record, .iov_len = sizeof(record) }
+	};
+	int64_t next, cpu;
+	uint32_t segs;
+	server_report_t r;
+	server_t srv;
+	int sock;
+	
+	pattern_fill(record, sizeof(record));
+	server_start(&srv, SERVER_SINK);
+	s->open(s, "127.0.0.1", srv.port);
+	sock = tcp_stream_fd(s->context);
+	
+	segs = tcp_data_segs_out(sock);
+	cpu = cpu_us();
+	next = esp_timer_get_time();
+	for (int ms = 0; ms < UPLOAD_MS; ms += UPLOAD_RECORD_MS) {
+		s->writev(s, iov, 2);
+		next += UPLOAD_RECORD_MS * 1000;
+		usleep(next - esp_timer_get_time());
+	}
+	s->flush(s);
+	cpu = cpu_us() - cpu;
+	segs = tcp_data_segs_out(sock) - segs;
+	
+	s->close(s);
+	server_finish(&srv, &r);
+	
+	printf("  upload of %d ms records       %5d segments, %5d us CPU per second of audio, %d bytes/segment\n",
+		   UPLOAD_RECORD_MS, (int)(segs * 1000 / UPLOAD_MS), (int)(cpu * 1000 / UPLOAD_MS),
+		   segs ? (int)(r.bytes / segs) : 0);
+	
+	tcp_stream_destroy(s);
+}
+
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+/**
+ * @brief The write path before large blocks bypassed the buffer, one block at a time
+ *
+ * Blocks which do not fit flush the buffer first, so a frame header goes
+ * out in a send of its own, and blocks smaller than the buffer are copied.
+ */
+static int copy_write(tcp_stream_context_handle_t ctx, const void *buffer, int bufsz)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buffer,
+		.iov_len = bufsz
+	};
+	int ret = bufsz;
+	bool started;
+	
+	xSemaphoreTake(ctx->wlock, portMAX_DELAY);
+	
+	if (ctx->wlen + bufsz > CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE && tcp_stream_flush_locked(ctx) < 0) {
+		ret = -1;
+		goto out;
+	}
+	
+	if (bufsz >= CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE) {
+		if (tcp_stream_send_msg(ctx, &iov, 1) < 0) {
+			ret = -1;
+		}
+		goto out;
+	}
+	
+	started = ctx->wlen == 0 && bufsz > 0;
+	if (started) {
+		ctx->wbuf_since = tcp_stream_now_ms();
+	}
+	memcpy(ctx->wbuf + ctx->wlen, buffer, bufsz);
+	ctx->wlen += bufsz;
+	ctx->stats.bytes_copied += bufsz;
+	
+	if (ctx->wlen == CONFIG_TCP_STREAM_WRITE_BUFFER_SIZE
+		|| tcp_stream_now_ms() - ctx->wbuf_since >= CONFIG_TCP_STREAM_FLUSH_INTERVAL) {
+		if (tcp_stream_flush_locked(ctx) < 0) {
+			ret = -1;
+		}
+	} else if (started) {
+		xTaskNotifyGive(ctx->flusher);
+	}
+	
+out:
+	xSemaphoreGive(ctx->wlock);
+	return ret;
+}
+#endif
+
+/* TSC ticks per nanosecond, to put CPU time in the unit of the other benches */
+static double cycles_per_ns(void)
+{
+	int64_t started = esp_timer_get_time();
+	uint64_t ticks = bench_now();
+	
+	usleep(100000);
+	ticks = bench_now() - ticks;
+	return ticks / ((esp_timer_get_time() - started) * 1000.0);
+}
+
+/**
+ * @brief Upload framed records as fast as the sink takes them
+ *
+ * Reports the CPU cost and the bytes copied per uploaded byte, and what
+ * that comes to for a second of 8 kHz PCM.
+ */
+static void bench_records(int size, bool copy, double ticks_per_ns)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t hdr[UPLOAD_HEADER] = { 0 }, *record = malloc(size);
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = record, .iov_len = size }
+	};
+	tcp_stream_stats_t stats;
+	server_report_t r;
+	server_t srv;
+	int64_t cpu;
+	int records = RECORDS_BYTES / size;
+	double per_byte;
+	
+	pattern_fill(record, size);
+	server_start(&srv, SERVER_SINK);
+	s->open(s, "127.0.0.1", srv.port);
+	
+	cpu = cpu_us();
+	for (int i = 0; i < records; i++) {
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+		if (copy) {
+			copy_write(s->context, hdr, sizeof(hdr));
+			copy_write(s->context, record, size);
+			continue;
+		}
+#endif
+		s->writev(s, iov, 2);
+	}
+	s->flush(s);
+	cpu = cpu_us() - cpu;
+	tcp_stream_get_stats(s, &stats);
+	
+	s->close(s);
+	server_finish(&srv, &r);
+	
+	per_byte = cpu * 1000.0 / r.bytes;
+	printf("  %-5d byte records, %-6s %6.2f " BENCH_UNIT "/byte, %4.2f copied/byte, %4.2f sends/record, %4d us CPU and %5d bytes copied per second of audio\n",
+		   size, copy ? "copied" : "gather", per_byte * ticks_per_ns,
+		   (double)stats.bytes_copied / r.bytes, (double)stats.sends / records,
+		   (int)(per_byte * AUDIO_BYTES_PER_SEC / 1000),
+		   (int)((double)stats.bytes_copied / r.bytes * AUDIO_BYTES_PER_SEC));
+	
+	tcp_stream_destroy(s);
+	free(record);
+}
+
+/* the harness only talks to literal addresses */
+esp_err_t resolver_lookup(const char *hostname, struct in_addr *addr)
+{
+	return inet_aton(hostname, addr) ? ESP_OK : ESP_FAIL;
+}
+
+int main(int argc, char *argv[])
+{
+	double ticks_per_ns;
+	
+	signal(SIGPIPE, SIG_IGN);
+	
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		printf("tcp_stream, loopback%s%s:\n",
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+			   ", write buffer",
+#else
+			   "",
+#endif
+#ifdef CONFIG_TCP_STREAM_READ_AHEAD
+			   ", read-ahead"
+#else
+			   ""
+#endif
+			   );
+		bench_throughput(64);
+		bench_throughput(1436);
+		bench_throughput(65536);
+		bench_latency();
+		bench_upload();
+		
+		/* the process CPU time is in ns, the other benches count cycles */
+		ticks_per_ns = strcmp(BENCH_UNIT, "ns") ? cycles_per_ns() : 1.0;
+		for (int size = 256; size <= RECORDS_MAX; size *= 2) {
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+			bench_records(size, true, ticks_per_ns);
+#endif
+			bench_records(size, false, ticks_per_ns);
+		}
+		return 0;
+	}
+	
+	check_connect();
+	check_write_all();
+	check_deadlines();
+	check_echo();
+	
+	printf("tcp_stream%s: %s\n",
+#ifdef CONFIG_TCP_STREAM_WRITE_BUFFER
+		   "",
+#else
+		   " (unbuffered)",
+#endif
+		   s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
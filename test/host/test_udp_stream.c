@@ -0,0 +1,644 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Sends audio from one UDP stream to another through a relay on the
+ * loopback interface which drops, delays, reorders and duplicates
+ * datagrams, and checks what the receiving stream rebuilds from parity
+ * and what it gives up on. With "bench" it plays the same scenarios on a
+ * TCP stream through a relay which holds back what TCP would retransmit,
+ * and compares the latency of the records and of the end of the turn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+/* built in, so the checks can reach the socket and the session of a stream */
+#include "udp_stream.c"
+
+#define RECORDS				200
+#define WRITE_INTERVAL_US	2000
+#define READ_CHUNK			97
+#define RELAY_QUEUE			(4 * RECORDS)
+#define LATE_MS				200
+/* a lost segment comes again after three duplicate ACKs and a round trip, or the RTO */
+#define TCP_DUPACKS			3
+#define TCP_RTT_MS			10
+#define TCP_RTO_MS			200
+
+static int s_failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+/**
+ * @brief What the relay does with the datagrams of a check
+ */
+typedef struct {
+	const char *name;
+	/* milliseconds to hold a datagram back, -1 drops it */
+	int (*delay)(uint16_t seq, bool parity);
+	int copies;
+	/* the arrival order varies, so do the recovered and late counters */
+	bool reorders;
+	uint32_t late;
+} scenario_t;
+
+struct relay_datagram {
+	int64_t due;
+	int len;
+	uint8_t pkt[UDP_STREAM_MTU];
+};
+
+struct relay {
+	int sock;
+	struct sockaddr_in rx_addr;
+	uint32_t rx_session;
+	const scenario_t *sc;
+	int stop;
+	int count;
+	struct relay_datagram queue[RELAY_QUEUE];
+};
+
+/**
+ * @brief When the bytes of a turn were written and when they were read
+ */
+typedef struct {
+	int64_t written[RECORDS];
+	int64_t finished;			/* the last record written */
+	int64_t ended;				/* the reader saw the end of the audio */
+	int end[RECORDS];			/* where each record ends in what was read, -1 if lost */
+	int reads;
+	int64_t *read_at;
+	int *read_end;
+} turn_t;
+
+struct receiver {
+	tcp_stream_handle_t s;
+	int fd;
+	uint8_t *out;
+	int len;
+	int ret;
+	turn_t *turn;
+};
+
+struct tcp_relay_record {
+	int64_t due;
+	int dupacks;				/* still to come before a lost one is sent again */
+	int len;
+	uint8_t data[200];
+};
+
+/**
+ * @brief Relay between a TCP stream and its reader
+ *
+ * TCP delivers in order, so a record which is dropped or delayed holds up
+ * everything behind it. The end of the stream counts as record RECORDS.
+ */
+struct tcp_relay {
+	int listener;
+	int up;
+	int down;
+	const scenario_t *sc;
+	int head;
+	int count;
+	int filled;
+	struct tcp_relay_record queue[RECORDS + 1];
+};
+
+/* the lengths differ from record to record, so a missing one cannot go unnoticed */
+static int payload_len(uint32_t seq)
+{
+	return 20 + seq * 13 % 180;
+}
+
+static void payload_fill(uint8_t *buf, uint32_t seq)
+{
+	for (int i = 0; i < payload_len(seq); i++) {
+		buf[i] = (uint8_t)(seq * 7 + i);
+	}
+}
+
+static uint32_t hash(uint16_t seq, bool parity)
+{
+	uint32_t h = seq * 2654435761u ^ (parity ? 0x9e3779b9u : 0);
+	
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+static int delay_none(uint16_t seq, bool parity)
+{
+	return 0;
+}
+
+/* less than the reorder window, datagrams are 2 ms apart */
+static int delay_jitter(uint16_t seq, bool parity)
+{
+	return hash(seq, parity) % 9;
+}
+
+/* a different position in every group */
+static int delay_one_per_group(uint16_t seq, bool parity)
+{
+	return !parity && seq < RECORDS && seq % UDP_STREAM_GROUP == seq / UDP_STREAM_GROUP % UDP_STREAM_GROUP ? -1 : 0;
+}
+
+/* the group of the end marker is spared, nothing after it could tell the reader the audio ended */
+static int delay_random_loss(uint16_t seq, bool parity)
+{
+	return seq < (RECORDS & ~(UDP_STREAM_GROUP - 1)) && hash(seq, parity) % 10 == 0 ? -1 : 0;
+}
+
+/* 20 comes back from parity, 41 cannot without the parity of its group */
+static int delay_late(uint16_t seq, bool parity)
+{
+	if (parity) {
+		return seq == 40 ? -1 : 0;
+	}
+	return seq == 20 || seq == 41 ? LATE_MS : 0;
+}
+
+static int delay_end_lost(uint16_t seq, bool parity)
+{
+	return !parity && seq == RECORDS ? -1 : 0;
+}
+
+static const scenario_t s_scenarios[] = {
+	{ "clean", delay_none, 1, false, 0 },
+	{ "jitter", delay_jitter, 1, true, 0 },
+	{ "one loss per group", delay_one_per_group, 1, false, 0 },
+	{ "10% loss", delay_random_loss, 1, false, 0 },
+	{ "late beyond the reorder delay", delay_late, 1, false, 2 },
+	{ "duplicates", delay_none, 2, true, 0 },
+	{ "end marker lost", delay_end_lost, 1, false, 0 },
+};
+
+/* a datagram which is dropped or comes after the reader gave up on it */
+static bool missing(const scenario_t *sc, uint16_t seq, bool parity)
+{
+	int delay = sc->delay(seq, parity);
+	
+	return delay < 0 || delay > CONFIG_UDP_REORDER_DELAY;
+}
+
+/* missing, and the rest of its group with the parity cannot rebuild it */
+static bool unrecoverable(const scenario_t *sc, uint16_t seq)
+{
+	uint16_t base = seq & ~(UDP_STREAM_GROUP - 1);
+	int k = RECORDS + 1 - base < UDP_STREAM_GROUP ? RECORDS + 1 - base : UDP_STREAM_GROUP;
+	
+	if (!missing(sc, seq, false)) {
+		return false;
+	}
+	if (missing(sc, base, true)) {
+		return true;
+	}
+	for (int i = 0; i < k; i++) {
+		if (base + i != seq && missing(sc, base + i, false)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *relay_task(void *arg)
+{
+	struct relay *r = arg;
+	uint8_t pkt[UDP_STREAM_MTU];
+	
+	for (;;) {
+		int64_t now = udp_stream_now_ms();
+		int next = -1, timeout = 5;
+		struct pollfd pfd = { .fd = r->sock, .events = POLLIN };
+		
+		/* the earliest due datagram, the first queued of equals */
+		for (int i = 0; i < r->count; i++) {
+			if (next < 0 || r->queue[i].due < r->queue[next].due) {
+				next = i;
+			}
+		}
+		if (next >= 0) {
+			if (r->queue[next].due <= now) {
+				sendto(r->sock, r->queue[next].pkt, r->queue[next].len, 0,
+					   (struct sockaddr *)&r->rx_addr, sizeof(r->rx_addr));
+				memmove(&r->queue[next], &r->queue[next + 1], (r->count - next - 1) * sizeof(r->queue[0]));
+				r->count--;
+				continue;
+			}
+			timeout = (int)(r->queue[next].due - now);
+		} else if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		
+		if (poll(&pfd, 1, timeout) <= 0) {
+			continue;
+		}
+		
+		int n = recv(r->sock, pkt, sizeof(pkt), 0);
+		if (n < UDP_STREAM_HEADER_SIZE) {
+			continue;
+		}
+		
+		int delay = r->sc->delay(udp_stream_get_u16(pkt + 2), pkt[1] & UDP_STREAM_FLAG_FEC);
+		if (delay < 0) {
+			continue;
+		}
+		
+		/* the server answers on the session the device announced */
+		udp_stream_put_u32(pkt + 8, r->rx_session);
+		for (int c = 0; c < r->sc->copies && r->count < RELAY_QUEUE; c++) {
+			struct relay_datagram *d = &r->queue[r->count++];
+			
+			d->due = udp_stream_now_ms() + delay;
+			d->len = n;
+			memcpy(d->pkt, pkt, n);
+		}
+	}
+	
+	return NULL;
+}
+
+static void *receiver_task(void *arg)
+{
+	struct receiver *rcv = arg;
+	
+	for (;;) {
+		if (rcv->s) {
+			rcv->ret = rcv->s->read(rcv->s, rcv->out + rcv->len, READ_CHUNK);
+		} else {
+			rcv->ret = read(rcv->fd, rcv->out + rcv->len, READ_CHUNK);
+		}
+		if (rcv->ret <= 0) {
+			break;
+		}
+		rcv->len += rcv->ret;
+		
+		rcv->turn->read_at[rcv->turn->reads] = esp_timer_get_time();
+		rcv->turn->read_end[rcv->turn->reads++] = rcv->len;
+	}
+	rcv->turn->ended = esp_timer_get_time();
+	
+	return NULL;
+}
+
+/**
+ * @brief Send a turn over UDP through the relay and check what is read
+ * @param [out] turn The timeline of the turn
+ */
+static void run(const scenario_t *sc, turn_t *turn)
+{
+	struct relay *r = calloc(1, sizeof(struct relay));
+	struct receiver rcv = { 0 };
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	tcp_stream_handle_t tx = udp_stream_create();
+	tcp_stream_handle_t rx = udp_stream_create();
+	uint8_t *expected = malloc(RECORDS * 200);
+	uint8_t payload[200];
+	uint32_t recovered = 0, lost = 0;
+	int expected_len = 0;
+	udp_stream_stats_t stats;
+	pthread_t relay, receiver;
+	
+	r->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	bind(r->sock, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(r->sock, (struct sockaddr *)&addr, &addrlen);
+	
+	CHECK(rx->open(rx, "127.0.0.1", ntohs(addr.sin_port)) && tx->open(tx, "127.0.0.1", ntohs(addr.sin_port)),
+		  "%s: open", sc->name);
+	
+	addrlen = sizeof(r->rx_addr);
+	getsockname(((udp_stream_context_handle_t)rx->context)->sock, (struct sockaddr *)&r->rx_addr, &addrlen);
+	r->rx_session = udp_stream_get_session(rx);
+	r->sc = sc;
+	((udp_stream_context_handle_t)rx->context)->timeout_ms = 1000;
+	
+	rcv.s = rx;
+	rcv.out = malloc(RECORDS * 200 + READ_CHUNK);
+	rcv.turn = turn;
+	turn->reads = 0;
+	pthread_create(&relay, NULL, relay_task, r);
+	pthread_create(&receiver, NULL, receiver_task, &rcv);
+	
+	for (uint32_t seq = 0; seq < RECORDS; seq++) {
+		payload_fill(payload, seq);
+		turn->written[seq] = esp_timer_get_time();
+		tx->write(tx, payload, payload_len(seq));
+		
+		if (unrecoverable(sc, seq)) {
+			lost++;
+			turn->end[seq] = -1;
+		} else {
+			memcpy(expected + expected_len, payload, payload_len(seq));
+			expected_len += payload_len(seq);
+			recovered += missing(sc, seq, false);
+			turn->end[seq] = expected_len;
+		}
+		usleep(WRITE_INTERVAL_US);
+	}
+	turn->finished = esp_timer_get_time();
+	udp_stream_finish(tx);
+	recovered += missing(sc, RECORDS, false);
+	
+	pthread_join(receiver, NULL);
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(relay, NULL);
+	
+	udp_stream_get_stats(rx, &stats);
+	
+	CHECK(rcv.ret == 0, "%s: no end of audio, read returned %d", sc->name, rcv.ret);
+	CHECK(rcv.len == expected_len && !memcmp(rcv.out, expected, expected_len),
+		  "%s: %d bytes read, %d expected", sc->name, rcv.len, expected_len);
+	CHECK(stats.lost == lost, "%s: %u datagrams lost, %u expected", sc->name, stats.lost, lost);
+	if (!sc->reorders) {
+		CHECK(stats.recovered == recovered, "%s: %u datagrams recovered, %u expected",
+			  sc->name, stats.recovered, recovered);
+		CHECK(stats.late == sc->late, "%s: %u late datagrams, %u expected", sc->name, stats.late, sc->late);
+		CHECK(sc->delay != delay_none || stats.reordered == 0, "%s: %u reordered", sc->name, stats.reordered);
+	} else if (sc->copies == 1) {
+		CHECK(stats.reordered > 0, "%s: nothing reordered", sc->name);
+	}
+	
+	printf("  %-30s %3u recovered, %3u lost, %3u reordered, %3u late\n",
+		   sc->name, stats.recovered, stats.lost, stats.reordered, stats.late);
+	
+	udp_stream_destroy(tx);
+	udp_stream_destroy(rx);
+	close(r->sock);
+	free(r);
+	free(rcv.out);
+	free(expected);
+}
+
+static turn_t *turn_create(void)
+{
+	turn_t *turn = calloc(1, sizeof(turn_t));
+	
+	/* a read takes at least a byte */
+	turn->read_at = malloc(RECORDS * 200 * sizeof(int64_t));
+	turn->read_end = malloc(RECORDS * 200 * sizeof(int));
+	return turn;
+}
+
+static void turn_destroy(turn_t *turn)
+{
+	free(turn->read_at);
+	free(turn->read_end);
+	free(turn);
+}
+
+/* a record in full, and what arrives behind an earlier lost one counts as a duplicate ACK */
+static void tcp_relay_arrived(struct tcp_relay *r, int seq, int64_t now)
+{
+	struct tcp_relay_record *rec = &r->queue[seq];
+	int delay = r->sc->delay(seq, false);
+	
+	for (int i = r->head; i < seq; i++) {
+		if (r->queue[i].dupacks > 0 && --r->queue[i].dupacks == 0 && now + TCP_RTT_MS < r->queue[i].due) {
+			r->queue[i].due = now + TCP_RTT_MS;
+		}
+	}
+	
+	if (delay < 0) {
+		rec->due = now + TCP_RTO_MS;
+		rec->dupacks = TCP_DUPACKS;
+	} else {
+		rec->due = now + delay;
+		rec->dupacks = 0;
+	}
+	r->count = seq + 1;
+	r->filled = 0;
+}
+
+static void *tcp_relay_task(void *arg)
+{
+	struct tcp_relay *r = arg;
+	uint8_t buf[512];
+	bool eof = false;
+	
+	r->up = accept(r->listener, NULL, NULL);
+	
+	for (;;) {
+		int64_t now = udp_stream_now_ms();
+		int timeout = 5;
+		struct pollfd pfd = { .fd = r->up, .events = POLLIN };
+		
+		/* in order, the head holds up the rest */
+		if (r->head < r->count) {
+			struct tcp_relay_record *rec = &r->queue[r->head];
+			
+			if (rec->due <= now) {
+				if (r->head == RECORDS) {
+					shutdown(r->down, SHUT_WR);
+					break;
+				}
+				write(r->down, rec->data, rec->len);
+				r->head++;
+				continue;
+			}
+			timeout = (int)(rec->due - now);
+		}
+		
+		if (eof || poll(&pfd, 1, timeout) <= 0) {
+			if (eof) {
+				usleep(timeout * 1000);
+			}
+			continue;
+		}
+		
+		int n = recv(r->up, buf, sizeof(buf), 0);
+		if (n <= 0) {
+			tcp_relay_arrived(r, RECORDS, udp_stream_now_ms());
+			eof = true;
+			continue;
+		}
+		
+		/* cut the bytes back into the records they were written as */
+		for (int i = 0; i < n; ) {
+			struct tcp_relay_record *rec = &r->queue[r->count];
+			int take = payload_len(r->count) - r->filled;
+			
+			if (take > n - i) {
+				take = n - i;
+			}
+			memcpy(rec->data + r->filled, buf + i, take);
+			r->filled += take;
+			rec->len = r->filled;
+			i += take;
+			if (r->filled == payload_len(r->count)) {
+				tcp_relay_arrived(r, r->count, udp_stream_now_ms());
+			}
+		}
+	}
+	
+	close(r->up);
+	return NULL;
+}
+
+/**
+ * @brief Send a turn over TCP through the relay and check what is read
+ * @param [out] turn The timeline of the turn
+ */
+static void run_tcp(const scenario_t *sc, turn_t *turn)
+{
+	struct tcp_relay *r = calloc(1, sizeof(struct tcp_relay));
+	struct receiver rcv = { 0 };
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	tcp_stream_handle_t tx = tcp_stream_create();
+	uint8_t *expected = malloc(RECORDS * 200);
+	uint8_t payload[200];
+	int expected_len = 0, pair[2];
+	pthread_t relay, receiver;
+	
+	r->listener = socket(AF_INET, SOCK_STREAM, 0);
+	bind(r->listener, (struct sockaddr *)&addr, sizeof(addr));
+	listen(r->listener, 1);
+	getsockname(r->listener, (struct sockaddr *)&addr, &addrlen);
+	
+	/* the reader is the server, behind the link the relay plays */
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+	r->down = pair[0];
+	r->sc = sc;
+	
+	rcv.fd = pair[1];
+	rcv.out = malloc(RECORDS * 200 + READ_CHUNK);
+	rcv.turn = turn;
+	turn->reads = 0;
+	pthread_create(&relay, NULL, tcp_relay_task, r);
+	pthread_create(&receiver, NULL, receiver_task, &rcv);
+	
+	CHECK(tx->open(tx, "127.0.0.1", ntohs(addr.sin_port)), "%s over TCP: open", sc->name);
+	
+	for (uint32_t seq = 0; seq < RECORDS; seq++) {
+		payload_fill(payload, seq);
+		turn->written[seq] = esp_timer_get_time();
+		tx->write(tx, payload, payload_len(seq));
+		
+		memcpy(expected + expected_len, payload, payload_len(seq));
+		expected_len += payload_len(seq);
+		turn->end[seq] = expected_len;
+		usleep(WRITE_INTERVAL_US);
+	}
+	turn->finished = esp_timer_get_time();
+	tx->flush(tx);
+	tx->close(tx);
+	
+	pthread_join(receiver, NULL);
+	pthread_join(relay, NULL);
+	
+	CHECK(rcv.ret == 0, "%s over TCP: no end of audio, read returned %d", sc->name, rcv.ret);
+	CHECK(rcv.len == expected_len && !memcmp(rcv.out, expected, expected_len),
+		  "%s over TCP: %d bytes read, %d expected", sc->name, rcv.len, expected_len);
+	
+	tcp_stream_destroy(tx);
+	close(r->listener);
+	close(pair[0]);
+	close(pair[1]);
+	free(r);
+	free(rcv.out);
+	free(expected);
+}
+
+static int compare_ms(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* from write to read of the records which made it, and from the last write to the end */
+static void turn_report(const char *transport, const turn_t *turn)
+{
+	int latency[RECORDS], n = 0, r = 0;
+	
+	for (int seq = 0; seq < RECORDS; seq++) {
+		if (turn->end[seq] < 0) {
+			continue;
+		}
+		while (r < turn->reads && turn->read_end[r] < turn->end[seq]) {
+			r++;
+		}
+		if (r == turn->reads) {
+			break;
+		}
+		latency[n++] = (int)((turn->read_at[r] - turn->written[seq]) / 1000);
+	}
+	qsort(latency, n, sizeof(int), compare_ms);
+	
+	printf("    %-4s records %3d ms median, %3d ms 99th percentile, %3d ms max, turn ends after %4d ms\n",
+		   transport, n ? latency[n / 2] : 0, n ? latency[n * 99 / 100] : 0, n ? latency[n - 1] : 0,
+		   (int)((turn->ended - turn->finished) / 1000));
+}
+
+static int bench(void)
+{
+	turn_t *turn = turn_create();
+	
+	printf("udp_stream against tcp_stream with its write buffer, %d records %d ms apart,\n  TCP retransmits after %d duplicate ACKs + %d ms or %d ms:\n",
+		   RECORDS, WRITE_INTERVAL_US / 1000, TCP_DUPACKS, TCP_RTT_MS, TCP_RTO_MS);
+	for (int i = 0; i < sizeof(s_scenarios) / sizeof(s_scenarios[0]); i++) {
+		run(&s_scenarios[i], turn);
+		turn_report("UDP", turn);
+		run_tcp(&s_scenarios[i], turn);
+		turn_report("TCP", turn);
+	}
+	
+	turn_destroy(turn);
+	return s_failures ? 1 : 0;
+}
+
+/* the harness only talks to literal addresses */
+esp_err_t resolver_lookup(const char *hostname, struct in_addr *addr)
+{
+	return inet_aton(hostname, addr) ? ESP_OK : ESP_FAIL;
+}
+
+int main(int argc, char *argv[])
+{
+	turn_t *turn;
+	
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		return bench();
+	}
+	
+	turn = turn_create();
+	for (int i = 0; i < sizeof(s_scenarios) / sizeof(s_scenarios[0]); i++) {
+		run(&s_scenarios[i], turn);
+	}
+	turn_destroy(turn);
+	
+	printf("udp_stream: %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}
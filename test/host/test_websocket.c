@@ -0,0 +1,630 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2019 Jiameng Shi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Runs a TCP stream tunnelled over WebSocket against servers on the
+ * loopback interface, each in a process of its own: one which echoes
+ * every frame with the shortest length form that fits, one which trickles
+ * its frames in byte by byte with a ping in between, and ones which answer
+ * the upgrade wrongly. With "bench" it measures the masking and the
+ * throughput through an echo server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+/* built in, so the checks can reach the masking and the handshake */
+#include "tcp_stream.c"
+#include "bench.h"
+
+#define IO_TIMEOUT_MS		300
+#define TRICKLE_GAP_US		2000
+#define PING_PAYLOAD		"are you there"
+#define MAX_FRAME			(128 * 1024)
+#define MASK_MAX_LEN		67
+#define BENCH_BYTES			(16 * 1024 * 1024)
+#define BENCH_MASK_LEN		1436
+#define BENCH_MASK_ROUNDS	20000
+
+static int s_failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAIL " __VA_ARGS__); \
+		printf("\n"); \
+		s_failures++; \
+	} \
+} while (0)
+
+/**
+ * @brief What the server does with the one connection it accepts
+ */
+typedef enum {
+	SERVER_ECHO,		/* sends every frame back */
+	SERVER_TRICKLE,		/* sends frame headers a byte at a time, a ping and a close */
+	SERVER_BAD_ACCEPT,	/* upgrades with the wrong Sec-WebSocket-Accept */
+	SERVER_REFUSE,		/* does not upgrade */
+} server_mode_t;
+
+/**
+ * @brief A server process and the pipe it reports on
+ */
+typedef struct {
+	pid_t pid;
+	int port;
+	int report;
+} server_t;
+
+/**
+ * @brief What a server received
+ */
+typedef struct {
+	uint64_t bytes;
+	uint32_t hash;
+	uint32_t frames[3];		/* by length form, 7, 16 and 64 bits */
+	bool unmasked;			/* a frame from the client came without a mask */
+	bool pong;				/* the ping came back */
+} server_report_t;
+
+/* the frames the trickling server sends, one in each length form */
+static const int s_trickle_frames[] = { 100, 300, 66000 };
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void pattern_fill(uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (uint8_t)(i * 131 + (i >> 11));
+	}
+}
+
+static void mask_bytewise(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4], size_t offset)
+{
+	for (size_t i = 0; i < len; i++) {
+		dst[i] = src[i] ^ key[(offset + i) & 3];
+	}
+}
+
+static int64_t now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static bool recv_all(int sock, void *buf, size_t len)
+{
+	for (size_t got = 0; got < len; ) {
+		ssize_t n = recv(sock, (uint8_t *)buf + got, len - got, 0);
+		if (n <= 0) {
+			return false;
+		}
+		got += n;
+	}
+	return true;
+}
+
+/* a byte at a time when gap_us is set, in one piece otherwise */
+static void send_all(int sock, const void *buf, size_t len, int gap_us)
+{
+	const uint8_t *p = buf;
+	
+	if (!gap_us) {
+		for (size_t off = 0, n; off < len; off += n) {
+			n = send(sock, p + off, len - off, 0);
+			if ((ssize_t)n <= 0) {
+				return;
+			}
+		}
+		return;
+	}
+	
+	for (size_t i = 0; i < len; i++) {
+		send(sock, p + i, 1, 0);
+		usleep(gap_us);
+	}
+}
+
+/* a server frame header, unmasked, in the shortest length form */
+static int frame_header(uint8_t *hdr, int opcode, uint64_t len)
+{
+	int n = 0;
+	
+	hdr[n++] = TCP_STREAM_WS_FIN | opcode;
+	if (len < 126) {
+		hdr[n++] = len;
+	} else if (len <= 0xffff) {
+		hdr[n++] = 126;
+		hdr[n++] = len >> 8;
+		hdr[n++] = len;
+	} else {
+		hdr[n++] = 127;
+		for (int i = 7; i >= 0; i--) {
+			hdr[n++] = len >> (8 * i);
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief Read a client frame and unmask it
+ * @return The payload length, -1 when the connection ended
+ */
+static int64_t frame_read(int sock, uint8_t *payload, int *opcode, server_report_t *r)
+{
+	uint8_t hdr[8], key[4];
+	uint64_t len;
+	int form = 0;
+	
+	if (!recv_all(sock, hdr, 2)) {
+		return -1;
+	}
+	
+	if (!(hdr[1] & TCP_STREAM_WS_MASK)) {
+		r->unmasked = true;
+	}
+	*opcode = hdr[0] & 0x0f;
+	len = hdr[1] & 0x7f;
+	if (len >= 126) {
+		int n = len == 126 ? 2 : 8;
+		
+		form = len == 126 ? 1 : 2;
+		if (!recv_all(sock, hdr, n)) {
+			return -1;
+		}
+		len = 0;
+		for (int i = 0; i < n; i++) {
+			len = len << 8 | hdr[i];
+		}
+	}
+	r->frames[form]++;
+	
+	if (len > MAX_FRAME || !recv_all(sock, key, sizeof(key)) || !recv_all(sock, payload, len)) {
+		return -1;
+	}
+	mask_bytewise(payload, payload, len, key, 0);
+	
+	return len;
+}
+
+/* answers the upgrade request as the mode says */
+static bool server_handshake(int sock, server_mode_t mode)
+{
+	char req[1024], resp[256], accept[32], src[64];
+	const char *field;
+	uint8_t digest[20];
+	size_t olen;
+	int len = 0;
+	
+	while (len < 4 || memcmp(req + len - 4, "\r\n\r\n", 4)) {
+		if (len == sizeof(req) - 1 || recv(sock, req + len, 1, 0) != 1) {
+			return false;
+		}
+		len++;
+	}
+	req[len] = '\0';
+	
+	field = strstr(req, "Sec-WebSocket-Key: ");
+	if (!field) {
+		return false;
+	}
+	field += 19;
+	len = snprintf(src, sizeof(src), "%.*s%s", (int)strcspn(field, "\r"), field, TCP_STREAM_WS_GUID);
+	mbedtls_sha1_ret((unsigned char *)src, len, digest);
+	if (mode == SERVER_BAD_ACCEPT) {
+		digest[0] ^= 1;
+	}
+	mbedtls_base64_encode((unsigned char *)accept, sizeof(accept), &olen, digest, sizeof(digest));
+	
+	if (mode == SERVER_REFUSE) {
+		len = snprintf(resp, sizeof(resp), "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+	} else {
+		len = snprintf(resp, sizeof(resp),
+					   "HTTP/1.1 101 Switching Protocols\r\n"
+					   "Upgrade: websocket\r\n"
+					   "Connection: Upgrade\r\n"
+					   "Sec-WebSocket-Accept: %s\r\n"
+					   "\r\n", accept);
+	}
+	
+	/* with the first byte of a frame in the same segment, when there is one */
+	if (mode == SERVER_TRICKLE) {
+		resp[len++] = TCP_STREAM_WS_FIN | TCP_STREAM_WS_BINARY;
+	}
+	send_all(sock, resp, len, 0);
+	
+	return mode != SERVER_REFUSE && mode != SERVER_BAD_ACCEPT;
+}
+
+static void server_trickle(int sock, server_report_t *r)
+{
+	uint8_t hdr[10], *payload = malloc(MAX_FRAME);
+	int64_t len;
+	int n, opcode;
+	
+	for (int f = 0; f < sizeof(s_trickle_frames) / sizeof(s_trickle_frames[0]); f++) {
+		pattern_fill(payload, s_trickle_frames[f]);
+		n = frame_header(hdr, TCP_STREAM_WS_BINARY, s_trickle_frames[f]);
+		
+		/* the first byte went out with the upgrade */
+		if (f == 0) {
+			send_all(sock, hdr + 1, n - 1, TRICKLE_GAP_US);
+		} else if (f == 1) {
+			/* stop inside the header long enough for one read, not two, to time out */
+			send_all(sock, hdr, 2, TRICKLE_GAP_US);
+			usleep(IO_TIMEOUT_MS * 3 / 2 * 1000);
+			send_all(sock, hdr + 2, n - 2, TRICKLE_GAP_US);
+		} else {
+			send_all(sock, hdr, n, TRICKLE_GAP_US);
+		}
+		send_all(sock, payload, s_trickle_frames[f], 0);
+		
+		if (f == 0) {
+			n = frame_header(hdr, TCP_STREAM_WS_PING, strlen(PING_PAYLOAD));
+			send_all(sock, hdr, n, TRICKLE_GAP_US);
+			send_all(sock, PING_PAYLOAD, strlen(PING_PAYLOAD), TRICKLE_GAP_US);
+		}
+	}
+	
+	n = frame_header(hdr, TCP_STREAM_WS_CLOSE, 0);
+	send_all(sock, hdr, n, TRICKLE_GAP_US);
+	
+	len = frame_read(sock, payload, &opcode, r);
+	r->pong = opcode == TCP_STREAM_WS_PONG && len == strlen(PING_PAYLOAD) && !memcmp(payload, PING_PAYLOAD, len);
+	
+	free(payload);
+}
+
+static void server_main(int lsock, server_mode_t mode, int report)
+{
+	server_report_t r = { .hash = 2166136261u };
+	uint8_t hdr[10], *payload = malloc(MAX_FRAME);
+	int sock = accept(lsock, NULL, NULL);
+	int64_t len;
+	int opcode;
+	
+	if (server_handshake(sock, mode)) {
+		if (mode == SERVER_TRICKLE) {
+			server_trickle(sock, &r);
+		}
+		
+		while (mode == SERVER_ECHO && (len = frame_read(sock, payload, &opcode, &r)) >= 0) {
+			r.bytes += len;
+			r.hash = fnv1a(r.hash, payload, len);
+			send_all(sock, hdr, frame_header(hdr, opcode, len), 0);
+			send_all(sock, payload, len, 0);
+		}
+	}
+	
+	write(report, &r, sizeof(r));
+	_exit(0);
+}
+
+static void server_start(server_t *srv, server_mode_t mode)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addrlen = sizeof(addr);
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+	int fds[2];
+	
+	bind(lsock, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(lsock, (struct sockaddr *)&addr, &addrlen);
+	listen(lsock, 1);
+	pipe(fds);
+	
+	srv->port = ntohs(addr.sin_port);
+	srv->pid = fork();
+	if (srv->pid == 0) {
+		close(fds[0]);
+		server_main(lsock, mode, fds[1]);
+	}
+	
+	close(fds[1]);
+	close(lsock);
+	srv->report = fds[0];
+}
+
+static void server_finish(server_t *srv, server_report_t *r)
+{
+	memset(r, 0, sizeof(*r));
+	if (read(srv->report, r, sizeof(*r)) != sizeof(*r)) {
+		kill(srv->pid, SIGKILL);
+	}
+	waitpid(srv->pid, NULL, 0);
+	close(srv->report);
+}
+
+/* the example of RFC 6455 section 1.3 */
+static void check_accept(void)
+{
+	const char *key = "dGhlIHNhbXBsZSBub25jZQ==";
+	char src[64], accept[32];
+	uint8_t digest[20];
+	size_t olen;
+	int len;
+	
+	len = snprintf(src, sizeof(src), "%s%s", key, TCP_STREAM_WS_GUID);
+	mbedtls_sha1_ret((unsigned char *)src, len, digest);
+	mbedtls_base64_encode((unsigned char *)accept, sizeof(accept), &olen, digest, sizeof(digest));
+	CHECK(olen == 28 && !strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="), "accept for the RFC 6455 key is %s", accept);
+}
+
+/* every alignment of source and destination, at every position in the key */
+static void check_mask(void)
+{
+	uint8_t src[MASK_MAX_LEN + 8], dst[MASK_MAX_LEN + 8], ref[MASK_MAX_LEN + 8];
+	const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	int bad = 0;
+	
+	pattern_fill(src, sizeof(src));
+	for (int s = 0; s < 4; s++) {
+		for (int d = 0; d < 4; d++) {
+			for (int offset = 0; offset < 8; offset++) {
+				for (int len = 0; len <= MASK_MAX_LEN; len++) {
+					memset(dst, 0xee, sizeof(dst));
+					memset(ref, 0xee, sizeof(ref));
+					tcp_stream_ws_mask_copy(dst + d, src + s, len, key, offset);
+					mask_bytewise(ref + d, src + s, len, key, offset);
+					bad += memcmp(dst, ref, sizeof(dst)) != 0;
+				}
+			}
+		}
+	}
+	CHECK(bad == 0, "%d masked copies differ from the bytewise mask", bad);
+}
+
+/* frames both ways in each length form, around the form boundaries */
+static void check_lengths(void)
+{
+	static const int sizes[] = { 1, 125, 126, 1000, 65535, 65536, 70000 };
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t *out = malloc(MAX_FRAME), *in = malloc(MAX_FRAME);
+	uint32_t hash = 2166136261u;
+	uint64_t total = 0;
+	server_report_t r;
+	server_t srv;
+	bool ok;
+	
+	server_start(&srv, SERVER_ECHO);
+	ok = s->open(s, "127.0.0.1", srv.port);
+	CHECK(ok, "upgrade by an echo server");
+	
+	for (int i = 0; ok && i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int got = 0, ret = 0;
+		
+		pattern_fill(out, sizes[i]);
+		out[0] = i;
+		s->write(s, out, sizes[i]);
+		s->flush(s);
+		while (got < sizes[i] && (ret = s->read(s, in + got, MAX_FRAME - got)) > 0) {
+			got += ret;
+		}
+		CHECK(got == sizes[i] && !memcmp(in, out, got), "%d of %d bytes echoed", got, sizes[i]);
+		
+		hash = fnv1a(hash, out, sizes[i]);
+		total += sizes[i];
+	}
+	
+	s->close(s);
+	server_finish(&srv, &r);
+	CHECK(r.bytes == total && r.hash == hash, "server received %llu bytes, %llu sent",
+		  (unsigned long long)r.bytes, (unsigned long long)total);
+	CHECK(r.frames[0] == 2 && r.frames[1] == 3 && r.frames[2] == 2,
+		  "%u, %u and %u frames with 7, 16 and 64 bit lengths, not 2, 3 and 2",
+		  r.frames[0], r.frames[1], r.frames[2]);
+	CHECK(!r.unmasked, "unmasked frame from the client");
+	
+	tcp_stream_destroy(s);
+	free(out);
+	free(in);
+}
+
+/* headers a byte at a time, one cut by a read timeout, and a ping between frames */
+static void check_split_headers(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	uint8_t *in = malloc(MAX_FRAME), *expected = malloc(MAX_FRAME);
+	int len = 0, got = 0, ret, timeouts = 0;
+	tcp_stream_stats_t stats;
+	server_report_t r;
+	server_t srv;
+	
+	for (int f = 0; f < sizeof(s_trickle_frames) / sizeof(s_trickle_frames[0]); f++) {
+		pattern_fill(expected + len, s_trickle_frames[f]);
+		len += s_trickle_frames[f];
+	}
+	
+	server_start(&srv, SERVER_TRICKLE);
+	CHECK(s->open(s, "127.0.0.1", srv.port), "upgrade by a trickling server");
+	tcp_stream_set_timeout(s, IO_TIMEOUT_MS);
+	
+	for (;;) {
+		ret = s->read(s, in + got, MAX_FRAME - got);
+		if (ret < 0 && errno == EAGAIN && timeouts++ == 0) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+		got += ret;
+	}
+	
+	CHECK(ret == 0, "no close from the server, read returned %d", ret);
+	CHECK(timeouts == 1, "%d reads timed out, not 1", timeouts);
+	CHECK(got == len && !memcmp(in, expected, len), "%d of %d bytes read", got, len);
+	
+	tcp_stream_get_stats(s, &stats);
+	CHECK(stats.read_timeouts == 1, "%u read timeouts counted", stats.read_timeouts);
+	
+	server_finish(&srv, &r);
+	CHECK(r.pong, "no pong with the ping payload");
+	CHECK(!r.unmasked, "unmasked frame from the client");
+	
+	s->close(s);
+	tcp_stream_destroy(s);
+	free(in);
+	free(expected);
+}
+
+static void check_bad_upgrade(void)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	tcp_stream_stats_t stats;
+	server_report_t r;
+	server_t srv;
+	
+	server_start(&srv, SERVER_BAD_ACCEPT);
+	CHECK(!s->open(s, "127.0.0.1", srv.port), "upgrade with the wrong Sec-WebSocket-Accept");
+	server_finish(&srv, &r);
+	
+	server_start(&srv, SERVER_REFUSE);
+	CHECK(!s->open(s, "127.0.0.1", srv.port), "upgrade refused with 403");
+	server_finish(&srv, &r);
+	
+	tcp_stream_get_stats(s, &stats);
+	CHECK(stats.connects == 2 && stats.connect_failures == 2, "%u connects, %u failed",
+		  stats.connects, stats.connect_failures);
+	
+	tcp_stream_destroy(s);
+}
+
+static void bench_mask(void)
+{
+	uint8_t src[BENCH_MASK_LEN + 4], dst[BENCH_MASK_LEN + 4];
+	const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	uint64_t started, words = UINT64_MAX, bytes = UINT64_MAX;
+	
+	pattern_fill(src, sizeof(src));
+	for (int run = 0; run < 5; run++) {
+		started = bench_now();
+		for (int i = 0; i < BENCH_MASK_ROUNDS; i++) {
+			tcp_stream_ws_mask_copy(dst + 1, src, BENCH_MASK_LEN, key, i);
+			__asm__ volatile("" : : "r"(dst) : "memory");
+		}
+		started = bench_now() - started;
+		words = started < words ? started : words;
+		
+		started = bench_now();
+		for (int i = 0; i < BENCH_MASK_ROUNDS; i++) {
+			mask_bytewise(dst + 1, src, BENCH_MASK_LEN, key, i);
+			__asm__ volatile("" : : "r"(dst) : "memory");
+		}
+		started = bench_now() - started;
+		bytes = started < bytes ? started : bytes;
+	}
+	
+	printf("  mask %d bytes, word at a time %6.2f " BENCH_UNIT "/byte\n", BENCH_MASK_LEN,
+		   (double)words / BENCH_MASK_ROUNDS / BENCH_MASK_LEN);
+	printf("  mask %d bytes, bytewise       %6.2f " BENCH_UNIT "/byte\n", BENCH_MASK_LEN,
+		   (double)bytes / BENCH_MASK_ROUNDS / BENCH_MASK_LEN);
+}
+
+struct writer {
+	tcp_stream_handle_t s;
+	int size;
+};
+
+static void *writer_task(void *arg)
+{
+	struct writer *w = arg;
+	uint8_t *buf = malloc(w->size);
+	
+	pattern_fill(buf, w->size);
+	for (int sent = 0; sent < BENCH_BYTES; sent += w->size) {
+		w->s->write(w->s, buf, w->size);
+	}
+	w->s->flush(w->s);
+	
+	free(buf);
+	return NULL;
+}
+
+/* written from one thread, the echo read back on another */
+static void bench_echo(int size)
+{
+	tcp_stream_handle_t s = tcp_stream_create();
+	struct writer w = { s, size };
+	uint8_t *buf = malloc(65536);
+	server_report_t r;
+	server_t srv;
+	pthread_t writer;
+	int64_t started, got = 0;
+	int ret;
+	
+	server_start(&srv, SERVER_ECHO);
+	s->open(s, "127.0.0.1", srv.port);
+	
+	started = esp_timer_get_time();
+	pthread_create(&writer, NULL, writer_task, &w);
+	while (got < BENCH_BYTES / size * size && (ret = s->read(s, buf, 65536)) > 0) {
+		got += ret;
+	}
+	pthread_join(writer, NULL);
+	started = esp_timer_get_time() - started;
+	
+	s->close(s);
+	server_finish(&srv, &r);
+	
+	printf("  echo of %-6d byte writes     %8.1f MB/s each way\n", size, got / (started / 1e6) / 1e6);
+	
+	tcp_stream_destroy(s);
+	free(buf);
+}
+
+/* the harness only talks to literal addresses */
+esp_err_t resolver_lookup(const char *hostname, struct in_addr *addr)
+{
+	return inet_aton(hostname, addr) ? ESP_OK : ESP_FAIL;
+}
+
+int main(int argc, char *argv[])
+{
+	signal(SIGPIPE, SIG_IGN);
+	
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		printf("tcp_stream over WebSocket, loopback, write buffer, read-ahead:\n");
+		bench_mask();
+		bench_echo(64);
+		bench_echo(1436);
+		bench_echo(65536);
+		return 0;
+	}
+	
+	check_accept();
+	check_mask();
+	check_lengths();
+	check_split_headers();
+	check_bad_upgrade();
+	
+	printf("tcp_stream (WebSocket): %s\n", s_failures ? "FAILED" : "ok");
+	return s_failures ? 1 : 0;
+}